@@ -0,0 +1,417 @@
+/*
+ * The microbenchmarks of the kernels in opzoo, which call the kernels by
+ * KERNEL_RUN without a framework. It is built and run for each context by
+ * benchmark_kernels.py.
+ *
+ * usage: benchmark_kernels [--quick] [--filter <substring of the kernel>]
+ * The results are printed to stdout in JSON, and as a table to stderr.
+ *
+ * `bytes` is the compulsory memory traffic of a kernel, where each input is
+ * read once and each output is written once, and `flops` is a nominal count
+ * of its arithmetic. They are compared with the roofline of the copy
+ * bandwidth and the FMA throughput measured by this program.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "mobula_op.h"
+
+#include "../opzoo/Convolution/Convolution.cpp"
+#include "../opzoo/FocalLoss/FocalLoss.cpp"
+#include "../opzoo/IoULoss/IoULoss.cpp"
+#include "../opzoo/ROIAlign/ROIAlign.cpp"
+#include "../opzoo/Softmax/Softmax.cpp"
+#include "../opzoo/Sum/Sum.cpp"
+#include "../opzoo/Transpose/Transpose.cpp"
+
+namespace mobula {
+
+template <typename T>
+MOBULA_KERNEL benchmark_copy_kernel(const int n, const T *x, T *y) {
+  parfor(n, [&](int i) { y[i] = x[i]; });
+}
+
+// the independent chains of FMA, which are kFMAChains vectors per element
+constexpr int kFMAChains = 8;
+constexpr int kFMARounds = 256;
+
+MOBULA_KERNEL benchmark_fma_kernel(const int n, const float a, const float b,
+                                   float *out) {
+  typedef Vec<float> V;
+  parfor(n, [&](int i) {
+    V acc[kFMAChains];
+    for (int k = 0; k < kFMAChains; ++k) acc[k] = V(static_cast<float>(i + k));
+    for (int r = 0; r < kFMARounds; ++r) {
+      for (int k = 0; k < kFMAChains; ++k) acc[k] = acc[k] * V(a) + V(b);
+    }
+    float lanes[V::kSize];
+    V sum = acc[0];
+    for (int k = 1; k < kFMAChains; ++k) sum += acc[k];
+    sum.store(lanes);
+    out[i] = lanes[0];
+  });
+}
+
+}  // namespace mobula
+
+using namespace mobula;
+
+namespace {
+
+template <typename T>
+struct DTypeName;
+template <>
+struct DTypeName<float> {
+  static const char *value() { return "float32"; }
+};
+template <>
+struct DTypeName<double> {
+  static const char *value() { return "float64"; }
+};
+template <>
+struct DTypeName<float16> {
+  static const char *value() { return "float16"; }
+};
+
+const char *get_context_name() {
+#if USING_CUDA
+  return "cuda";
+#elif USING_HIP
+  return "hip";
+#elif USING_OPENMP
+  return "openmp";
+#else
+  return "naive";
+#endif
+}
+
+// an array on the device of the context, initialized by the host values
+template <typename T>
+class DeviceArray {
+ public:
+  explicit DeviceArray(const std::vector<T> &host)
+      : size_(host.size()), data_(new_array<T>(host.size())) {
+    MemcpyHostToDev(data_, host.data(), sizeof(T) * size_);
+  }
+  explicit DeviceArray(const size_t size)
+      : DeviceArray(std::vector<T>(size, T(0))) {}
+  ~DeviceArray() { del_array(data_); }
+  DeviceArray(const DeviceArray &) = delete;
+  DeviceArray &operator=(const DeviceArray &) = delete;
+  T *data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  size_t size_;
+  T *data_;
+};
+
+// the deterministic values in [low, high)
+template <typename T>
+std::vector<T> uniform(const size_t size, const float low, const float high,
+                       uint32_t seed = 1) {
+  std::vector<T> out(size);
+  for (size_t i = 0; i < size; ++i) {
+    seed = seed * 1664525u + 1013904223u;
+    out[i] = T(low + (high - low) * static_cast<float>(seed >> 8) / 16777216.f);
+  }
+  return out;
+}
+
+struct Options {
+  bool quick = false;
+  std::string filter;
+};
+
+struct Result {
+  std::string kernel, dtype, shape;
+  double time_us, bytes, flops;
+};
+
+class Benchmark {
+ public:
+  explicit Benchmark(const Options &opt) : opt_(opt) {}
+
+  // the average time of `run` in microseconds, which is the best of the
+  // batches after a warm-up
+  template <typename Func>
+  double Time(Func run) const {
+    const double min_us = opt_.quick ? 2e4 : 2e5;
+    run();
+    synchronize(-1);
+    int iters = 1;
+    double best = 0;
+    for (int batch = 0; batch < 3;) {
+      const auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < iters; ++i) run();
+      synchronize(-1);
+      const double us = std::chrono::duration<double, std::micro>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+      if (us < min_us / 3 && iters < (1 << 20)) {
+        iters *= 2;
+        continue;
+      }
+      best = batch == 0 ? us / iters : std::min(best, us / iters);
+      ++batch;
+    }
+    return best;
+  }
+
+  template <typename Func>
+  void Run(const std::string &kernel, const char *dtype,
+           const std::string &shape, const double bytes, const double flops,
+           Func run) {
+    if (kernel.find(opt_.filter) == std::string::npos) return;
+    const Result r{kernel, dtype, shape, Time(run), bytes, flops};
+    fprintf(stderr, "%-28s %-8s %-24s %10.1f us %8.2f GB/s %8.2f GFLOP/s\n",
+            r.kernel.c_str(), r.dtype.c_str(), r.shape.c_str(), r.time_us,
+            r.bytes / r.time_us * 1e-3, r.flops / r.time_us * 1e-3);
+    results_.push_back(r);
+  }
+
+  // the roofline of this device
+  void MeasurePeak() {
+    const int n = opt_.quick ? 1 << 22 : 1 << 24;
+    DeviceArray<float> x(uniform<float>(n, -1, 1)), y(n);
+    peak_gbps_ = 2.0 * sizeof(float) * n * 1e-3 / Time([&] {
+      KERNEL_RUN(benchmark_copy_kernel<float>)(n, x.data(), y.data());
+    });
+    const int m = 1 << 16;
+    const double flops = 2.0 * m * kFMARounds * kFMAChains * Vec<float>::kSize;
+    peak_gflops_ = flops * 1e-3 / Time([&] {
+      KERNEL_RUN(benchmark_fma_kernel)(m, 0.999f, 0.001f, y.data());
+    });
+    fprintf(stderr, "peak: %.2f GB/s, %.2f GFLOP/s\n", peak_gbps_,
+            peak_gflops_);
+  }
+
+  void PrintJSON() const {
+    printf("{\n  \"context\": \"%s\",\n  \"num_threads\": %d,\n",
+           get_context_name(), HOST_NUM_THREADS);
+    printf("  \"peak_gbps\": %.4f,\n  \"peak_gflops\": %.4f,\n", peak_gbps_,
+           peak_gflops_);
+    printf("  \"results\": [");
+    for (size_t i = 0; i < results_.size(); ++i) {
+      const Result &r = results_[i];
+      const double gbps = r.bytes / r.time_us * 1e-3;
+      const double gflops = r.flops / r.time_us * 1e-3;
+      // the attainable GFLOP/s of the arithmetic intensity
+      const double intensity = r.flops / r.bytes;
+      const double roofline = std::min(peak_gflops_, intensity * peak_gbps_);
+      const double fraction =
+          r.flops > 0 ? gflops / roofline : gbps / peak_gbps_;
+      printf(
+          "%s\n    {\"kernel\": \"%s\", \"dtype\": \"%s\", \"shape\": \"%s\", "
+          "\"time_us\": %.4f, \"gbps\": %.4f, \"gflops\": %.4f, "
+          "\"intensity\": %.4f, \"roofline_fraction\": %.4f}",
+          i == 0 ? "" : ",", r.kernel.c_str(), r.dtype.c_str(),
+          r.shape.c_str(), r.time_us, gbps, gflops, intensity, fraction);
+    }
+    printf("\n  ]\n}\n");
+  }
+
+  bool quick() const { return opt_.quick; }
+
+ private:
+  Options opt_;
+  std::vector<Result> results_;
+  double peak_gbps_ = 0, peak_gflops_ = 0;
+};
+
+std::string shape_str(std::initializer_list<int> dims) {
+  std::string s;
+  for (int d : dims) s += (s.empty() ? "" : "x") + std::to_string(d);
+  return s;
+}
+
+template <typename T>
+void bench_roi_align(Benchmark *b, const int C, const int H, const int W,
+                     const int R, const int P, const int sr) {
+  const int N = 2;
+  DeviceArray<T> data(uniform<T>(N * C * H * W, -1, 1));
+  std::vector<T> rois_host(R * 5);
+  const std::vector<float> coords = uniform<float>(R * 4, 0, H - 1, R);
+  for (int r = 0; r < R; ++r) {
+    const float x1 = coords[r * 4], y1 = coords[r * 4 + 1];
+    rois_host[r * 5] = T(r % N);
+    rois_host[r * 5 + 1] = T(x1);
+    rois_host[r * 5 + 2] = T(y1);
+    rois_host[r * 5 + 3] = T(std::min(x1 + 1 + coords[r * 4 + 2] / 2, W - 1.f));
+    rois_host[r * 5 + 4] = T(std::min(y1 + 1 + coords[r * 4 + 3] / 2, H - 1.f));
+  }
+  DeviceArray<T> rois(rois_host);
+  const int out_size = R * C * P * P;
+  DeviceArray<T> top(out_size), diff(data.size());
+  const std::string shape = shape_str({N, C, H, W, R, P, sr});
+  const double bytes = sizeof(T) * (data.size() + rois.size() + out_size);
+  // 4 taps of a sample, and the weights of the bilinear interpolation
+  const double flops = 20.0 * out_size * sr * sr;
+  const char *dtype = DTypeName<T>::value();
+  b->Run("roi_align_forward", dtype, shape, bytes, flops, [&] {
+    KERNEL_RUN(roi_align_forward_kernel<T>)(out_size, data.data(), T(1), C, H,
+                                            W, P, P, sr, rois.data(),
+                                            top.data());
+  });
+  b->Run("roi_align_backward", dtype, shape, bytes, flops, [&] {
+    KERNEL_RUN(roi_align_backward_kernel<T>)(out_size, top.data(), T(1), C, H,
+                                             W, P, P, sr, diff.data(),
+                                             rois.data());
+  });
+}
+
+template <typename T>
+void bench_softmax(Benchmark *b, const int rows, const int C) {
+  const int size = rows * C;
+  DeviceArray<T> x(uniform<T>(size, -4, 4)), y(size),
+      dy(uniform<T>(size, -1, 1)), dx(size);
+  const std::string shape = shape_str({rows, C});
+  const char *dtype = DTypeName<T>::value();
+  // max, exp, sum and scale of each element
+  b->Run("softmax_forward", dtype, shape, 2.0 * sizeof(T) * size, 4.0 * size,
+         [&] {
+           KERNEL_RUN(softmax_forward_kernel<T>)(size, C, x.data(), y.data());
+         });
+  b->Run("softmax_backward", dtype, shape, 3.0 * sizeof(T) * size, 4.0 * size,
+         [&] {
+           KERNEL_RUN(softmax_backward_kernel<T>)(size, C, y.data(), dy.data(),
+                                                  false, dx.data());
+         });
+}
+
+template <typename T>
+void bench_transpose(Benchmark *b, const int B, const int R, const int C,
+                     const int E) {
+  const int N = B * R * C * E;
+  DeviceArray<T> x(uniform<T>(N, -1, 1)), y(N);
+  b->Run("transpose_blocked", DTypeName<T>::value(), shape_str({B, R, C, E}),
+         2.0 * sizeof(T) * N, 0, [&] {
+           KERNEL_RUN(transpose_blocked_kernel<T>)(N, x.data(), B, R, C, E,
+                                                   y.data());
+         });
+}
+
+template <typename T>
+void bench_sum(Benchmark *b, const int N) {
+  DeviceArray<T> x(uniform<T>(N, -1, 1)), partials(N / 32 + 1), y(1);
+  // the kernels leave the counter 0
+  DeviceArray<unsigned int> counter(1);
+  b->Run("sum", DTypeName<T>::value(), shape_str({N}), sizeof(T) * double(N),
+         double(N), [&] {
+           KERNEL_RUN(sum_kernel<T>)(N, x.data(), partials.data(),
+                                     counter.data(), y.data());
+         });
+}
+
+template <typename T>
+void bench_focal_loss(Benchmark *b, const int N) {
+  typedef typename AccType<T>::type A;
+  DeviceArray<T> x(uniform<T>(N, -4, 4)), y(uniform<T>(N, 0, 1.2f)),
+      out(N), grads(N);
+  DeviceArray<A> partials(N / 32 + 1), loss(1), num_pos(1);
+  DeviceArray<unsigned int> counter(1);
+  const std::string shape = shape_str({N});
+  const char *dtype = DTypeName<T>::value();
+  // a sigmoid, two log-sigmoids and two powers of each element
+  const double flops = 30.0 * N;
+  b->Run("focal_loss_forward", dtype, shape, 3.0 * sizeof(T) * N, flops, [&] {
+    KERNEL_RUN(focal_loss_forward_kernel<T>)(N, T(0.25f), T(2), x.data(),
+                                             y.data(), out.data());
+  });
+  b->Run("focal_loss_backward", dtype, shape, 3.0 * sizeof(T) * N, flops, [&] {
+    KERNEL_RUN(focal_loss_backward_kernel<T>)(N, T(0.25f), T(2), x.data(),
+                                              y.data(), grads.data());
+  });
+  b->Run("focal_loss_reduce", dtype, shape, 2.0 * sizeof(T) * N, flops, [&] {
+    KERNEL_RUN((focal_loss_reduce_kernel<T, A>))(
+        N, T(0.25f), T(2), x.data(), y.data(), partials.data(), counter.data(),
+        loss.data(), num_pos.data());
+  });
+}
+
+template <typename T>
+void bench_iou_loss(Benchmark *b, const int N) {
+  std::vector<T> boxes = uniform<T>(N * 8, 0, 64);
+  for (int i = 0; i < N * 2; ++i) {
+    // x2 > x1 and y2 > y1
+    boxes[i * 4 + 2] = T(float(boxes[i * 4]) + 1 + float(boxes[i * 4 + 2]));
+    boxes[i * 4 + 3] = T(float(boxes[i * 4 + 1]) + 1 + float(boxes[i * 4 + 3]));
+  }
+  DeviceArray<T> preds(std::vector<T>(boxes.begin(), boxes.begin() + N * 4)),
+      targets(std::vector<T>(boxes.begin() + N * 4, boxes.end())), out(N),
+      grads(N * 4);
+  const std::string shape = shape_str({N, 4});
+  const char *dtype = DTypeName<T>::value();
+  // the areas, the intersection and the union of a pair of boxes
+  b->Run("iou_loss_forward", dtype, shape, 9.0 * sizeof(T) * N, 20.0 * N, [&] {
+    KERNEL_RUN(iou_loss_forward_kernel<T>)(N, preds.data(), targets.data(),
+                                           out.data());
+  });
+  b->Run("iou_loss_backward", dtype, shape, 12.0 * sizeof(T) * N, 40.0 * N,
+         [&] {
+           KERNEL_RUN(iou_loss_backward_kernel<T>)(N, preds.data(),
+                                                   targets.data(),
+                                                   grads.data());
+         });
+}
+
+template <typename T>
+void bench_im2col(Benchmark *b, const int C, const int H, const int W,
+                  const int K, const int stride) {
+  const int pad = K / 2;
+  const int HC = (H + 2 * pad - K) / stride + 1;
+  const int WC = (W + 2 * pad - K) / stride + 1;
+  const int n = C * K * K * HC * WC;
+  DeviceArray<T> im(uniform<T>(C * H * W, -1, 1)), col(n);
+  b->Run("im2col", DTypeName<T>::value(), shape_str({C, H, W, K, stride}),
+         sizeof(T) * (double(C) * H * W + n), 0, [&] {
+           KERNEL_RUN(im2col_kernel<T>)(n, im.data(), H, W, K, K, pad, pad,
+                                        stride, stride, 1, 1, HC, WC,
+                                        col.data());
+         });
+}
+
+template <typename T>
+void bench_all(Benchmark *b) {
+  const int s = b->quick() ? 4 : 1;
+  bench_roi_align<T>(b, 256 / s, 32, 32, 128, 7, 2);
+  bench_roi_align<T>(b, 64, 64, 64, 512 / s, 14, 2);
+  bench_softmax<T>(b, 4096 / s, 1000);
+  bench_softmax<T>(b, (1 << 18) / s, 16);
+  bench_transpose<T>(b, 1, 4096 / s, 4096, 1);
+  bench_transpose<T>(b, 256 / s, 64, 64, 4);
+  bench_sum<T>(b, (1 << 24) / s);
+  bench_focal_loss<T>(b, (1 << 24) / s);
+  bench_iou_loss<T>(b, (1 << 20) / s);
+  bench_im2col<T>(b, 64, 112 / s, 112, 3, 1);
+  bench_im2col<T>(b, 256, 28, 28, 3, 2);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options opt;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--quick") == 0) {
+      opt.quick = true;
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      opt.filter = argv[++i];
+    } else {
+      fprintf(stderr, "usage: %s [--quick] [--filter <kernel>]\n", argv[0]);
+      return 1;
+    }
+  }
+  Benchmark b(opt);
+  b.MeasurePeak();
+  bench_all<float>(&b);
+  bench_all<double>(&b);
+  const int s = opt.quick ? 4 : 1;
+  // the kernels which support the 16-bit floating types
+  bench_transpose<float16>(&b, 1, 4096 / s, 4096, 1);
+  bench_focal_loss<float16>(&b, (1 << 24) / s);
+  b.PrintJSON();
+  return 0;
+}
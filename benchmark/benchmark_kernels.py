@@ -0,0 +1,149 @@
+"""Build and run the kernel microbenchmarks of benchmark_kernels.cpp on each
+context, and compare the results with a baseline.
+
+usage:
+    python benchmark_kernels.py -o results.json
+    python benchmark_kernels.py --quick --baseline results.json
+It exits with 1 when a kernel is slower than the baseline by `--tolerance`.
+"""
+import argparse
+import json
+import os
+import subprocess
+import sys
+import mobula
+from mobula.config import config
+from mobula.building.build import get_build_flag, get_buildin_cpp, \
+    get_compile_command, get_link_command
+from mobula.building.build_utils import mkdir, run_command
+
+BENCHMARK_DIR = os.path.dirname(os.path.abspath(__file__))
+BENCHMARK_CPP = os.path.join(BENCHMARK_DIR, 'benchmark_kernels.cpp')
+
+# context name -> (the context of the build flags, the config)
+CONTEXTS = dict(
+    naive=('cpu', dict(USING_OPENMP=False)),
+    openmp=('cpu', dict(USING_OPENMP=True)),
+    cuda=('cuda', dict()),
+    hip=('hip', dict()),
+)
+
+
+def get_default_contexts():
+    ctxs = ['naive', 'openmp']
+    if mobula.utils.list_gpus():
+        ctxs.append(config.GPU_BACKEND)
+    return ctxs
+
+
+def build_benchmark(ctx, build_dir):
+    """Build the benchmark of the context `ctx` into `build_dir`.
+
+    Returns
+    -------
+    str
+        the path of the executable.
+    """
+    ctx_name, ctx_config = CONTEXTS[ctx]
+    with config.TempConfig(**ctx_config):
+        compiler, cflags, ldflags = get_build_flag(ctx_name)[:3]
+    # the benchmark is an executable rather than a library
+    ldflags = ' '.join(f for f in str(ldflags).split() if f != '-shared')
+    ctx_dir = os.path.join(build_dir, ctx)
+    mkdir(ctx_dir)
+    objs = []
+    for src in [BENCHMARK_CPP] + get_buildin_cpp():
+        obj = os.path.join(ctx_dir, os.path.splitext(
+            os.path.basename(src))[0] + '.o')
+        run_command(get_compile_command(src, obj, compiler, cflags))
+        objs.append(obj)
+    target = os.path.join(ctx_dir, 'benchmark_kernels')
+    run_command(get_link_command(target, objs, compiler, ldflags))
+    return target
+
+
+def run_benchmark(target, quick, kernel_filter):
+    command = [target]
+    if quick:
+        command.append('--quick')
+    if kernel_filter:
+        command.extend(['--filter', kernel_filter])
+    return json.loads(subprocess.check_output(command,
+                                              universal_newlines=True))
+
+
+def _result_key(context, r):
+    return (context, r['kernel'], r['dtype'], r['shape'])
+
+
+def compare(reports, baseline, tolerance):
+    """Compare the time of the kernels with the baseline.
+
+    Returns
+    -------
+    list of str
+        the descriptions of the regressions.
+    """
+    baseline_time = dict()
+    for report in baseline['reports']:
+        for r in report['results']:
+            baseline_time[_result_key(report['context'], r)] = r['time_us']
+    regressions = []
+    for report in reports:
+        for r in report['results']:
+            key = _result_key(report['context'], r)
+            old = baseline_time.get(key, None)
+            if old is None:
+                continue
+            ratio = r['time_us'] / old
+            if ratio > 1.0 + tolerance:
+                regressions.append(
+                    '{} {} {} {}: {:.2f} us -> {:.2f} us ({:+.1f}%)'.format(
+                        key[0], key[1], key[2], key[3], old, r['time_us'],
+                        (ratio - 1.0) * 100))
+    return regressions
+
+
+def main(args=None):
+    parser = argparse.ArgumentParser(
+        description='Benchmark the kernels of opzoo on each context.')
+    parser.add_argument('--ctx', nargs='+', choices=sorted(CONTEXTS.keys()),
+                        default=None,
+                        help='naive, openmp and the GPU by default')
+    parser.add_argument('--quick', action='store_true',
+                        help='run the small shapes for a short time')
+    parser.add_argument('--filter', default='',
+                        help='only run the kernels containing the substring')
+    parser.add_argument('-o', '--output', default=None,
+                        help='the output file of the results (JSON)')
+    parser.add_argument('--baseline', default=None,
+                        help='the results to compare with (JSON)')
+    parser.add_argument('--tolerance', type=float, default=0.1,
+                        help='the allowed slowdown to the baseline')
+    parser.add_argument('--build-dir', default=os.path.join(
+        config.BUILD_PATH, 'build', 'benchmark'),
+        help='the directory of the executables')
+    args = parser.parse_args(args)
+
+    reports = []
+    for ctx in args.ctx or get_default_contexts():
+        target = build_benchmark(ctx, args.build_dir)
+        reports.append(run_benchmark(target, args.quick, args.filter))
+    results = dict(reports=reports)
+    if args.output:
+        with open(args.output, 'w') as fout:
+            json.dump(results, fout, indent=2)
+    if args.baseline:
+        with open(args.baseline) as fin:
+            baseline = json.load(fin)
+        regressions = compare(reports, baseline, args.tolerance)
+        for line in regressions:
+            print('Regression: ' + line)
+        if regressions:
+            return 1
+        print('No regression over {:.0f}%'.format(args.tolerance * 100))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -1,6 +1,10 @@
 from .version import __version__
+from . import engine
 from . import func
+from . import graph
+from . import memory
 from . import op
+from . import profiler
 from . import testing
 from .config import config
 
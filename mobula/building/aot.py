@@ -0,0 +1,207 @@
+"""Ahead-of-time building
+
+Build the instances of the functions listed in a manifest into a directory,
+which is loaded by setting `mobula.config.AOT_PATH`.
+
+Usage:
+    python -m mobula.building.aot manifest.json -o aot_build
+
+Manifest (JSON):
+    {
+        "ctx": ["cpu", "cuda"],
+        "dtypes": ["float", "double"],
+        "ops": [
+            {"op": "ROIAlign"},
+            {"op": "MyOp", "path": "./ops", "functions": ["my_kernel"],
+             "ctx": ["cpu"], "dtypes": ["float", ["int", "float"]]},
+            {"cpp": "./ops/utils.cpp"}
+        ]
+    }
+    `ctx` and `dtypes` of an op override the global ones. A dtype is the
+    type name of all template types, or the `template_types` of
+    `mobula.func.<name>.build`. `op` is found like `mobula.op.load`, and the
+    relative paths are relative to the directory of the manifest.
+"""
+import argparse
+import json
+import os
+import shutil
+import tempfile
+
+from ..config import config
+from ..func import INDEX_TEMPLATE, MobulaFunc, get_func_idcode, \
+    get_idcode_hash
+from ..op import loader
+from ..utils import makedirs
+from ..version import OP_LOAD_MODULE_BUILD_VERSION
+from .build import get_build_flag, get_buildin_cpp, get_compile_command, get_link_command, get_runtime_link, run_command_parallel
+from .build_cache import get_cache_key, load_from_cache, save_to_cache
+
+
+def _find_cpp_fname(op_entry, manifest_dir):
+    if 'cpp' in op_entry:
+        return os.path.abspath(os.path.join(manifest_dir, op_entry['cpp']))
+    op_name = os.path.basename(op_entry['op'])
+    path = op_entry.get('path', '')
+    if path:
+        path = os.path.join(manifest_dir, path)
+    else:
+        path = os.path.join(os.path.dirname(loader.__file__), '../../opzoo')
+    cpp_fname = os.path.join(path, op_entry['op'], op_name + '.cpp')
+    assert os.path.exists(cpp_fname), IOError(
+        '{} not found'.format(cpp_fname))
+    return os.path.abspath(cpp_fname)
+
+
+def _get_template_types(cfunc, dtype):
+    if isinstance(dtype, str):
+        return dict((tname, dtype) for tname in cfunc.template_list
+                    if tname != INDEX_TEMPLATE)
+    return dtype
+
+
+def _get_index_types(cfunc):
+    # the kernels of the template `index_t` are built for the large sizes too
+    return ['int', 'int64'] if INDEX_TEMPLATE in cfunc.template_list \
+        else ['int']
+
+
+def get_instances(manifest, manifest_dir='.'):
+    """Get the instances listed in the manifest.
+
+    Returns
+    -------
+    list of (ctx, cpp_fname, idcode, cfunc, arg_types)
+    """
+    instances = []
+    visited = set()
+    for op_entry in manifest['ops']:
+        cpp_fname = _find_cpp_fname(op_entry, manifest_dir)
+        functions = loader._get_functions_from_cpp(cpp_fname)
+        func_names = op_entry.get('functions', sorted(functions.keys()))
+        ctxs = op_entry.get('ctx', manifest.get('ctx', ['cpu']))
+        dtypes = op_entry.get('dtypes', manifest.get('dtypes', ['float']))
+        for func_name in func_names:
+            assert func_name in functions, KeyError(
+                'No function `{}` in {}'.format(func_name, cpp_fname))
+            cfunc = functions[func_name]
+            mfunc = MobulaFunc(func_name, cfunc)
+            # the function without template is built once
+            for dtype in (dtypes if cfunc.template_list else [None]):
+                for index_type in _get_index_types(cfunc):
+                    arg_types = mfunc.get_build_arg_types(
+                        _get_template_types(cfunc, dtype), index_type)
+                    idcode = get_func_idcode(func_name, arg_types)
+                    for ctx in ctxs:
+                        key = (ctx, cpp_fname, idcode)
+                        if key not in visited:
+                            visited.add(key)
+                            instances.append(
+                                (ctx, cpp_fname, idcode, cfunc, arg_types))
+    return instances
+
+
+def build(manifest, out_dir, manifest_dir='.'):
+    """Build the instances listed in the manifest into `out_dir`.
+
+    Parameters
+    ----------
+    manifest: dict
+        the manifest, see the docstring of this module.
+    out_dir: str
+        the output directory, which can be moved as a whole.
+    manifest_dir: str
+        the directory which the relative paths in the manifest are relative to.
+    """
+    instances = get_instances(manifest, manifest_dir)
+    makedirs(out_dir, exist_ok=True)
+    # ctx -> cpp basename -> idcode -> (library, rtn_type)
+    index = dict()
+    # ctx -> the runtime library in `out_dir`
+    runtimes = dict()
+    cpp_basenames = dict()
+    compile_commands = []
+    link_commands = []
+    # the libraries to save into the build cache
+    cache_items = []
+    tmp_dir = tempfile.mkdtemp(prefix='mobula_aot_')
+    try:
+        ctx_flags = dict()
+        for ctx, cpp_fname, idcode, cfunc, arg_types in instances:
+            # the libraries are found by the basename of the source file
+            cpp_basename = os.path.basename(cpp_fname)
+            assert cpp_basenames.setdefault(cpp_basename, cpp_fname) == cpp_fname,\
+                ValueError('Different source files with the same name: {} and {}'.format(
+                    cpp_basenames[cpp_basename], cpp_fname))
+            if ctx not in ctx_flags:
+                compiler, cflags, ldflags = get_build_flag(ctx)[:3]
+                # the runtime is copied into `out_dir`, and the libraries
+                # find it by their own directory
+                runtime_o, link_flags, runtime_lib = get_runtime_link(
+                    tmp_dir, ctx, compiler, cflags, ldflags, rpath='$ORIGIN')
+                if runtime_lib is not None:
+                    runtimes[ctx] = os.path.basename(runtime_lib)
+                    shutil.copy(runtime_lib, os.path.join(
+                        out_dir, runtimes[ctx]))
+                ctx_flags[ctx] = (compiler, cflags, ldflags,
+                                  runtime_o, link_flags)
+                makedirs(os.path.join(tmp_dir, ctx), exist_ok=True)
+            compiler, cflags, ldflags, runtime_o, link_flags = ctx_flags[ctx]
+
+            template_functions = dict()
+            loader.update_template_inst_map(
+                idcode, template_functions, cfunc, arg_types)
+            code, rtn_type = template_functions[idcode]
+            stem = os.path.splitext(cpp_basename)[0]
+            idcode_hash = get_idcode_hash(idcode)
+            wrapper_fname = os.path.join(
+                tmp_dir, ctx, '{}_{}_wrapper.cpp'.format(stem, idcode_hash))
+            obj_fname = os.path.splitext(wrapper_fname)[0] + '.o'
+            lib_name = '{}_{}_{}.so'.format(stem, ctx, idcode_hash)
+            lib_fname = os.path.join(out_dir, lib_name)
+            loader.write_wrapper(cpp_fname, code, wrapper_fname)
+            index.setdefault(ctx, dict()).setdefault(
+                cpp_basename, dict())[idcode] = (lib_name, rtn_type)
+            if config.BUILD_CACHE_PATH:
+                key = get_cache_key([wrapper_fname] + get_buildin_cpp(),
+                                    ctx, compiler, cflags, ldflags)
+                if load_from_cache(key, lib_fname):
+                    continue
+                cache_items.append((key, lib_fname))
+            compile_commands.append(get_compile_command(
+                wrapper_fname, obj_fname, compiler, cflags))
+            link_commands.append(get_link_command(
+                lib_fname, [obj_fname] + runtime_o, compiler, link_flags))
+        run_command_parallel(compile_commands)
+        run_command_parallel(link_commands)
+        for key, lib_fname in cache_items:
+            save_to_cache(key, lib_fname)
+    finally:
+        shutil.rmtree(tmp_dir, ignore_errors=True)
+    with open(os.path.join(out_dir, loader.AOT_INDEX_FILENAME), 'w') as fout:
+        json.dump(dict(version=OP_LOAD_MODULE_BUILD_VERSION,
+                       functions=index, runtimes=runtimes), fout)
+    return index
+
+
+def main(args=None):
+    parser = argparse.ArgumentParser(
+        description='Build the instances of MobulaOP functions ahead of time.')
+    parser.add_argument('manifest', help='the manifest file (JSON)')
+    parser.add_argument('-o', '--output', required=True,
+                        help='the output directory')
+    parser.add_argument('-j', '--jobs', type=int, default=config.MAX_BUILDING_WORKER_NUM,
+                        help='the number of parallel building workers')
+    args = parser.parse_args(args)
+    with open(args.manifest) as fin:
+        manifest = json.load(fin)
+    with config.TempConfig(MAX_BUILDING_WORKER_NUM=args.jobs):
+        index = build(manifest, args.output,
+                      os.path.dirname(os.path.abspath(args.manifest)))
+    num_instances = sum(len(v) for ctx_index in index.values()
+                        for v in ctx_index.values())
+    print('Built {} instances into {}'.format(num_instances, args.output))
+
+
+if __name__ == '__main__':
+    main()
@@ -5,9 +5,17 @@ try:
     from .build_utils import *
 except Exception:
     from build_utils import *
+from .build_cache import get_cache_key, load_from_cache, save_to_cache, cache_lock
 
 
 NUM_CPU_CORE = multiprocessing.cpu_count()
+# the flags of `config.SIMD_ISA`, see mobula/cpp/include/simd.h
+SIMD_ISA_FLAGS = {
+    '': '',
+    'avx2': '-mavx2 -mfma -mf16c',
+    'avx512': '-mavx512f -mavx512dq -mavx2 -mfma -mf16c',
+    'native': '-march=native',
+}
 
 
 def source_to_o(build_path, src_obj, compiler, cflags):
@@ -25,30 +33,34 @@ def source_to_o(build_path, src_obj, compiler, cflags):
         if build_dir_name not in existed_dirs:
             mkdir(build_dir_name)
             existed_dirs.add(build_dir_name)
-        if OS_IS_WINDOWS and not command_exists(compiler):
-            inc_flags = Flags()
-            for path in INC_PATHS:
-                p = os.path.join(ENV_PATH, path)
-                inc_flags.add_string('-I{}'.format(p))
-            cflags_sp = str(cflags).split()
-            def_flags = ' '.join(
-                [s for s in cflags_sp if len(s) > 2 and s[:2] == '-D'])
-            command = 'cl /EHsc /O2 %s %s -c %s -Fo%s' % (
-                def_flags, inc_flags, src, build_name)
-        else:
-            command = '%s %s %s -c -o %s' % (compiler, src, cflags, build_name)
-        commands.append(command)
+        commands.append(get_compile_command(
+            src, build_name, compiler, cflags))
     run_command_parallel(commands)
     return updated
 
 
-def o_to_so(target_name, objs, linker, ldflags):
+def get_compile_command(src, obj, compiler, cflags):
+    if OS_IS_WINDOWS and not command_exists(compiler):
+        inc_flags = Flags()
+        for path in INC_PATHS:
+            p = os.path.join(ENV_PATH, path)
+            inc_flags.add_string('-I{}'.format(p))
+        cflags_sp = str(cflags).split()
+        def_flags = ' '.join(
+            [s for s in cflags_sp if len(s) > 2 and s[:2] == '-D'])
+        return 'cl /EHsc /O2 %s %s -c %s -Fo%s' % (
+            def_flags, inc_flags, src, obj)
+    return '%s %s %s -c -o %s' % (compiler, src, cflags, obj)
+
+
+def get_link_command(target_name, objs, linker, ldflags):
     if OS_IS_WINDOWS and not command_exists(linker):
-        command = 'link -DLL %s -out:%s' % (' '.join(objs), target_name)
-    else:
-        command = '%s %s %s -o %s' % (linker,
-                                      ' '.join(objs), ldflags, target_name)
-    run_command(command)
+        return 'link -DLL %s -out:%s' % (' '.join(objs), target_name)
+    return '%s %s %s -o %s' % (linker, ' '.join(objs), ldflags, target_name)
+
+
+def o_to_so(target_name, objs, linker, ldflags):
+    run_command(get_link_command(target_name, objs, linker, ldflags))
 
 
 def source_to_so(build_path, srcs, target_name, compiler, cflags, ldflags, buildin_o=None):
@@ -69,8 +81,12 @@ def get_common_flags():
     if config.DEBUG:
         COMMON_FLAGS.add_string('-g')
     COMMON_FLAGS.add_definition('USING_CBLAS', config.USING_CBLAS)
-    INC_PATHS.extend(['./cpp/include', '../3rdparty/dlpack/include',
-                      '../3rdparty/tvm_packed_func'])
+    COMMON_FLAGS.add_definition('USING_FAST_MATH', config.USING_FAST_MATH)
+    # the flags are got for each library, so the paths are added once
+    for path in ['./cpp/include', '../3rdparty/dlpack/include',
+                 '../3rdparty/tvm_packed_func']:
+        if path not in INC_PATHS:
+            INC_PATHS.append(path)
     for path in INC_PATHS:
         p = os.path.join(ENV_PATH, path)
         if p:
@@ -83,9 +99,15 @@ def get_build_flag_cpu():
     COMMON_FLAGS = get_common_flags()
     CFLAGS = Flags('-std=c++11').add_definition('USING_CUDA', 0).\
         add_definition('USING_HIP', 0).add_definition('USING_OPENMP', config.USING_OPENMP).\
+        add_definition('USING_SPIN_BARRIER', config.USING_SPIN_BARRIER).\
         add_string(COMMON_FLAGS)
     if not OS_IS_WINDOWS:
         CFLAGS.add_string('-fPIC')
+    assert config.SIMD_ISA in SIMD_ISA_FLAGS, ValueError(
+        'Unsupported SIMD_ISA: {}, expected one of {}'.format(
+            config.SIMD_ISA, sorted(SIMD_ISA_FLAGS.keys())))
+    if config.SIMD_ISA:
+        CFLAGS.add_string(SIMD_ISA_FLAGS[config.SIMD_ISA])
     LDFLAGS = Flags('-lpthread -shared')
     if config.USING_CBLAS:
         LDFLAGS.add_string('-lopenblas')
@@ -107,6 +129,8 @@ def get_build_flag_cuda():
     -D_MWAITXINTRIN_H_INCLUDED -D_FORCE_INLINES --expt-extended-lambda').\
         add_definition('USING_CUDA', 1).\
         add_definition('USING_HIP', 0).\
+        add_definition('USING_ASYNC_KERNEL_LAUNCH', config.USING_ASYNC_KERNEL_LAUNCH).\
+        add_definition('USING_NVTX', config.USING_NVTX).\
         add_string(COMMON_FLAGS)
     if not OS_IS_WINDOWS:
         CU_FLAGS.add_string('--compiler-options "-fPIC"')
@@ -114,6 +138,9 @@ def get_build_flag_cuda():
     -L%s/lib64 -lcuda -lcudart' % config.CUDA_DIR)
     if config.USING_CBLAS:
         CU_LDFLAGS.add_string('-lcublas')
+    if config.USING_NVTX:
+        # NVTX 3 is header-only, and loads the tools by dlopen
+        CU_LDFLAGS.add_string('-ldl')
     return config.NVCC, CU_FLAGS, CU_LDFLAGS
 
 
@@ -123,12 +150,16 @@ def get_build_flag_hip():
     --expt-extended-lambda').\
         add_definition('USING_CUDA', 0).\
         add_definition('USING_HIP', 1).\
+        add_definition('USING_ASYNC_KERNEL_LAUNCH', config.USING_ASYNC_KERNEL_LAUNCH).\
+        add_definition('USING_NVTX', config.USING_NVTX).\
         add_string(COMMON_FLAGS)
     if not OS_IS_WINDOWS:
         HIP_FLAGS.add_string('--compiler-options "-fPIC"')
     HIP_LDFLAGS = Flags('-shared -Wno-deprecated-gpu-targets')
     if config.USING_CBLAS:
         HIP_LDFLAGS.add_string('-lhipblas')
+    if config.USING_NVTX:
+        HIP_LDFLAGS.add_string('-lroctx64')
     return config.HIPCC, HIP_FLAGS, HIP_LDFLAGS
 
 
@@ -146,24 +177,121 @@ def get_build_flag(ctx_name):
     return flags
 
 
-def source_to_so_ctx(build_path, srcs, target_name, ctx_name):
-    flags = get_build_flag(ctx_name)
-    compiler, cflags, ldflags = flags[:3]
-
-    buildin_path = os.path.join(
-        config.BUILD_PATH, 'build', 'buildin', ctx_name)
-    buildin_o = []
-    buildin_cpp = []
-    for src in ['defines.cpp', 'context.cpp']:
-        fname = os.path.join('cpp', 'src', src)
-        buildin_o.append(os.path.join(buildin_path, fname))
-        buildin_cpp.append(os.path.join(ENV_PATH, fname))
-    buildin_o = change_exts(buildin_o, [('cpp', 'o')])
+BUILDIN_SRCS = [os.path.join('cpp', 'src', src)
+                for src in ['defines.cpp', 'context.cpp']]
+
+
+def get_buildin_cpp():
+    return [os.path.join(ENV_PATH, fname) for fname in BUILDIN_SRCS]
+
+
+def get_buildin_path(ctx_name, compiler, cflags):
+    """Get the directory of the buildin objects of the context `ctx_name`. It
+    is named by the hash of the flags and the buildin sources with their
+    headers, so that the objects built by other flags, e.g. USING_OPENMP or
+    SIMD_ISA, or by an older MobulaOP are never linked."""
+    flags_hash = get_cache_key(get_buildin_cpp(), ctx_name, compiler, cflags,
+                               '')[:16]
+    return os.path.join(config.BUILD_PATH, 'build', 'buildin',
+                        '{}_{}'.format(ctx_name, flags_hash))
+
+
+def get_buildin_o(build_path, ctx_name, compiler, cflags):
+    """Get the objects linked into every library of the context `ctx_name`,
+    and build them if they don't exist."""
+    buildin_path = get_buildin_path(ctx_name, compiler, cflags)
+    buildin_o = change_exts([os.path.join(buildin_path, fname)
+                             for fname in BUILDIN_SRCS], [('cpp', 'o')])
+    buildin_cpp = get_buildin_cpp()
 
     for fname in buildin_o:
         if not os.path.exists(fname):
             with build_context():
                 source_to_o(build_path, zip(
                     buildin_cpp, buildin_o), compiler, cflags)
-    flags += (buildin_o, )
-    source_to_so(build_path, srcs, target_name, *flags)
+    return buildin_o
+
+
+def get_linker_option(ctx_name, option):
+    # nvcc and hipcc pass the options of the host linker by -Xlinker
+    if ctx_name == 'cpu':
+        return '-Wl,{}'.format(option)
+    return '-Xlinker {}'.format(option)
+
+
+# (ctx_name, compiler, cflags, ldflags) -> the filename of the runtime library
+_RUNTIME_LIBS = dict()
+
+
+def get_runtime_lib(ctx_name, compiler, cflags, ldflags):
+    """Get the runtime library of the context `ctx_name`, which is built from
+    the buildin objects in the buildin directory if it doesn't exist.
+
+    The libraries of the functions in the context are linked against it and
+    share its state, e.g. the memory pool, the thread pool, the settings of
+    the threads and the profiler. It is None on Windows, where the buildin
+    objects are linked into each library.
+    """
+    if OS_IS_WINDOWS:
+        return None
+    # the include paths are ignored like `get_cache_key`
+    key = (ctx_name, compiler, ' '.join(
+        f for f in str(cflags).split() if not f.startswith('-I')),
+        str(ldflags))
+    lib_fname = _RUNTIME_LIBS.get(key, None)
+    if lib_fname is not None:
+        return lib_fname
+    buildin_path = get_buildin_path(ctx_name, compiler, cflags)
+    lib_name = 'libmobula_{}.so'.format(os.path.basename(buildin_path))
+    lib_fname = os.path.join(buildin_path, lib_name)
+    if not os.path.exists(lib_fname):
+        buildin_o = get_buildin_o(buildin_path, ctx_name, compiler, cflags)
+        # the library is renamed after linking, since the other processes
+        # may load it once it exists
+        tmp_fname = '{}.{}.tmp'.format(lib_fname, os.getpid())
+        o_to_so(tmp_fname, buildin_o, compiler, Flags(str(ldflags)).add_string(
+            get_linker_option(ctx_name, '-soname={}'.format(lib_name))))
+        os.rename(tmp_fname, lib_fname)
+    _RUNTIME_LIBS[key] = lib_fname
+    return lib_fname
+
+
+def get_runtime_link(build_path, ctx_name, compiler, cflags, ldflags,
+                     rpath=None):
+    """Get the objects and the flags to link a library of the functions in the
+    context `ctx_name` with the runtime.
+
+    Returns
+    -------
+    (objs, ldflags, runtime_lib)
+        `runtime_lib` is the runtime library which the library is linked
+        against, or None if the buildin objects are linked into it.
+    """
+    runtime_lib = get_runtime_lib(ctx_name, compiler, cflags, ldflags)
+    if runtime_lib is None:
+        return get_buildin_o(build_path, ctx_name, compiler, cflags), \
+            ldflags, None
+    if rpath is None:
+        rpath = os.path.dirname(runtime_lib)
+    ldflags = Flags(str(ldflags)).add_string(
+        get_linker_option(ctx_name, "-rpath='{}'".format(rpath)))
+    return [runtime_lib], ldflags, runtime_lib
+
+
+def source_to_so_ctx(build_path, srcs, target_name, ctx_name):
+    compiler, cflags, ldflags = get_build_flag(ctx_name)[:3]
+    objs, link_flags, _ = get_runtime_link(
+        build_path, ctx_name, compiler, cflags, ldflags)
+    if not config.BUILD_CACHE_PATH:
+        source_to_so(build_path, srcs, target_name,
+                     compiler, cflags, link_flags, objs)
+        return
+    # the library depends on the buildin sources through the runtime
+    key = get_cache_key(srcs + get_buildin_cpp(),
+                        ctx_name, compiler, cflags, ldflags)
+    with cache_lock(key):
+        if load_from_cache(key, target_name):
+            return
+        source_to_so(build_path, srcs, target_name,
+                     compiler, cflags, link_flags, objs)
+        save_to_cache(key, target_name)
@@ -0,0 +1,141 @@
+"""Content-addressed cache of the built libraries
+
+The key of a library is the hash of
+    the context, the compiler version, the flags (except include paths),
+    the sources and the contents of the included files found in the source
+    directories and the include paths.
+The absolute paths are not hashed, so the processes and the machines
+sharing the cache directory `config.BUILD_CACHE_PATH` reuse the libraries.
+"""
+import hashlib
+import os
+import re
+import shutil
+from subprocess import Popen, PIPE
+import portalocker
+
+from ..config import config
+from ..utils import makedirs
+from ..version import OP_LOAD_MODULE_BUILD_VERSION
+from .build_dependant import _INCLUDE_FILE_REG
+
+# the generated comment of a wrapper records its path and creation time
+_LEADING_COMMENT_REG = re.compile(r'^\s*/\*.*?\*/', re.S)
+_COMPILER_VERSIONS = dict()
+
+
+def _get_compiler_version(compiler):
+    version = _COMPILER_VERSIONS.get(compiler, None)
+    if version is None:
+        try:
+            proc = Popen([compiler, '--version'], stdout=PIPE, stderr=PIPE)
+            version = proc.communicate()[0].decode('utf-8', 'ignore')
+        except Exception:
+            version = compiler
+        _COMPILER_VERSIONS[compiler] = version
+    return version
+
+
+def _find_include_file(name, dirs):
+    for dirname in dirs:
+        fname = os.path.join(dirname, name)
+        if os.path.isfile(fname):
+            return os.path.abspath(fname)
+    return None
+
+
+def _update_file_hash(md5, fname, inc_dirs, visited):
+    with open(fname, 'rb') as fin:
+        code = fin.read().decode('utf-8', 'ignore')
+    code = _LEADING_COMMENT_REG.sub('', code, count=1)
+    dirs = [os.path.dirname(fname)] + inc_dirs
+    for line in code.splitlines():
+        match = _INCLUDE_FILE_REG.search(line)
+        if match is not None:
+            inc_fname = _find_include_file(match.groups()[0], dirs)
+            if inc_fname is not None:
+                # hash the content rather than the path
+                md5.update(b'#include\n')
+                if inc_fname not in visited:
+                    visited.add(inc_fname)
+                    _update_file_hash(md5, inc_fname, inc_dirs, visited)
+                continue
+        md5.update(line.encode('utf-8'))
+        md5.update(b'\n')
+
+
+def get_cache_key(srcs, ctx_name, compiler, cflags, ldflags):
+    """Get the key of the library built from `srcs`."""
+    md5 = hashlib.md5()
+    inc_dirs = []
+    flags = []
+    for flag in str(cflags).split() + ['|'] + str(ldflags).split():
+        if flag.startswith('-I'):
+            inc_dirs.append(flag[2:])
+        else:
+            flags.append(flag)
+    for s in [OP_LOAD_MODULE_BUILD_VERSION, ctx_name,
+              _get_compiler_version(compiler), ' '.join(flags)]:
+        md5.update(str(s).encode('utf-8'))
+        md5.update(b'\0')
+    visited = set()
+    for src in srcs:
+        _update_file_hash(md5, src, inc_dirs, visited)
+        md5.update(b'\0')
+    return md5.hexdigest()
+
+
+def _get_cache_fname(key):
+    return os.path.join(config.BUILD_CACHE_PATH, key[:2], key + '.so')
+
+
+def _copy_file(src, dst):
+    # the other processes never see a partial file
+    tmp_fname = '{}.{}.tmp'.format(dst, os.getpid())
+    shutil.copyfile(src, tmp_fname)
+    try:
+        os.rename(tmp_fname, dst)
+    except OSError:
+        # `dst` has been written by another process
+        os.remove(tmp_fname)
+
+
+def load_from_cache(key, target_name):
+    """Copy the cached library to `target_name`.
+
+    Returns
+    -------
+    bool: whether the library is in the cache
+    """
+    cache_fname = _get_cache_fname(key)
+    if not os.path.exists(cache_fname):
+        return False
+    _copy_file(cache_fname, target_name)
+    return True
+
+
+def save_to_cache(key, target_name):
+    cache_fname = _get_cache_fname(key)
+    if not os.path.exists(cache_fname):
+        makedirs(os.path.dirname(cache_fname), exist_ok=True)
+        _copy_file(target_name, cache_fname)
+
+
+class cache_lock:
+    """Lock the key, so that a library is built by only one of the processes
+    sharing the cache."""
+
+    def __init__(self, key):
+        self.key = key
+        self.fs = None
+
+    def __enter__(self):
+        lock_fname = _get_cache_fname(self.key) + '.lock'
+        makedirs(os.path.dirname(lock_fname), exist_ok=True)
+        self.fs = open(lock_fname, 'a+')
+        portalocker.lock(self.fs, portalocker.LOCK_EX)
+        return self
+
+    def __exit__(self, *dummy):
+        portalocker.unlock(self.fs)
+        self.fs.close()
@@ -7,14 +7,27 @@ class DefaultConfig:
     BUILD_IN_LOCAL_PATH = True
     SHOW_BUILDING_COMMAND = False
     MAX_BUILDING_WORKER_NUM = 8
+    BUILD_CACHE_PATH = ''  # the shared cache of the built libraries, '' to disable
+    AOT_PATH = ''  # the directory built by `python -m mobula.building.aot`
 
     DEBUG = False
     USING_OPENMP = True
     USING_CBLAS = False
     HOST_NUM_THREADS = 0  # 0 : auto
+    NUM_THREADS = 0  # the threads of the kernels on CPU at runtime, 0 : HOST_NUM_THREADS
+    INLINE_GRAIN = 0  # the kernels on CPU of fewer elements run on the calling thread, 0 : off
+    THREAD_AFFINITY = ''  # pin the threads of the kernels on CPU, '' (no pinning), 'compact' or 'scatter'
+    USING_SPIN_BARRIER = True  # only for naive CPU
     USING_HIGH_LEVEL_WARNINGS = False
     USING_OPTIMIZATION = True
+    USING_FAST_MATH = False  # the approximations of mobula/cpp/include/fast_math.h
+    USING_CONST_SPECIALIZATION = True  # the instances of the values of `mobula.func.constexpr`
+    SIMD_ISA = ''  # '' (the baseline of the compiler), 'avx2', 'avx512' or 'native'
+    AUTOTUNE = False  # benchmark the launch configs of the kernels on first use, and keep the fastest in the build information
     USING_ASYNC_EXEC = True
+    USING_ASYNC_CPU = False  # the calls on CPU return a future and run on a worker thread, see mobula/engine.py
+    USING_ASYNC_KERNEL_LAUNCH = True  # only for GPU, see `mobula.func.synchronize`
+    USING_NVTX = False  # only for GPU, the NVTX/roctx ranges of the kernels
     GPU_BACKEND = 'cuda'
 
     CXX = 'g++'
@@ -40,6 +53,23 @@ class Config:
             raise TypeError('The type of config attribute `{}` is not consistent, target {} vs value {}.'.format(
                 name, target_type, value_type))
         self.__dict__[name] = value
+        hook = _runtime_hooks.get(name, None)
+        if hook is not None:
+            hook(value)
+
+    def set_num_threads(self, num_threads):
+        """Set the threads of the kernels on CPU without rebuilding, at most
+        HOST_NUM_THREADS. 0 is HOST_NUM_THREADS."""
+        self.NUM_THREADS = num_threads
+
+
+# config name -> hook(value), which applies the runtime config to the loaded
+# libraries when it is set
+_runtime_hooks = dict()
+
+
+def set_runtime_hook(name, hook):
+    _runtime_hooks[name] = hook
 
 
 config = Config()
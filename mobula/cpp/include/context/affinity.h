@@ -0,0 +1,174 @@
+#ifndef MOBULA_INCLUDE_CONTEXT_AFFINITY_H_
+#define MOBULA_INCLUDE_CONTEXT_AFFINITY_H_
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace mobula {
+
+// the policies to pin the threads of the kernels on CPU
+enum ThreadAffinity {
+  // leave the placement to the OS
+  kAffinityNone = 0,
+  // fill the CPUs of a NUMA node before the next one
+  kAffinityCompact = 1,
+  // spread the threads over the NUMA nodes in turn
+  kAffinityScatter = 2,
+};
+
+/*!
+ * \brief The CPUs which the process is allowed to run on, grouped by NUMA
+ *  node. It is a single node if the topology is unknown.
+ */
+struct CpuTopology {
+  std::vector<std::vector<int>> nodes;
+  // the number of the CPUs in `nodes`
+  int num_cpus;
+};
+
+namespace affinity_detail {
+
+#ifdef __linux__
+// add the CPUs of a cpulist, e.g. "0-3,8-11", which are in `allowed`
+inline void parse_cpulist(const char *list, const cpu_set_t &allowed,
+                          std::vector<int> *cpus) {
+  const char *s = list;
+  while (*s != '\0' && *s != '\n') {
+    char *end;
+    const long first = std::strtol(s, &end, 10);
+    if (end == s) break;
+    long last = first;
+    s = end;
+    if (*s == '-') {
+      last = std::strtol(s + 1, &end, 10);
+      s = end;
+    }
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &allowed)) cpus->push_back(static_cast<int>(cpu));
+    }
+    if (*s == ',') ++s;
+  }
+}
+
+inline bool get_process_cpus(cpu_set_t *allowed) {
+  CPU_ZERO(allowed);
+  return sched_getaffinity(0, sizeof(cpu_set_t), allowed) == 0;
+}
+#endif  // __linux__
+
+inline CpuTopology read_cpu_topology() {
+  CpuTopology topology;
+  topology.num_cpus = 0;
+#ifdef __linux__
+  cpu_set_t allowed;
+  if (get_process_cpus(&allowed)) {
+    // node id -> CPUs
+    std::vector<std::pair<int, std::vector<int>>> nodes;
+    const char *kNodeDir = "/sys/devices/system/node";
+    DIR *dir = opendir(kNodeDir);
+    if (dir != nullptr) {
+      while (dirent *entry = readdir(dir)) {
+        int node;
+        char tail;
+        if (std::sscanf(entry->d_name, "node%d%c", &node, &tail) != 1) {
+          continue;
+        }
+        char fname[512], list[4096];
+        std::snprintf(fname, sizeof(fname), "%s/%s/cpulist", kNodeDir,
+                      entry->d_name);
+        FILE *fin = std::fopen(fname, "r");
+        if (fin == nullptr) continue;
+        if (std::fgets(list, sizeof(list), fin) != nullptr) {
+          std::vector<int> cpus;
+          parse_cpulist(list, allowed, &cpus);
+          if (!cpus.empty()) nodes.emplace_back(node, cpus);
+        }
+        std::fclose(fin);
+      }
+      closedir(dir);
+    }
+    std::sort(nodes.begin(), nodes.end());
+    for (auto &node : nodes) topology.nodes.push_back(node.second);
+    if (topology.nodes.empty()) {
+      topology.nodes.emplace_back();
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed)) topology.nodes[0].push_back(cpu);
+      }
+    }
+  }
+#endif  // __linux__
+  for (const std::vector<int> &cpus : topology.nodes) {
+    topology.num_cpus += static_cast<int>(cpus.size());
+  }
+  return topology;
+}
+
+#ifdef __linux__
+// the CPUs which the process is allowed to run on before pinning
+inline const cpu_set_t &get_unpinned_cpus() {
+  static cpu_set_t *cpus = [] {
+    cpu_set_t *allowed = new cpu_set_t;
+    get_process_cpus(allowed);
+    return allowed;
+  }();
+  return *cpus;
+}
+#endif  // __linux__
+
+// whether a thread of the kernels has been pinned
+inline std::atomic<bool> &any_thread_pinned() {
+  static std::atomic<bool> pinned{false};
+  return pinned;
+}
+
+}  // namespace affinity_detail
+
+// the topology is read once, and never destroyed
+inline const CpuTopology &get_cpu_topology() {
+  static const CpuTopology *topology =
+      new CpuTopology(affinity_detail::read_cpu_topology());
+  return *topology;
+}
+
+/*!
+ * \brief Get the CPU of the thread `thread_id` under `policy`, or -1 for
+ *  kAffinityNone. The static partition of parfor gives the thread the same
+ *  share of the indices in every kernel, so the thread stays on the node of
+ *  the pages it touched first.
+ */
+inline int get_affinity_cpu(const int policy, const int thread_id) {
+  const CpuTopology &topology = get_cpu_topology();
+  if (policy == kAffinityNone || topology.num_cpus == 0) return -1;
+  const int num_nodes = static_cast<int>(topology.nodes.size());
+  if (policy == kAffinityScatter) {
+    const std::vector<int> &cpus = topology.nodes[thread_id % num_nodes];
+    return cpus[(thread_id / num_nodes) % cpus.size()];
+  }
+  int k = thread_id % topology.num_cpus;
+  for (const std::vector<int> &cpus : topology.nodes) {
+    if (k < static_cast<int>(cpus.size())) return cpus[k];
+    k -= static_cast<int>(cpus.size());
+  }
+  return -1;
+}
+
+/*!
+ * \brief Pin the calling thread, which is the thread `thread_id` of a kernel,
+ *  by `policy`. It only calls the OS when the policy or the thread id of the
+ *  calling thread changes, and kAffinityNone unpins it. It is defined in
+ *  context.cpp, since the threads are shared by the libraries.
+ */
+void apply_thread_affinity(const int policy, const int thread_id);
+
+}  // namespace mobula
+
+#endif  // MOBULA_INCLUDE_CONTEXT_AFFINITY_H_
@@ -33,9 +33,66 @@ inline MOBULA_DEVICE void get_parfor_range(const size_t n,
                                            index_t *end) {
   const index_t avg_len = n / num_threads;
   const index_t rest = n % num_threads;
+  const index_t tid = static_cast<index_t>(thread_id);
   // [start, end)
-  *start = avg_len * thread_id + (thread_id < rest ? thread_id : rest);
-  *end = *start + avg_len + (thread_id < rest);
+  *start = avg_len * tid + (tid < rest ? tid : rest);
+  *end = *start + avg_len + (tid < rest);
+}
+
+/*!
+ * \brief The scheduling of the indices of parfor over the threads on CPU.
+ *  kStatic splits [0, n) into equal contiguous ranges, like get_parfor_range.
+ *  kDynamic lets the threads take the chunks in turn by an atomic counter.
+ *  kStealing starts from the static ranges, and the threads which finish
+ *  steal the half of the rest of the others, which keeps the locality of the
+ *  static ranges. They balance the kernels whose indices cost differently.
+ *  The schedules other than kStatic should be called by all threads of the
+ *  kernel together, and end with a barrier like __syncthreads.
+ *  On GPU the schedule is ignored, since the blocks are balanced by the
+ *  hardware.
+ */
+struct ParforSchedule {
+  enum Kind { kStatic, kDynamic, kStealing };
+  Kind kind;
+  // the number of the indices taken at a time, or 0 to choose it by `cost`
+  size_t chunk;
+  // the hint of the cost of an index, in nominal arithmetic operations
+  float cost;
+};
+
+inline MOBULA_DEVICE ParforSchedule parfor_static() {
+  return ParforSchedule{ParforSchedule::kStatic, 0, 1.0f};
+}
+
+inline MOBULA_DEVICE ParforSchedule parfor_dynamic(const size_t chunk = 0,
+                                                   const float cost = 1.0f) {
+  return ParforSchedule{ParforSchedule::kDynamic, chunk, cost};
+}
+
+inline MOBULA_DEVICE ParforSchedule parfor_stealing(const size_t chunk = 0,
+                                                    const float cost = 1.0f) {
+  return ParforSchedule{ParforSchedule::kStealing, chunk, cost};
+}
+
+// the nominal operations of a chunk which amortize taking it
+constexpr float PARFOR_CHUNK_COST = 4096.0f;
+// the least chunks of a thread to balance the load
+constexpr int PARFOR_CHUNKS_PER_THREAD = 8;
+
+/*!
+ * \brief The chunk of `schedule` for `n` indices on `num_threads` threads.
+ *  Without an explicit chunk, a chunk costs about PARFOR_CHUNK_COST, and it is
+ *  small enough to give each thread PARFOR_CHUNKS_PER_THREAD chunks.
+ */
+inline size_t get_parfor_chunk(const ParforSchedule &schedule, const size_t n,
+                               const int num_threads) {
+  if (schedule.chunk > 0) return schedule.chunk;
+  const float cost = schedule.cost > 0 ? schedule.cost : 1.0f;
+  const size_t by_cost =
+      static_cast<size_t>(std::max(1.0f, PARFOR_CHUNK_COST / cost));
+  const size_t by_balance = std::max<size_t>(
+      1, n / (static_cast<size_t>(num_threads) * PARFOR_CHUNKS_PER_THREAD));
+  return std::min(by_cost, by_balance);
 }
 
 }  // namespace mobula
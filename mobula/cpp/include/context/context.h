@@ -14,6 +14,50 @@
 
 extern "C" {
 MOBULA_DLL void set_device(const int device_id);
+// wait for the kernels on the device `device_id`, or all devices if it is -1
+MOBULA_DLL void synchronize(const int device_id);
+// the statistics of the memory pool behind new_array/del_array
+MOBULA_DLL void memory_pool_stats(mobula::MemoryPoolStats *stats);
+// release the cached blocks of the memory pool
+MOBULA_DLL void memory_pool_trim();
+// record the kernels launched by KERNEL_RUN, see mobula/profiler.py
+MOBULA_DLL void profiler_set_enabled(const int enabled);
+// move at most `max_events` recorded kernels into `events`, and return the
+// number of the events
+MOBULA_DLL int profiler_take_events(mobula::ProfilerEvent *events,
+                                    const int max_events);
+
+#if USING_HIP || USING_CUDA
+// the graph of the kernels on device `device_id`, see mobula/graph.py
+// begin capturing the kernels on a new stream, and return the stream
+MOBULA_DLL void *graph_begin_capture(const int device_id);
+// end capturing, and return the executable graph
+MOBULA_DLL void *graph_end_capture(void *stream);
+MOBULA_DLL void graph_launch(void *exec, const int device_id);
+MOBULA_DLL void graph_destroy(void *exec);
+// launch KERNEL_RUN of this library on `stream`, or nullptr to stop capturing
+MOBULA_DLL void graph_set_capture_stream(void *stream);
+// take the workspaces kept by the capture of this library
+MOBULA_DLL void *graph_take_arrays();
+MOBULA_DLL void graph_free_arrays(void *arrays);
+// launch KERNEL_RUN of this library on the calling thread on `stream`, the
+// current stream of the framework, kNullStream for the null stream, or nullptr
+// for the stream of the device
+MOBULA_DLL void set_current_stream(void *stream);
+// the block size of KERNEL_RUN of this library on the calling thread, at most
+// the one of the maximum occupancy, or 0 for it
+MOBULA_DLL void set_thread_block_size(const int block_size);
+#else
+// the threads of KERNEL_RUN, see HostThreadConfig
+// the threads of a launch, 0 for HOST_NUM_THREADS
+MOBULA_DLL void cpu_set_num_threads(const int num_threads);
+// run the kernels of fewer elements than `grain` on the calling thread
+MOBULA_DLL void cpu_set_inline_grain(const int grain);
+// the threads of the launches on the calling thread, 0 to use the above
+MOBULA_DLL void cpu_set_thread_num_threads(const int num_threads);
+// pin the threads of the launches by mobula::ThreadAffinity
+MOBULA_DLL void cpu_set_thread_affinity(const int affinity);
+#endif  // USING_HIP || USING_CUDA
 }
 
 #endif  // MOBULA_INCLUDE_CONTEXT_CONTEXT_H_
@@ -3,15 +3,22 @@
 
 #define MOBULA_KERNEL void
 #define MOBULA_DEVICE
+#define MOBULA_LAUNCH_BOUNDS(max_threads)
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstring>
 #include <mutex>
+#include <new>
 #include <thread>
+#include <type_traits>
 
 #include "../ctypes.h"
+#include "./affinity.h"
 #include "./common.h"
+#include "./memory_pool.h"
+#include "./profiler.h"
 
 namespace mobula {
 
@@ -34,19 +41,49 @@ using std::min;
 
 #if USING_OPENMP
 
-inline MOBULA_DEVICE float atomic_add(const float val, float *address) {
+template <typename T>
+inline MOBULA_DEVICE T atomic_add(const T val, T *address) {
 #pragma omp atomic update
   *address += val;
   return *address;
 }
 
+#elif HOST_NUM_THREADS > 1 && defined(__GNUC__)
+// Naive CPU, lock-free
+
+template <typename T>
+inline T atomic_add_impl(const T val, T *address, std::true_type) {
+  // integral type
+  return __atomic_add_fetch(address, val, __ATOMIC_RELAXED);
+}
+
+template <typename T>
+inline T atomic_add_impl(const T val, T *address, std::false_type) {
+  // floating type, CAS loop on the bits of `*address`
+  static_assert(sizeof(T) == 4 || sizeof(T) == 8,
+                "atomic_add only supports 32-bit and 64-bit types");
+  T old_val, new_val;
+  __atomic_load(address, &old_val, __ATOMIC_RELAXED);
+  do {
+    new_val = old_val + val;
+  } while (!__atomic_compare_exchange(address, &old_val, &new_val, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return new_val;
+}
+
+template <typename T>
+inline MOBULA_DEVICE T atomic_add(const T val, T *address) {
+  return atomic_add_impl(val, address, std::is_integral<T>());
+}
+
 #elif HOST_NUM_THREADS > 1
-// Naive CPU
+// Naive CPU, fallback for the compilers without __atomic builtins
 
 constexpr int NUM_MOBULA_ATOMIC_ADD_MUTEXES = HOST_NUM_THREADS * 8;
 static std::mutex MOBULA_ATOMIC_ADD_MUTEXES[NUM_MOBULA_ATOMIC_ADD_MUTEXES];
-inline MOBULA_DEVICE float atomic_add(const float val, float *address) {
-  uintptr_t id = (reinterpret_cast<uintptr_t>(address) / sizeof(float)) %
+template <typename T>
+inline MOBULA_DEVICE T atomic_add(const T val, T *address) {
+  uintptr_t id = (reinterpret_cast<uintptr_t>(address) / sizeof(T)) %
                  NUM_MOBULA_ATOMIC_ADD_MUTEXES;
   std::lock_guard<std::mutex> lock(MOBULA_ATOMIC_ADD_MUTEXES[id]);
   *address += val;
@@ -56,20 +93,148 @@ inline MOBULA_DEVICE float atomic_add(const float val, float *address) {
 #else
 
 // no lock for single thread mode
-inline MOBULA_DEVICE float atomic_add(const float val, float *address) {
+template <typename T>
+inline MOBULA_DEVICE T atomic_add(const T val, T *address) {
   *address += val;
   return *address;
 }
 #endif
 
+#if USING_OPENMP || (HOST_NUM_THREADS > 1 && defined(__GNUC__))
+// the 16-bit floating types are added in float, by a CAS loop on their bits
 template <typename T>
-T *new_array(size_t size) {
-  return new T[size];
+inline T atomic_add_float16(const T val, T *address) {
+  T new_val;
+#if defined(__GNUC__)
+  T old_val;
+  old_val.bits = __atomic_load_n(&address->bits, __ATOMIC_RELAXED);
+  do {
+    new_val = static_cast<float>(old_val) + static_cast<float>(val);
+  } while (!__atomic_compare_exchange_n(&address->bits, &old_val.bits,
+                                        new_val.bits, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+#else
+#pragma omp critical(mobula_atomic_add_float16)
+  new_val = *address += static_cast<float>(val);
+#endif  // defined(__GNUC__)
+  return new_val;
+}
+
+inline MOBULA_DEVICE float16 atomic_add(const float16 val, float16 *address) {
+  return atomic_add_float16(val, address);
+}
+
+inline MOBULA_DEVICE bfloat16 atomic_add(const bfloat16 val,
+                                         bfloat16 *address) {
+  return atomic_add_float16(val, address);
+}
+#endif  // USING_OPENMP || (HOST_NUM_THREADS > 1 && defined(__GNUC__))
+
+/*!
+ * \brief The runtime settings of the threads of KERNEL_RUN, which are set by
+ *  `mobula.config.NUM_THREADS`, `INLINE_GRAIN` and `THREAD_AFFINITY`.
+ *  HOST_NUM_THREADS is still the most threads of a launch.
+ */
+struct HostThreadConfig {
+  // the threads of a launch, 0 for HOST_NUM_THREADS
+  std::atomic<int> num_threads{0};
+  // the kernels of fewer elements than it run on the calling thread
+  std::atomic<int> inline_grain{0};
+  // ThreadAffinity of the threads of the launches
+  std::atomic<int> affinity{kAffinityNone};
+};
+
+// The state of the runtime is defined in context.cpp, which is built once per
+// context into the runtime library shared by the libraries of the functions.
+
+// the config is never destroyed, like the memory pool
+HostThreadConfig *get_host_thread_config();
+
+// the threads of the launches on this thread, 0 for HostThreadConfig
+int &thread_num_threads_override();
+
+// the threads of a launch of many elements, at most `max_threads`
+inline int get_host_num_threads(const int max_threads) {
+  int nthreads = thread_num_threads_override();
+  if (nthreads <= 0) {
+    nthreads = get_host_thread_config()->num_threads.load(
+        std::memory_order_relaxed);
+  }
+  if (nthreads <= 0 || nthreads > max_threads) nthreads = max_threads;
+  return nthreads;
+}
+
+/*!
+ * \brief Get the threads to launch a kernel of `n` elements with, at most
+ *  `max_threads`. The override of the thread ignores the inline grain.
+ */
+inline int get_launch_num_threads(const int64_t n, const int max_threads) {
+  if (thread_num_threads_override() <= 0 &&
+      n < get_host_thread_config()->inline_grain.load(
+              std::memory_order_relaxed)) {
+    return static_cast<int>(std::min<int64_t>(n, 1));
+  }
+  return static_cast<int>(
+      std::min<int64_t>(n, get_host_num_threads(max_threads)));
+}
+
+// pin the calling thread, the thread `thread_id` of a launch, by the config.
+// The thread 0 is the thread which launches the kernel, e.g. the main thread
+// of Python, which is left to the caller, so only the workers are pinned.
+inline void apply_host_thread_affinity(const int thread_id) {
+  if (thread_id == 0) return;
+  apply_thread_affinity(
+      get_host_thread_config()->affinity.load(std::memory_order_relaxed),
+      thread_id);
+}
+
+// the fresh blocks of the memory pool of at least the bytes are first
+// touched by the threads of the kernels when the threads are pinned
+constexpr size_t HOST_FIRST_TOUCH_BYTES = size_t(1) << 20;
+constexpr size_t HOST_PAGE_BYTES = 4096;
+
+// touch the pages of [p, p + bytes) by the static partition of parfor over
+// the pages, so that each page is on the NUMA node of the thread which
+// computes the same share of a kernel. It is defined by the runner.
+inline void first_touch_pages(void *p, const size_t bytes);
+
+// a slot of the buffer of block_reduce, one cache line per thread
+struct alignas(64) BlockReduceSlot {
+  char data[64];
+};
+
+// the slots of the threads for the next call of block_reduce in the kernel.
+// The calls use two buffers in turn, so that a buffer is rewritten after the
+// barrier of the next call. It is defined by the runner.
+inline BlockReduceSlot *next_block_reduce_slots();
+
+inline void *host_malloc(size_t bytes) {
+  void *p = ::operator new(bytes, std::nothrow);
+  if (p != nullptr && bytes >= HOST_FIRST_TOUCH_BYTES &&
+      get_host_thread_config()->affinity.load(std::memory_order_relaxed) !=
+          kAffinityNone) {
+    first_touch_pages(p, bytes);
+  }
+  return p;
+}
+
+inline void host_free(void *p) { ::operator delete(p); }
+
+// the pool is never destroyed, since arrays may be freed during exit
+MemoryPool *get_memory_pool();
+
+// it fails when out of memory after the cached blocks are released
+template <typename T>
+T *new_array(size_t size, void * /*stream*/ = nullptr) {
+  void *p = get_memory_pool()->Alloc(sizeof(T) * size, -1, nullptr);
+  CHECK(p != nullptr) << "Out of memory to allocate " << sizeof(T) * size
+                      << " bytes on CPU";
+  return static_cast<T *>(p);
 }
 
 template <typename T>
 void del_array(T *p) {
-  delete[] p;
+  get_memory_pool()->Free(p);
 }
 
 template <typename T>
@@ -90,6 +255,25 @@ T *MemcpyDevToDev(T *dst, const T *src, size_t size) {
   return static_cast<T *>(memcpy(dst, src, size));
 }
 
+// there are no device events on CPU
+inline double device_elapsed_us(void * /*start*/, void * /*stop*/) {
+  return -1;
+}
+
+// KERNEL_RUN in the single-thread mode, which calls the kernel directly
+template <typename Func>
+class SerialKernelRunner {
+ public:
+  explicit SerialKernelRunner(Func func) : func_(func) {}
+  template <typename... Args>
+  void operator()(const int64_t n, Args... args) {
+    profile_kernel(n, 1, [&]() { func_(n, args...); });
+  }
+
+ private:
+  Func func_;
+};
+
 }  // namespace mobula
 
 #define KERNEL_RUN_BEGIN(device_id) \
@@ -3,10 +3,35 @@
 
 #define MOBULA_KERNEL __global__ void
 #define MOBULA_DEVICE __device__
+// the maximum block size of a kernel, e.g.
+// MOBULA_KERNEL MOBULA_LAUNCH_BOUNDS(256) foo_kernel(const int n, ...)
+#define MOBULA_LAUNCH_BOUNDS(max_threads) __launch_bounds__(max_threads)
 
 #include <algorithm>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 #include "./hip_ctx_header.h"
+#include "./memory_pool.h"
+#include "./profiler.h"
+
+#if USING_NVTX
+#if USING_HIP
+#include <roctracer/roctx.h>
+#define MOBULA_RANGE_PUSH(name) roctxRangePushA(name)
+#define MOBULA_RANGE_POP() roctxRangePop()
+#else
+#include <nvtx3/nvToolsExt.h>
+#define MOBULA_RANGE_PUSH(name) nvtxRangePushA(name)
+#define MOBULA_RANGE_POP() nvtxRangePop()
+#endif  // USING_HIP
+#else
+#define MOBULA_RANGE_PUSH(name)
+#define MOBULA_RANGE_POP()
+#endif  // USING_NVTX
 
 namespace mobula {
 
@@ -33,15 +58,6 @@ inline void blas_gemm(const int axis, const bool tA, const bool tB, const int M,
 }
 #endif
 
-const int HIP_MAX_GRID_NUM = 65535;
-const int HIP_MAX_NUM_THREADS = 512;
-inline int HIP_GET_NUM_THREADS(const int n) {
-  return std::min(HIP_MAX_NUM_THREADS, ((n + 31) / 32) * 32);
-}
-inline int HIP_GET_BLOCKS(const int n, const int num_threads) {
-  return std::min(HIP_MAX_GRID_NUM, n + num_threads - 1) / num_threads;
-}
-
 /*!
  * \brief Check HIP error.
  * \param msg Message to print if an error occured.
@@ -59,32 +75,180 @@ inline int HIP_GET_BLOCKS(const int n, const int num_threads) {
 #define CHECK_HIP(condition) \
   CHECK_EQ(condition, hipSuccess) << hipGetErrorString(condition)
 
+/*!
+ * \brief The launch configuration with the maximum occupancy of a kernel.
+ *  `num_threads` is the block size, and `max_blocks` is the number of blocks
+ *  to fill the device.
+ */
+struct KernelOccupancy {
+  int num_threads;
+  int max_blocks;
+};
+
+/*!
+ * \brief Get the launch configuration of the kernel `func` on the current
+ *  device. The result is queried once and cached for each kernel and device.
+ *  The block size respects `MOBULA_LAUNCH_BOUNDS` of the kernel.
+ */
+template <typename Func>
+KernelOccupancy get_kernel_occupancy(Func func) {
+  static std::mutex mtx;
+  static std::map<std::pair<const void *, int>, KernelOccupancy> cache;
+  int device_id;
+  CHECK_HIP(hipGetDevice(&device_id));
+  const auto key =
+      std::make_pair(reinterpret_cast<const void *>(func), device_id);
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = cache.find(key);
+  if (it != cache.end()) return it->second;
+  KernelOccupancy occ;
+  CHECK_HIP(hipOccupancyMaxPotentialBlockSize(&occ.max_blocks,
+                                              &occ.num_threads, func, 0, 0));
+  cache[key] = occ;
+  return occ;
+}
+
+/*!
+ * \brief The state of capturing the kernels of this library into a graph.
+ *  While `stream` is not nullptr, KERNEL_RUN launches the kernels on it
+ *  without waiting, and the memory of the workspaces is kept in `arrays` for
+ *  the graph rather than returned to the memory pool.
+ */
+struct GraphCapture {
+  void *stream = nullptr;
+  std::vector<void *> arrays;
+};
+
+// The state of the runtime is defined in context.cpp, which is built once per
+// context into the runtime library shared by the libraries of the functions.
+
+// the capture is never destroyed, like the memory pool
+GraphCapture *get_graph_capture();
+
+// the current stream of the framework which calls the functions of the
+// libraries on this thread, or nullptr for the stream of the device
+void *&current_stream();
+
+// the value of current_stream() for the null stream, e.g. the default stream
+// of PyTorch, which is NULL_STREAM in mobula/func.py
+constexpr uintptr_t kNullStream = 1;
+
+/*!
+ * \brief The non-blocking stream of the current device, which is created by
+ *  the first launch without a stream and never destroyed. Unlike the legacy
+ *  null stream, it doesn't wait for the blocking streams of other libraries.
+ */
+void *get_device_stream();
+
+// the counters of MOBULA_COUNTER in a kernel
+constexpr int kMaxKernelCounters = 8;
+
+/*!
+ * \brief The kMaxKernelCounters counters of the kernels on `stream` of the
+ *  current device, which are zero-filled on `stream` at the first call and
+ *  never freed. The kernels on a stream run in order, and each kernel leaves
+ *  its counters 0, so they are shared by all kernels on the stream.
+ */
+unsigned int *get_kernel_counters(void *stream);
+
+// the block size of the kernels launched by the libraries on this thread,
+// which is set by the autotuner, or 0 for the one of the maximum occupancy
+int &thread_block_size_override();
+
+/*!
+ * \brief Get the launch configuration of the kernel `func` by
+ *  `thread_block_size_override()`, which is at most the block size of the
+ *  maximum occupancy and a multiple of the warp size.
+ */
+template <typename Func>
+KernelOccupancy get_launch_occupancy(Func func) {
+  KernelOccupancy occ = get_kernel_occupancy(func);
+  const int block_size = thread_block_size_override() / 32 * 32;
+  if (block_size > 0 && block_size < occ.num_threads) {
+    // the smaller blocks fill the device as well
+    occ.max_blocks = static_cast<int>(
+        static_cast<int64_t>(occ.max_blocks) * occ.num_threads / block_size);
+    occ.num_threads = block_size;
+  }
+  return occ;
+}
+
+// the stream of the kernels launched without a stream
+inline void *get_launch_stream() {
+  void *stream = get_graph_capture()->stream;
+  if (stream == nullptr) stream = current_stream();
+  if (stream == nullptr) return get_device_stream();
+  return reinterpret_cast<uintptr_t>(stream) == kNullStream ? nullptr : stream;
+}
+
+/*!
+ * \brief Launch kernels on the stream `strm`, or on `get_launch_stream()`
+ *  when `strm` is nullptr, which is the capturing stream while capturing a
+ *  graph, or else the current stream of the framework, or else the stream of
+ *  the device.
+ *  When USING_ASYNC_KERNEL_LAUNCH is enabled, the launch returns without
+ *  waiting for the kernel, and the errors during the execution are reported by
+ *  the later HIP calls, e.g. `synchronize`.
+ */
 template <typename Func>
 class KernelRunner {
  public:
   explicit KernelRunner(Func func, void *strm = nullptr)
-      : func_(func), strm_(strm) {}
+      : func_(func),
+        strm_(strm != nullptr ? strm : get_launch_stream()) {}
   template <typename... Args>
-  void operator()(const int n, Args... args) {
-    const int threadsPerBlock = HIP_GET_NUM_THREADS(n);
-    const int blocks = HIP_GET_BLOCKS(n, threadsPerBlock);
-    hipStream_t stream;
-    if (strm_ == nullptr) {
-      CHECK_HIP(hipStreamCreate(&stream));
+  void operator()(const int64_t n, Args... args) {
+    if (n <= 0) return;
+    const KernelOccupancy occ = get_launch_occupancy(func_);
+    // the block size is a multiple of the warp size
+    const int threadsPerBlock = n >= occ.num_threads
+                                    ? occ.num_threads
+                                    : static_cast<int>((n + 31) / 32 * 32);
+    // the grid-stride parfor iterates when n exceeds the threads of the grid
+    const int blocks = static_cast<int>(std::min<int64_t>(
+        occ.max_blocks, (n - 1) / threadsPerBlock + 1));
+    hipStream_t stream = static_cast<hipStream_t>(strm_);
+    MOBULA_RANGE_PUSH(current_kernel_name() != nullptr ? current_kernel_name()
+                                                       : "unknown");
+    if (!get_profiler()->enabled()) {
+      Launch(blocks, threadsPerBlock, stream, n, args...);
     } else {
-      stream = static_cast<hipStream_t>(strm_);
+      int device_id;
+      CHECK_HIP(hipGetDevice(&device_id));
+      KernelProfile profile(n, blocks * threadsPerBlock, device_id);
+      // the events can't be recorded into a capturing stream
+      if (get_graph_capture()->stream == nullptr) {
+        hipEvent_t start, stop;
+        CHECK_HIP(hipEventCreate(&start));
+        CHECK_HIP(hipEventCreate(&stop));
+        CHECK_HIP(hipEventRecord(start, stream));
+        Launch(blocks, threadsPerBlock, stream, n, args...);
+        CHECK_HIP(hipEventRecord(stop, stream));
+        profile.set_device_events(start, stop);
+      } else {
+        Launch(blocks, threadsPerBlock, stream, n, args...);
+      }
+    }
+    MOBULA_RANGE_POP();
+#if !USING_ASYNC_KERNEL_LAUNCH
+    // the captured kernels are not executed until the graph is launched
+    if (get_graph_capture()->stream == nullptr) {
+      CHECK_HIP(hipStreamSynchronize(stream));
     }
+#endif
+    CHECK_HIP_ERROR("Run Kernel");
+  }
+
+ private:
+  template <typename... Args>
+  void Launch(const int blocks, const int threadsPerBlock, hipStream_t stream,
+              const int64_t n, Args... args) {
 #if USING_HIP
     hipLaunchKernelGGL(func_, dim3(blocks), dim3(threadsPerBlock), 0, stream, n,
                        args...);
 #else
     func_<<<blocks, threadsPerBlock, 0, stream>>>(n, args...);
 #endif
-    CHECK_HIP(hipStreamSynchronize(stream));
-    if (strm_ == nullptr) {
-      CHECK_HIP(hipStreamDestroy(stream));
-    }
-    CHECK_HIP_ERROR("Run Kernel");
   }
 
  private:
@@ -113,33 +277,138 @@ inline __device__ float atomic_add(const float val, float *address) {
   return atomicAdd(address, val);
 }
 
+template <>
+inline __device__ double atomic_add(const double val, double *address) {
+#if USING_HIP || __CUDA_ARCH__ >= 600
+  return atomicAdd(address, val);
+#else
+  unsigned long long int *address_as_ull =
+      reinterpret_cast<unsigned long long int *>(address);
+  unsigned long long int old = *address_as_ull, assumed;
+  do {
+    assumed = old;
+    old = atomicCAS(address_as_ull, assumed,
+                    __double_as_longlong(val + __longlong_as_double(assumed)));
+  } while (assumed != old);
+  return __longlong_as_double(old);
+#endif
+}
+
+template <>
+inline __device__ int atomic_add(const int val, int *address) {
+  return atomicAdd(address, val);
+}
+
+template <>
+inline __device__ int64_t atomic_add(const int64_t val, int64_t *address) {
+  return static_cast<int64_t>(
+      atomicAdd(reinterpret_cast<unsigned long long int *>(address),
+                static_cast<unsigned long long int>(val)));
+}
+
+// the 16-bit floating types are added in float, by a CAS loop on the aligned
+// 32-bit word which contains `*address`
 template <typename T>
-T *new_array(size_t size) {
-  T *p;
-  hipMalloc(reinterpret_cast<void **>(&p), sizeof(T) * size);
+inline __device__ T atomic_add_float16(const T val, T *address) {
+  const size_t offset = reinterpret_cast<size_t>(address) & 2;
+  unsigned int *address_as_ui = reinterpret_cast<unsigned int *>(
+      reinterpret_cast<char *>(address) - offset);
+  const int shift = offset * 8;
+  unsigned int old = *address_as_ui, assumed;
+  T old_val;
+  do {
+    assumed = old;
+    old_val.bits = static_cast<uint16_t>(assumed >> shift);
+    const T new_val = static_cast<float>(old_val) + static_cast<float>(val);
+    old = atomicCAS(address_as_ui, assumed,
+                    (assumed & ~(0xffffu << shift)) |
+                        (static_cast<unsigned int>(new_val.bits) << shift));
+  } while (assumed != old);
+  return old_val;
+}
+
+template <>
+inline __device__ float16 atomic_add(const float16 val, float16 *address) {
+  return atomic_add_float16(val, address);
+}
+
+template <>
+inline __device__ bfloat16 atomic_add(const bfloat16 val, bfloat16 *address) {
+  return atomic_add_float16(val, address);
+}
+
+inline void *device_malloc(size_t bytes) {
+  void *p;
+  if (hipMalloc(&p, bytes) != hipSuccess) {
+    // clear the error of out of memory
+    hipGetLastError();
+    return nullptr;
+  }
   return p;
 }
 
+inline void device_free(void *p) { CHECK_HIP(hipFree(p)); }
+
+inline double device_elapsed_us(void *start, void *stop) {
+  hipEvent_t start_event = static_cast<hipEvent_t>(start);
+  hipEvent_t stop_event = static_cast<hipEvent_t>(stop);
+  CHECK_HIP(hipEventSynchronize(stop_event));
+  float ms;
+  CHECK_HIP(hipEventElapsedTime(&ms, start_event, stop_event));
+  CHECK_HIP(hipEventDestroy(start_event));
+  CHECK_HIP(hipEventDestroy(stop_event));
+  return ms * 1000.0;
+}
+
+// the pool is never destroyed, since the runtime may be unloaded before it
+MemoryPool *get_memory_pool();
+
+/*!
+ * \brief Allocate an array on the current device.
+ *  The array is reused after `del_array` only by the kernels on `stream`,
+ *  which is the stream of KERNEL_RUN if it is nullptr. It fails when the
+ *  device is out of memory after the cached blocks are released.
+ */
+template <typename T>
+T *new_array(size_t size, void *stream = nullptr) {
+  int device_id;
+  CHECK_HIP(hipGetDevice(&device_id));
+  if (stream == nullptr) stream = get_launch_stream();
+  void *p = get_memory_pool()->Alloc(sizeof(T) * size, device_id, stream);
+  CHECK(p != nullptr) << "Out of memory to allocate " << sizeof(T) * size
+                      << " bytes on the device " << device_id;
+  return static_cast<T *>(p);
+}
+
 template <typename T>
 void del_array(T *p) {
-  hipFree(p);
+  get_memory_pool()->Free(p);
+}
+
+// the copies are ordered with the kernels on `get_launch_stream()`, and
+// finished when they return
+inline void device_memcpy(void *dst, const void *src, size_t size,
+                          hipMemcpyKind kind) {
+  hipStream_t stream = static_cast<hipStream_t>(get_launch_stream());
+  CHECK_HIP(hipMemcpyAsync(dst, src, size, kind, stream));
+  CHECK_HIP(hipStreamSynchronize(stream));
 }
 
 template <typename T>
 T *MemcpyHostToDev(T *dst, const T *src, size_t size) {
-  hipMemcpy(dst, src, size, hipMemcpyHostToDevice);
+  device_memcpy(dst, src, size, hipMemcpyHostToDevice);
   return dst;
 }
 
 template <typename T>
 T *MemcpyDevToHost(T *dst, const T *src, size_t size) {
-  hipMemcpy(dst, src, size, hipMemcpyDeviceToHost);
+  device_memcpy(dst, src, size, hipMemcpyDeviceToHost);
   return dst;
 }
 
 template <typename T>
 T *MemcpyDevToDev(T *dst, const T *src, size_t size) {
-  hipMemcpy(dst, src, size, hipMemcpyDeviceToDevice);
+  device_memcpy(dst, src, size, hipMemcpyDeviceToDevice);
   return dst;
 }
 
@@ -151,7 +420,19 @@ MOBULA_DEVICE inline int get_thread_num() {
   return hipBlockIdx_x * hipBlockDim_x + hipThreadIdx_x;
 }
 
+// the lane i of a warp gets `value` of the lane (i ^ lane_mask)
+// all lanes of the warp should call it together
+template <typename T>
+MOBULA_DEVICE inline T warp_shfl_xor(const T value, const int lane_mask) {
+#if USING_HIP
+  return __shfl_xor(value, lane_mask);
+#else
+  return __shfl_xor_sync(0xffffffff, value, lane_mask);
+#endif  // USING_HIP
+}
+
 // parfor for hip device should be called in hip kernel.
+// The adjacent threads visit the adjacent indices for coalesced memory access.
 template <typename Func>
 MOBULA_DEVICE void parfor(const size_t n, Func F) {
   // [gridDim.x, blockDim.x]
@@ -159,14 +440,19 @@ MOBULA_DEVICE void parfor(const size_t n, Func F) {
   // thread_id is in [0, num_threads)
   const int thread_id = get_thread_num();
   INDEX_TYPE_SWITCH(n, {
-    index_t start, end;
-    get_parfor_range(n, num_threads, thread_id, &start, &end);
-    for (index_t i = start; i < end; ++i) {
+    for (index_t i = thread_id; i < static_cast<index_t>(n);
+         i += num_threads) {
       F(i);
     }
   });
 }
 
+// the schedule is for CPU, see ParforSchedule
+template <typename Func>
+MOBULA_DEVICE void parfor(const size_t n, const ParforSchedule &, Func F) {
+  parfor(n, F);
+}
+
 }  // namespace mobula
 
 #endif  // MOBULA_INCLUDE_CONTEXT_HIP_CTX_H_
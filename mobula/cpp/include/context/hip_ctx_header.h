@@ -29,7 +29,10 @@ using hipblasHandle_t = cublasHandle_t;
 #endif  // USING_CBLAS
 
 using hipStream_t = cudaStream_t;
+using hipEvent_t = cudaEvent_t;
 using hipError_t = cudaError_t;
+using hipGraph_t = cudaGraph_t;
+using hipGraphExec_t = cudaGraphExec_t;
 
 // basic
 #define hipGetLastError cudaGetLastError
@@ -56,19 +59,43 @@ using hipError_t = cudaError_t;
 // device
 #define hipSetDevice cudaSetDevice
 #define hipGetDevice cudaGetDevice
+#define hipGetDeviceCount cudaGetDeviceCount
+#define hipDeviceSynchronize cudaDeviceSynchronize
+#define hipOccupancyMaxPotentialBlockSize cudaOccupancyMaxPotentialBlockSize
 
 // memory
 #define hipMalloc cudaMalloc
 #define hipFree cudaFree
 #define hipMemcpy cudaMemcpy
+#define hipMemcpyAsync cudaMemcpyAsync
+#define hipMemcpyKind cudaMemcpyKind
 #define hipMemcpyHostToDevice cudaMemcpyHostToDevice
 #define hipMemcpyDeviceToHost cudaMemcpyDeviceToHost
 #define hipMemcpyDeviceToDevice cudaMemcpyDeviceToDevice
+#define hipMemsetAsync cudaMemsetAsync
 
 // stream
 #define hipStreamCreate cudaStreamCreate
 #define hipStreamSynchronize cudaStreamSynchronize
 #define hipStreamDestroy cudaStreamDestroy
+#define hipStreamCreateWithFlags cudaStreamCreateWithFlags
+#define hipStreamNonBlocking cudaStreamNonBlocking
+
+// event
+#define hipEventCreate cudaEventCreate
+#define hipEventRecord cudaEventRecord
+#define hipEventSynchronize cudaEventSynchronize
+#define hipEventElapsedTime cudaEventElapsedTime
+#define hipEventDestroy cudaEventDestroy
+
+// graph
+#define hipStreamBeginCapture cudaStreamBeginCapture
+#define hipStreamEndCapture cudaStreamEndCapture
+#define hipStreamCaptureModeRelaxed cudaStreamCaptureModeRelaxed
+#define hipGraphInstantiateWithFlags cudaGraphInstantiateWithFlags
+#define hipGraphLaunch cudaGraphLaunch
+#define hipGraphDestroy cudaGraphDestroy
+#define hipGraphExecDestroy cudaGraphExecDestroy
 
 #endif  // USING_HIP
 
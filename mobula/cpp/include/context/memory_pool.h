@@ -0,0 +1,129 @@
+#ifndef MOBULA_INCLUDE_CONTEXT_MEMORY_POOL_H_
+#define MOBULA_INCLUDE_CONTEXT_MEMORY_POOL_H_
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "../logging.h"
+
+namespace mobula {
+
+/*!
+ * \brief The statistics of a memory pool.
+ *  The layout is shared with `mobula.memory` in Python.
+ */
+struct MemoryPoolStats {
+  // the bytes of the blocks which are allocated by new_array
+  int64_t bytes_in_use;
+  // the bytes of the free blocks kept by the pool
+  int64_t bytes_cached;
+  // the number of allocations
+  int64_t num_allocs;
+  // the number of allocations served by the cached blocks
+  int64_t num_hits;
+};
+
+/*!
+ * \brief A caching allocator.
+ *  The sizes are rounded up to size classes, and the free blocks are kept in
+ *  the lists of (device, stream, size class). A free block is only reused on
+ *  the same device and stream, so that it is not reused before the kernels
+ *  using it on that stream finish.
+ */
+class MemoryPool {
+ public:
+  typedef void *(*MallocFunc)(size_t bytes);
+  typedef void (*FreeFunc)(void *p);
+
+  MemoryPool(MallocFunc malloc_func, FreeFunc free_func)
+      : malloc_func_(malloc_func), free_func_(free_func), stats_() {}
+
+  void *Alloc(size_t bytes, int device_id, void *stream) {
+    const size_t size = GetSizeClass(bytes);
+    const Key key(device_id, stream, size);
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.num_allocs;
+    void *p = nullptr;
+    auto it = free_blocks_.find(key);
+    if (it != free_blocks_.end() && !it->second.empty()) {
+      p = it->second.back();
+      it->second.pop_back();
+      stats_.bytes_cached -= size;
+      ++stats_.num_hits;
+    } else {
+      p = malloc_func_(size);
+      if (p == nullptr) {
+        // release the cached blocks and retry
+        ReleaseCachedBlocks();
+        p = malloc_func_(size);
+        if (p == nullptr) return nullptr;
+      }
+    }
+    used_blocks_[p] = key;
+    stats_.bytes_in_use += size;
+    return p;
+  }
+
+  void Free(void *p) {
+    if (p == nullptr) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = used_blocks_.find(p);
+    CHECK(it != used_blocks_.end()) << "The pointer " << p
+                                    << " is not allocated by new_array";
+    const size_t size = std::get<2>(it->second);
+    free_blocks_[it->second].push_back(p);
+    used_blocks_.erase(it);
+    stats_.bytes_in_use -= size;
+    stats_.bytes_cached += size;
+  }
+
+  // release all cached blocks
+  void Trim() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ReleaseCachedBlocks();
+  }
+
+  MemoryPoolStats Stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
+
+ private:
+  // (device_id, stream, size class)
+  typedef std::tuple<int, void *, size_t> Key;
+
+  // 512 B, 1 KB, 2 KB, ..., 1 MB, then multiples of 1 MB
+  static size_t GetSizeClass(size_t bytes) {
+    const size_t kMinSize = 512;
+    const size_t kLargeSize = size_t(1) << 20;
+    if (bytes > kLargeSize) {
+      return (bytes + kLargeSize - 1) / kLargeSize * kLargeSize;
+    }
+    size_t size = kMinSize;
+    while (size < bytes) size <<= 1;
+    return size;
+  }
+
+  void ReleaseCachedBlocks() {
+    for (auto &kv : free_blocks_) {
+      for (void *p : kv.second) free_func_(p);
+    }
+    free_blocks_.clear();
+    stats_.bytes_cached = 0;
+  }
+
+  MallocFunc malloc_func_;
+  FreeFunc free_func_;
+  std::mutex mutex_;
+  std::map<Key, std::vector<void *>> free_blocks_;
+  std::unordered_map<void *, Key> used_blocks_;
+  MemoryPoolStats stats_;
+};
+
+}  // namespace mobula
+
+#endif  // MOBULA_INCLUDE_CONTEXT_MEMORY_POOL_H_
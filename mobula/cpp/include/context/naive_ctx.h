@@ -1,8 +1,16 @@
 #ifndef MOBULA_INCLUDE_CONTEXT_NAIVE_CTX_H_
 #define MOBULA_INCLUDE_CONTEXT_NAIVE_CTX_H_
 
+#ifndef _WIN32
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
 #include <algorithm>
+#include <atomic>
 #include <condition_variable>
+#include <cstdint>
+#include <mutex>
 #include <thread>
 #include <vector>
 
@@ -13,36 +21,270 @@ namespace mobula {
 static thread_local int thread_local_i;
 static thread_local int thread_local_n;
 
-class Barrier {
+// busy-wait until `pred()` is true, at most `max_spin` rounds
+template <typename Pred>
+inline bool spin_until(Pred pred, const int max_spin) {
+  for (int i = 0; i < max_spin; ++i) {
+    if (pred()) return true;
+    std::this_thread::yield();
+  }
+  return pred();
+}
+
+constexpr int HOST_SPIN_COUNT = 1024;
+
+class MutexBarrier {
  public:
-  explicit Barrier(size_t nthreads) : count_(nthreads), nthreads_(nthreads) {}
+  explicit MutexBarrier(size_t nthreads)
+      : count_(nthreads), nthreads_(nthreads), generation_(0) {}
   void wait() {
     std::unique_lock<std::mutex> lck(mutex_);
     if (--count_ == 0) {
       // set `count` for next barrier
       count_ = nthreads_;
+      ++generation_;
       cv_.notify_all();
     } else {
-      cv_.wait(lck);
+      const size_t generation = generation_;
+      cv_.wait(lck, [&] { return generation != generation_; });
     }
   }
 
  private:
   size_t count_;
   size_t nthreads_;
+  size_t generation_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+/*!
+ * \brief Sense-reversing barrier.
+ *  The waiting threads spin on `sense_` for `HOST_SPIN_COUNT` rounds before
+ *  sleeping on the condition variable.
+ */
+class SpinBarrier {
+ public:
+  explicit SpinBarrier(size_t nthreads)
+      : count_(nthreads), nthreads_(nthreads), sense_(false), sleepers_(0) {}
+  void wait() {
+    const bool sense = sense_.load(std::memory_order_acquire);
+    if (count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      // set `count` for next barrier
+      count_.store(nthreads_, std::memory_order_relaxed);
+      sense_.store(!sense, std::memory_order_seq_cst);
+      if (sleepers_.load(std::memory_order_seq_cst) > 0) {
+        std::lock_guard<std::mutex> lck(mutex_);
+        cv_.notify_all();
+      }
+      return;
+    }
+    auto released = [&] {
+      return sense_.load(std::memory_order_acquire) != sense;
+    };
+    if (spin_until(released, HOST_SPIN_COUNT)) return;
+    std::unique_lock<std::mutex> lck(mutex_);
+    sleepers_.fetch_add(1, std::memory_order_seq_cst);
+    cv_.wait(lck, released);
+    sleepers_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<size_t> count_;
+  const size_t nthreads_;
+  std::atomic<bool> sense_;
+  std::atomic<int> sleepers_;
   std::mutex mutex_;
   std::condition_variable cv_;
 };
 
-static thread_local Barrier *thread_local_barrier;
+#if USING_SPIN_BARRIER
+typedef SpinBarrier Barrier;
+#else
+typedef MutexBarrier Barrier;
+#endif  // USING_SPIN_BARRIER
+
+// the state shared by all threads of a kernel launch
+struct LaunchContext {
+  explicit LaunchContext(size_t nthreads)
+      : barrier(nthreads), shared(nullptr) {
+    for (std::atomic<size_t> &next : parfor_next) {
+      next.store(0, std::memory_order_relaxed);
+    }
+  }
+  Barrier barrier;
+  // the array created by `new_shared_array`
+  void *shared;
+  // the counters of the dynamic parfors, which are used in turn, so that a
+  // counter is reset before the parfor after the next one
+  std::atomic<size_t> parfor_next[2];
+  // the ranges [lo, hi) of the threads in the stealing parfor, packed as
+  // lo << 32 | hi, one cache line per thread
+  struct ParforRange {
+    std::atomic<uint64_t> range{0};
+    char padding[64 - sizeof(std::atomic<uint64_t>)];
+  };
+  ParforRange parfor_ranges[HOST_NUM_THREADS];
+  // the buffers of block_reduce, which are used in turn
+  BlockReduceSlot reduce_slots[2][HOST_NUM_THREADS];
+};
+
+static thread_local LaunchContext *thread_local_ctx;
+// the number of the scheduled parfors of the thread in the launch
+static thread_local int thread_local_parfor_calls;
+// the number of the calls of block_reduce of the thread in the launch
+static thread_local int thread_local_reduce_calls;
+
+/*!
+ * \brief A process-wide pool of persistent worker threads.
+ *  The thread which launches a kernel takes part in it as the thread 0, and
+ *  the workers park on their own epoch between launches. The workers are
+ *  started by the first launch which needs them.
+ */
+class ThreadPool {
+ public:
+  typedef void (*TaskFunc)(void *task, const int thread_id, const int nthreads,
+                           LaunchContext *ctx);
+  explicit ThreadPool(const int num_workers)
+      : slots_(num_workers), pending_(0), stop_(false) {
+#ifndef _WIN32
+    pid_ = getpid();
+#endif
+  }
+
+  // run `func(task, i, nthreads, ctx)` on the threads [0, nthreads)
+  void Run(TaskFunc func, void *task, const int nthreads, LaunchContext *ctx) {
+    std::lock_guard<std::mutex> launch_lock(launch_mutex_);
+    const int num_signals =
+        std::min(nthreads - 1, static_cast<int>(slots_.size()));
+    while (num_workers() < num_signals) {
+      workers_.emplace_back(&ThreadPool::WorkerLoop, this, num_workers());
+    }
+    func_ = func;
+    task_ = task;
+    nthreads_ = nthreads;
+    ctx_ = ctx;
+    pending_.store(num_signals, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (int i = 0; i < num_signals; ++i) {
+        slots_[i].epoch.fetch_add(1, std::memory_order_release);
+      }
+    }
+    if (num_signals > 0) wake_cv_.notify_all();
+    func(task, 0, nthreads, ctx);
+    auto done = [this] {
+      return pending_.load(std::memory_order_acquire) == 0;
+    };
+    if (spin_until(done, HOST_SPIN_COUNT)) return;
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, done);
+  }
+
+  inline int num_workers() const { return static_cast<int>(workers_.size()); }
+
+#ifndef _WIN32
+  inline pid_t pid() const { return pid_; }
+#endif
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_cv_.notify_all();
+    for (std::thread &worker : workers_) worker.join();
+  }
+
+ private:
+  void WorkerLoop(const int worker_id) {
+    const int thread_id = worker_id + 1;
+    std::atomic<uint64_t> &epoch = slots_[worker_id].epoch;
+    uint64_t seen = 0;
+    while (true) {
+      // spin for a while, then sleep until the next launch
+      auto launched = [&] {
+        return epoch.load(std::memory_order_acquire) != seen;
+      };
+      if (!spin_until(launched, HOST_SPIN_COUNT)) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_cv_.wait(lock, [&] { return stop_ || launched(); });
+        if (stop_) return;
+      }
+      seen = epoch.load(std::memory_order_acquire);
+      func_(task_, thread_id, nthreads_, ctx_);
+      if (pending_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_cv_.notify_one();
+      }
+    }
+  }
+
+ private:
+  // one cache line per worker to avoid false sharing
+  struct Slot {
+    std::atomic<uint64_t> epoch{0};
+    char padding[64 - sizeof(std::atomic<uint64_t>)];
+  };
+  std::vector<Slot> slots_;
+  std::vector<std::thread> workers_;
+  std::mutex launch_mutex_;
+  std::mutex mutex_;
+  std::condition_variable wake_cv_;
+  std::condition_variable done_cv_;
+  std::atomic<int> pending_;
+  bool stop_;
+  // the arguments of the current launch
+  TaskFunc func_;
+  void *task_;
+  int nthreads_;
+  LaunchContext *ctx_;
+#ifndef _WIN32
+  pid_t pid_;
+#endif
+};
+
+// the pool of the runtime library, see context.cpp
+ThreadPool *get_thread_pool();
 
-template <typename Func, typename... Args>
-void thread_func_wrapper(Func func, const int i, const int nthreads,
-                         const int n, Barrier *barrier, Args... args) {
-  thread_local_i = i;
-  thread_local_n = nthreads;
-  thread_local_barrier = barrier;
-  func(n, args...);
+// the state of the thread `i` in a launch, and the state of the outer launch
+// on the thread, if any, is restored in the end
+class LaunchThreadScope {
+ public:
+  LaunchThreadScope(const int i, const int nthreads, LaunchContext *ctx)
+      : i_(thread_local_i),
+        n_(thread_local_n),
+        ctx_(thread_local_ctx),
+        parfor_calls_(thread_local_parfor_calls),
+        reduce_calls_(thread_local_reduce_calls) {
+    thread_local_i = i;
+    thread_local_n = nthreads;
+    thread_local_ctx = ctx;
+    thread_local_parfor_calls = 0;
+    thread_local_reduce_calls = 0;
+  }
+  ~LaunchThreadScope() {
+    thread_local_i = i_;
+    thread_local_n = n_;
+    thread_local_ctx = ctx_;
+    thread_local_parfor_calls = parfor_calls_;
+    thread_local_reduce_calls = reduce_calls_;
+  }
+  LaunchThreadScope(const LaunchThreadScope &) = delete;
+  LaunchThreadScope &operator=(const LaunchThreadScope &) = delete;
+
+ private:
+  int i_, n_;
+  LaunchContext *ctx_;
+  int parfor_calls_, reduce_calls_;
+};
+
+template <typename Task>
+void thread_func_wrapper(void *task, const int i, const int nthreads,
+                         LaunchContext *ctx) {
+  const LaunchThreadScope scope(i, nthreads, ctx);
+  apply_host_thread_affinity(i);
+  (*static_cast<Task *>(task))();
 }
 
 template <typename Func>
@@ -50,17 +292,25 @@ class KernelRunner {
  public:
   explicit KernelRunner(Func func) : func_(func) {}
   template <typename... Args>
-  void operator()(const int n, Args... args) {
-    const int nthreads = std::min(n, HOST_NUM_THREADS);
-    std::vector<std::thread> threads(nthreads);
-    Barrier barrier(nthreads);
-    for (int i = 0; i < nthreads; ++i) {
-      threads[i] = std::thread(thread_func_wrapper<Func, Args...>, func_, i,
-                               nthreads, n, &barrier, args...);
-    }
-    for (int i = 0; i < nthreads; ++i) {
-      threads[i].join();
-    }
+  void operator()(const int64_t n, Args... args) {
+    // a launch in a kernel would wait for the launch running it in the pool,
+    // so it runs on the calling thread
+    const int nthreads =
+        thread_local_ctx != nullptr
+            ? static_cast<int>(std::min<int64_t>(n, 1))
+            : get_launch_num_threads(n, HOST_NUM_THREADS);
+    if (nthreads <= 0) return;
+    profile_kernel(n, nthreads, [&]() {
+      auto task = [&]() { func_(n, args...); };
+      LaunchContext ctx(nthreads);
+      if (nthreads == 1) {
+        // run inline, without waking the pool
+        thread_func_wrapper<decltype(task)>(&task, 0, 1, &ctx);
+        return;
+      }
+      get_thread_pool()->Run(thread_func_wrapper<decltype(task)>, &task,
+                             nthreads, &ctx);
+    });
   }
 
  private:
@@ -82,7 +332,157 @@ MOBULA_DEVICE void parfor(const size_t n, Func F) {
   });
 }
 
-inline void __syncthreads() { thread_local_barrier->wait(); }
+inline void __syncthreads() { thread_local_ctx->barrier.wait(); }
+
+namespace parfor_detail {
+
+inline uint64_t pack_range(const uint64_t lo, const uint64_t hi) {
+  return lo << 32 | hi;
+}
+
+inline uint64_t range_lo(const uint64_t range) { return range >> 32; }
+
+inline uint64_t range_hi(const uint64_t range) {
+  return range & 0xffffffffu;
+}
+
+template <typename index_t, typename Func>
+inline void run_range(const size_t start, const size_t end, Func &F) {
+  for (index_t i = static_cast<index_t>(start); i < static_cast<index_t>(end);
+       ++i) {
+    F(i);
+  }
+}
+
+template <typename index_t, typename Func>
+void run_dynamic(const size_t n, Func &F, const size_t chunk) {
+  std::atomic<size_t> &next =
+      thread_local_ctx->parfor_next[thread_local_parfor_calls % 2];
+  while (true) {
+    const size_t start = next.fetch_add(chunk, std::memory_order_relaxed);
+    if (start >= n) break;
+    run_range<index_t>(start, std::min(n, start + chunk), F);
+  }
+}
+
+// take at most `chunk` indices from the front of `range`
+inline bool take_front(std::atomic<uint64_t> *range, const uint64_t chunk,
+                       uint64_t *start, uint64_t *end) {
+  uint64_t r = range->load(std::memory_order_acquire);
+  while (range_lo(r) < range_hi(r)) {
+    *start = range_lo(r);
+    *end = std::min(range_hi(r), *start + chunk);
+    if (range->compare_exchange_weak(r, pack_range(*end, range_hi(r)),
+                                     std::memory_order_acq_rel)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// take the back half of the range of another thread into `own`
+inline bool steal(std::atomic<uint64_t> *own, const int thread_id,
+                  const int nthreads) {
+  LaunchContext::ParforRange *ranges = thread_local_ctx->parfor_ranges;
+  for (int k = 1; k < nthreads; ++k) {
+    std::atomic<uint64_t> &victim = ranges[(thread_id + k) % nthreads].range;
+    uint64_t r = victim.load(std::memory_order_acquire);
+    while (range_lo(r) < range_hi(r)) {
+      const uint64_t mid = range_lo(r) + (range_hi(r) - range_lo(r)) / 2;
+      if (victim.compare_exchange_weak(r, pack_range(range_lo(r), mid),
+                                       std::memory_order_acq_rel)) {
+        own->store(pack_range(mid, range_hi(r)), std::memory_order_release);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// n is at most UINT32_MAX
+template <typename index_t, typename Func>
+void run_stealing(const size_t n, Func &F, const size_t chunk) {
+  const int nthreads = get_num_threads();
+  const int thread_id = get_thread_num();
+  uint64_t start, end;
+  get_parfor_range(n, nthreads, thread_id, &start, &end);
+  // the ranges of the last stealing parfor are empty, so the threads which
+  // haven't stored theirs only lose the chance to be stolen from
+  std::atomic<uint64_t> &own = thread_local_ctx->parfor_ranges[thread_id].range;
+  own.store(pack_range(start, end), std::memory_order_release);
+  do {
+    while (take_front(&own, chunk, &start, &end)) {
+      run_range<index_t>(start, end, F);
+    }
+  } while (steal(&own, thread_id, nthreads));
+}
+
+}  // namespace parfor_detail
+
+/*!
+ * \brief parfor scheduled by `schedule`, see ParforSchedule, e.g.
+ *    parfor(n, parfor_dynamic(0, cost_of_an_index), [&](int i) { ... });
+ */
+template <typename Func>
+MOBULA_DEVICE void parfor(const size_t n, const ParforSchedule &schedule,
+                          Func F) {
+  const int nthreads = get_num_threads();
+  if (schedule.kind == ParforSchedule::kStatic || nthreads <= 1) {
+    parfor(n, F);
+    return;
+  }
+  const size_t chunk = get_parfor_chunk(schedule, n, nthreads);
+  INDEX_TYPE_SWITCH(n, {
+    if (schedule.kind == ParforSchedule::kStealing && n <= UINT32_MAX) {
+      parfor_detail::run_stealing<index_t>(n, F, chunk);
+    } else {
+      parfor_detail::run_dynamic<index_t>(n, F, chunk);
+    }
+  });
+  const int slot = thread_local_parfor_calls++ % 2;
+  __syncthreads();
+  // the counter is not taken until the parfor after the next one, which
+  // begins after the barrier of the next one
+  if (get_thread_num() == 0) {
+    thread_local_ctx->parfor_next[slot].store(0, std::memory_order_relaxed);
+  }
+}
+
+// create an array shared by all threads in the kernel
+template <typename T>
+inline T *new_shared_array(const size_t size) {
+  if (get_thread_num() == 0) thread_local_ctx->shared = new T[size];
+  __syncthreads();
+  T *p = static_cast<T *>(thread_local_ctx->shared);
+  __syncthreads();
+  return p;
+}
+
+template <typename T>
+inline void del_shared_array(T *p) {
+  __syncthreads();
+  if (get_thread_num() == 0) delete[] p;
+}
+
+inline BlockReduceSlot *next_block_reduce_slots() {
+  return thread_local_ctx->reduce_slots[thread_local_reduce_calls++ % 2];
+}
+
+inline void first_touch_pages(void *p, const size_t bytes) {
+  // a launch in a kernel would wait for the launch running it
+  if (thread_local_ctx != nullptr) return;
+  const size_t num_pages = (bytes + HOST_PAGE_BYTES - 1) / HOST_PAGE_BYTES;
+  const int nthreads = static_cast<int>(std::min<size_t>(
+      num_pages, get_host_num_threads(HOST_NUM_THREADS)));
+  if (nthreads <= 1) return;
+  char *pages = static_cast<char *>(p);
+  auto task = [&]() {
+    parfor(num_pages, [&](size_t i) { pages[i * HOST_PAGE_BYTES] = 0; });
+  };
+  LaunchContext ctx(nthreads);
+  get_thread_pool()->Run(thread_func_wrapper<decltype(task)>, &task, nthreads,
+                         &ctx);
+}
 
 #define KERNEL_RUN(a) (mobula::KernelRunner<decltype(&(a))>(&(a)))
 
@@ -101,9 +501,33 @@ MOBULA_DEVICE void parfor(const size_t n, Func F) {
   });
 }
 
+template <typename Func>
+MOBULA_DEVICE void parfor(const size_t n, const ParforSchedule &, Func F) {
+  parfor(n, F);
+}
+
 inline void __syncthreads() {}
 
-#define KERNEL_RUN(a) (a)
+template <typename T>
+inline T *new_shared_array(const size_t size) {
+  return new T[size];
+}
+
+template <typename T>
+inline void del_shared_array(T *p) {
+  delete[] p;
+}
+
+// a single thread touches the pages in the kernels
+inline void first_touch_pages(void *, const size_t) {}
+
+inline BlockReduceSlot *next_block_reduce_slots() {
+  static thread_local BlockReduceSlot slot;
+  return &slot;
+}
+
+#define KERNEL_RUN(a) \
+  (mobula::SerialKernelRunner<decltype(&(a))>(&(a)))
 
 #endif  // HOST_NUM_THREADS > 1
 
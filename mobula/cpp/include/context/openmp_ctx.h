@@ -4,6 +4,7 @@
 #include <omp.h>
 
 #include <algorithm>
+#include <cstdlib>
 
 #ifndef _MSC_VER
 #define __pragma(id) _Pragma(#id)
@@ -13,15 +14,70 @@ namespace mobula {
 
 #if HOST_NUM_THREADS > 1
 
+// the places set by OMP_PROC_BIND or OMP_PLACES are kept
+inline void apply_omp_thread_affinity(const int thread_id) {
+  static const bool bound_by_omp = std::getenv("OMP_PROC_BIND") != nullptr ||
+                                   std::getenv("OMP_PLACES") != nullptr;
+  if (!bound_by_omp) apply_host_thread_affinity(thread_id);
+}
+
+// the buffers of block_reduce of a launch, which are used in turn
+struct BlockReduceBuffers {
+  BlockReduceSlot slots[2][HOST_NUM_THREADS];
+};
+
+static thread_local BlockReduceBuffers *thread_local_reduce_buffers;
+// the number of the calls of block_reduce of the thread in the launch
+static thread_local int thread_local_reduce_calls;
+
+// the buffers of block_reduce of the thread in a launch, and the ones of the
+// outer launch are restored in the end
+class BlockReduceScope {
+ public:
+  explicit BlockReduceScope(BlockReduceBuffers *buffers)
+      : buffers_(thread_local_reduce_buffers),
+        calls_(thread_local_reduce_calls) {
+    thread_local_reduce_buffers = buffers;
+    thread_local_reduce_calls = 0;
+  }
+  ~BlockReduceScope() {
+    thread_local_reduce_buffers = buffers_;
+    thread_local_reduce_calls = calls_;
+  }
+  BlockReduceScope(const BlockReduceScope &) = delete;
+  BlockReduceScope &operator=(const BlockReduceScope &) = delete;
+
+ private:
+  BlockReduceBuffers *buffers_;
+  int calls_;
+};
+
+inline BlockReduceSlot *next_block_reduce_slots() {
+  return thread_local_reduce_buffers->slots[thread_local_reduce_calls++ % 2];
+}
+
 template <typename Func>
 class KernelRunner {
  public:
   explicit KernelRunner(Func func) : func_(func) {}
   template <typename... Args>
-  void operator()(const int n, Args... args) {
-    const int nthreads = std::min(n, omp_get_max_threads());
+  void operator()(const int64_t n, Args... args) {
+    const int nthreads = get_launch_num_threads(n, omp_get_max_threads());
+    profile_kernel(n, nthreads, [&]() {
+      BlockReduceBuffers buffers;
+      if (nthreads <= 1) {
+        // run inline, without a parallel region
+        BlockReduceScope scope(&buffers);
+        func_(n, args...);
+        return;
+      }
 #pragma omp parallel num_threads(nthreads)
-    { func_(n, args...); }
+      {
+        apply_omp_thread_affinity(omp_get_thread_num());
+        BlockReduceScope scope(&buffers);
+        func_(n, args...);
+      }
+    });
   }
 
  private:
@@ -45,13 +101,81 @@ MOBULA_DEVICE void parfor(const size_t n, Func F) {
 
 inline void __syncthreads() { __pragma(omp barrier); }
 
+namespace parfor_detail {
+
+template <typename index_t, typename Func>
+void run_omp_for(const index_t n, Func &F, const ParforSchedule &schedule,
+                 const int chunk) {
+  if (schedule.kind == ParforSchedule::kDynamic) {
+#pragma omp for schedule(dynamic, chunk)
+    for (index_t i = 0; i < n; ++i) F(i);
+  } else {
+    // OpenMP doesn't steal, and the guided chunks, which begin large and
+    // shrink down to `chunk`, are the nearest
+#pragma omp for schedule(guided, chunk)
+    for (index_t i = 0; i < n; ++i) F(i);
+  }
+}
+
+}  // namespace parfor_detail
+
+/*!
+ * \brief parfor scheduled by `schedule`, see ParforSchedule, by the
+ *  worksharing loop of OpenMP.
+ */
+template <typename Func>
+MOBULA_DEVICE void parfor(const size_t n, const ParforSchedule &schedule,
+                          Func F) {
+  const int nthreads = get_num_threads();
+  if (schedule.kind == ParforSchedule::kStatic || nthreads <= 1) {
+    parfor(n, F);
+    return;
+  }
+  const int chunk = static_cast<int>(
+      std::min<size_t>(get_parfor_chunk(schedule, n, nthreads), INT_MAX));
+  INDEX_TYPE_SWITCH(n, {
+    parfor_detail::run_omp_for(static_cast<index_t>(n), F, schedule, chunk);
+  });
+}
+
+// create an array shared by all threads in the kernel
+template <typename T>
+inline T *new_shared_array(const size_t size) {
+  T *p;
+#pragma omp single copyprivate(p)
+  p = new T[size];
+  return p;
+}
+
+template <typename T>
+inline void del_shared_array(T *p) {
+#pragma omp barrier
+#pragma omp single
+  delete[] p;
+}
+
+inline void first_touch_pages(void *p, const size_t bytes) {
+  // a nested parallel region would run on a single thread
+  if (omp_in_parallel()) return;
+  const size_t num_pages = (bytes + HOST_PAGE_BYTES - 1) / HOST_PAGE_BYTES;
+  const int nthreads = static_cast<int>(std::min<size_t>(
+      num_pages, get_host_num_threads(omp_get_max_threads())));
+  if (nthreads <= 1) return;
+  char *pages = static_cast<char *>(p);
+#pragma omp parallel num_threads(nthreads)
+  {
+    apply_omp_thread_affinity(omp_get_thread_num());
+    parfor(num_pages, [&](size_t i) { pages[i * HOST_PAGE_BYTES] = 0; });
+  }
+}
+
 #define KERNEL_RUN(a) (mobula::KernelRunner<decltype(&(a))>(&(a)))
 
 #else  // HOST_NUM_THREADS > 1 else
 
 MOBULA_DEVICE inline int get_num_threads() { return 1; }
 
-MOBULA_DEVICE inline int get_thread_num() { return 1; }
+MOBULA_DEVICE inline int get_thread_num() { return 0; }
 
 template <typename Func>
 MOBULA_DEVICE void parfor(const size_t n, Func F) {
@@ -62,9 +186,33 @@ MOBULA_DEVICE void parfor(const size_t n, Func F) {
   });
 }
 
+template <typename Func>
+MOBULA_DEVICE void parfor(const size_t n, const ParforSchedule &, Func F) {
+  parfor(n, F);
+}
+
 inline void __syncthreads() {}
 
-#define KERNEL_RUN(a) (a)
+template <typename T>
+inline T *new_shared_array(const size_t size) {
+  return new T[size];
+}
+
+template <typename T>
+inline void del_shared_array(T *p) {
+  delete[] p;
+}
+
+// a single thread touches the pages in the kernels
+inline void first_touch_pages(void *, const size_t) {}
+
+inline BlockReduceSlot *next_block_reduce_slots() {
+  static thread_local BlockReduceSlot slot;
+  return &slot;
+}
+
+#define KERNEL_RUN(a) \
+  (mobula::SerialKernelRunner<decltype(&(a))>(&(a)))
 
 #endif  // HOST_NUM_THREADS > 1
 
@@ -0,0 +1,165 @@
+#ifndef MOBULA_INCLUDE_CONTEXT_PROFILER_H_
+#define MOBULA_INCLUDE_CONTEXT_PROFILER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace mobula {
+
+/*!
+ * \brief A kernel launch recorded by the profiler.
+ *  The layout is shared with `mobula.profiler` in Python.
+ */
+struct ProfilerEvent {
+  // the name of the exported function, i.e. func_idcode_hash
+  const char *name;
+  // the number of the elements passed to the kernel
+  int64_t n;
+  // the threads of the launch, which are blocks * block size on GPU
+  int32_t num_threads;
+  // -1 on CPU
+  int32_t device_id;
+  // the steady clock when the launch begins, in microseconds
+  double start_us;
+  // the time until KERNEL_RUN returns, which is the launch time on GPU when
+  // the kernels are launched asynchronously
+  double wall_us;
+  // the execution time on GPU by the events, or -1 if not available
+  double device_us;
+};
+
+// the elapsed time between the recorded events `start` and `stop` on GPU,
+// which are destroyed. It is defined by the context.
+inline double device_elapsed_us(void *start, void *stop);
+
+inline double profiler_now_us() {
+  return std::chrono::duration<double, std::micro>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/*!
+ * \brief The profiler of the kernels launched by KERNEL_RUN of a library.
+ *  It is disabled by default, and a launch only loads a flag then.
+ */
+class Profiler {
+ public:
+  Profiler() : enabled_(false) {}
+
+  inline bool enabled() const {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  void SetEnabled(const bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+  }
+
+  // `start` and `stop` are the events on GPU, or nullptr
+  void Add(const ProfilerEvent &event, void *start, void *stop) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    records_.push_back(Record{event, start, stop});
+  }
+
+  // move at most `max_events` events into `events`, and return the number
+  int Take(ProfilerEvent *events, const int max_events) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const int num =
+        std::min(max_events, static_cast<int>(records_.size()));
+    for (int i = 0; i < num; ++i) {
+      Record &record = records_[i];
+      if (record.start != nullptr) {
+        // wait for the kernel here rather than after its launch
+        record.event.device_us = device_elapsed_us(record.start, record.stop);
+      }
+      events[i] = record.event;
+    }
+    records_.erase(records_.begin(), records_.begin() + num);
+    return num;
+  }
+
+ private:
+  struct Record {
+    ProfilerEvent event;
+    void *start, *stop;
+  };
+  std::atomic<bool> enabled_;
+  std::mutex mutex_;
+  std::vector<Record> records_;
+};
+
+// the profiler is never destroyed, like the memory pool
+Profiler *get_profiler();
+
+// the name of the function which is calling KERNEL_RUN on this thread
+const char *&current_kernel_name();
+
+/*!
+ * \brief Name the kernels launched in the scope for the profiler, e.g. the
+ *  exported wrappers name their kernels by func_idcode_hash.
+ */
+class ProfilerScope {
+ public:
+  explicit ProfilerScope(const char *name) : last_(current_kernel_name()) {
+    current_kernel_name() = name;
+  }
+  ~ProfilerScope() { current_kernel_name() = last_; }
+
+ private:
+  const char *last_;
+};
+
+/*!
+ * \brief Record a kernel launch from its construction to its destruction.
+ *  It should only be constructed when the profiler is enabled.
+ */
+class KernelProfile {
+ public:
+  KernelProfile(const int64_t n, const int num_threads, const int device_id)
+      : start_(nullptr), stop_(nullptr) {
+    const char *name = current_kernel_name();
+    event_.name = name != nullptr ? name : "unknown";
+    event_.n = n;
+    event_.num_threads = num_threads;
+    event_.device_id = device_id;
+    event_.device_us = -1;
+    event_.start_us = profiler_now_us();
+  }
+
+  ~KernelProfile() {
+    event_.wall_us = profiler_now_us() - event_.start_us;
+    get_profiler()->Add(event_, start_, stop_);
+  }
+
+  // the events recorded before and after the kernel on GPU
+  void set_device_events(void *start, void *stop) {
+    start_ = start;
+    stop_ = stop;
+  }
+
+ private:
+  ProfilerEvent event_;
+  void *start_, *stop_;
+};
+
+/*!
+ * \brief Run `launch()`, which launches a kernel of `n` elements on
+ *  `num_threads` threads, and record it when the profiler is enabled.
+ */
+template <typename Launch>
+inline void profile_kernel(const int64_t n, const int num_threads,
+                           Launch launch) {
+  if (!get_profiler()->enabled()) {
+    launch();
+    return;
+  }
+  KernelProfile profile(n, num_threads, -1);
+  launch();
+}
+
+}  // namespace mobula
+
+#endif  // MOBULA_INCLUDE_CONTEXT_PROFILER_H_
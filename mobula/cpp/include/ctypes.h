@@ -1,6 +1,8 @@
 #ifndef MOBULA_INCLUDE_CTYPES_H_
 #define MOBULA_INCLUDE_CTYPES_H_
 
+#include "./float16.h"
+
 namespace mobula {
 
 typedef wchar_t wchar;
@@ -4,7 +4,9 @@
 #include <array>
 #include <cassert>
 #include <cfloat>
+#include <climits>
 #include <cmath>
+#include <cstdint>
 #include <iomanip>
 #include <iostream>
 #include <map>
@@ -28,6 +30,70 @@ struct CArray {
   T &operator[](int i) const { return data[i]; }
 };
 
+/*!
+ * \brief A tensor of `N` dimensions which may be non-contiguous, e.g. a
+ *  transposed or sliced view, so that a kernel reads it without a copy.
+ *  `view[i]` is the i-th element in the C order of the shape, and its
+ *  address is computed only when the view is non-contiguous.
+ *  The parameter `MOBULA_VIEW(T, name, N)` of a kernel is a StridedView.
+ */
+template <typename T, int N>
+struct StridedView {
+  T *data;
+  int64_t shape[N];
+  // in elements
+  int64_t strides[N];
+  bool is_contiguous;
+
+  // `layout` is shape[N] followed by strides[N], or nullptr if contiguous,
+  // so that a pointer converts to a contiguous view
+  StridedView(T *ptr, const int64_t *layout = nullptr)
+      : data(ptr), is_contiguous(layout == nullptr) {
+    for (int d = 0; d < N; ++d) {
+      shape[d] = is_contiguous ? 1 : layout[d];
+      strides[d] = is_contiguous ? 0 : layout[N + d];
+    }
+  }
+
+  // the offset of the i-th element from `data`
+  MOBULA_DEVICE int64_t offset(int64_t i) const {
+    int64_t off = 0;
+    for (int d = N - 1; d > 0; --d) {
+      off += (i % shape[d]) * strides[d];
+      i /= shape[d];
+    }
+    return off + i * strides[0];
+  }
+
+  MOBULA_DEVICE T &operator[](const int64_t i) const {
+    return is_contiguous ? data[i] : data[offset(i)];
+  }
+};
+
+// the parameter of a kernel, which accepts a non-contiguous tensor
+#define MOBULA_VIEW(type, name, ndim) mobula::StridedView<type, ndim> name
+
+// the value of a MOBULA_CONSTEXPR parameter which is not specialized
+constexpr int kDynamicConst = INT_MIN;
+
+/*!
+ * \brief An int parameter of a kernel, which is the compile-time constant `V`
+ *  in a specialized instance and the value passed at runtime otherwise, so
+ *  that the compiler unrolls the loops and reduces the divisions by it.
+ *  The parameter `MOBULA_CONSTEXPR(name, V)` of a kernel is a ConstInt<V>.
+ */
+template <int V>
+struct ConstInt {
+  int value;
+  MOBULA_DEVICE ConstInt(const int v) : value(V == kDynamicConst ? v : V) {}
+  MOBULA_DEVICE operator int() const {
+    return V == kDynamicConst ? value : V;
+  }
+};
+
+// the parameter of a kernel, which is specialized by the template `V`
+#define MOBULA_CONSTEXPR(name, V) const mobula::ConstInt<V> name
+
 template <typename F, typename T>
 inline MOBULA_DEVICE void mobula_map(F func, const T *data, const int n,
                                      const int stride = 1, T *out = nullptr) {
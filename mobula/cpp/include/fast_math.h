@@ -0,0 +1,100 @@
+#ifndef MOBULA_INCLUDE_FAST_MATH_H_
+#define MOBULA_INCLUDE_FAST_MATH_H_
+
+#include "simd.h"
+
+/*!
+ * \brief The math functions of the kernels, which accept T and Vec<T>.
+ *  If USING_FAST_MATH, see `USING_FAST_MATH` in mobula/config.py,
+ *    fast_exp and fast_log of Vec on CPU are the polynomials of lower
+ *    degrees, and the relative error is less than 4e-6 for float and 2e-12
+ *    for double. The scalar ones are exp and log, which are as fast.
+ *    On GPU, they are __expf and __logf for float.
+ *  Otherwise, they are exp and log.
+ */
+#ifndef USING_FAST_MATH
+#define USING_FAST_MATH 0
+#endif
+
+namespace mobula {
+
+#if USING_FAST_MATH && (USING_CUDA || USING_HIP)
+MOBULA_DEVICE inline float fast_exp(const float x) { return __expf(x); }
+MOBULA_DEVICE inline float fast_log(const float x) { return __logf(x); }
+#endif
+
+template <typename T>
+MOBULA_DEVICE inline T fast_exp(const T x) {
+  return simd_detail::exp(x);
+}
+
+template <typename T>
+MOBULA_DEVICE inline T fast_log(const T x) {
+  return simd_detail::log(x);
+}
+
+template <typename T, int W>
+MOBULA_DEVICE inline Vec<T, W> fast_exp(const Vec<T, W> &x) {
+#if USING_FAST_MATH && !(USING_CUDA || USING_HIP)
+  if (W == 1 || !simd_detail::exp_in_range(x)) {
+    MOBULA_VEC_LANEWISE(simd_detail::exp, x);
+  }
+  return simd_detail::exp_poly<simd_detail::FloatTraits<T>::kFastExpTerms>(x);
+#elif USING_FAST_MATH
+  MOBULA_VEC_LANEWISE(fast_exp, x);
+#else
+  return exp(x);
+#endif
+}
+
+template <typename T, int W>
+MOBULA_DEVICE inline Vec<T, W> fast_log(const Vec<T, W> &x) {
+#if USING_FAST_MATH && !(USING_CUDA || USING_HIP)
+  if (W == 1 || !simd_detail::log_in_range(x)) {
+    MOBULA_VEC_LANEWISE(simd_detail::log, x);
+  }
+  return simd_detail::log_poly<simd_detail::FloatTraits<T>::kFastLogTerms>(x);
+#elif USING_FAST_MATH
+  MOBULA_VEC_LANEWISE(fast_log, x);
+#else
+  return log(x);
+#endif
+}
+
+/*! \brief 1 / (1 + exp(-x)) */
+template <typename T>
+MOBULA_DEVICE inline T fast_sigmoid(const T &x) {
+  return T(1) / (T(1) + fast_exp(-x));
+}
+
+#if USING_FAST_MATH && (USING_CUDA || USING_HIP)
+MOBULA_DEVICE inline float fast_sigmoid(const float &x) {
+  return __fdividef(1.0f, 1.0f + __expf(-x));
+}
+#endif
+
+/*! \brief log(sigmoid(x)) = min(x, 0) - log(1 + exp(-|x|)) */
+template <typename T>
+MOBULA_DEVICE inline T log_sigmoid(const T &x) {
+  const T zero(0);
+  return select(x < zero, x, zero) -
+         fast_log(T(1) + fast_exp(select(x < zero, x, -x)));
+}
+
+/*!
+ * \brief x^n by squaring, which is faster and more accurate than pow for a
+ *  small integer n.
+ */
+template <typename T>
+MOBULA_DEVICE inline T pow_int(const T &x, const int n) {
+  T r(1), b = x;
+  for (int e = n < 0 ? -n : n; e > 0; e >>= 1) {
+    if (e & 1) r *= b;
+    b *= b;
+  }
+  return n < 0 ? T(1) / r : r;
+}
+
+}  // namespace mobula
+
+#endif  // MOBULA_INCLUDE_FAST_MATH_H_
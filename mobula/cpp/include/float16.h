@@ -0,0 +1,162 @@
+#ifndef MOBULA_INCLUDE_FLOAT16_H_
+#define MOBULA_INCLUDE_FLOAT16_H_
+
+#include <cstdint>
+#include <cstring>
+
+#if USING_CUDA
+#include <cuda_fp16.h>
+#elif USING_HIP
+#include <hip/hip_fp16.h>
+#elif defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+// the conversions are available in both the host and the device code
+#if defined(__CUDACC__) || defined(__HIPCC__)
+#define MOBULA_HOST_DEVICE __host__ __device__
+#else
+#define MOBULA_HOST_DEVICE
+#endif
+
+#if defined(__CUDA_ARCH__) || defined(__HIP_DEVICE_COMPILE__)
+#define MOBULA_FP16_INTRINSICS 1
+#else
+#define MOBULA_FP16_INTRINSICS 0
+#endif
+
+namespace mobula {
+
+namespace float16_detail {
+
+MOBULA_HOST_DEVICE inline uint32_t float_as_bits(const float f) {
+  uint32_t u;
+  memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
+MOBULA_HOST_DEVICE inline float bits_as_float(const uint32_t u) {
+  float f;
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+// IEEE half, rounded to nearest even
+MOBULA_HOST_DEVICE inline uint16_t float_to_half(const float val) {
+#if MOBULA_FP16_INTRINSICS
+  return __half_as_ushort(__float2half_rn(val));
+#elif defined(__F16C__)
+  return _cvtss_sh(val, 0);
+#else
+  uint32_t f = float_as_bits(val);
+  const uint32_t sign = f & 0x80000000u;
+  f ^= sign;
+  uint32_t h;
+  if (f >= 0x47800000u) {
+    // overflow to infinity, or NaN
+    h = f > 0x7f800000u ? 0x7e00u : 0x7c00u;
+  } else if (f < 0x38800000u) {
+    // the subnormals and zero are rounded by the addition of floats
+    const uint32_t magic = 0x3f000000u;
+    h = float_as_bits(bits_as_float(f) + bits_as_float(magic)) - magic;
+  } else {
+    // rebias the exponent, and round the 13 dropped bits to even
+    const uint32_t mant_odd = (f >> 13) & 1;
+    f += 0xc8000fffu + mant_odd;
+    h = f >> 13;
+  }
+  return static_cast<uint16_t>(h | (sign >> 16));
+#endif  // MOBULA_FP16_INTRINSICS
+}
+
+MOBULA_HOST_DEVICE inline float half_to_float(const uint16_t h) {
+#if MOBULA_FP16_INTRINSICS
+  return __half2float(__ushort_as_half(h));
+#elif defined(__F16C__)
+  return _cvtsh_ss(h);
+#else
+  const uint32_t shifted_exp = 0x0f800000u;
+  uint32_t f = (h & 0x7fffu) << 13;
+  const uint32_t exp = f & shifted_exp;
+  f += 0x38000000u;
+  if (exp == shifted_exp) {
+    // infinity or NaN
+    f += 0x38000000u;
+  } else if (exp == 0) {
+    // subnormal, normalized by the subtraction of floats
+    f = float_as_bits(bits_as_float(f + 0x00800000u) -
+                      bits_as_float(0x38800000u));
+  }
+  return bits_as_float(f | (static_cast<uint32_t>(h & 0x8000u) << 16));
+#endif  // MOBULA_FP16_INTRINSICS
+}
+
+// the high 16 bits of float, rounded to nearest even
+MOBULA_HOST_DEVICE inline uint16_t float_to_bfloat16(const float val) {
+  const uint32_t f = float_as_bits(val);
+  if ((f & 0x7fffffffu) > 0x7f800000u) {
+    // keep NaN quiet, which may be rounded to infinity otherwise
+    return static_cast<uint16_t>((f >> 16) | 0x40u);
+  }
+  return static_cast<uint16_t>((f + 0x7fffu + ((f >> 16) & 1)) >> 16);
+}
+
+MOBULA_HOST_DEVICE inline float bfloat16_to_float(const uint16_t h) {
+  return bits_as_float(static_cast<uint32_t>(h) << 16);
+}
+
+}  // namespace float16_detail
+
+#define MOBULA_FLOAT16_TYPE(NAME, TO_BITS, FROM_BITS)                    \
+  struct NAME {                                                          \
+    uint16_t bits;                                                       \
+    NAME() = default;                                                    \
+    MOBULA_HOST_DEVICE NAME(const float val)  /* NOLINT */               \
+        : bits(float16_detail::TO_BITS(val)) {}                          \
+    MOBULA_HOST_DEVICE operator float() const {                          \
+      return float16_detail::FROM_BITS(bits);                            \
+    }                                                                    \
+    MOBULA_HOST_DEVICE NAME &operator+=(const float val) {               \
+      return *this = static_cast<float>(*this) + val;                    \
+    }                                                                    \
+    MOBULA_HOST_DEVICE NAME &operator-=(const float val) {               \
+      return *this = static_cast<float>(*this) - val;                    \
+    }                                                                    \
+    MOBULA_HOST_DEVICE NAME &operator*=(const float val) {               \
+      return *this = static_cast<float>(*this) * val;                    \
+    }                                                                    \
+    MOBULA_HOST_DEVICE NAME &operator/=(const float val) {               \
+      return *this = static_cast<float>(*this) / val;                    \
+    }                                                                    \
+  };                                                                     \
+  static_assert(sizeof(NAME) == 2, "the size of " #NAME " should be 2")
+
+/*!
+ * \brief The 16-bit floating types in memory.
+ *  float16 is the IEEE half, and bfloat16 is the high 16 bits of float. They
+ *  are converted to float for the arithmetic, and the result is rounded to
+ *  nearest even when it is stored. The accumulations of the kernels should
+ *  use AccType<T>::type rather than T.
+ */
+MOBULA_FLOAT16_TYPE(float16, float_to_half, half_to_float);
+MOBULA_FLOAT16_TYPE(bfloat16, float_to_bfloat16, bfloat16_to_float);
+
+#undef MOBULA_FLOAT16_TYPE
+
+/*! \brief The type which the values of T are accumulated in. */
+template <typename T>
+struct AccType {
+  typedef T type;
+};
+template <>
+struct AccType<float16> {
+  typedef float type;
+};
+template <>
+struct AccType<bfloat16> {
+  typedef float type;
+};
+
+}  // namespace mobula
+
+#endif  // MOBULA_INCLUDE_FLOAT16_H_
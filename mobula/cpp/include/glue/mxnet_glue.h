@@ -6,6 +6,7 @@
 #include <algorithm>
 #include <cstring>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -44,6 +45,10 @@ int (*MXEnginePushSyncND)(
     ContextHandle ctx_handle, NDArrayHandle* const_nds_handle,
     int num_const_nds, NDArrayHandle* mutable_nds_handle, int num_mutable_nds,
     EngineFnPropertyHandle prop_handle, int priority, const char* opr_name);
+int (*MXNDArrayGetData)(NDArrayHandle handle, void** out_pdata);
+int (*MXNDArrayGetDType)(NDArrayHandle handle, int* out_dtype);
+int (*MXNDArrayGetShape)(NDArrayHandle handle, unsigned int* out_dim,
+                         const unsigned int** out_pdata);
 
 struct Context {
   enum DeviceType { kCPU = 1 << 0, kGPU = 1 << 1, kCPUPinned = 3 };
@@ -64,24 +69,121 @@ void set_stream(TVMArgs args, TVMRetValue*) {
   STRM = args.values[2].v_handle;
 }
 
+/*!
+ * \brief A vector whose first N elements are stored inline, so that it
+ *  doesn't allocate until it grows beyond N elements.
+ */
+template <typename T, size_t N>
+class InlineVector {
+ public:
+  InlineVector() : size_(0) {}
+  inline size_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+  inline T* data() { return size_ <= N ? inline_ : heap_.data(); }
+  inline T* begin() { return data(); }
+  inline T* end() { return data() + size_; }
+  inline T& operator[](const size_t i) { return data()[i]; }
+  void clear() { resize(0); }
+  void push_back(const T& value) {
+    if (size_ < N) {
+      inline_[size_] = value;
+    } else {
+      if (size_ == N) heap_.assign(inline_, inline_ + N);
+      heap_.push_back(value);
+    }
+    ++size_;
+  }
+  void resize(const size_t size) {
+    if (size > N) {
+      if (size_ <= N) heap_.assign(inline_, inline_ + size_);
+      heap_.resize(size);
+    } else {
+      if (size_ > N) std::copy(heap_.begin(), heap_.begin() + size, inline_);
+      for (size_t i = size_; i < size; ++i) inline_[i] = T();
+      // keep the capacity of heap_ for the later calls
+      heap_.clear();
+    }
+    size_ = size;
+  }
+
+ private:
+  size_t size_;
+  T inline_[N];
+  std::vector<T> heap_;
+};
+
+/*!
+ * \brief The DLTensor of an NDArray argument, which is reused by the later
+ *  runs while the data, dtype, shape and context of the NDArray don't change.
+ */
+struct CachedDLTensor {
+  static constexpr unsigned int kMaxNDim = 8;
+  CachedDLTensor() : valid(false) {}
+  bool Matches(void* data, const int dtype, const unsigned int ndim,
+               const unsigned int* mx_shape, const Context& ctx) const {
+    if (!valid || data != tensor.data || dtype != mx_dtype ||
+        static_cast<int>(ndim) != tensor.ndim || ctx.dev_type != dev_type ||
+        ctx.dev_id != dev_id) {
+      return false;
+    }
+    for (unsigned int i = 0; i < ndim; ++i) {
+      if (static_cast<int64_t>(mx_shape[i]) != shape[i]) return false;
+    }
+    return true;
+  }
+  // copy `src`, whose ndim is at most kMaxNDim
+  void Assign(const DLTensor& src, const int dtype, const Context& ctx) {
+    tensor = src;
+    std::copy(src.shape, src.shape + src.ndim, shape);
+    if (src.strides != nullptr) {
+      std::copy(src.strides, src.strides + src.ndim, strides);
+    }
+    mx_dtype = dtype;
+    dev_type = ctx.dev_type;
+    dev_id = ctx.dev_id;
+    valid = true;
+  }
+  DLTensor* get() {
+    // the cache may have been moved since Assign
+    tensor.shape = shape;
+    if (tensor.strides != nullptr) tensor.strides = strides;
+    return &tensor;
+  }
+  bool valid;
+  DLTensor tensor;
+  int64_t shape[kMaxNDim];
+  int64_t strides[kMaxNDim];
+  int mx_dtype;
+  Context::DeviceType dev_type;
+  int32_t dev_id;
+};
+
+class TVMFunctorPool;
+
 /*!
  * \brief Async functor object
  *  calling argument of the function.
+ *  The functors are reused by TVMFunctorPool, so that the arguments of small
+ *  calls are stored inline and the DLTensors are converted once, and a push
+ *  to the engine doesn't allocate in the steady state except the shallow
+ *  copies of the NDArrays, which keep them alive until the run.
  */
 class TVMFunctor {
  public:
+  // the capacity of the inline storage
+  static constexpr size_t kInlineArgs = 16;
+  static constexpr size_t kInlineArrays = 8;
+
   // constructor
-  explicit TVMFunctor(PackedFunc func, PackedFunc fset_stream)
-      : func_(func), fset_stream_(fset_stream) {}
+  explicit TVMFunctor(PackedFunc func, PackedFunc fset_stream,
+                      TVMFunctorPool* pool)
+      : func_(func), fset_stream_(fset_stream), pool_(pool) {}
 
-  void Init(const TVMArgs& args, const std::vector<int>& const_loc,
-            std::vector<NDArrayHandle>* const_nds,
-            std::vector<NDArrayHandle>* mutate_nds) {
-    values_.clear();
-    type_codes_.clear();
-    values_.insert(values_.end(), args.values, args.values + args.size());
-    type_codes_.insert(type_codes_.end(), args.type_codes,
-                       args.type_codes + args.size());
+  void Init(const TVMArgs& args, const std::vector<int>& const_loc) {
+    for (int i = 0; i < args.size(); ++i) {
+      values_.push_back(args.values[i]);
+      type_codes_.push_back(args.type_codes[i]);
+    }
 
     size_t const_loc_ptr = 0;
     int dev_type, dev_id;
@@ -108,29 +210,31 @@ class TVMFunctor {
         // check if there is read or mutate
         // by default assume we mutate the array.
         if (const_loc_ptr < const_loc.size() && i == const_loc[const_loc_ptr]) {
-          const_nds->push_back(nd);
+          const_nds_.push_back(nd);
           ++const_loc_ptr;
         } else {
-          mutate_nds->push_back(nd);
+          mutate_nds_.push_back(nd);
         }
       } else {
         CHECK_LT(args.type_codes[i], int(kTVMType))
             << "Only allow POD type in mxnet async call";
       }
     }
+    if (dl_tensors_.size() < array_loc_.size()) {
+      dl_tensors_.resize(array_loc_.size());
+    }
+    DeduplicateNDArrayHandle(&const_nds_, &mutate_nds_);
   }
 
   void Run(const RunContext& rctx) {
     // setup DLTensor
-    std::vector<DLManagedTensorHandle> dlms(array_loc_.size());
     for (size_t i = 0; i < array_loc_.size(); ++i) {
-      DLManagedTensorHandle& dlm = dlms[i];
-      MXNDArrayToDLPack(array_handle_[i], &dlm);
-      values_[array_loc_[i]].v_handle = static_cast<void*>(&dlm->dl_tensor);
+      values_[array_loc_[i]].v_handle = static_cast<void*>(GetDLTensor(i));
     }
     // run the packed function
     TVMRetValue rv;
-    TVMArgs args(&values_[0], &type_codes_[0], values_.size());
+    TVMArgs args(values_.data(), type_codes_.data(),
+                 static_cast<int>(values_.size()));
     if (ctx_.dev_type == Context::kGPU) {
       // pass stream via last argument.
       void* strm = reinterpret_cast<void**>(rctx.stream)[0];
@@ -141,100 +245,172 @@ class TVMFunctor {
     } else {
       func_.CallPacked(args, &rv);
     }
-    for (DLManagedTensorHandle dlm : dlms) {
+    for (DLManagedTensorHandle dlm : uncached_dlms_) {
       dlm->deleter(dlm);
     }
+    uncached_dlms_.clear();
   }
 
-  inline const Context& ctx() { return ctx_; }
-
-  ~TVMFunctor() {
+  // release the arrays, and keep the storage and the DLTensors for reuse
+  void Reset() {
     for (NDArrayHandle handle : array_handle_) {
       MXNDArrayFree(handle);
     }
+    values_.clear();
+    type_codes_.clear();
+    array_handle_.clear();
+    array_loc_.clear();
+    const_nds_.clear();
+    mutate_nds_.clear();
   }
 
+  inline const Context& ctx() { return ctx_; }
+  inline TVMFunctorPool* pool() { return pool_; }
+  inline NDArrayHandle* const_nds() { return const_nds_.data(); }
+  inline int num_const_nds() { return static_cast<int>(const_nds_.size()); }
+  inline NDArrayHandle* mutate_nds() { return mutate_nds_.data(); }
+  inline int num_mutate_nds() { return static_cast<int>(mutate_nds_.size()); }
+
+  ~TVMFunctor() { Reset(); }
+
  private:
+  // the DLTensor of the i-th array, which is converted by MXNDArrayToDLPack
+  // only if the array differs from the one of the last run
+  DLTensor* GetDLTensor(const size_t i) {
+    NDArrayHandle nd = array_handle_[i];
+    CachedDLTensor& cache = dl_tensors_[i];
+    void* data = nullptr;
+    int dtype = -1;
+    unsigned int ndim = 0;
+    const unsigned int* shape = nullptr;
+    MXNDArrayGetData(nd, &data);
+    MXNDArrayGetDType(nd, &dtype);
+    MXNDArrayGetShape(nd, &ndim, &shape);
+    if (cache.Matches(data, dtype, ndim, shape, ctx_)) return cache.get();
+    DLManagedTensorHandle dlm;
+    MXNDArrayToDLPack(nd, &dlm);
+    if (dlm->dl_tensor.ndim > static_cast<int>(CachedDLTensor::kMaxNDim)) {
+      // too many dimensions to cache, so it is deleted after the run
+      cache.valid = false;
+      uncached_dlms_.push_back(dlm);
+      return &dlm->dl_tensor;
+    }
+    cache.Assign(dlm->dl_tensor, dtype, ctx_);
+    dlm->deleter(dlm);
+    return cache.get();
+  }
+
+  template <typename Vec>
+  static void DeduplicateNDArrayHandle(Vec* read_nds, Vec* write_nds) {
+    std::sort(write_nds->begin(), write_nds->end());
+    write_nds->resize(std::unique(write_nds->begin(), write_nds->end()) -
+                      write_nds->begin());
+    std::sort(read_nds->begin(), read_nds->end());
+    read_nds->resize(std::unique(read_nds->begin(), read_nds->end()) -
+                     read_nds->begin());
+    auto wit = write_nds->begin();
+    auto rtop = read_nds->begin();
+    for (auto rit = read_nds->begin(); rit != read_nds->end(); ++rit) {
+      while (wit != write_nds->end() && *wit < *rit) ++wit;
+      if (wit == write_nds->end() || *wit != *rit) {
+        *rtop = *rit;
+        ++rtop;
+      }
+    }
+    read_nds->resize(rtop - read_nds->begin());
+  }
+
   /*! \brief The function */
   PackedFunc func_;
   /*! \brief Set stream */
   PackedFunc fset_stream_;
+  /*! \brief The pool which the functor returns to */
+  TVMFunctorPool* pool_;
   /*! \brief Values field */
-  std::vector<TVMValue> values_;
+  InlineVector<TVMValue, kInlineArgs> values_;
   /*! \brief type code field */
-  std::vector<int> type_codes_;
+  InlineVector<int, kInlineArgs> type_codes_;
   /*! \brief NDArrayHandles field */
-  std::vector<NDArrayHandle> array_handle_;
+  InlineVector<NDArrayHandle, kInlineArrays> array_handle_;
   /*! \brief position of array in arguments */
-  std::vector<int> array_loc_;
+  InlineVector<int, kInlineArrays> array_loc_;
+  /*! \brief the deduplicated arrays to read and to mutate */
+  InlineVector<NDArrayHandle, kInlineArrays> const_nds_, mutate_nds_;
+  /*! \brief DLTensors of the arrays in the last run */
+  InlineVector<CachedDLTensor, kInlineArrays> dl_tensors_;
+  /*! \brief DLTensors to delete after the run */
+  InlineVector<DLManagedTensorHandle, kInlineArrays> uncached_dlms_;
   /*! \brief context */
   Context ctx_;
 };
 
-inline void DeduplicateNDArrayHandle(std::vector<NDArrayHandle>* read_nds,
-                                     std::vector<NDArrayHandle>* write_nds) {
-  std::sort(write_nds->begin(), write_nds->end());
-  write_nds->resize(std::unique(write_nds->begin(), write_nds->end()) -
-                    write_nds->begin());
-  std::sort(read_nds->begin(), read_nds->end());
-  read_nds->resize(std::unique(read_nds->begin(), read_nds->end()) -
-                   read_nds->begin());
-  auto wit = write_nds->begin();
-  auto rtop = read_nds->begin();
-  for (auto rit = read_nds->begin(); rit != read_nds->end(); ++rit) {
-    while (wit != write_nds->end() && *wit < *rit) ++wit;
-    if (wit == write_nds->end() || *wit != *rit) {
-      *rtop = *rit;
-      ++rtop;
+/*!
+ * \brief The idle functors of a wrapped function. A call takes one, and the
+ *  engine returns it after the run. The pool is never destroyed, since the
+ *  functors in the engine may outlive the wrapped function.
+ */
+class TVMFunctorPool {
+ public:
+  TVMFunctorPool(PackedFunc func, PackedFunc fset_stream)
+      : func_(func), fset_stream_(fset_stream) {
+    idle_.reserve(kReservedFunctors);
+  }
+
+  TVMFunctor* Acquire() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!idle_.empty()) {
+        TVMFunctor* functor = idle_.back();
+        idle_.pop_back();
+        return functor;
+      }
     }
+    return new TVMFunctor(func_, fset_stream_, this);
   }
-  read_nds->resize(rtop - read_nds->begin());
-}
 
-struct SyncFuncParams {
-  Context ctx;
-  std::shared_ptr<TVMFunctor> func;
+  void Release(TVMFunctor* functor) {
+    functor->Reset();
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.push_back(functor);
+  }
+
+ private:
+  static constexpr size_t kReservedFunctors = 16;
+  PackedFunc func_;
+  PackedFunc fset_stream_;
+  std::mutex mutex_;
+  std::vector<TVMFunctor*> idle_;
 };
 
 void sync_func_inst(void* rctx, void* param) {
-  SyncFuncParams* ps = static_cast<SyncFuncParams*>(param);
+  TVMFunctor* func = static_cast<TVMFunctor*>(param);
   const RunContext* pctx = static_cast<RunContext*>(rctx);
-  ps->func->Run(*pctx);
+  func->Run(*pctx);
 }
 
 void deleter_inst(void* param) {
-  SyncFuncParams* ps = static_cast<SyncFuncParams*>(param);
-  delete ps;
+  TVMFunctor* func = static_cast<TVMFunctor*>(param);
+  func->pool()->Release(func);
 }
 
 PackedFunc WrapAsyncCall(TVMFunc pfunc, decltype(set_stream) set_stream_func,
                          const int num_const, int* c_const_loc) {
   PackedFunc f(pfunc);
   PackedFunc fset_stream(set_stream_func);
+  TVMFunctorPool* pool = new TVMFunctorPool(f, fset_stream);
 
   // sorted position of constant arguments
   std::vector<int> const_loc(c_const_loc, c_const_loc + num_const);
   std::sort(const_loc.begin(), const_loc.end());
   // wrapped function
   // This is the function that called by the user.
-  auto wrapped = [f, fset_stream, const_loc](TVMArgs args,
-                                             TVMRetValue* /*rv*/) {
-    std::shared_ptr<TVMFunctor> func =
-        std::make_shared<TVMFunctor>(f, fset_stream);
-    std::vector<NDArrayHandle> const_nds, mutate_nds;
-    func->Init(args, const_loc, &const_nds, &mutate_nds);
-    DeduplicateNDArrayHandle(&const_nds, &mutate_nds);
-    SyncFuncParams* ps = new SyncFuncParams();
-    ps->ctx = func->ctx();
-    ps->func = func;
-    NDArrayHandle* const_nds_handle = const_nds.data();
-    int num_const_nds = const_nds.size();
-    NDArrayHandle* mutate_nds_handle = mutate_nds.data();
-    int num_mutate_nds = mutate_nds.size();
-
-    MXEnginePushSyncND(sync_func_inst, static_cast<void*>(ps), deleter_inst,
-                       &ps->ctx, const_nds_handle, num_const_nds,
-                       mutate_nds_handle, num_mutate_nds, nullptr, 0, nullptr);
+  auto wrapped = [pool, const_loc](TVMArgs args, TVMRetValue* /*rv*/) {
+    TVMFunctor* func = pool->Acquire();
+    func->Init(args, const_loc);
+    MXEnginePushSyncND(sync_func_inst, static_cast<void*>(func), deleter_inst,
+                       &func->ctx(), func->const_nds(), func->num_const_nds(),
+                       func->mutate_nds(), func->num_mutate_nds(), nullptr, 0,
+                       nullptr);
   };
   return PackedFunc(wrapped);
 }
@@ -275,12 +451,18 @@ MOBULA_DLL void RegisterMXAPI(
     decltype(MXNDArrayFree) ndarray_free,
     decltype(MXNDArrayGetContext) ndarray_get_context,
     decltype(MXNDArrayToDLPack) ndarray_to_dlpack,
-    decltype(MXEnginePushSyncND) engine_push_sync_nd) {
+    decltype(MXEnginePushSyncND) engine_push_sync_nd,
+    decltype(MXNDArrayGetData) ndarray_get_data,
+    decltype(MXNDArrayGetDType) ndarray_get_dtype,
+    decltype(MXNDArrayGetShape) ndarray_get_shape) {
   MXShallowCopyNDArray = shallow_copy_ndarray;
   MXNDArrayFree = ndarray_free;
   MXNDArrayGetContext = ndarray_get_context;
   MXNDArrayToDLPack = ndarray_to_dlpack;
   MXEnginePushSyncND = engine_push_sync_nd;
+  MXNDArrayGetData = ndarray_get_data;
+  MXNDArrayGetDType = ndarray_get_dtype;
+  MXNDArrayGetShape = ndarray_get_shape;
 }
 }
 
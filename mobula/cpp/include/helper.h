@@ -93,6 +93,69 @@ MOBULA_DEVICE void Reduce(const int n, const T *data, T *out,
   }
 }
 
+// the maximum bytes of the thread-private copies in a ScatterBuffer
+constexpr size_t SCATTER_BUFFER_MAX_BYTES = size_t(256) << 20;
+
+/*!
+ * \brief Thread-private accumulation for scatter-heavy kernels.
+ *  Each thread adds into its own zero-initialized copy of `out`, and `merge`
+ *  reduces the copies into `out` in parallel. The constructor and `merge`
+ *  should be called by all threads in the kernel.
+ *  On GPU, or when the copies exceed SCATTER_BUFFER_MAX_BYTES, `add` calls
+ *  `atomic_add` on `out` directly. The copies are of AccType<T>::type.
+ */
+template <typename T>
+class ScatterBuffer {
+ public:
+  typedef typename AccType<T>::type acc_type;
+  // whether the output can be privatized, `size` is unused otherwise
+  static constexpr bool kPrivatizable =
+      !(USING_CUDA || USING_HIP) && HOST_NUM_THREADS > 1;
+
+  MOBULA_DEVICE ScatterBuffer(T *out, const size_t size)
+      : out_(out), size_(size), buffer_(nullptr), data_(nullptr) {
+#if !(USING_CUDA || USING_HIP)
+    const int num_threads = get_num_threads();
+    if (num_threads > 1 &&
+        num_threads * size * sizeof(acc_type) <= SCATTER_BUFFER_MAX_BYTES) {
+      buffer_ = new_shared_array<acc_type>(num_threads * size);
+      data_ = buffer_ + get_thread_num() * size;
+      for (size_t i = 0; i < size; ++i) data_[i] = acc_type(0);
+    }
+#endif  // !(USING_CUDA || USING_HIP)
+  }
+
+  MOBULA_DEVICE void add(const acc_type val, const size_t i) {
+    if (data_ == nullptr) {
+      atomic_add(T(val), out_ + i);
+    } else {
+      data_[i] += val;
+    }
+  }
+
+  MOBULA_DEVICE void merge() {
+#if !(USING_CUDA || USING_HIP)
+    if (buffer_ == nullptr) return;
+    __syncthreads();
+    const int num_threads = get_num_threads();
+    parfor(size_, [&](size_t i) {
+      acc_type val = out_[i];
+      for (int t = 0; t < num_threads; ++t) val += buffer_[t * size_ + i];
+      out_[i] = val;
+    });
+    del_shared_array(buffer_);
+    buffer_ = data_ = nullptr;
+#endif  // !(USING_CUDA || USING_HIP)
+  }
+
+ private:
+  T *out_;
+  size_t size_;
+  acc_type *buffer_;
+  // the private copy of the current thread
+  acc_type *data_;
+};
+
 template <typename T>
 MOBULA_DEVICE void max_func(T &dst, const T &src) {
   if (src > dst) dst = src;
@@ -122,6 +185,186 @@ MOBULA_DEVICE void add_residual_merge_func(T &dst, T &dst_residual,
   dst_residual = t2 - (dst - t1);
 }
 
+// the lanes of a warp of warp_reduce on GPU, which divides the warp sizes of
+// both CUDA and HIP
+constexpr int kWarpSize = 32;
+
+/*!
+ * \brief Reduce `value` over the groups of `width` adjacent lanes by
+ *  func(dst, src), e.g. add_func, and return the result to every lane.
+ *  `width` is a power of two which is not greater than kWarpSize, and all
+ *  lanes of the warp should call it together.
+ *  On CPU, a thread is a warp of one lane, so `value` is returned.
+ */
+template <typename T, typename Func>
+MOBULA_DEVICE inline T warp_reduce(T value, Func func,
+                                   const int width = kWarpSize) {
+#if USING_CUDA || USING_HIP
+  for (int mask = width / 2; mask > 0; mask /= 2) {
+    func(value, warp_shfl_xor(value, mask));
+  }
+#else
+  static_cast<void>(func);
+  static_cast<void>(width);
+#endif  // USING_CUDA || USING_HIP
+  return value;
+}
+
+/*!
+ * \brief Call F(row, cols, lane, lanes) for each of the N rows of C columns.
+ *  On GPU, the `lanes` adjacent threads compute a row together, and the lane
+ *  `lane` visits the columns lane, lane + lanes, ... in [0, cols). `lanes` is
+ *  the smallest power of two which is not less than C, and at most
+ *  `max_lanes`. The lanes padding the last warp get a valid row and cols = 0,
+ *  so that all lanes of a warp can call warp_reduce(value, func, lanes).
+ *  On CPU, a thread computes a row, and lanes = 1.
+ */
+template <typename Func>
+MOBULA_DEVICE void parfor_rows(const int N, const int C, Func F,
+                               const int max_lanes = kWarpSize) {
+#if USING_CUDA || USING_HIP
+  int lanes = max_lanes;
+  while (lanes > 1 && lanes / 2 >= C) lanes /= 2;
+  const int num_lanes = (N * lanes + kWarpSize - 1) / kWarpSize * kWarpSize;
+  parfor(num_lanes, [&](int i) {
+    const int row = i / lanes;
+    if (row < N) {
+      F(row, C, i % lanes, lanes);
+    } else {
+      F(N - 1, 0, i % lanes, lanes);
+    }
+  });
+#else
+  static_cast<void>(max_lanes);
+  parfor(N, [&](int i) { F(i, C, 0, 1); });
+#endif  // USING_CUDA || USING_HIP
+}
+
+/*!
+ * \brief Reduce `value` over the threads of a block by func(dst, src), and
+ *  return the result to every thread.
+ *  On GPU, the warps are reduced by shuffles, and their results are reduced
+ *  through the shared memory. On CPU, the threads of the kernel are a block,
+ *  and each thread merges the values of all threads in the same order from
+ *  the slots of the launch, which costs a barrier.
+ *  All threads of the block should call it together.
+ */
+template <typename T, typename Func>
+MOBULA_DEVICE T block_reduce(T value, Func func, const T init) {
+#if USING_CUDA || USING_HIP
+  // a block has at most 1024 threads
+  __shared__ T buffer[1024 / kWarpSize];
+  const int lane = hipThreadIdx_x % kWarpSize;
+  const int warp = hipThreadIdx_x / kWarpSize;
+  const int num_warps = (hipBlockDim_x + kWarpSize - 1) / kWarpSize;
+  value = warp_reduce(value, func);
+  if (lane == 0) buffer[warp] = value;
+  __syncthreads();
+  // every warp reduces the results of the warps, so no broadcast is needed
+  value = warp_reduce(lane < num_warps ? buffer[lane] : init, func);
+  // the buffer is reused by the next call
+  __syncthreads();
+#else
+  static_assert(sizeof(T) <= sizeof(BlockReduceSlot) &&
+                    alignof(T) <= alignof(BlockReduceSlot),
+                "T should fit a slot of block_reduce");
+  BlockReduceSlot *slots = next_block_reduce_slots();
+  new (slots[get_thread_num()].data) T(value);
+  __syncthreads();
+  value = init;
+  const int num_threads = get_num_threads();
+  for (int t = 0; t < num_threads; ++t) {
+    func(value, *reinterpret_cast<const T *>(slots[t].data));
+  }
+#endif  // USING_CUDA || USING_HIP
+  return value;
+}
+
+/*!
+ * \brief Reduce the values of all threads of the kernel into `out[0]`.
+ *  On GPU, the blocks write their partials, and the last finishing block
+ *  reduces the partials. `partials` has an element per block, and the blocks
+ *  count themselves in `counter`, which is 0 before the launch, e.g.
+ *  MOBULA_COUNTER, and the last block resets it to 0. So a kernel calls
+ *  grid_reduce once per counter.
+ *  `partials` and `counter` are unused on CPU.
+ */
+template <typename T, typename Func>
+MOBULA_DEVICE void grid_reduce(T value, T *partials, unsigned int *counter,
+                               T *out, Func func, const T init) {
+  value = block_reduce(value, func, init);
+#if USING_CUDA || USING_HIP
+  __shared__ bool is_last_block;
+  if (hipThreadIdx_x == 0) {
+    partials[hipBlockIdx_x] = value;
+    // the partial is visible to the last block before the counter increases
+    __threadfence();
+    is_last_block = atomicInc(counter, hipGridDim_x - 1) == hipGridDim_x - 1;
+  }
+  __syncthreads();
+  if (is_last_block) {
+    value = init;
+    for (int i = hipThreadIdx_x; i < static_cast<int>(hipGridDim_x);
+         i += hipBlockDim_x) {
+      func(value, partials[i]);
+    }
+    value = block_reduce(value, func, init);
+    if (hipThreadIdx_x == 0) out[0] = value;
+  }
+#else
+  static_cast<void>(partials);
+  static_cast<void>(counter);
+  if (get_thread_num() == 0) out[0] = value;
+#endif  // USING_CUDA || USING_HIP
+}
+
+/*!
+ * \brief Reduce `data[0:n]` into `out[0]` by func(dst, src) in two stages:
+ *  the threads reduce `data` into the block partials, and the partials are
+ *  reduced in the end, see grid_reduce. `partials` has n / kWarpSize + 1
+ *  elements for the kernel launched with `n` threads.
+ *  On CPU, each thread reduces a contiguous range into a private accumulator.
+ *  All threads of the kernel should call it together.
+ */
+template <typename T, typename Func>
+MOBULA_DEVICE void device_reduce(const int n, const T *data, T *partials,
+                                 unsigned int *counter, T *out, Func func,
+                                 const T init) {
+  T value = init;
+#if USING_CUDA || USING_HIP
+  parfor(n, [&](int i) { func(value, data[i]); });
+#else
+  int start, end;
+  get_parfor_range(n, get_num_threads(), get_thread_num(), &start, &end);
+  for (int i = start; i < end; ++i) func(value, data[i]);
+#endif  // USING_CUDA || USING_HIP
+  grid_reduce(value, partials, counter, out, func, init);
+}
+
+/*!
+ * \brief device_reduce whose thread-private accumulators are compensated by
+ *  func_reduce(dst, src, residual), e.g. add_residual_reduce_func, which keeps
+ *  the residual to subtract from dst. The compensated values of the threads
+ *  are reduced by func(dst, src).
+ */
+template <typename T, typename FuncReduce, typename Func>
+MOBULA_DEVICE void device_reduce(const int n, const T *data, T *partials,
+                                 unsigned int *counter, T *out,
+                                 FuncReduce func_reduce, Func func,
+                                 const T init) {
+  T value = init;
+  T residual = 0;
+#if USING_CUDA || USING_HIP
+  parfor(n, [&](int i) { func_reduce(value, data[i], residual); });
+#else
+  int start, end;
+  get_parfor_range(n, get_num_threads(), get_thread_num(), &start, &end);
+  for (int i = start; i < end; ++i) func_reduce(value, data[i], residual);
+#endif  // USING_CUDA || USING_HIP
+  grid_reduce(value - residual, partials, counter, out, func, init);
+}
+
+
 }  // namespace mobula
 
 #endif  // MOBULA_INCLUDE_HELPER_H_
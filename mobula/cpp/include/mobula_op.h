@@ -2,7 +2,10 @@
 #define MOBULA_INCLUDE_MOBULA_OP_H_
 
 #include "defines.h"
+#include "fast_math.h"
 #include "helper.h"
+#include "simd.h"
+#include "workspace.h"
 
 // glue
 #include "glue/mxnet_glue.h"
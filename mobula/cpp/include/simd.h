@@ -0,0 +1,746 @@
+#ifndef MOBULA_INCLUDE_SIMD_H_
+#define MOBULA_INCLUDE_SIMD_H_
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#include "defines.h"
+#include "float16.h"
+
+/*!
+ * \brief The bytes of a SIMD register on CPU.
+ *  The instruction set is chosen by the build flags, see `SIMD_ISA` in
+ *  mobula/config.py. On GPU, a vector has only one element.
+ */
+#if USING_CUDA || USING_HIP
+#define MOBULA_SIMD_BYTES 0
+#elif defined(__AVX512F__)
+#define MOBULA_SIMD_BYTES 64
+#elif defined(__AVX__)
+#define MOBULA_SIMD_BYTES 32
+#else
+// SSE2 or NEON
+#define MOBULA_SIMD_BYTES 16
+#endif
+
+// the vector extension of GCC and Clang maps a vector to a SIMD register
+#if !(USING_CUDA || USING_HIP) && (defined(__GNUC__) || defined(__clang__))
+#define MOBULA_SIMD_VECTOR_EXT 1
+#else
+#define MOBULA_SIMD_VECTOR_EXT 0
+#endif
+
+// the polynomials of exp, log and pow pay off with 256-bit or wider vectors
+#define MOBULA_SIMD_MATH (MOBULA_SIMD_BYTES >= 32)
+
+namespace mobula {
+
+/*! \brief The number of elements of type T in a SIMD register */
+template <typename T>
+struct VecSize {
+  static constexpr int value =
+      MOBULA_SIMD_BYTES >= 2 * sizeof(T) ? MOBULA_SIMD_BYTES / sizeof(T) : 1;
+};
+
+/*!
+ * \brief The number of elements of type T in a vector of the kernels which
+ *  are dominated by exp, log and pow. The lane-wise math functions of short
+ *  vectors are slower than the scalar ones.
+ */
+template <typename T>
+struct VecMathSize {
+  static constexpr int value = MOBULA_SIMD_MATH ? VecSize<T>::value : 1;
+};
+
+namespace simd_detail {
+
+template <int bytes>
+struct MaskType;
+template <>
+struct MaskType<1> {
+  typedef int8_t type;
+};
+template <>
+struct MaskType<2> {
+  typedef int16_t type;
+};
+template <>
+struct MaskType<4> {
+  typedef int32_t type;
+};
+template <>
+struct MaskType<8> {
+  typedef int64_t type;
+};
+
+template <typename T>
+MOBULA_DEVICE inline T exp(const T x) {
+#if USING_CUDA || USING_HIP
+  return ::exp(x);
+#else
+  return std::exp(x);
+#endif
+}
+
+template <typename T>
+MOBULA_DEVICE inline T log(const T x) {
+#if USING_CUDA || USING_HIP
+  return ::log(x);
+#else
+  return std::log(x);
+#endif
+}
+
+template <typename T>
+MOBULA_DEVICE inline T pow(const T x, const T y) {
+#if USING_CUDA || USING_HIP
+  return ::pow(x, y);
+#else
+  return std::pow(x, y);
+#endif
+}
+
+template <typename T>
+MOBULA_DEVICE inline T sqrt(const T x) {
+#if USING_CUDA || USING_HIP
+  return ::sqrt(x);
+#else
+  return std::sqrt(x);
+#endif
+}
+
+}  // namespace simd_detail
+
+template <typename T, int W>
+class Vec;
+
+namespace simd_detail {
+template <typename T, int W>
+MOBULA_DEVICE Vec<T, W> vec_exp(const Vec<T, W> &x);
+template <typename T, int W>
+MOBULA_DEVICE Vec<T, W> vec_log(const Vec<T, W> &x);
+template <typename T, int W>
+MOBULA_DEVICE Vec<T, W> vec_pow(const Vec<T, W> &x, const Vec<T, W> &y);
+}  // namespace simd_detail
+
+/*!
+ * \brief The lanes selected by a comparison of Vec<T, W>.
+ */
+template <typename T, int W>
+class VecMask {
+ public:
+  typedef typename simd_detail::MaskType<sizeof(T)>::type mask_type;
+#if MOBULA_SIMD_VECTOR_EXT
+  // every bit of a selected lane is 1
+  typedef mask_type native_type
+      __attribute__((vector_size(W * sizeof(mask_type))));
+#endif
+
+  MOBULA_DEVICE VecMask() {}
+  MOBULA_DEVICE bool operator[](const int k) const { return m[k] != 0; }
+
+  // whether all lanes are selected
+  MOBULA_DEVICE bool all() const {
+    mask_type r = -1;
+    for (int k = 0; k < W; ++k) r &= m[k];
+    return r != 0;
+  }
+  // whether any lane is selected
+  MOBULA_DEVICE bool any() const {
+    mask_type r = 0;
+    for (int k = 0; k < W; ++k) r |= m[k];
+    return r != 0;
+  }
+
+  // the vector whose lanes are -1 for the selected lanes, otherwise 0
+  template <typename U>
+  MOBULA_DEVICE Vec<U, W> cast() const {
+    Vec<U, W> r;
+#if MOBULA_SIMD_VECTOR_EXT && (defined(__clang__) || __GNUC__ >= 9)
+    r.v_ = __builtin_convertvector(m, typename Vec<U, W>::native_type);
+#else
+    for (int k = 0; k < W; ++k) r.v_[k] = static_cast<U>(m[k]);
+#endif
+    return r;
+  }
+
+  friend MOBULA_DEVICE VecMask operator&(const VecMask &a, const VecMask &b) {
+    VecMask r;
+#if MOBULA_SIMD_VECTOR_EXT
+    r.m = a.m & b.m;
+#else
+    for (int k = 0; k < W; ++k) r.m[k] = a.m[k] & b.m[k];
+#endif
+    return r;
+  }
+  friend MOBULA_DEVICE VecMask operator|(const VecMask &a, const VecMask &b) {
+    VecMask r;
+#if MOBULA_SIMD_VECTOR_EXT
+    r.m = a.m | b.m;
+#else
+    for (int k = 0; k < W; ++k) r.m[k] = a.m[k] | b.m[k];
+#endif
+    return r;
+  }
+  friend MOBULA_DEVICE VecMask operator!(const VecMask &a) {
+    VecMask r;
+#if MOBULA_SIMD_VECTOR_EXT
+    r.m = ~a.m;
+#else
+    for (int k = 0; k < W; ++k) r.m[k] = ~a.m[k];
+#endif
+    return r;
+  }
+
+#if MOBULA_SIMD_VECTOR_EXT
+  native_type m;
+#else
+  mask_type m[W];
+#endif
+};
+
+#if MOBULA_SIMD_VECTOR_EXT
+#define MOBULA_VEC_BINARY_OP(OP)                                   \
+  friend MOBULA_DEVICE Vec operator OP(const Vec &a, const Vec &b) { \
+    Vec r;                                                         \
+    r.v_ = a.v_ OP b.v_;                                           \
+    return r;                                                      \
+  }
+#define MOBULA_VEC_SHIFT_OP(OP)                                     \
+  friend MOBULA_DEVICE Vec operator OP(const Vec &a, const int s) { \
+    Vec r;                                                          \
+    r.v_ = a.v_ OP s;                                               \
+    return r;                                                       \
+  }
+#define MOBULA_VEC_COMPARE_OP(OP)                                     \
+  friend MOBULA_DEVICE mask_type operator OP(const Vec &a, const Vec &b) { \
+    mask_type r;                                                      \
+    r.m = a.v_ OP b.v_;                                              \
+    return r;                                                         \
+  }
+#else
+#define MOBULA_VEC_BINARY_OP(OP)                                   \
+  friend MOBULA_DEVICE Vec operator OP(const Vec &a, const Vec &b) { \
+    Vec r;                                                         \
+    for (int k = 0; k < W; ++k) r.v_[k] = a.v_[k] OP b.v_[k];      \
+    return r;                                                      \
+  }
+#define MOBULA_VEC_SHIFT_OP(OP)                                     \
+  friend MOBULA_DEVICE Vec operator OP(const Vec &a, const int s) { \
+    Vec r;                                                          \
+    for (int k = 0; k < W; ++k) r.v_[k] = a.v_[k] OP s;             \
+    return r;                                                       \
+  }
+#define MOBULA_VEC_COMPARE_OP(OP)                                     \
+  friend MOBULA_DEVICE mask_type operator OP(const Vec &a, const Vec &b) { \
+    mask_type r;                                                      \
+    for (int k = 0; k < W; ++k) r.m[k] = a.v_[k] OP b.v_[k] ? -1 : 0; \
+    return r;                                                         \
+  }
+#endif  // MOBULA_SIMD_VECTOR_EXT
+
+#define MOBULA_VEC_UNARY_FUNC(FUNC)                           \
+  friend MOBULA_DEVICE Vec FUNC(const Vec &a) {               \
+    T x[W];                                                   \
+    a.store(x);                                               \
+    for (int k = 0; k < W; ++k) x[k] = simd_detail::FUNC(x[k]); \
+    return load(x);                                           \
+  }
+
+/*!
+ * \brief A packed vector of W elements of type T.
+ *  The arithmetic of Vec maps to the SIMD instructions chosen by the build
+ *  flags. exp, log and pow are evaluated by polynomials of Vec if
+ *  MOBULA_SIMD_MATH, and the other math functions are applied to each lane.
+ *  A scalar is converted to the vector whose lanes are all the scalar.
+ */
+template <typename T, int W = VecSize<T>::value>
+class Vec {
+ public:
+  typedef T value_type;
+  typedef VecMask<T, W> mask_type;
+  static constexpr int kSize = W;
+#if MOBULA_SIMD_VECTOR_EXT
+  typedef T native_type __attribute__((vector_size(W * sizeof(T))));
+#endif
+
+  MOBULA_DEVICE Vec() {}
+  MOBULA_DEVICE Vec(const T val) {  // NOLINT(runtime/explicit)
+#if MOBULA_SIMD_VECTOR_EXT
+    // broadcast, and val - 0 is val for -0 and NaN
+    v_ = val - native_type{};
+#else
+    for (int k = 0; k < W; ++k) v_[k] = val;
+#endif
+  }
+
+  // load `num` elements, and the other lanes are zero
+  static MOBULA_DEVICE Vec load(const T *p, const int num = W) {
+    Vec r;
+    if (num == W) {
+      memcpy(&r.v_, p, sizeof(r.v_));
+    } else {
+      for (int k = 0; k < W; ++k) r.v_[k] = k < num ? p[k] : T(0);
+    }
+    return r;
+  }
+  // load p[0], p[stride], ..., p[(num - 1) * stride]
+  static MOBULA_DEVICE Vec load_strided(const T *p, const int stride,
+                                        const int num = W) {
+    Vec r;
+    for (int k = 0; k < W; ++k) r.v_[k] = k < num ? p[k * stride] : T(0);
+    return r;
+  }
+  // store the first `num` elements
+  MOBULA_DEVICE void store(T *p, const int num = W) const {
+    if (num == W) {
+      memcpy(p, &v_, sizeof(v_));
+    } else {
+      for (int k = 0; k < num; ++k) p[k] = v_[k];
+    }
+  }
+  MOBULA_DEVICE void store_strided(T *p, const int stride,
+                                   const int num = W) const {
+    for (int k = 0; k < num; ++k) p[k * stride] = v_[k];
+  }
+  // load and store the elements of another type, e.g. Vec<float> of float16
+  template <typename U>
+  static MOBULA_DEVICE Vec load(const U *p, const int num = W) {
+    Vec r;
+    for (int k = 0; k < W; ++k) {
+      r.v_[k] = k < num ? static_cast<T>(p[k]) : T(0);
+    }
+    return r;
+  }
+  template <typename U>
+  MOBULA_DEVICE void store(U *p, const int num = W) const {
+    for (int k = 0; k < num; ++k) p[k] = static_cast<U>(v_[k]);
+  }
+
+  MOBULA_DEVICE T operator[](const int k) const { return v_[k]; }
+
+  // convert the value of each lane to U
+  template <typename U>
+  MOBULA_DEVICE Vec<U, W> cast() const {
+    Vec<U, W> r;
+#if MOBULA_SIMD_VECTOR_EXT && (defined(__clang__) || __GNUC__ >= 9)
+    r.v_ = __builtin_convertvector(v_, typename Vec<U, W>::native_type);
+#else
+    for (int k = 0; k < W; ++k) r.v_[k] = static_cast<U>(v_[k]);
+#endif
+    return r;
+  }
+  // reinterpret the bits as a vector of U, sizeof(U) == sizeof(T)
+  template <typename U>
+  MOBULA_DEVICE Vec<U, W> bitcast() const {
+    static_assert(sizeof(U) == sizeof(T), "the sizes of lanes differ");
+    Vec<U, W> r;
+    memcpy(&r.v_, &v_, sizeof(v_));
+    return r;
+  }
+
+  MOBULA_VEC_BINARY_OP(+)
+  MOBULA_VEC_BINARY_OP(-)
+  MOBULA_VEC_BINARY_OP(*)
+  MOBULA_VEC_BINARY_OP(/)
+  // the bitwise operators are only for the integer types
+  MOBULA_VEC_BINARY_OP(&)
+  MOBULA_VEC_BINARY_OP(|)
+  MOBULA_VEC_SHIFT_OP(<<)
+  MOBULA_VEC_SHIFT_OP(>>)
+  MOBULA_VEC_COMPARE_OP(<)
+  MOBULA_VEC_COMPARE_OP(>)
+  MOBULA_VEC_COMPARE_OP(<=)
+  MOBULA_VEC_COMPARE_OP(>=)
+  MOBULA_VEC_COMPARE_OP(==)
+  MOBULA_VEC_COMPARE_OP(!=)
+
+  friend MOBULA_DEVICE Vec operator-(const Vec &a) {
+    Vec r;
+#if MOBULA_SIMD_VECTOR_EXT
+    r.v_ = -a.v_;
+#else
+    for (int k = 0; k < W; ++k) r.v_[k] = -a.v_[k];
+#endif
+    return r;
+  }
+  MOBULA_DEVICE Vec &operator+=(const Vec &b) { return *this = *this + b; }
+  MOBULA_DEVICE Vec &operator-=(const Vec &b) { return *this = *this - b; }
+  MOBULA_DEVICE Vec &operator*=(const Vec &b) { return *this = *this * b; }
+  MOBULA_DEVICE Vec &operator/=(const Vec &b) { return *this = *this / b; }
+
+  // the lanes of `a` where `mask` is selected, otherwise the lanes of `b`
+  friend MOBULA_DEVICE Vec select(const mask_type &mask, const Vec &a,
+                                  const Vec &b) {
+    Vec r;
+#if MOBULA_SIMD_VECTOR_EXT
+    typename mask_type::native_type ia, ib;
+    memcpy(&ia, &a.v_, sizeof(ia));
+    memcpy(&ib, &b.v_, sizeof(ib));
+    ia = (ia & mask.m) | (ib & ~mask.m);
+    memcpy(&r.v_, &ia, sizeof(ia));
+#else
+    for (int k = 0; k < W; ++k) r.v_[k] = mask.m[k] ? a.v_[k] : b.v_[k];
+#endif
+    return r;
+  }
+  friend MOBULA_DEVICE Vec min(const Vec &a, const Vec &b) {
+    return select(a < b, a, b);
+  }
+  friend MOBULA_DEVICE Vec max(const Vec &a, const Vec &b) {
+    return select(a > b, a, b);
+  }
+
+  MOBULA_VEC_UNARY_FUNC(sqrt)
+  friend MOBULA_DEVICE Vec exp(const Vec &a) {
+    return simd_detail::vec_exp(a);
+  }
+  friend MOBULA_DEVICE Vec log(const Vec &a) {
+    return simd_detail::vec_log(a);
+  }
+  friend MOBULA_DEVICE Vec pow(const Vec &a, const Vec &b) {
+    return simd_detail::vec_pow(a, b);
+  }
+
+ private:
+  template <typename, int>
+  friend class Vec;
+  template <typename, int>
+  friend class VecMask;
+#if MOBULA_SIMD_VECTOR_EXT
+  native_type v_;
+#else
+  T v_[W];
+#endif
+};
+
+#undef MOBULA_VEC_BINARY_OP
+#undef MOBULA_VEC_SHIFT_OP
+#undef MOBULA_VEC_COMPARE_OP
+#undef MOBULA_VEC_UNARY_FUNC
+
+namespace simd_detail {
+
+template <typename T>
+struct FloatTraits;
+
+template <>
+struct FloatTraits<float> {
+  typedef uint32_t bits_type;
+  static constexpr int kMantBits = 23;
+  static constexpr int kBias = 127;
+  // 2^n is a normal number for the n of these inputs
+  static constexpr float kExpMin = -87.0f;
+  static constexpr float kExpMax = 88.0f;
+  // ln(2) = kLn2Hi + kLn2Lo, and n * kLn2Hi is exact
+  static constexpr float kLn2Hi = 0.693359375f;
+  static constexpr float kLn2Lo = -2.12194440e-4f;
+  // the degrees of the polynomials, and the lower degrees of fast math
+  static constexpr int kExpTerms = 7;
+  static constexpr int kLogTerms = 5;
+  static constexpr int kFastExpTerms = 5;
+  static constexpr int kFastLogTerms = 2;
+};
+
+template <>
+struct FloatTraits<double> {
+  typedef uint64_t bits_type;
+  static constexpr int kMantBits = 52;
+  static constexpr int kBias = 1023;
+  static constexpr double kExpMin = -708.0;
+  static constexpr double kExpMax = 709.0;
+  static constexpr double kLn2Hi = 6.93145751953125e-1;
+  static constexpr double kLn2Lo = 1.42860682030941723212e-6;
+  static constexpr int kExpTerms = 13;
+  static constexpr int kLogTerms = 10;
+  static constexpr int kFastExpTerms = 10;
+  static constexpr int kFastLogTerms = 6;
+};
+
+// whether exp_poly is valid for all lanes, false for NaN
+template <typename T, int W>
+MOBULA_DEVICE bool exp_in_range(const Vec<T, W> &x) {
+  typedef FloatTraits<T> F;
+  return ((x >= Vec<T, W>(F::kExpMin)) & (x <= Vec<T, W>(F::kExpMax))).all();
+}
+
+// whether log_poly is valid for all lanes, i.e. positive normal numbers
+template <typename T, int W>
+MOBULA_DEVICE bool log_in_range(const Vec<T, W> &x) {
+  return ((x >= Vec<T, W>(std::numeric_limits<T>::min())) &
+          (x <= Vec<T, W>(std::numeric_limits<T>::max())))
+      .all();
+}
+
+// apply the scalar function FUNC to each lane
+#define MOBULA_VEC_LANEWISE(FUNC, x)                 \
+  do {                                               \
+    T xs[W];                                         \
+    (x).store(xs);                                   \
+    for (int k = 0; k < W; ++k) xs[k] = FUNC(xs[k]); \
+    return Vec<T, W>::load(xs);                      \
+  } while (0)
+
+/*!
+ * \brief exp(x) = 2^n * exp(r), |r| <= ln(2) / 2.
+ *  exp(r) is the Taylor polynomial of degree kTerms. exp_in_range(x) should
+ *  be true.
+ */
+template <int kTerms, typename T, int W>
+MOBULA_DEVICE Vec<T, W> exp_poly(const Vec<T, W> &x) {
+  typedef FloatTraits<T> F;
+  typedef typename F::bits_type I;
+  typedef Vec<T, W> V;
+  // n = floor(x / ln(2) + 0.5)
+  // the conversions between T and int32_t are native on x86 and ARM
+  const V v = x * V(T(1.44269504088896341)) + V(T(0.5));
+  Vec<int32_t, W> ni = v.template cast<int32_t>();
+  V n = ni.template cast<T>();
+  const typename V::mask_type gt = n > v;
+  n = select(gt, n - V(1), n);
+  ni = ni + gt.template cast<int32_t>();
+  const V r = x - n * V(F::kLn2Hi) - n * V(F::kLn2Lo);
+  // the Horner's scheme of sum(r^i / i!)
+  T c = 1;
+  for (int i = 2; i <= kTerms; ++i) c /= T(i);
+  V p(c);
+  for (int i = kTerms; i > 0; --i) {
+    c *= T(i);
+    p = p * r + V(c);
+  }
+  const Vec<I, W> scale = (ni + Vec<int32_t, W>(F::kBias)).template cast<I>()
+                          << F::kMantBits;
+  return p * scale.template bitcast<T>();
+}
+
+/*!
+ * \brief log(x) = e * ln(2) + log(m), sqrt(0.5) <= m < sqrt(2).
+ *  log(m) = 2 atanh(s) = 2 (s + s^3 / 3 + ... + s^(2 kTerms + 1) / (2 kTerms
+ *  + 1)), s = (m - 1) / (m + 1). log_in_range(x) should be true.
+ */
+template <int kTerms, typename T, int W>
+MOBULA_DEVICE Vec<T, W> log_poly(const Vec<T, W> &x) {
+  typedef FloatTraits<T> F;
+  typedef typename F::bits_type I;
+  typedef Vec<T, W> V;
+  typedef Vec<I, W> VI;
+  // x = m * 2^e, 0.5 <= m < 1
+  const VI bits = x.template bitcast<I>();
+  // e + 2^kMantBits + kBias - 1 is exact in the mantissa of 2^kMantBits
+  const I two_mant_bits = I(F::kBias + F::kMantBits) << F::kMantBits;
+  V e = ((bits >> F::kMantBits) | VI(two_mant_bits)).template bitcast<T>() -
+        V(T(I(1) << F::kMantBits) + T(F::kBias - 1));
+  V m = ((bits & VI((I(1) << F::kMantBits) - 1)) |
+         VI(I(F::kBias - 1) << F::kMantBits))
+            .template bitcast<T>();
+  const typename V::mask_type small = m < V(T(0.707106781186547524));
+  m = select(small, m + m, m);
+  e = select(small, e - V(1), e);
+  const V s = (m - V(1)) / (m + V(1));
+  const V s2 = s * s;
+  V p(T(1) / T(2 * kTerms + 1));
+  for (int i = kTerms - 1; i >= 0; --i) {
+    p = p * s2 + V(T(1) / T(2 * i + 1));
+  }
+  return e * V(F::kLn2Hi) + (V(2) * s * p + e * V(F::kLn2Lo));
+}
+
+// the vector falls back to the scalar function if a lane is out of the range
+template <typename T, int W>
+MOBULA_DEVICE Vec<T, W> vec_exp(const Vec<T, W> &x) {
+  if (!MOBULA_SIMD_MATH || W == 1 || !exp_in_range(x)) {
+    MOBULA_VEC_LANEWISE(exp, x);
+  }
+  return exp_poly<FloatTraits<T>::kExpTerms>(x);
+}
+
+template <typename T, int W>
+MOBULA_DEVICE Vec<T, W> vec_log(const Vec<T, W> &x) {
+  if (!MOBULA_SIMD_MATH || W == 1 || !log_in_range(x)) {
+    MOBULA_VEC_LANEWISE(log, x);
+  }
+  return log_poly<FloatTraits<T>::kLogTerms>(x);
+}
+
+/*!
+ * \brief pow(x, y) = exp(y log(x)) if all lanes of x are positive,
+ *  otherwise the scalar function.
+ */
+template <typename T, int W>
+MOBULA_DEVICE Vec<T, W> vec_pow(const Vec<T, W> &x, const Vec<T, W> &y) {
+  if (MOBULA_SIMD_MATH && W > 1 && (x > Vec<T, W>(0)).all()) {
+    return vec_exp(y * vec_log(x));
+  }
+  T xs[W], ys[W];
+  x.store(xs);
+  y.store(ys);
+  for (int k = 0; k < W; ++k) xs[k] = pow(xs[k], ys[k]);
+  return Vec<T, W>::load(xs);
+}
+
+}  // namespace simd_detail
+
+/*!
+ * \brief select for scalars, so that the code is generic over T and Vec<T>.
+ */
+template <typename T>
+MOBULA_DEVICE inline T select(const bool mask, const T &a, const T &b) {
+  return mask ? a : b;
+}
+
+/*!
+ * \brief parfor over the vectors of W elements.
+ *  F(i, num) processes the elements [i, i + num), where num is W except for
+ *  the tail, e.g.
+ *    typedef Vec<T> V;
+ *    parfor_vec<V::kSize>(n, [&](int i, int num) {
+ *      (V::load(a + i, num) + V::load(b + i, num)).store(c + i, num);
+ *    });
+ */
+template <int W, typename Func>
+MOBULA_DEVICE void parfor_vec(const size_t n, Func F) {
+  parfor((n + W - 1) / W, [&](const size_t j) {
+    const size_t i = j * W;
+    F(i, static_cast<int>(n - i < size_t(W) ? n - i : size_t(W)));
+  });
+}
+
+// parfor_vec scheduled by `schedule`, see ParforSchedule
+template <int W, typename Func>
+MOBULA_DEVICE void parfor_vec(const size_t n, const ParforSchedule &schedule,
+                              Func F) {
+  parfor((n + W - 1) / W, schedule, [&](const size_t j) {
+    const size_t i = j * W;
+    F(i, static_cast<int>(n - i < size_t(W) ? n - i : size_t(W)));
+  });
+}
+
+/*!
+ * \brief The number of elements of type T in a vectorized access of
+ *  `load_vec` and `store_vec`. It is 128 bits on GPU, e.g. float4 of float
+ *  and 8 halves of float16, and a SIMD register of AccType<T>::type on CPU.
+ */
+template <typename T>
+struct VecAccessSize {
+#if USING_CUDA || USING_HIP
+  static constexpr int value = sizeof(T) <= 16 ? 16 / sizeof(T) : 1;
+#else
+  static constexpr int value = VecSize<typename AccType<T>::type>::value;
+#endif
+};
+
+namespace simd_detail {
+
+// N elements of T, aligned to their bytes for a single access on GPU
+template <typename T, int N>
+struct alignas(sizeof(T) * N) AlignedArray {
+  T data[N];
+};
+
+}  // namespace simd_detail
+
+/*!
+ * \brief Load `num` elements of `p` into a vector of AccType<T>::type, and
+ *  the other lanes are zero. When num is N on GPU, the elements are loaded by
+ *  one access, and `p` should be aligned to N * sizeof(T) bytes, see
+ *  `parfor_vec_aligned`.
+ */
+template <int N, typename T>
+MOBULA_DEVICE inline Vec<typename AccType<T>::type, N> load_vec(
+    const T *p, const int num = N) {
+  typedef Vec<typename AccType<T>::type, N> V;
+#if USING_CUDA || USING_HIP
+  if (num == N) {
+    const simd_detail::AlignedArray<T, N> a =
+        *reinterpret_cast<const simd_detail::AlignedArray<T, N> *>(p);
+    return V::load(a.data);
+  }
+#endif
+  return V::load(p, num);
+}
+
+/*!
+ * \brief Load the elements [index, index + num) of a view like `load_vec`.
+ *  They are gathered one by one when the view is non-contiguous.
+ */
+template <int N, typename T, int D,
+          typename E = typename std::remove_const<T>::type>
+MOBULA_DEVICE inline Vec<typename AccType<E>::type, N> load_vec(
+    const StridedView<T, D> &view, const int index, const int num = N) {
+  if (view.is_contiguous) return load_vec<N>(view.data + index, num);
+  E buf[N];
+  for (int k = 0; k < num; ++k) buf[k] = view[index + k];
+  return Vec<typename AccType<E>::type, N>::load(buf, num);
+}
+
+/*! \brief Store the first `num` elements of `v` like `load_vec`. */
+template <int N, typename T, typename A>
+MOBULA_DEVICE inline void store_vec(T *p, const Vec<A, N> &v,
+                                    const int num = N) {
+#if USING_CUDA || USING_HIP
+  if (num == N) {
+    simd_detail::AlignedArray<T, N> a;
+    v.store(a.data);
+    *reinterpret_cast<simd_detail::AlignedArray<T, N> *>(p) = a;
+    return;
+  }
+#endif
+  v.store(p, num);
+}
+
+// whether each pointer is aligned to N of its elements
+template <int N>
+MOBULA_DEVICE inline bool is_aligned() {
+  return true;
+}
+
+template <int N, typename T, typename... Ts>
+MOBULA_DEVICE inline bool is_aligned(const T *p, const Ts *... ps) {
+  return reinterpret_cast<uintptr_t>(p) % (N * sizeof(T)) == 0 &&
+         is_aligned<N>(ps...);
+}
+
+/*!
+ * \brief parfor_vec for the elementwise kernels, whose vector width depends on
+ *  the alignment of the arrays.
+ *  `F.template apply<N>(i, num)` processes the elements [i, i + num) by
+ *  `load_vec<N>` and `store_vec`, so that the variants of all widths come from
+ *  one body, e.g.
+ *    struct AddOp {
+ *      const T *a, *b;
+ *      T *c;
+ *      template <int N>
+ *      MOBULA_DEVICE void apply(const int i, const int num) const {
+ *        store_vec(c + i, load_vec<N>(a + i, num) + load_vec<N>(b + i, num),
+ *                  num);
+ *      }
+ *    };
+ *    parfor_vec_aligned<VecAccessSize<T>::value>(n, AddOp{a, b, c}, a, b, c);
+ *  On GPU, the vectors have W elements when each of `ptrs` is aligned to W
+ *  of its elements, otherwise one element. The pointers are the same for
+ *  all threads of a launch, so the threads take the same variant. On CPU, the
+ *  unaligned vectors are loaded as fast, and the vectors have W elements.
+ */
+template <int W, typename Func, typename... Ts>
+MOBULA_DEVICE void parfor_vec_aligned(const size_t n, const Func &F,
+                                      const Ts *... ptrs) {
+#if USING_CUDA || USING_HIP
+  if (!is_aligned<W>(ptrs...)) {
+    parfor_vec<1>(n, [&](const int i, const int num) {
+      F.template apply<1>(i, num);
+    });
+    return;
+  }
+#else
+  UNUSED(ptrs...);
+#endif
+  parfor_vec<W>(n, [&](const int i, const int num) {
+    F.template apply<W>(i, num);
+  });
+}
+
+}  // namespace mobula
+
+#endif  // MOBULA_INCLUDE_SIMD_H_
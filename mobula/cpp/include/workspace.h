@@ -0,0 +1,97 @@
+#ifndef MOBULA_INCLUDE_WORKSPACE_H_
+#define MOBULA_INCLUDE_WORKSPACE_H_
+
+#include "defines.h"
+
+/*!
+ * \brief Declare a workspace parameter of a kernel, e.g.
+ *  MOBULA_KERNEL foo_kernel(const int n, const T *x,
+ *                           MOBULA_WORKSPACE(T, tmp, n + 1), T *y)
+ *  The caller in Python doesn't pass the workspace. The generated wrapper
+ *  allocates `size` elements of `type` and passes them as `type *name`.
+ *  `size` is an expression of the other parameters without parentheses.
+ */
+#define MOBULA_WORKSPACE(type, name, size) type *name
+
+/*!
+ * \brief Declare a counter parameter of a kernel, e.g. the counter of
+ *  grid_reduce. The generated wrapper passes an `unsigned int *name`, which
+ *  is 0 at the launch, and the kernel should leave it 0, so that it is reused
+ *  by the next kernel without a memset. A kernel has at most
+ *  kMaxKernelCounters counters, and it is nullptr on CPU.
+ */
+#define MOBULA_COUNTER(name) unsigned int *name
+
+namespace mobula {
+
+/*!
+ * \brief The temporary memory of kernel calls.
+ *  The memory is taken from the memory pool of `new_array`, and returned when
+ *  the workspace is destroyed. It is reused only by the kernels on `stream`,
+ *  which is the stream of KERNEL_RUN by default, so it is safe to destroy the
+ *  workspace before these kernels finish.
+ *  While capturing a graph, the memory is kept until the graph is destroyed.
+ *  The memory is uninitialized.
+ */
+template <typename T>
+class Workspace {
+ public:
+  explicit Workspace(const size_t size, void *stream = nullptr)
+      : data_(size > 0 ? new_array<T>(size, stream) : nullptr) {}
+  ~Workspace() {
+    if (data_ == nullptr) return;
+#if USING_CUDA || USING_HIP
+    // the graph being captured replays its kernels on the memory
+    GraphCapture *capture = get_graph_capture();
+    if (capture->stream != nullptr) {
+      capture->arrays.push_back(data_);
+      return;
+    }
+#endif  // USING_CUDA || USING_HIP
+    del_array(data_);
+  }
+  Workspace(const Workspace &) = delete;
+  Workspace &operator=(const Workspace &) = delete;
+
+  T *data() const { return data_; }
+
+ private:
+  T *data_;
+};
+
+/*!
+ * \brief The `index`-th counter of MOBULA_COUNTER in a kernel.
+ *  On GPU, it is one of get_kernel_counters(get_launch_stream()). While
+ *  capturing a graph, the counter is zero-filled in the graph and kept until
+ *  the graph is destroyed, since the replays may run on another stream.
+ */
+class KernelCounter {
+ public:
+  explicit KernelCounter(const int index) : data_(nullptr) {
+#if USING_CUDA || USING_HIP
+    CHECK_LT(index, kMaxKernelCounters);
+    GraphCapture *capture = get_graph_capture();
+    if (capture->stream != nullptr) {
+      data_ = new_array<unsigned int>(1);
+      CHECK_HIP(hipMemsetAsync(data_, 0, sizeof(unsigned int),
+                               static_cast<hipStream_t>(capture->stream)));
+      capture->arrays.push_back(data_);
+    } else {
+      data_ = get_kernel_counters(get_launch_stream()) + index;
+    }
+#else
+    static_cast<void>(index);
+#endif  // USING_CUDA || USING_HIP
+  }
+  KernelCounter(const KernelCounter &) = delete;
+  KernelCounter &operator=(const KernelCounter &) = delete;
+
+  unsigned int *data() const { return data_; }
+
+ private:
+  unsigned int *data_;
+};
+
+}  // namespace mobula
+
+#endif  // MOBULA_INCLUDE_WORKSPACE_H_
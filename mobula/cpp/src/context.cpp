@@ -1,10 +1,149 @@
 #include "context/context.h"
 
+#include <map>
+#include <mutex>
 #include <stdexcept>
+#include <utility>
+#include <vector>
 
 #include "logging.h"
 
-namespace mobula {}
+namespace mobula {
+
+// The state of the runtime is defined here rather than in the headers, so
+// that the libraries of the functions linked against the runtime library of
+// a context share it.
+
+Profiler *get_profiler() {
+  static Profiler *profiler = new Profiler();
+  return profiler;
+}
+
+const char *&current_kernel_name() {
+  static thread_local const char *name = nullptr;
+  return name;
+}
+
+#if USING_HIP || USING_CUDA
+GraphCapture *get_graph_capture() {
+  static GraphCapture *capture = new GraphCapture();
+  return capture;
+}
+
+void *&current_stream() {
+  static thread_local void *stream = nullptr;
+  return stream;
+}
+
+void *get_device_stream() {
+  // the streams are never destroyed, like the memory pool
+  static std::mutex *mutex = new std::mutex();
+  static std::vector<hipStream_t> *streams = new std::vector<hipStream_t>();
+  int device_id;
+  CHECK_HIP(hipGetDevice(&device_id));
+  std::lock_guard<std::mutex> lock(*mutex);
+  if (device_id >= static_cast<int>(streams->size())) {
+    streams->resize(device_id + 1, nullptr);
+  }
+  hipStream_t &stream = (*streams)[device_id];
+  if (stream == nullptr) {
+    CHECK_HIP(hipStreamCreateWithFlags(&stream, hipStreamNonBlocking));
+  }
+  return stream;
+}
+
+unsigned int *get_kernel_counters(void *stream) {
+  static std::mutex *mutex = new std::mutex();
+  static std::map<std::pair<int, void *>, unsigned int *> *counters =
+      new std::map<std::pair<int, void *>, unsigned int *>();
+  int device_id;
+  CHECK_HIP(hipGetDevice(&device_id));
+  std::lock_guard<std::mutex> lock(*mutex);
+  unsigned int *&data = (*counters)[std::make_pair(device_id, stream)];
+  if (data == nullptr) {
+    const size_t size = sizeof(unsigned int) * kMaxKernelCounters;
+    CHECK_HIP(hipMalloc(reinterpret_cast<void **>(&data), size));
+    // the kernels on `stream` run after the memset
+    CHECK_HIP(hipMemsetAsync(data, 0, size, static_cast<hipStream_t>(stream)));
+  }
+  return data;
+}
+
+int &thread_block_size_override() {
+  static thread_local int block_size = 0;
+  return block_size;
+}
+
+MemoryPool *get_memory_pool() {
+  static MemoryPool *pool = new MemoryPool(device_malloc, device_free);
+  return pool;
+}
+#else
+HostThreadConfig *get_host_thread_config() {
+  static HostThreadConfig *config = new HostThreadConfig();
+  return config;
+}
+
+int &thread_num_threads_override() {
+  static thread_local int num_threads = 0;
+  return num_threads;
+}
+
+MemoryPool *get_memory_pool() {
+  static MemoryPool *pool = new MemoryPool(host_malloc, host_free);
+  return pool;
+}
+
+#if !USING_OPENMP && HOST_NUM_THREADS > 1
+ThreadPool *get_thread_pool() {
+  // The pool is never destructed, since the workers may be stopped before
+  // the destruction of static objects at exit.
+  static ThreadPool *pool = new ThreadPool(HOST_NUM_THREADS - 1);
+#ifndef _WIN32
+  // the workers are not copied into the child process after fork
+  if (pool->pid() != getpid()) pool = new ThreadPool(HOST_NUM_THREADS - 1);
+#endif
+  return pool;
+}
+#endif  // !USING_OPENMP && HOST_NUM_THREADS > 1
+
+void apply_thread_affinity(const int policy, const int thread_id) {
+  // -1 for a thread which hasn't applied a policy yet
+  static thread_local int applied_policy = -1;
+  static thread_local int applied_thread_id = -1;
+  if (policy == applied_policy &&
+      (policy == kAffinityNone || thread_id == applied_thread_id)) {
+    return;
+  }
+  const bool was_pinned = applied_policy > kAffinityNone;
+  applied_policy = policy;
+  applied_thread_id = thread_id;
+#ifdef __linux__
+  if (policy == kAffinityNone) {
+    // the threads started by a pinned thread inherit its CPU
+    if (was_pinned || affinity_detail::any_thread_pinned().load()) {
+      cpu_set_t cpus = affinity_detail::get_unpinned_cpus();
+      sched_setaffinity(0, sizeof(cpu_set_t), &cpus);
+    }
+    return;
+  }
+  const int cpu = get_affinity_cpu(policy, thread_id);
+  if (cpu < 0) return;
+  // read the unpinned CPUs before pinning the first thread
+  affinity_detail::get_unpinned_cpus();
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &cpus) == 0) {
+    affinity_detail::any_thread_pinned().store(true);
+  }
+#else
+  (void)was_pinned;
+#endif  // __linux__
+}
+#endif  // USING_HIP || USING_CUDA
+
+}  // namespace mobula
 
 #if USING_HIP || USING_CUDA
 void set_device(const int device_id) {
@@ -14,8 +153,118 @@ void set_device(const int device_id) {
     CHECK_HIP(hipSetDevice(device_id));
   }
 }
+
+void synchronize(const int device_id) {
+  int current_device;
+  CHECK_HIP(hipGetDevice(&current_device));
+  int first = device_id, last = device_id;
+  if (device_id < 0) {
+    int num_devices;
+    CHECK_HIP(hipGetDeviceCount(&num_devices));
+    first = 0;
+    last = num_devices - 1;
+  }
+  for (int i = first; i <= last; ++i) {
+    CHECK_HIP(hipSetDevice(i));
+    CHECK_HIP(hipDeviceSynchronize());
+  }
+  CHECK_HIP(hipSetDevice(current_device));
+}
+
+void *graph_begin_capture(const int device_id) {
+  set_device(device_id);
+  // a blocking stream can't be captured since it waits for the default stream
+  hipStream_t stream;
+  CHECK_HIP(hipStreamCreateWithFlags(&stream, hipStreamNonBlocking));
+  // the memory pool may allocate memory during capturing
+  CHECK_HIP(hipStreamBeginCapture(stream, hipStreamCaptureModeRelaxed));
+  return stream;
+}
+
+void *graph_end_capture(void *stream) {
+  hipStream_t strm = static_cast<hipStream_t>(stream);
+  hipGraph_t graph;
+  CHECK_HIP(hipStreamEndCapture(strm, &graph));
+  CHECK_HIP(hipStreamDestroy(strm));
+  hipGraphExec_t exec;
+  CHECK_HIP(hipGraphInstantiateWithFlags(&exec, graph, 0));
+  CHECK_HIP(hipGraphDestroy(graph));
+  return exec;
+}
+
+void graph_launch(void *exec, const int device_id) {
+  set_device(device_id);
+  // the graph is ordered with the other kernels on the stream of KERNEL_RUN
+  hipStream_t stream = static_cast<hipStream_t>(mobula::get_launch_stream());
+  CHECK_HIP(hipGraphLaunch(static_cast<hipGraphExec_t>(exec), stream));
+#if !USING_ASYNC_KERNEL_LAUNCH
+  CHECK_HIP(hipStreamSynchronize(stream));
+#endif
+}
+
+void graph_destroy(void *exec) {
+  CHECK_HIP(hipGraphExecDestroy(static_cast<hipGraphExec_t>(exec)));
+}
+
+void graph_set_capture_stream(void *stream) {
+  mobula::get_graph_capture()->stream = stream;
+}
+
+void *graph_take_arrays() {
+  auto *arrays = new std::vector<void *>();
+  arrays->swap(mobula::get_graph_capture()->arrays);
+  return arrays;
+}
+
+void graph_free_arrays(void *arrays) {
+  auto *p = static_cast<std::vector<void *> *>(arrays);
+  for (void *array : *p) mobula::del_array(array);
+  delete p;
+}
+
+void set_current_stream(void *stream) { mobula::current_stream() = stream; }
+
+void set_thread_block_size(const int block_size) {
+  mobula::thread_block_size_override() = block_size;
+}
 #else
 void set_device(const int /*device_id*/) {
   LOG(FATAL) << "Doesn't support setting device on CPU mode";
 }
+
+// kernels on CPU are finished when KERNEL_RUN returns
+void synchronize(const int /*device_id*/) {}
+
+void cpu_set_num_threads(const int num_threads) {
+  mobula::get_host_thread_config()->num_threads.store(
+      num_threads, std::memory_order_relaxed);
+}
+
+void cpu_set_inline_grain(const int grain) {
+  mobula::get_host_thread_config()->inline_grain.store(
+      grain, std::memory_order_relaxed);
+}
+
+void cpu_set_thread_num_threads(const int num_threads) {
+  mobula::thread_num_threads_override() = num_threads;
+}
+
+void cpu_set_thread_affinity(const int affinity) {
+  mobula::get_host_thread_config()->affinity.store(affinity,
+                                                   std::memory_order_relaxed);
+}
 #endif  // USING_HIP || USING_CUDA
+
+void memory_pool_stats(mobula::MemoryPoolStats *stats) {
+  *stats = mobula::get_memory_pool()->Stats();
+}
+
+void memory_pool_trim() { mobula::get_memory_pool()->Trim(); }
+
+void profiler_set_enabled(const int enabled) {
+  mobula::get_profiler()->SetEnabled(enabled != 0);
+}
+
+int profiler_take_events(mobula::ProfilerEvent *events, const int max_events) {
+  return mobula::get_profiler()->Take(events, max_events);
+}
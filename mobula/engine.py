@@ -0,0 +1,171 @@
+"""The asynchronous engine of the calls on CPU.
+
+Example:
+    mobula.config.USING_ASYNC_CPU = True
+    future = mobula.func.foo(n, x, out)  # returns at once
+    batch = load_next_batch()  # overlaps with the kernel
+    mobula.func.wait(out)  # or future.wait() before reading `out`
+    mobula.func.wait(x, for_write=True)  # before writing `x` in Python
+    x[:] = batch
+
+The calls are executed in order on a worker thread, so a call sees the results
+of the calls before it. ctypes releases the GIL while the kernel runs on the
+threads of KERNEL_RUN, which lets the Python thread continue. Each call records
+the buffers which it reads and writes by the constness of the parameters. A
+buffer is the range of bytes [begin, end) which a tensor spans, so `wait` only
+waits for the calls whose buffers overlap the ones waited for, including the
+calls on other views of the same memory. `wait_all` waits for all calls.
+
+The custom operators run their calls at once in `mobula.func.run_sync`, since
+they read and write their outputs in Python.
+
+The functions on GPU and the functions of MXNet, which has its own engine, are
+not affected.
+"""
+__all__ = ['Future', 'Engine', 'get_cpu_engine']
+
+import atexit
+import collections
+import threading
+try:
+    import queue
+except ImportError:
+    import Queue as queue
+
+
+def _overlap(ranges, buffers):
+    """Whether a range of `ranges` overlaps a range of `buffers`."""
+    for begin, end in ranges:
+        for buf_begin, buf_end in buffers:
+            if begin < buf_end and buf_begin < end:
+                return True
+    return False
+
+
+class Future:
+    """The result of a call pushed into the engine."""
+
+    def __init__(self):
+        self._event = threading.Event()
+        self._result = None
+        self._error = None
+
+    def done(self):
+        return self._event.is_set()
+
+    def wait(self):
+        """Wait for the call, and raise its error if it failed."""
+        self._event.wait()
+        if self._error is not None:
+            raise self._error
+
+    def result(self):
+        """Wait for the call, and return its return value."""
+        self.wait()
+        return self._result
+
+    def _set(self, result, error):
+        self._result = result
+        self._error = error
+        self._event.set()
+
+
+class Engine:
+    """A queue of calls executed in order on a worker thread, which is started
+    by the first call."""
+
+    def __init__(self):
+        self._queue = queue.Queue()
+        self._lock = threading.Lock()
+        # the pending calls in order, (future, reads, writes)
+        self._pending = collections.deque()
+        # the last pushed call
+        self._last = None
+        # the first error which hasn't been raised by `wait_all`
+        self._error = None
+        self._worker = None
+
+    def push(self, func, reads, writes):
+        """Push the call `func()` which reads the buffers `reads` and writes
+        the buffers `writes`, which are lists of the ranges (begin, end).
+
+        Returns
+        -------
+        Future
+        """
+        future = Future()
+        with self._lock:
+            self._pending.append((future, reads, writes))
+            self._last = future
+            # the order of the queue is the order of the pending calls
+            self._queue.put((func, future))
+            if self._worker is None:
+                self._worker = threading.Thread(target=self._run)
+                self._worker.daemon = True
+                self._worker.start()
+        return future
+
+    def busy(self):
+        last = self._last
+        return last is not None and not last.done()
+
+    def wait(self, buffers, for_write=False):
+        """Wait for the pending calls which write the buffers, and the ones
+        which read them as well if `for_write` is True."""
+        with self._lock:
+            futures = [future for future, reads, writes in self._pending
+                       if _overlap(writes, buffers) or
+                       (for_write and _overlap(reads, buffers))]
+        for future in futures:
+            future.wait()
+
+    def wait_all(self):
+        """Wait for all pushed calls, and raise the first error of them which
+        hasn't been raised."""
+        last = self._last
+        if last is not None:
+            last._event.wait()
+        with self._lock:
+            error, self._error = self._error, None
+        if error is not None:
+            raise error
+
+    def _run(self):
+        while True:
+            func, future = self._queue.get()
+            result, error = None, None
+            try:
+                result = func()
+            except Exception as e:
+                error = e
+            future._set(result, error)
+            with self._lock:
+                if error is not None and self._error is None:
+                    self._error = error
+                # the calls are finished in order
+                self._pending.popleft()
+
+
+_cpu_engine = None
+_cpu_engine_lock = threading.Lock()
+
+
+def get_cpu_engine(create=True):
+    """Get the engine of the calls on CPU, or None if it isn't created and
+    `create` is False."""
+    global _cpu_engine
+    if _cpu_engine is None and create:
+        with _cpu_engine_lock:
+            if _cpu_engine is None:
+                _cpu_engine = Engine()
+    return _cpu_engine
+
+
+def _wait_at_exit():
+    # the pending calls are finished before the interpreter exits
+    last = None if _cpu_engine is None else _cpu_engine._last
+    if last is not None:
+        last._event.wait()
+
+
+atexit.register(_wait_at_exit)
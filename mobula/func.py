@@ -1,13 +1,21 @@
 """A `Module` implement the `MobulaFunc` class."""
-__all__ = ['MobulaFunc', 'bind']
+__all__ = ['MobulaFunc', 'bind', 'synchronize', 'wait', 'run_sync']
 
 
+import contextlib
 import ctypes
 import hashlib
+import multiprocessing
+import numbers
+import threading
+import time
 import warnings
 from . import glue
-from .internal.dtype import DType, CStruct, TemplateType, UnknownCType
+from .internal.dtype import DType, CStruct, ConstValue, TemplateType, \
+    UnknownCType, get_ctype
 from .building.build_utils import config
+from .config import set_runtime_hook
+from .engine import get_cpu_engine
 
 
 def get_func_idcode(func_name, arg_types):
@@ -24,7 +32,8 @@ def get_func_idcode(func_name, arg_types):
     idcode: str
         IDCode
     """
-    arg_types_str = ','.join([e.cname for e in arg_types])
+    arg_types_str = ','.join([getattr(e, 'idname', e.cname)
+                              for e in arg_types])
     idcode = '{func_name}:{arg_types_str}'.format(
         func_name=func_name,
         arg_types_str=arg_types_str)
@@ -50,22 +59,6 @@ def get_idcode_hash(idcode):
     return '{}_{}'.format(func_name, md5.hexdigest()[:8])
 
 
-class CFuncTensor:
-    def __init__(self, var, ptype, glue_mod):
-        self.var = var
-        self.ptype = ptype
-        self.glue_mod = glue_mod
-
-    @property
-    def is_const(self):
-        return self.ptype.is_const
-
-
-class CStructArg:
-    def __init__(self, var):
-        self.var = var
-
-
 def _wait_to_read(var):
     if hasattr(var, 'wait_to_read'):
         var.wait_to_read()
@@ -76,47 +69,11 @@ def _wait_to_write(var):
         var.wait_to_write()
 
 
-def _get_raw_pointer(arg, const_vars, mutable_vars):
-    if isinstance(arg, CFuncTensor):
-        p = arg.glue_mod.Tensor(arg.var).data_ptr
-        if isinstance(p, (list, tuple)):
-            p, v = p
-            if arg.is_const:
-                const_vars.append(v)
-            else:
-                mutable_vars.append((arg.var, v))
-        return p
-    if isinstance(arg, CStructArg):
-        const_vars.append(arg.var)
-        return ctypes.byref(const_vars[-1])
-    return arg
-
-
-def _get_async_pointer(arg):
-    if isinstance(arg, CFuncTensor):
-        return arg.glue_mod.Tensor(arg.var).async_data_ptr
-    return arg
-
-
-def _get_raw_pointers(args, const_vars, mutable_vars):
-    return [_get_raw_pointer(a, const_vars, mutable_vars) for a in args]
-
-
-def _get_async_pointers(args):
-    return list(map(_get_async_pointer, args))
-
-
-def _arg_wait_to_rw(arg):
-    if isinstance(arg, CFuncTensor):
-        if arg.is_const:
-            _wait_to_read(arg)
-        else:
-            _wait_to_write(arg)
-
-
-def _args_wait_to_rw(args):
-    for arg in args:
-        _arg_wait_to_rw(arg)
+def _get_cstruct(constructor, var):
+    try:
+        return constructor(var)
+    except TypeError:
+        return constructor(*var)
 
 
 class CFuncDef:
@@ -125,44 +82,537 @@ class CFuncDef:
     FUNC = 2
 
     def __init__(self, func_name, func_kind, arg_names=None, arg_types=None, rtn_type=None,
-                 template_list=None, loader=None, loader_kwargs=None):
+                 template_list=None, workspace=None, views=None, consts=None,
+                 const_template_list=None, loader=None, loader_kwargs=None):
         self.func_name = func_name
         self.func_kind = func_kind
         self.arg_names = arg_names or list()
         self.arg_types = arg_types
         self.rtn_type = rtn_type
         self.template_list = template_list or list()
+        # variable name -> the size expression of the workspace
+        self.workspace = workspace or dict()
+        # variable name -> the number of dimensions of MOBULA_VIEW
+        self.views = views or dict()
+        # variable name -> the template value of MOBULA_CONSTEXPR
+        self.consts = consts or dict()
+        # the template values of MOBULA_CONSTEXPR in the declaration order
+        self.const_template_list = const_template_list or list()
         self.loader = loader
         self.loader_kwargs = loader_kwargs
 
-    def __call__(self, arg_datas, arg_types, dev_id, glue_mod=None, using_async=False):
-        if dev_id is None:
-            ctx = 'cpu'
-            dev_id = -1
+
+# the graph which the calls on this thread are captured into, see mobula/graph.py
+_capturing = threading.local()
+
+
+def get_capturing_graph():
+    return getattr(_capturing, 'graph', None)
+
+
+# the Profile of mobula/profiler.py, or None when the profiler is stopped
+_profiler = None
+
+
+def get_profiler():
+    return _profiler
+
+
+def set_profiler(prof):
+    """Set the Profile which records the calls, and enable the profilers of
+    the loaded libraries if it is not None."""
+    global _profiler
+    _profiler = prof
+    for dlls in _loaded_dlls.values():
+        for dll in dlls:
+            _set_dll_profiler(dll)
+
+
+def _set_dll_profiler(dll):
+    set_enabled = getattr(dll, 'profiler_set_enabled', None)
+    if set_enabled is not None:
+        set_enabled.argtypes = [ctypes.c_int]
+        set_enabled(int(_profiler is not None))
+
+
+# the values of mobula::ThreadAffinity
+_THREAD_AFFINITIES = {'': 0, 'compact': 1, 'scatter': 2}
+
+
+def _get_thread_affinity(value):
+    assert value in _THREAD_AFFINITIES, ValueError(
+        'Unknown THREAD_AFFINITY: {}'.format(value))
+    return _THREAD_AFFINITIES[value]
+
+
+# config name -> (the function which applies it to a library on CPU,
+#                 the conversion of the value)
+_CPU_THREAD_CONFIGS = dict(
+    NUM_THREADS=('cpu_set_num_threads', int),
+    INLINE_GRAIN=('cpu_set_inline_grain', int),
+    THREAD_AFFINITY=('cpu_set_thread_affinity', _get_thread_affinity),
+)
+
+
+def _set_dll_thread_config(dll, name):
+    func_name, convert = _CPU_THREAD_CONFIGS[name]
+    set_value = getattr(dll, func_name, None)
+    if set_value is not None:
+        set_value.argtypes = [ctypes.c_int]
+        set_value(convert(getattr(config, name)))
+
+
+def _apply_thread_config(name):
+    for dll in _loaded_dlls.get('cpu', []):
+        _set_dll_thread_config(dll, name)
+
+
+for _name in _CPU_THREAD_CONFIGS:
+    set_runtime_hook(_name, lambda value, name=_name: _apply_thread_config(name))
+
+
+def set_capturing_graph(graph):
+    _capturing.graph = graph
+
+
+# the kinds of arguments of a dispatcher
+_TENSOR = 0
+_CSTRUCT = 1
+_SCALAR = 2
+# a tensor of MOBULA_VIEW, which is passed with its layout
+_VIEW = 3
+
+# the template name of the launch size of a kernel, which is int when the size
+# fits in int32 and int64_t otherwise, e.g.
+#   template <typename T, typename index_t = int>
+#   MOBULA_KERNEL foo_kernel(const index_t n, ...)
+INDEX_TEMPLATE = 'index_t'
+
+# the value of `set_current_stream` for the null stream, kNullStream in
+# mobula/cpp/include/context/hip_ctx.h
+NULL_STREAM = 1
+_INT32_MAX = 2 ** 31 - 1
+
+
+def _exceeds_int32(n):
+    return isinstance(n, numbers.Integral) and n > _INT32_MAX
+
+
+class ConstExpr:
+    """An argument which is constant for the life of a model, see `constexpr`."""
+
+    def __init__(self, value):
+        self.value = value
+
+
+def constexpr(value):
+    """Mark an int argument as a constant, e.g. the kernel size of a layer.
+
+    The kernel specializes its parameter `MOBULA_CONSTEXPR(name, V)` by the
+    value, and each value is built into its own instance. The other parameters
+    take the value as usual, i.e. the generic instance.
+
+    Examples
+    --------
+    >>> mobula.func.foo(n, x, mobula.func.constexpr(3), out)
+    """
+    assert isinstance(value, numbers.Integral), TypeError(
+        'constexpr only supports int rather than {}'.format(type(value)))
+    return ConstExpr(value)
+
+
+def _get_view_layout(shape, strides, ndim):
+    """Get the layout of a StridedView of `ndim` dimensions, i.e. the shape and
+    the strides in elements, where the dimensions of size 1 are dropped, the
+    contiguous dimensions are merged and the leading dimensions are padded.
+
+    Returns
+    -------
+    ctypes array of int64 or None
+        None if the tensor has more than `ndim` dimensions after merging.
+    """
+    dims = []
+    for size, stride in zip(shape, strides):
+        if size == 1:
+            continue
+        if dims and dims[-1][1] == size * stride:
+            dims[-1] = (dims[-1][0] * size, stride)
         else:
-            ctx = config.GPU_BACKEND
+            dims.append((size, stride))
+    if len(dims) > ndim:
+        return None
+    dims = [(1, 0)] * (ndim - len(dims)) + dims
+    return (ctypes.c_int64 * (2 * ndim))(*([size for size, _ in dims] +
+                                            [stride for _, stride in dims]))
+
+
+# the clock of the autotuner
+_now = getattr(time, 'perf_counter', time.time)
+# the block sizes of the candidates of the kernels on GPU
+_TUNING_BLOCK_SIZES = (64, 128, 256, 512, 1024)
+# the runs of each candidate, whose fastest time is compared
+_TUNING_REPEAT = 3
+
+
+def _get_size_bucket(n):
+    """Get the bucket of the launch size of a kernel for the autotuner, i.e.
+    the smallest power of 2 not less than `n`."""
+    if not isinstance(n, numbers.Integral):
+        return '?'
+    return '2^{}'.format(max(int(n) - 1, 0).bit_length())
+
+
+def _get_tuning_candidates(dev_id):
+    """Get the candidates of the launch config of a kernel on the device.
+
+    Returns
+    -------
+    (str, list of int)
+        the name of the launch config and the candidate values of it.
+    """
+    if dev_id >= 0:
+        return 'block_size', list(_TUNING_BLOCK_SIZES)
+    max_threads = config.NUM_THREADS or config.HOST_NUM_THREADS or \
+        multiprocessing.cpu_count()
+    candidates = []
+    num_threads = 1
+    while num_threads < max_threads:
+        candidates.append(num_threads)
+        num_threads *= 2
+    return 'num_threads', candidates + [max_threads]
+
+
+def _get_buffer_range(tensor):
+    """Get the range of bytes [begin, end) of a glue tensor, which is the
+    buffer of the tensor in the engine on CPU."""
+    buffer_range = tensor.buffer_range
+    if buffer_range is not None:
+        return buffer_range
+    # only the calls on the same data pointer are ordered
+    strided = tensor.strided_data_ptr
+    p = tensor.data_ptr if strided is None else strided[0]
+    if isinstance(p, (list, tuple)):
+        p = p[0]
+    p = p.value or 0
+    return p, p + 1
+
+
+def _is_cpu_engine_busy():
+    engine = get_cpu_engine(create=False)
+    return engine is not None and engine.busy()
+
+
+def _wait_for_cpu_engine():
+    """Wait for the pending calls on CPU before a call which runs at once."""
+    if _is_cpu_engine_busy():
+        get_cpu_engine().wait_all()
+
+
+# the depth of the `run_sync` scopes on each thread
+_sync_scopes = threading.local()
+
+
+@contextlib.contextmanager
+def run_sync():
+    """Run the calls on CPU at once in the scope after the pending calls, even
+    if `config.USING_ASYNC_CPU` is True. The custom operators run in it, since
+    they read and write their inputs and outputs in Python."""
+    _wait_for_cpu_engine()
+    depth = getattr(_sync_scopes, 'depth', 0)
+    _sync_scopes.depth = depth + 1
+    try:
+        yield
+    finally:
+        _sync_scopes.depth = depth
+
+
+def _copy_tensor(var):
+    # torch.Tensor has no copy()
+    copy = getattr(var, 'clone', None) or var.copy
+    return copy()
+
+
+class Dispatcher:
+    """The call of a CFunction with a signature, which is resolved once.
+
+    The signature of a call is the types and the devices of its tensors, the types
+    of its scalars and its glue module. The calls with the same signature skip the
+    type inference and the loader, and only extract the pointers of the tensors.
+
+    Parameters:
+    -----------
+    cfunc: CFuncDef
+    arg_types: list of DType
+        the argument types of the instance, including the types of workspaces.
+    arg_kinds: list of (kind, info)
+        the kind of each argument, where `info` is whether the tensor is const,
+        (whether the tensor is const, the number of dimensions) for a view,
+        the constructor of the struct, or the ctype which the scalar is converted
+        into (None for no conversion).
+    dev_id: int or None
+        the device id, which is None for CPU.
+    glue_mod: glue module or None
+    using_async: bool
+        whether to use the asynchronous function of the glue module.
+    """
+
+    def __init__(self, cfunc, arg_types, arg_kinds, dev_id, glue_mod, using_async):
+        assert cfunc.func_kind in (CFuncDef.KERNEL, CFuncDef.FUNC), TypeError(
+            'Unsupported func kind: {}'.format(cfunc.func_kind))
+        ctx = 'cpu' if dev_id is None else config.GPU_BACKEND
         # function loader
-        func = self.loader(self, arg_types, ctx, **self.loader_kwargs)
+        func = cfunc.loader(cfunc, arg_types, ctx, **cfunc.loader_kwargs)
+        self.func = func.func
+        self.async_func = None
         if using_async and glue_mod is not None:
-            async_func = func.get_async_func(glue_mod)
-            if async_func is not None:
-                return async_func(*_get_async_pointers(arg_datas))
-
-        _args_wait_to_rw(arg_datas)
+            self.async_func = func.get_async_func(glue_mod)
+        self.arg_kinds = arg_kinds
+        self.is_kernel = cfunc.func_kind == CFuncDef.KERNEL
+        self.dev_id = -1 if dev_id is None else dev_id
+        # the launch size which int can't hold would be truncated
+        self.func_name = cfunc.func_name
+        self.int32_n = self.is_kernel and bool(arg_types) and \
+            getattr(arg_types[0], 'ctype', None) is ctypes.c_int
+        dll = getattr(func, 'dll', None)
+        # the override of the threads of the kernels on CPU
+        self.set_thread_num_threads = None
+        if self.is_kernel and dev_id is None:
+            self.set_thread_num_threads = getattr(
+                dll, 'cpu_set_thread_num_threads', None)
+            if self.set_thread_num_threads is not None:
+                self.set_thread_num_threads.argtypes = [ctypes.c_int]
+        # the kernels on GPU are launched on the current stream of the framework
+        self.get_current_stream = None
+        self.set_current_stream = None
+        if dev_id is not None:
+            self.set_current_stream = getattr(dll, 'set_current_stream', None)
+            if self.set_current_stream is not None:
+                self.set_current_stream.argtypes = [ctypes.c_void_p]
+                self.get_current_stream = getattr(
+                    glue_mod, 'get_current_stream', None)
+        # the override of the block size of the kernels on GPU
+        self.set_thread_block_size = None
+        if self.is_kernel and dev_id is not None:
+            self.set_thread_block_size = getattr(
+                dll, 'set_thread_block_size', None)
+            if self.set_thread_block_size is not None:
+                self.set_thread_block_size.argtypes = [ctypes.c_int]
+        # the launch configs of `config.AUTOTUNE`, which are stored with the
+        # build information of the loader
+        self.tuning_loader = None
+        if (self.set_thread_num_threads or self.set_thread_block_size) is \
+                not None and hasattr(func, 'save_tuning'):
+            self.tuning_loader = func
+            self.tuning_prefix = '{}|{}:{}|'.format(
+                func.idcode, ctx, self.dev_id)
+            # the size bucket -> the launch config
+            self.tuned = dict()
+        # the engine runs the following operators on its own streams
+        self.sync_after_kernel = self.is_kernel and dev_id is not None and getattr(
+            glue_mod, 'async_name', None) is not None
+
+    def __call__(self, args, tensors, num_threads=None):
+        if self.int32_n and _exceeds_int32(args[0]):
+            raise OverflowError(
+                'The size {} of the kernel `{}` exceeds int, please declare it '
+                'as `const index_t n` with the template `{}`'.format(
+                    args[0], self.func_name, INDEX_TEMPLATE))
+        graph = get_capturing_graph()
+        # the graph replays the synchronous functions
+        if self.async_func is not None and graph is None:
+            # the engine launches the kernel on its own thread
+            return self.async_func(*self._get_async_pointers(args, tensors))
         const_vars = []
         mutable_vars = []
-        raw_pointers = _get_raw_pointers(arg_datas, const_vars, mutable_vars)
-        if self.func_kind == CFuncDef.KERNEL:
-            out = func(dev_id, *raw_pointers)
-        elif self.func_kind == CFuncDef.FUNC:
-            out = func(*raw_pointers)
+        pointers = []
+        for var, tensor, (kind, info) in zip(args, tensors, self.arg_kinds):
+            if kind == _TENSOR or kind == _VIEW:
+                if kind == _VIEW:
+                    info, ndim = info
+                if info:
+                    _wait_to_read(var)
+                else:
+                    _wait_to_write(var)
+                layout = None
+                if kind == _VIEW:
+                    # a non-contiguous view is passed without a copy
+                    strided = tensor.strided_data_ptr
+                    if strided is not None:
+                        layout = _get_view_layout(strided[1], strided[2], ndim)
+                if layout is not None:
+                    p = strided[0]
+                    const_vars.append(layout)
+                else:
+                    p = tensor.data_ptr
+                if isinstance(p, (list, tuple)):
+                    assert graph is None, ValueError(
+                        'The non-contiguous tensors can not be captured')
+                    if self.dev_id < 0 and _is_cpu_engine_busy():
+                        # copy the tensor after the pending calls
+                        get_cpu_engine().wait_all()
+                        p = tensor.data_ptr
+                    # the contiguous copy of the tensor
+                    p, v = p
+                    if info:
+                        const_vars.append(v)
+                    else:
+                        mutable_vars.append((var, v))
+                if kind == _VIEW:
+                    # the layout is nullptr for a contiguous tensor
+                    pointers.append(p)
+                    p = layout
+            elif kind == _CSTRUCT:
+                const_vars.append(_get_cstruct(info, var))
+                p = ctypes.byref(const_vars[-1])
+            else:
+                p = var if info is None else info(var)
+            pointers.append(p)
+        if self.is_kernel:
+            pointers.insert(0, self.dev_id)
+        if _profiler is not None:
+            _profiler.mark_launch()
+        if self.dev_id < 0:
+            if config.USING_ASYNC_CPU and graph is None and \
+                    not getattr(_sync_scopes, 'depth', 0):
+                # the arguments are kept alive until the call is executed
+                reads, writes = self._get_buffers(tensors)
+                return get_cpu_engine().push(
+                    lambda: self._run(args, pointers, num_threads,
+                                      mutable_vars, const_vars, None),
+                    reads, writes)
+            _wait_for_cpu_engine()
+        return self._run(args, pointers, num_threads, mutable_vars, const_vars,
+                         graph)
+
+    def _run(self, args, pointers, num_threads, mutable_vars, const_vars,
+             graph):
+        """Launch the function on the pointers of the arguments, and copy the
+        contiguous copies back into the non-contiguous tensors."""
+        launch = None
+        if config.AUTOTUNE and self.tuning_loader is not None and \
+                num_threads is None:
+            # the kernel runs several times, which can't be captured, and the
+            # copies of the non-contiguous tensors are not restored
+            launch = self._get_tuned_launch(
+                pointers, args, can_tune=graph is None and not mutable_vars)
+        if launch:
+            out = self._launch(pointers, launch.get('num_threads'),
+                               launch.get('block_size'))
         else:
-            raise TypeError(
-                'Unsupported func kind: {}'.format(self.func_kind))
+            out = self._launch(pointers, num_threads)
+        if self.sync_after_kernel:
+            synchronize(self.dev_id)
         for target, value in mutable_vars:
             target[:] = value
+        if graph is not None:
+            # the arguments are kept alive for the pointers
+            graph.add_call(self, pointers, (args, const_vars))
         return out
 
+    def get_stream(self):
+        """The current stream of the framework for `set_current_stream`."""
+        # the libraries launch on their own stream without a stream, so the
+        # default stream of the framework, 0, is passed as the null stream
+        return self.get_current_stream(self.dev_id) or NULL_STREAM
+
+    def _launch(self, pointers, num_threads, block_size=None):
+        # the thread-local states of the library during the call, which are
+        # only set when they are not the default
+        states = []
+        if num_threads and self.set_thread_num_threads is not None:
+            states.append((self.set_thread_num_threads, num_threads))
+        if block_size and self.set_thread_block_size is not None:
+            states.append((self.set_thread_block_size, block_size))
+        if self.get_current_stream is not None:
+            states.append((self.set_current_stream, self.get_stream()))
+        if not states:
+            return self.func(*pointers)
+        for set_state, state in states:
+            set_state(state)
+        try:
+            return self.func(*pointers)
+        finally:
+            for set_state, _ in states:
+                set_state(0)
+
+    def _get_buffers(self, tensors):
+        """Get the data pointers of the tensors which the call reads, and the
+        ones which it writes."""
+        reads = []
+        writes = []
+        for tensor, (kind, info) in zip(tensors, self.arg_kinds):
+            if kind == _VIEW:
+                info = info[0]
+            if kind == _TENSOR or kind == _VIEW:
+                (reads if info else writes).append(
+                    _get_buffer_range(tensor))
+        return reads, writes
+
+    def _get_tuned_launch(self, pointers, args, can_tune):
+        """Get the launch config of the size bucket of the call, which is
+        loaded from the build information, or tuned and saved on the first
+        call of the bucket when `can_tune` is True.
+
+        Returns
+        -------
+        dict or None
+            the launch config, e.g. {'num_threads': 4}, or None for the default.
+        """
+        bucket = _get_size_bucket(args[0])
+        launch = self.tuned.get(bucket, None)
+        if launch is None:
+            key = self.tuning_prefix + bucket
+            launch = self.tuning_loader.load_tuning().get(key, None)
+            if launch is None:
+                if not can_tune:
+                    return None
+                launch = self._tune(pointers, args)
+                self.tuning_loader.save_tuning(key, launch)
+            self.tuned[bucket] = launch
+        return launch
+
+    def _tune(self, pointers, args):
+        """Benchmark the candidates of the launch config on the arguments of
+        the call, and return the fastest one. The mutable tensors are restored
+        after each run, since a kernel may accumulate into its outputs."""
+        saved = []
+        for var, (kind, info) in zip(args, self.arg_kinds):
+            if kind == _VIEW:
+                info = info[0]
+            if (kind == _TENSOR or kind == _VIEW) and not info:
+                saved.append((var, _copy_tensor(var)))
+                _wait_to_read(saved[-1][1])
+        name, candidates = _get_tuning_candidates(self.dev_id)
+        best = None
+        # the first run warms up the caches and the memory pool
+        for value in [None] + candidates:
+            elapsed = None
+            for _ in range(1 if value is None else _TUNING_REPEAT):
+                start = _now()
+                self._launch(pointers, **{name: value})
+                if self.dev_id >= 0:
+                    synchronize(self.dev_id)
+                t = _now() - start
+                elapsed = t if elapsed is None else min(elapsed, t)
+                for var, value_copy in saved:
+                    var[:] = value_copy
+                    _wait_to_write(var)
+            if value is not None and (best is None or elapsed < best[1]):
+                best = (value, elapsed)
+        return {name: best[0], 'time_us': round(best[1] * 1e6, 3)}
+
+    def _get_async_pointers(self, args, tensors):
+        pointers = []
+        for var, tensor, (kind, info) in zip(args, tensors, self.arg_kinds):
+            if kind == _TENSOR or kind == _VIEW:
+                p = tensor.async_data_ptr
+            elif kind == _CSTRUCT:
+                p = ctypes.byref(_get_cstruct(info, var))
+            else:
+                p = var if info is None else info(var)
+            pointers.append(p)
+        return pointers
+
 
 class MobulaFunc:
     """An encapsulation for CFunction
@@ -178,57 +628,127 @@ class MobulaFunc:
         self.name = name
         self.func = func
 
-        self.wait_to_read_list = []
-        self.wait_to_write_list = []
-        for i, ptype in enumerate(self.func.arg_types):
-            if ptype.is_pointer:
-                if ptype.is_const:
-                    self.wait_to_read_list.append(i)
-                else:
-                    self.wait_to_write_list.append(i)
+        # the workspaces are allocated by the wrapper rather than the caller
+        self.arg_names = []
+        self.arg_types = []
+        for name, ptype in zip(self.func.arg_names, self.func.arg_types):
+            if name not in self.func.workspace:
+                self.arg_names.append(name)
+                self.arg_types.append(ptype)
+        # whether each argument is a tensor
+        self.is_tensor = [ptype.is_pointer and not hasattr(ptype, 'constructor')
+                          for ptype in self.arg_types]
+        # the position of the launch size of the template INDEX_TEMPLATE
+        self.index_arg = None
+        for i, ptype in enumerate(self.arg_types):
+            if isinstance(ptype, TemplateType) and not ptype.is_pointer and \
+                    ptype.tname == INDEX_TEMPLATE:
+                self.index_arg = i
+                break
+        # the positions of the parameters of MOBULA_CONSTEXPR
+        self.const_args = set(i for i, name in enumerate(self.arg_names)
+                              if name in self.func.consts)
+        # signature -> Dispatcher
+        self.dispatchers = dict()
 
     def __call__(self, *args, **kwargs):
+        if _profiler is not None:
+            return _profiler.call(self, args, kwargs)
+        return self._call(args, kwargs)
+
+    def _call(self, args, kwargs):
+        # the threads of this call on CPU, e.g. `mobula.func.foo(..., num_threads=2)`
+        num_threads = None
+        if 'num_threads' in kwargs and 'num_threads' not in self.arg_names:
+            num_threads = kwargs.pop('num_threads')
         # move kwargs into args
         args = list(args)
-        for name in self.func.arg_names[len(args):]:
+        for name in self.arg_names[len(args):]:
             args.append(kwargs[name])
 
-        # type check
-        arg_datas = []
-        dev_id = None
-        arg_types = []
-        template_mapping = dict()
+        signature, tensors = self._get_signature(args)
+        dispatcher = self.dispatchers.get(signature, None)
+        if dispatcher is None:
+            dispatcher = self._get_dispatcher(args, tensors, *signature[1:])
+            self.dispatchers[signature] = dispatcher
+        return dispatcher(args, tensors, num_threads)
+
+    def _get_signature(self, args):
+        """Get the signature of a call and the glue tensors of its arguments.
+
+        The values of `constexpr` in `args` are replaced by the plain values.
 
-        glue_mod = self._get_glue_mod(args)
+        Returns
+        -------
+        signature: tuple
+            (the types of arguments, glue module, using_async, the specialized
+            (position, value) of MOBULA_CONSTEXPR)
+        tensors: list of MobulaTensor or None
+            the glue tensor of each argument, which is None for a non-tensor.
+        """
+        glue_mods = []
+        tensors = []
+        types = []
+        consts = []
+        for i, (var, is_tensor) in enumerate(zip(args, self.is_tensor)):
+            if isinstance(var, ConstExpr):
+                var = args[i] = var.value
+                if i in self.const_args and config.USING_CONST_SPECIALIZATION:
+                    consts.append((i, var))
+            var_glue_mod = glue.backend.get_var_glue(var)
+            if var_glue_mod is not None:
+                glue_mods.append(var_glue_mod)
+            if is_tensor:
+                if var_glue_mod is None:
+                    raise self._unmatched_error(args)
+                tensor = var_glue_mod.Tensor(var)
+                tensors.append(tensor)
+                types.append((var_glue_mod, tensor.ctype, tensor.dev_id))
+            else:
+                tensors.append(None)
+                types.append(type(var))
+        if self.index_arg is not None:
+            # the instance of int64_t is only for the large sizes
+            types.append(_exceeds_int32(args[self.index_arg]))
+        glue_mod = None
+        # all glue modules in args are consistent
+        if glue_mods and all(mod == glue_mods[0] for mod in glue_mods):
+            glue_mod = glue_mods[0]
         using_async = config.USING_ASYNC_EXEC and glue_mod is not None and hasattr(
             glue_mod, 'get_async_func')
+        return (tuple(types), glue_mod, using_async, tuple(consts)), tensors
 
-        if not using_async:
-            # Pre-process
-            for i in self.wait_to_read_list:
-                _wait_to_read(args[i])
-            for i in self.wait_to_write_list:
-                _wait_to_write(args[i])
-
+    def _get_dispatcher(self, args, tensors, glue_mod, using_async, consts):
+        """Resolve the argument types of the call, and load the function."""
+        dev_id = None
+        arg_types = []
+        arg_kinds = []
+        template_mapping = dict()
+        if self.index_arg is not None:
+            template_mapping[INDEX_TEMPLATE] = ctypes.POINTER(
+                ctypes.c_int64 if _exceeds_int32(args[self.index_arg])
+                else ctypes.c_int)
         try:
-            for var, ptype in zip(args, self.func.arg_types):
-                if ptype.is_pointer:
-                    if hasattr(ptype, 'constructor'):
-                        var_dev_id = None
-                        ctype = ctypes.POINTER(ptype.cstruct)
-                        try:
-                            data = CStructArg(ptype.constructor(var))
-                        except TypeError:
-                            data = CStructArg(ptype.constructor(*var))
+            for var, tensor, ptype, name in zip(args, tensors, self.arg_types,
+                                                self.arg_names):
+                var_dev_id = None
+                if tensor is not None:
+                    var_dev_id, ctype = self._get_tensor_info(
+                        tensor, ptype, template_mapping)
+                    if name in self.func.views:
+                        arg_kinds.append(
+                            (_VIEW, (ptype.is_const, self.func.views[name])))
                     else:
-                        # The type of `var` is Tensor.
-                        data, var_dev_id, ctype = self._get_tensor_info(
-                            var, ptype, template_mapping, using_async)
+                        arg_kinds.append((_TENSOR, ptype.is_const))
+                elif ptype.is_pointer:
+                    _get_cstruct(ptype.constructor, var)
+                    ctype = ctypes.POINTER(ptype.cstruct)
+                    arg_kinds.append((_CSTRUCT, ptype.constructor))
                 else:
                     # The type of `var` is Scalar.
-                    data, var_dev_id, ctype = self._get_scalar_info(var, ptype)
+                    converter, ctype = self._get_scalar_info(var, ptype)
+                    arg_kinds.append((_SCALAR, converter))
 
-                arg_datas.append(data)
                 if isinstance(ctype, UnknownCType):
                     ctype.is_const = ptype.is_const
                     arg_types.append(ctype)
@@ -252,46 +772,54 @@ class MobulaFunc:
                             'Unknown template name: {}'.format(vtype.tname))
                     ctype = template_mapping[vtype.tname]._type_
                     arg_types[i] = DType(ctype, vtype.is_const)
-                    arg_datas[i] = ctype(arg_datas[i])
+                    arg_kinds[i] = (_SCALAR, ctype)
+                    ctype(args[i])
+
+            # the specialized instance of the values of MOBULA_CONSTEXPR
+            for i, value in consts:
+                arg_types[i] = ConstValue(arg_types[i].ctype, value)
+
+            # insert the types of workspaces, which are not in `args`
+            for i, (name, ptype) in enumerate(zip(self.func.arg_names, self.func.arg_types)):
+                if name not in self.func.workspace:
+                    continue
+                if isinstance(ptype, TemplateType):
+                    assert ptype.tname in template_mapping,\
+                        Exception(
+                            'Unknown template name of workspace: {}'.format(ptype.tname))
+                    ctype = template_mapping[ptype.tname]
+                else:
+                    ctype = ptype.ctype
+                arg_types.insert(i, DType(ctype, is_const=False))
         except TypeError:
-            raise TypeError('Unmatched parameters list of the function `{}`:\n\t{}\n\t\tvs\n\t{}'.format(
-                self.name, self.func.arg_types, list(map(type, args))))
+            raise self._unmatched_error(args)
 
-        rtn = self.func(arg_datas=arg_datas,
-                        arg_types=arg_types,
-                        dev_id=dev_id,
-                        glue_mod=glue_mod,
-                        using_async=using_async)
-        return rtn
+        return Dispatcher(self.func, arg_types, arg_kinds, dev_id, glue_mod, using_async)
+
+    def _unmatched_error(self, args):
+        return TypeError('Unmatched parameters list of the function `{}`:\n\t{}\n\t\tvs\n\t{}'.format(
+            self.name, self.arg_types, list(map(type, args))))
 
     @staticmethod
-    def _get_tensor_info(var, ptype, template_mapping, using_async=False):
+    def _get_tensor_info(tensor, ptype, template_mapping):
         """Get tensor info
 
         Parameters
         ----------
-        var: object
-            input variable
+        tensor: MobulaTensor
+            the glue tensor of the input variable
         ptype: DType | TemplateType
             the type of argument
         template_mapping: dict
             the mapping from template name to ctype
-        using_async: bool
-            whether to use asynchronous execution
 
         Returns
         -------
-        data: CFuncTensor
         dev_id: int | None
             the id of device
         ctype: ctypes.POINTER | ctypes.c_*
             the ctype of data
         """
-        glue_mod = glue.backend.get_var_glue(var)
-        if glue_mod is None:
-            raise TypeError()
-        data = CFuncTensor(var, ptype, glue_mod)
-        tensor = glue_mod.Tensor(var)
         dev_id = tensor.dev_id
         ctype = ctypes.POINTER(tensor.ctype)
         if isinstance(ptype, DType):
@@ -303,7 +831,7 @@ class MobulaFunc:
         assert ctype == expected_ctype,\
             TypeError('Expected Type {} instead of {}'.format(
                 expected_ctype, ctype))
-        return data, dev_id, ctype
+        return dev_id, ctype
 
     @staticmethod
     def _get_scalar_info(var, ptype):
@@ -318,37 +846,23 @@ class MobulaFunc:
 
         Returns
         -------
-        data: ctyoes.c_void_p
-            the pointer of data
-        dev_id: int | None
-            the id of device
-        ctype: ctypes.POINTER | ctypes.c_*
+        converter: ctypes.c_* | None
+            the ctype which `var` is converted into, or None for no conversion
+        ctype: ctypes.c_* | UnknownCType
             the ctype of data
         """
-
-        dev_id = None
         if isinstance(ptype, TemplateType):
-            data = var
-            ctype = type(var) if hasattr(
-                var, '_type_') else UnknownCType(ptype.tname)
-        else:
-            data = var if isinstance(
-                var, ctypes.c_void_p) else ptype.ctype(var)
-            ctype = ptype.ctype
-        return data, dev_id, ctype
-
-    @staticmethod
-    def _get_glue_mod(datas):
-        mods = map(glue.backend.get_var_glue, datas)
-        mods = list(filter(lambda x: x is not None, mods))
-        if mods:
-            glue_mod = mods[0]
-            # all glue modules in datas are consistent
-            if all(map(lambda x: x == glue_mod, mods)):
-                return glue_mod
-        return None
-
-    def build(self, ctx, template_types=None):
+            if hasattr(var, '_type_'):
+                return None, type(var)
+            # the converter is known after the template is inferred
+            return None, UnknownCType(ptype.tname)
+        if isinstance(var, ctypes.c_void_p):
+            return None, ptype.ctype
+        # check whether `var` is convertible
+        ptype.ctype(var)
+        return ptype.ctype, ptype.ctype
+
+    def build(self, ctx, template_types=None, index_type='int'):
         """Build this function
 
         Parameters
@@ -359,16 +873,39 @@ class MobulaFunc:
             list: a list of template type Names
             tuple: a tuple of template type Names
             dict: a mapping from template name to type name
+            The template `index_t` is not in the list, and it is optional in
+            the dict.
+        index_type: str, default: 'int'
+            the type of the template `index_t`, 'int' or 'int64'.
 
         Examples
         --------
         >>> mobula.func.add.build('cpu', ['float'])
         """
+        func = self.func
+        arg_types = self.get_build_arg_types(template_types, index_type)
+        func.loader(func, arg_types, ctx, **func.loader_kwargs)
+
+    def get_build_arg_types(self, template_types=None, index_type='int'):
+        """Get the argument types of the instance to build.
+
+        Parameters
+        ----------
+        template_types: list or tuple or dict, default: []
+            the same as that of `build`
+        index_type: str, default: 'int'
+            the same as that of `build`
+
+        Returns
+        -------
+        list of DType, including the types of workspaces
+        """
         arg_types = []
         par_type = self.func.arg_types
         if template_types is None:
             template_types = list()
         if isinstance(template_types, (list, tuple)):
+            template_types = list(template_types)
             template_mapping = dict()  # tname -> ctype
             for vtype in par_type:
                 if isinstance(vtype, TemplateType):
@@ -376,8 +913,9 @@ class MobulaFunc:
                     if tname in template_mapping:
                         ctype = template_mapping[tname]
                     else:
-                        ctype = getattr(ctypes, 'c_{}'.format(
-                            template_types.pop(0)))
+                        ctype = get_ctype(index_type) \
+                            if tname == INDEX_TEMPLATE else \
+                            get_ctype(template_types.pop(0))
                         template_mapping[tname] = ctype
                     arg_types.append(vtype(ctype))
                 else:
@@ -390,19 +928,102 @@ class MobulaFunc:
             for vtype in par_type:
                 if isinstance(vtype, TemplateType):
                     tname = vtype.tname
+                    if tname == INDEX_TEMPLATE and tname not in template_types:
+                        arg_types.append(vtype(get_ctype(index_type)))
+                        continue
                     assert tname in template_types, KeyError(
                         'Unknown Template Type: {}'.format(tname))
                     template_name.add(tname)
-                    ctype = getattr(ctypes, 'c_{}'.format(
-                        template_types[tname]))
+                    ctype = get_ctype(template_types[tname])
                     arg_types.append(vtype(ctype))
                 else:
                     arg_types.append(vtype)
             assert len(template_name) == len(template_types), Exception(
                 'Different template name: {} vs {}'.format(
                     template_name, set(template_types.keys())))
-        func = self.func
-        func.loader(func, arg_types, ctx, **func.loader_kwargs)
+        return arg_types
+
+
+# ctx -> the loaded libraries
+_loaded_dlls = dict()
+
+
+def register_dll(ctx, dll):
+    """Register a loaded library for the functions exported by context.cpp.
+
+    Parameters
+    ----------
+    ctx: str
+        the context of the library, e.g. 'cpu', 'cuda' or 'hip'.
+    dll: ctypes.CDLL
+        the loaded library.
+    """
+    dlls = _loaded_dlls.setdefault(ctx, [])
+    # a library loaded again shares the same handle
+    if all(d._handle != dll._handle for d in dlls):
+        dlls.append(dll)
+        if _profiler is not None:
+            _set_dll_profiler(dll)
+        if ctx == 'cpu':
+            for name in _CPU_THREAD_CONFIGS:
+                _set_dll_thread_config(dll, name)
+
+
+def get_dll_funcs(ctx, name):
+    """Get the function `name` of each loaded library in the context `ctx`."""
+    funcs = []
+    for dll in _loaded_dlls.get(ctx, []):
+        func = getattr(dll, name, None)
+        if func is not None:
+            funcs.append(func)
+    return funcs
+
+
+def synchronize(dev_id=None):
+    """Wait for the kernels launched on GPU to complete.
+
+    Kernels on GPU are launched asynchronously when `config.USING_ASYNC_KERNEL_LAUNCH`
+    is True, and the errors during the execution are raised here.
+
+    Parameters
+    ----------
+    dev_id: int or None
+        the device id. Synchronize all devices and the calls pushed into the
+        engine on CPU if it is None.
+    """
+    if dev_id is None:
+        engine = get_cpu_engine(create=False)
+        if engine is not None:
+            engine.wait_all()
+    funcs = get_dll_funcs(config.GPU_BACKEND, 'synchronize')
+    if funcs:
+        funcs[0].argtypes = [ctypes.c_int]
+        funcs[0](-1 if dev_id is None else dev_id)
+
+
+def wait(*tensors, **kwargs):
+    """Wait for the calls on CPU pushed when `config.USING_ASYNC_CPU` is True,
+    which write the tensors, before reading them. See mobula/engine.py.
+
+    Parameters
+    ----------
+    tensors: the tensors on CPU
+    for_write: bool
+        wait for the calls which read the tensors as well, before writing them.
+    """
+    for_write = kwargs.pop('for_write', False)
+    assert not kwargs, TypeError(
+        'Unexpected arguments of wait: {}'.format(list(kwargs.keys())))
+    engine = get_cpu_engine(create=False)
+    if engine is None:
+        return
+    buffers = []
+    for var in tensors:
+        glue_mod = glue.backend.get_var_glue(var)
+        assert glue_mod is not None, TypeError(
+            'Unsupported tensor type: {}'.format(type(var)))
+        buffers.append(_get_buffer_range(glue_mod.Tensor(var)))
+    engine.wait(buffers, for_write)
 
 
 _binded_functions = dict()
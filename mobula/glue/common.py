@@ -6,6 +6,7 @@ import base64
 import ctypes
 import functools
 import warnings
+from ..internal.dtype import c_float16
 
 
 def pars_encode(data):
@@ -121,6 +122,38 @@ def get_in_shape(in_data):
     return [d.shape for d in in_data]
 
 
+def get_out_types(op, in_data, num_outputs):
+    """Get the dtypes of the outputs by `op.infer_type(in_types)` like MXNet,
+    which are the dtype of the first input if the operator doesn't define it.
+    """
+    if hasattr(op, 'infer_type'):
+        return list(op.infer_type([d.dtype for d in in_data])[1])
+    return [in_data[0].dtype if in_data else None] * num_outputs
+
+
+def get_buffer_range(ptr, shape, strides, itemsize):
+    """Get the range of bytes [begin, end) which a tensor spans.
+
+    Parameters
+    ----------
+    ptr: int
+        the address of the first element.
+    shape: tuple of int
+    strides: tuple of int
+        the strides in bytes.
+    itemsize: int
+    """
+    begin = end = ptr
+    for size, stride in zip(shape, strides):
+        if size == 0:
+            return ptr, ptr
+        if stride > 0:
+            end += (size - 1) * stride
+        else:
+            begin += (size - 1) * stride
+    return begin, end + itemsize
+
+
 def assign(_, dst, req, src):
     """Helper function for assigning into dst depending on requirements."""
     if req == 'null':
@@ -148,6 +181,18 @@ class MobulaTensor:
     def async_data_ptr(self):
         raise NotImplementedError
 
+    @property
+    def strided_data_ptr(self):
+        """(the pointer, the shape, the strides in elements) of a
+        non-contiguous tensor for MOBULA_VIEW, or None to pass `data_ptr`."""
+        return None
+
+    @property
+    def buffer_range(self):
+        """The range of bytes [begin, end) of the tensor on CPU, which orders
+        the calls in the engine on CPU, or None for the data pointer only."""
+        return None
+
     @property
     def ctype(self):
         raise NotImplementedError
@@ -253,6 +298,7 @@ try:
             (np.dtype('int16'), ctypes.c_int16),
             (np.dtype('int32'), ctypes.c_int32),
             (np.dtype('int64'), ctypes.c_int64),  # alias: np.int
+            (np.dtype('float16'), c_float16),
             (np.dtype('float32'), ctypes.c_float),
             (np.dtype('float64'), ctypes.c_double),  # alias: np.float
         ]
@@ -8,11 +8,19 @@ class CuPyTensor(MobulaTensor):
     def data_ptr(self):
         def p(e):
             return ctypes.c_void_p(e.data.ptr)
-        if not v.flags.c_contiguous:
+        if not self.tensor.flags.c_contiguous:
             c = cp.ascontiguousarray(self.tensor)
             return p(c), c
         return p(self.tensor)
 
+    @property
+    def strided_data_ptr(self):
+        t = self.tensor
+        if t.flags.c_contiguous or any(s % t.itemsize for s in t.strides):
+            return None
+        return ctypes.c_void_p(t.data.ptr), t.shape, \
+            [s // t.itemsize for s in t.strides]
+
     @property
     def ctype(self):
         return NPDTYPE2CTYPE(self.tensor.dtype)
@@ -24,6 +32,15 @@ class CuPyTensor(MobulaTensor):
         return None
 
 
+def get_current_stream(dev_id):
+    """Get the handle of the current stream of CuPy on the GPU `dev_id`,
+    which is 0 for the default stream."""
+    if cp.cuda.runtime.getDevice() == dev_id:
+        return cp.cuda.get_current_stream().ptr
+    with cp.cuda.Device(dev_id):
+        return cp.cuda.get_current_stream().ptr
+
+
 class OpGen(object):
     def __init__(self, op, name):
         self.op = op
@@ -42,11 +59,12 @@ class OpGen(object):
             inputs, pars = get_in_data(op=self.op, *args, **kwargs)
 
             self.in_data = inputs
-            dtype = self.in_data[0].dtype
             self.req = ['write' for _ in self.in_data]
             in_shape = get_in_shape(self.in_data)
             out_shape = self.infer_shape(in_shape)[1]
-            self.out_data = [self.F.empty(s, dtype=dtype) for s in out_shape]
+            out_types = get_out_types(self, self.in_data, len(out_shape))
+            self.out_data = [self.F.empty(s, dtype=t)
+                             for s, t in zip(out_shape, out_types)]
             out = self._forward(*inputs)
             if out is not None:
                 if not isinstance(out, (list, tuple)):
@@ -1,4 +1,5 @@
 from .common import *
+from ..func import run_sync
 import numpy as np
 import mxnet as mx
 from mxnet.base import _LIB
@@ -43,23 +44,24 @@ async_name = 'mx'
 try:
     MX_LIB_APIS = [_LIB.MXShallowCopyNDArray, _LIB.MXNDArrayFree,
                    _LIB.MXNDArrayGetContext, _LIB.MXNDArrayToDLPack,
-                   _LIB.MXEnginePushSyncND]
+                   _LIB.MXEnginePushSyncND, _LIB.MXNDArrayGetData,
+                   _LIB.MXNDArrayGetDType, _LIB.MXNDArrayGetShape]
 except AttributeError as e:
     warnings.warn("""Fail to enable asynchronous execution for MXNet, since the version of MXNet is old. It will drop the performance.
 In order to improve the performance, please install MXNet whose version >= 1.6.0b20190809""")
     MX_LIB_APIS = None
 
 
-def get_async_func(cpp_info, func_idcode_hash):
+def get_async_func(dll, func_idcode_hash):
     if MX_LIB_APIS is None:
         return None
-    cpp_info.dll.RegisterMXAPI.argtypes = [ctypes.c_void_p] * len(MX_LIB_APIS)
-    cpp_info.dll.RegisterMXAPI(*MX_LIB_APIS)
+    dll.RegisterMXAPI.argtypes = [ctypes.c_void_p] * len(MX_LIB_APIS)
+    dll.RegisterMXAPI(*MX_LIB_APIS)
     register_func_for_mx = getattr(
-        cpp_info.dll, func_idcode_hash + '_register_mx', None)
+        dll, func_idcode_hash + '_register_mx', None)
     if register_func_for_mx is None:
         return None
-    async_func_for_mx = getattr(cpp_info.dll, func_idcode_hash + '_async_mx')
+    async_func_for_mx = getattr(dll, func_idcode_hash + '_async_mx')
     register_func_for_mx.restype = ctypes.c_void_p
     packed_func_mx = ctypes.c_void_p(register_func_for_mx())
     func = lambda *args: async_func_for_mx(packed_func_mx, *args)
@@ -106,24 +108,26 @@ class OpGen(object):
                 self.in_data = in_data
                 self.out_data = out_data
                 self.req = req
-                out = self._forward(*in_data)
-                if out is not None:
-                    if not isinstance(out, (list, tuple)):
-                        out = [out]
-                    for i, x in enumerate(out):
-                        self.assign(out_data[i], req[i], x)
+                with run_sync():
+                    out = self._forward(*in_data)
+                    if out is not None:
+                        if not isinstance(out, (list, tuple)):
+                            out = [out]
+                        for i, x in enumerate(out):
+                            self.assign(out_data[i], req[i], x)
 
             def backward(self, req, out_grad, in_data, out_data, in_grad, aux):
                 self.in_grad = in_grad
                 self.out_grad = out_grad
                 self.req = req
-                out = self._backward(*out_grad)
-                if out is not None:
-                    if not isinstance(out, (list, tuple)):
-                        out = [out]
-                    num_inputs = len(get_varnames(self._forward))
-                    for i in range(num_inputs):
-                        self.assign(in_grad[i], req[i], out[i])
+                with run_sync():
+                    out = self._backward(*out_grad)
+                    if out is not None:
+                        if not isinstance(out, (list, tuple)):
+                            out = [out]
+                        num_inputs = len(get_varnames(self._forward))
+                        for i in range(num_inputs):
+                            self.assign(in_grad[i], req[i], out[i])
             mx_op_dict = dict(
                 __init__=__init__,
                 __getattr__=__getattr__,
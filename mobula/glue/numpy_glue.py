@@ -1,6 +1,7 @@
 import ctypes
 import numpy as np
 from .common import *
+from ..func import run_sync
 
 
 class NumPyTensor(MobulaTensor):
@@ -13,6 +14,19 @@ class NumPyTensor(MobulaTensor):
             return p(c), c
         return p(self.tensor)
 
+    @property
+    def strided_data_ptr(self):
+        t = self.tensor
+        if t.flags.c_contiguous or any(s % t.itemsize for s in t.strides):
+            return None
+        return ctypes.c_void_p(t.ctypes.data), t.shape, \
+            [s // t.itemsize for s in t.strides]
+
+    @property
+    def buffer_range(self):
+        t = self.tensor
+        return get_buffer_range(t.ctypes.data, t.shape, t.strides, t.itemsize)
+
     @property
     def ctype(self):
         return NPDTYPE2CTYPE(self.tensor.dtype)
@@ -45,17 +59,19 @@ class OpGen(object):
             inputs, pars = get_in_data(op=self.op, *args, **kwargs)
 
             self.in_data = inputs
-            dtype = self.in_data[0].dtype
             self.req = ['write' for _ in self.in_data]
             in_shape = get_in_shape(self.in_data)
             out_shape = self.infer_shape(in_shape)[1]
-            self.out_data = [self.F.empty(s, dtype=dtype) for s in out_shape]
-            out = self._forward(*inputs)
-            if out is not None:
-                if not isinstance(out, (list, tuple)):
-                    out = [out]
-                for i, x in enumerate(out):
-                    self.assign(self.out_data[i], self.req[i], x)
+            out_types = get_out_types(self, self.in_data, len(out_shape))
+            self.out_data = [self.F.empty(s, dtype=t)
+                             for s, t in zip(out_shape, out_types)]
+            with run_sync():
+                out = self._forward(*inputs)
+                if out is not None:
+                    if not isinstance(out, (list, tuple)):
+                        out = [out]
+                    for i, x in enumerate(out):
+                        self.assign(self.out_data[i], self.req[i], x)
             if len(self.out_data) == 1:
                 return self.out_data[0]
             return self.out_data
@@ -91,13 +107,14 @@ class OpGen(object):
                 assert len(req) == len(self.in_data),\
                     ValueError('len(req) should be %d' % len(self.in_data))
                 self.req = req
-            out = self._backward(*out_grad)
-            if out is not None:
-                if not isinstance(out, (list, tuple)):
-                    out = [out]
-                num_inputs = len(get_varnames(self._forward))
-                for i in range(num_inputs):
-                    self.assign(in_grad[i], self.req[i], out[i])
+            with run_sync():
+                out = self._backward(*out_grad)
+                if out is not None:
+                    if not isinstance(out, (list, tuple)):
+                        out = [out]
+                    num_inputs = len(get_varnames(self._forward))
+                    for i in range(num_inputs):
+                        self.assign(in_grad[i], self.req[i], out[i])
             if len(in_grad) == 1:
                 return in_grad[0]
             return self.in_grad
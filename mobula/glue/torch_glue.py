@@ -1,12 +1,25 @@
 import ctypes
+import numpy as np
 import torch
 from .common import *
+from ..func import run_sync
+from ..internal.dtype import c_float16, c_bfloat16
 
 
 THDTYPE2CTYPE_MAP = dict()
 THDTYPE2CTYPE_MAP[torch.int] = ctypes.c_int
 THDTYPE2CTYPE_MAP[torch.float] = ctypes.c_float
 THDTYPE2CTYPE_MAP[torch.double] = ctypes.c_double
+THDTYPE2CTYPE_MAP[torch.half] = c_float16
+if hasattr(torch, 'bfloat16'):
+    THDTYPE2CTYPE_MAP[torch.bfloat16] = c_bfloat16
+
+
+def get_torch_dtype(dtype):
+    """Get the dtype of PyTorch of a dtype of PyTorch or NumPy."""
+    if isinstance(dtype, torch.dtype):
+        return dtype
+    return getattr(torch, np.dtype(dtype).name)
 
 
 class TorchTensor(MobulaTensor):
@@ -21,6 +34,20 @@ class TorchTensor(MobulaTensor):
             return p(c), c
         return p(self.tensor)
 
+    @property
+    def strided_data_ptr(self):
+        t = self.tensor
+        if t.is_contiguous():
+            return None
+        return ctypes.c_void_p(t.data_ptr()), t.shape, t.stride()
+
+    @property
+    def buffer_range(self):
+        t = self.tensor
+        itemsize = t.element_size()
+        return get_buffer_range(t.data_ptr(), t.shape,
+                                [s * itemsize for s in t.stride()], itemsize)
+
     @property
     def ctype(self):
         dtype = self.tensor.dtype
@@ -36,6 +63,12 @@ class TorchTensor(MobulaTensor):
         return None
 
 
+def get_current_stream(dev_id):
+    """Get the handle of the current stream of PyTorch on the GPU `dev_id`,
+    which is 0 for the default stream."""
+    return torch.cuda.current_stream(dev_id).cuda_stream
+
+
 class OpGen(object):
     def __init__(self, op, name):
         self.op = op
@@ -60,17 +93,19 @@ class OpGen(object):
                 self.req = ['write' for _ in self.in_data]
                 in_shape = get_in_shape(self.in_data)
                 out_shape = self.infer_shape(in_shape)[1]
-                dtype = self.in_data[0].dtype if self.in_data else torch.float32
+                out_types = [torch.float32 if t is None else get_torch_dtype(t)
+                             for t in get_out_types(self, self.in_data, len(out_shape))]
                 device = self.in_data[0].device if self.in_data else torch.device(
                     'cpu')
                 self.out_data = [self.F.empty(
-                    s, dtype=dtype, device=device) for s in out_shape]
-                out = self._forward(*args, **kwargs)
-                if out is not None:
-                    if not isinstance(out, (list, tuple)):
-                        out = [out]
-                    for i, x in enumerate(out):
-                        self.assign(self.out_data[i], self.req[i], x)
+                    s, dtype=t, device=device) for s, t in zip(out_shape, out_types)]
+                with run_sync():
+                    out = self._forward(*args, **kwargs)
+                    if out is not None:
+                        if not isinstance(out, (list, tuple)):
+                            out = [out]
+                        for i, x in enumerate(out):
+                            self.assign(self.out_data[i], self.req[i], x)
                 if len(self.out_data) == 1:
                     return self.out_data[0]
                 return tuple(self.out_data)
@@ -83,13 +118,14 @@ class OpGen(object):
                 self.in_grad = [self.F.empty_like(d, dtype=dtype, device=device) if d.grad is None
                                 else d.grad for d in self.in_data]
                 self.out_grad = args
-                out = self._backward(*args, **kwargs)
-                if out is not None:
-                    if not isinstance(out, (list, tuple)):
-                        out = [out]
-                    num_inputs = len(get_varnames(self._forward))
-                    for i in range(num_inputs):
-                        self.assign(self.in_grad[i], self.req[i], out[i])
+                with run_sync():
+                    out = self._backward(*args, **kwargs)
+                    if out is not None:
+                        if not isinstance(out, (list, tuple)):
+                            out = [out]
+                        num_inputs = len(get_varnames(self._forward))
+                        for i in range(num_inputs):
+                            self.assign(self.in_grad[i], self.req[i], out[i])
 
                 if len(self.in_grad) == 1:
                     return None, self.in_grad[0]
@@ -0,0 +1,174 @@
+"""Capture the calls of MobulaOP functions, and replay them.
+
+Example:
+    with mobula.graph.capture() as g:
+        mobula.func.foo(n, a, b)
+        mobula.func.bar(n, b, c)
+    for _ in range(100):
+        # update the data of `a` in place
+        g.replay()
+
+The calls in the `with` block run as usual, and they are recorded with the
+pointers of their arguments. `replay` calls them again on the same pointers
+without the dispatch in Python, so the shapes, the scalars and the memory of
+the tensors are fixed. The tensors are kept alive by the graph, and they should
+be updated in place between replays.
+
+When all calls are kernels on the same GPU, the graph is replayed by a CUDA/HIP
+graph on the current stream of the kernels. Otherwise the calls are replayed in
+order.
+Neither the non-contiguous tensors nor the asynchronous execution of MXNet are
+captured, and the calls of a graph run synchronously.
+"""
+__all__ = ['capture', 'Graph']
+
+import contextlib
+import ctypes
+from .config import config
+from .func import get_capturing_graph, set_capturing_graph, get_dll_funcs, synchronize
+
+
+def _get_dll_func(ctx, name, argtypes, restype=None):
+    funcs = get_dll_funcs(ctx, name)
+    for func in funcs:
+        func.argtypes = argtypes
+        func.restype = restype
+    return funcs
+
+
+class Graph:
+    """The recorded calls of MobulaOP functions."""
+
+    def __init__(self):
+        # (function, arguments)
+        self.calls = []
+        # the objects which the pointers point to
+        self.refs = []
+        self.dev_ids = set()
+        self.all_kernels = True
+        self.sync_after_kernel = False
+        self.exec_handle = None
+        # a recorded call which tells the current stream of the framework
+        self.stream_dispatcher = None
+        # (graph_free_arrays, the workspaces kept by a library)
+        self.arrays = []
+
+    def add_call(self, dispatcher, pointers, refs):
+        self.calls.append((dispatcher.func, pointers))
+        self.refs.append(refs)
+        self.all_kernels = self.all_kernels and dispatcher.is_kernel
+        if dispatcher.is_kernel:
+            self.dev_ids.add(dispatcher.dev_id)
+        self.sync_after_kernel = self.sync_after_kernel or dispatcher.sync_after_kernel
+        if self.stream_dispatcher is None and dispatcher.get_current_stream is not None:
+            self.stream_dispatcher = dispatcher
+
+    @property
+    def dev_id(self):
+        """The GPU which the graph is launched on, or None."""
+        if self.all_kernels and len(self.dev_ids) == 1:
+            dev_id = next(iter(self.dev_ids))
+            if dev_id >= 0:
+                return dev_id
+        return None
+
+    def instantiate(self):
+        """Capture the recorded kernels into a CUDA/HIP graph if possible."""
+        dev_id = self.dev_id
+        if dev_id is None or self.exec_handle is not None:
+            return
+        ctx = config.GPU_BACKEND
+        begin_funcs = _get_dll_func(
+            ctx, 'graph_begin_capture', [ctypes.c_int], ctypes.c_void_p)
+        if not begin_funcs:
+            return
+        set_stream_funcs = _get_dll_func(
+            ctx, 'graph_set_capture_stream', [ctypes.c_void_p])
+        end_func = _get_dll_func(
+            ctx, 'graph_end_capture', [ctypes.c_void_p], ctypes.c_void_p)[0]
+        stream = begin_funcs[0](dev_id)
+        try:
+            for func in set_stream_funcs:
+                func(stream)
+            # the kernels are captured rather than executed
+            self._run_calls()
+        finally:
+            for func in set_stream_funcs:
+                func(None)
+            self.exec_handle = end_func(stream)
+            take_funcs = _get_dll_func(
+                ctx, 'graph_take_arrays', [], ctypes.c_void_p)
+            free_funcs = _get_dll_func(
+                ctx, 'graph_free_arrays', [ctypes.c_void_p])
+            for take, free in zip(take_funcs, free_funcs):
+                self.arrays.append((free, take()))
+
+    def replay(self):
+        """Run the recorded calls again."""
+        # the calls are ordered with the current stream of the framework
+        set_stream_funcs = []
+        if self.stream_dispatcher is not None:
+            set_stream_funcs = _get_dll_func(
+                config.GPU_BACKEND, 'set_current_stream', [ctypes.c_void_p])
+            stream = self.stream_dispatcher.get_stream()
+            for func in set_stream_funcs:
+                func(stream)
+        try:
+            if self.exec_handle is not None:
+                launch = _get_dll_func(config.GPU_BACKEND, 'graph_launch', [
+                    ctypes.c_void_p, ctypes.c_int])[0]
+                launch(self.exec_handle, self.dev_id)
+            else:
+                self._run_calls()
+        finally:
+            for func in set_stream_funcs:
+                func(None)
+        if self.sync_after_kernel:
+            # the engine runs the following operators on its own streams
+            for dev_id in self.dev_ids:
+                if dev_id >= 0:
+                    synchronize(dev_id)
+
+    def release(self):
+        """Release the GPU graph, the workspaces and the arguments."""
+        if self.exec_handle is not None:
+            destroy = _get_dll_func(
+                config.GPU_BACKEND, 'graph_destroy', [ctypes.c_void_p])[0]
+            destroy(self.exec_handle)
+            self.exec_handle = None
+        for free, arrays in self.arrays:
+            free(arrays)
+        self.arrays = []
+        self.calls = []
+        self.refs = []
+
+    def __del__(self):
+        try:
+            self.release()
+        except Exception:
+            # the libraries may be unloaded at exit
+            pass
+
+    def _run_calls(self):
+        for func, pointers in self.calls:
+            func(*pointers)
+
+
+@contextlib.contextmanager
+def capture():
+    """Record the calls of MobulaOP functions on this thread into a graph.
+
+    Returns
+    -------
+    Graph
+        The graph is instantiated when the `with` block exits without errors.
+    """
+    assert get_capturing_graph() is None, RuntimeError(
+        'The graphs can not be captured recursively')
+    graph = Graph()
+    set_capturing_graph(graph)
+    try:
+        yield graph
+    finally:
+        set_capturing_graph(None)
+    graph.instantiate()
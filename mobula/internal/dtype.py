@@ -1,14 +1,65 @@
 import ctypes
+import math
+import struct
+
+
+def _float_to_bits(value, exp_bits, mant_bits):
+    """The bits of the binary floating number of `value`, which has `exp_bits`
+    bits of exponent and `mant_bits` bits of mantissa, rounded to nearest even.
+    """
+    bias = (1 << (exp_bits - 1)) - 1
+    inf = ((1 << exp_bits) - 1) << mant_bits
+    value = float(value)
+    sign = 1 << (exp_bits + mant_bits) if math.copysign(1.0, value) < 0 else 0
+    value = abs(value)
+    if math.isnan(value):
+        return sign | inf | (1 << (mant_bits - 1))
+    if math.isinf(value):
+        return sign | inf
+    if value < math.ldexp(1.0, 1 - bias):
+        # subnormal or zero
+        return sign | int(round(math.ldexp(value, bias - 1 + mant_bits)))
+    mant, exp = math.frexp(value)
+    bits = ((exp - 1 + bias) << mant_bits) + \
+        int(round((mant * 2 - 1) * (1 << mant_bits)))
+    return sign | min(bits, inf)
+
+
+class c_float16(ctypes.c_uint16):
+    """The 16-bit float `mobula::float16`, whose value is the bits."""
+
+    def __init__(self, value=0.0):
+        ctypes.c_uint16.__init__(self, _float_to_bits(value, 5, 10))
+
+    def __float__(self):
+        return struct.unpack('<e', struct.pack('<H', self.value))[0]
+
+
+class c_bfloat16(ctypes.c_uint16):
+    """The 16-bit float `mobula::bfloat16`, whose value is the bits."""
+
+    def __init__(self, value=0.0):
+        ctypes.c_uint16.__init__(self, _float_to_bits(value, 8, 7))
+
+    def __float__(self):
+        return struct.unpack('<f', struct.pack('<I', self.value << 16))[0]
+
 
 CTYPE_INTS = [ctypes.c_short, ctypes.c_int, ctypes.c_long, ctypes.c_longlong]
 CTYPE_UINTS = [ctypes.c_ushort, ctypes.c_uint,
                ctypes.c_ulong, ctypes.c_ulonglong]
+CTYPE_FLOAT16S = {
+    'float16': c_float16,
+    'bfloat16': c_bfloat16,
+}
 CTYPENAME2CTYPE = {
     'bool': ctypes.c_bool,
     'char': ctypes.c_char,
     'char*': ctypes.c_char_p,
     'double': ctypes.c_double,
     'float': ctypes.c_float,
+    'float16': c_float16,
+    'bfloat16': c_bfloat16,
     'int': ctypes.c_int,
     'int8_t': ctypes.c_int8,
     'int16_t': ctypes.c_int16,
@@ -20,6 +71,18 @@ CTYPENAME2CTYPE = {
 }
 
 
+def get_ctype(type_name):
+    """Get the ctype of the C type `type_name`, e.g. 'float' or 'float16'.
+
+    Returns
+    -------
+    ctypes.c_* | None
+    """
+    if type_name in CTYPE_FLOAT16S:
+        return CTYPE_FLOAT16S[type_name]
+    return getattr(ctypes, 'c_{}'.format(type_name), None)
+
+
 def get_ctype_name(ctype):
     # ctype.__name__ = 'c_xxx'
     if ctype in CTYPE_INTS[2:]:
@@ -68,6 +131,20 @@ class DType:
         return self.ctype(value)
 
 
+class ConstValue(DType):
+    """The type of a MOBULA_CONSTEXPR parameter, which is specialized with
+    `value` at compile time."""
+
+    def __init__(self, ctype, value):
+        super(ConstValue, self).__init__(ctype, is_const=True)
+        self.value = value
+        # the instances of different values have their own idcodes
+        self.idname = '{}={}'.format(self.cname, value)
+
+    def __repr__(self):
+        return self.idname
+
+
 class CStruct:
     def __init__(self, name, is_const, cstruct, constructor):
         self.cname = name + '*'
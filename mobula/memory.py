@@ -0,0 +1,56 @@
+"""The memory pool behind `new_array`/`del_array` in C++."""
+__all__ = ['stats', 'trim']
+
+import ctypes
+from .config import config
+from .func import get_dll_funcs
+
+
+class MemoryPoolStats(ctypes.Structure):
+    # the same layout as `MemoryPoolStats` in memory_pool.h
+    _fields_ = [('bytes_in_use', ctypes.c_int64),
+                ('bytes_cached', ctypes.c_int64),
+                ('num_allocs', ctypes.c_int64),
+                ('num_hits', ctypes.c_int64)]
+
+
+def stats(ctx=None):
+    """Get the statistics of the memory pools.
+
+    Each loaded library owns a memory pool, and the statistics are summed up.
+
+    Parameters
+    ----------
+    ctx: str or None
+        'cpu' or the GPU backend. Use `config.GPU_BACKEND` if it is None.
+
+    Returns
+    -------
+    dict
+        bytes_in_use, bytes_cached, num_allocs, num_hits and hit_rate
+    """
+    if ctx is None:
+        ctx = config.GPU_BACKEND
+    out = dict(bytes_in_use=0, bytes_cached=0, num_allocs=0, num_hits=0)
+    for func in get_dll_funcs(ctx, 'memory_pool_stats'):
+        data = MemoryPoolStats()
+        func(ctypes.byref(data))
+        for name, _ in MemoryPoolStats._fields_:
+            out[name] += getattr(data, name)
+    out['hit_rate'] = float(out['num_hits']) / \
+        out['num_allocs'] if out['num_allocs'] > 0 else 0.0
+    return out
+
+
+def trim(ctx=None):
+    """Release the cached blocks of the memory pools.
+
+    Parameters
+    ----------
+    ctx: str or None
+        'cpu' or the GPU backend. Use `config.GPU_BACKEND` if it is None.
+    """
+    if ctx is None:
+        ctx = config.GPU_BACKEND
+    for func in get_dll_funcs(ctx, 'memory_pool_trim'):
+        func()
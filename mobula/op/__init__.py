@@ -5,3 +5,4 @@ from .. import glue
 glue.common.OP_MODULE_GLOBALS = globals()
 from .register import register
 from .loader import load
+from . import fusion
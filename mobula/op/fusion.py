@@ -0,0 +1,242 @@
+"""Fuse the chains of elementwise functions into a kernel.
+
+Example:
+    from mobula.op import fusion
+    x = fusion.tensor('x')
+    alpha = fusion.scalar('alpha')
+    p = fusion.call('fast_sigmoid', x)
+    out = alpha * p * (1 - p)
+    fusion.fuse('sigmoid_grad', [x, alpha], [('y', out)])
+    # the kernel is bound to mobula.func.sigmoid_grad
+    mobula.func.sigmoid_grad(x_data.size, x_data, 0.5, y_data)
+
+A fused function takes the number of elements, the inputs and the outputs in
+order. All tensors have the same type T, and the intermediate values are kept in
+registers as `AccType<T>::type`, e.g. float for float16. `call` applies a
+`MOBULA_DEVICE` function or functor of the headers in `includes`, or of
+MobulaOP, e.g. `fast_exp` and `fast_sigmoid`.
+
+The source of a fused kernel is generated into `config.BUILD_PATH`, and named
+by its hash. Its template instances are built and cached like those of the
+other source files.
+"""
+__all__ = ['tensor', 'scalar', 'call', 'fuse']
+
+import hashlib
+import os
+import re
+from ..building.build_hash import get_file_hash
+from ..config import config
+from .. import func
+from ..utils import makedirs
+from .gen_code import get_gen_rel_code
+from .loader import _get_functions_from_cpp
+
+gen_code = get_gen_rel_code(os.path.dirname(__file__))
+
+# the source file -> MobulaFunc
+_FUSED_FUNCTIONS = dict()
+
+IDENTIFIER_PATTERN = re.compile(r'^[A-Za-z_][A-Za-z0-9_]*$')
+
+
+def _check_identifier(name):
+    assert IDENTIFIER_PATTERN.match(name), ValueError(
+        'Invalid name: {}'.format(name))
+
+
+class Expr:
+    """A node of the elementwise expression.
+
+    Parameters
+    ----------
+    kind: str
+        'tensor', 'scalar', 'const', 'call' or 'op'
+    value: str or number
+        the name of the tensor, scalar, function or operator, or the constant.
+    args: list of Expr
+    """
+
+    def __init__(self, kind, value, args=()):
+        self.kind = kind
+        self.value = value
+        self.args = list(args)
+
+    def __add__(self, other):
+        return Expr('op', '+', [self, _as_expr(other)])
+
+    def __radd__(self, other):
+        return Expr('op', '+', [_as_expr(other), self])
+
+    def __sub__(self, other):
+        return Expr('op', '-', [self, _as_expr(other)])
+
+    def __rsub__(self, other):
+        return Expr('op', '-', [_as_expr(other), self])
+
+    def __mul__(self, other):
+        return Expr('op', '*', [self, _as_expr(other)])
+
+    def __rmul__(self, other):
+        return Expr('op', '*', [_as_expr(other), self])
+
+    def __truediv__(self, other):
+        return Expr('op', '/', [self, _as_expr(other)])
+
+    def __rtruediv__(self, other):
+        return Expr('op', '/', [_as_expr(other), self])
+
+    __div__ = __truediv__
+    __rdiv__ = __rtruediv__
+
+    def __neg__(self):
+        return Expr('op', '-', [self])
+
+
+def _as_expr(value):
+    if isinstance(value, Expr):
+        return value
+    assert isinstance(value, (int, float)), TypeError(
+        'Unsupported constant: {}'.format(value))
+    return Expr('const', value)
+
+
+def tensor(name):
+    """An input tensor, which is read at the index of each element."""
+    _check_identifier(name)
+    return Expr('tensor', name)
+
+
+def scalar(name):
+    """An input scalar, which is the same for all elements."""
+    _check_identifier(name)
+    return Expr('scalar', name)
+
+
+def call(func_name, *args):
+    """Call the `MOBULA_DEVICE` function `func_name`, e.g. 'fast_exp', or a
+    functor object, e.g. 'SigmoidOp()'."""
+    return Expr('call', func_name, map(_as_expr, args))
+
+
+def _ref(expr, names):
+    if expr.kind == 'const':
+        return 'A({!r})'.format(expr.value)
+    return names[id(expr)]
+
+
+def _emit(expr, names, lines):
+    """Emit the code of `expr` after its arguments, and visit each node once."""
+    if id(expr) in names or expr.kind == 'const':
+        return
+    if expr.kind == 'scalar':
+        names[id(expr)] = 'A({})'.format(expr.value)
+        return
+    for arg in expr.args:
+        _emit(arg, names, lines)
+    name = 'v{}'.format(len(lines))
+    if expr.kind == 'tensor':
+        value = '{}[i]'.format(expr.value)
+    elif expr.kind == 'call':
+        value = '{}({})'.format(expr.value, ', '.join(
+            _ref(arg, names) for arg in expr.args))
+    elif len(expr.args) == 1:
+        value = '{}{}'.format(expr.value, _ref(expr.args[0], names))
+    else:
+        value = '{} {} {}'.format(_ref(expr.args[0], names), expr.value,
+                                  _ref(expr.args[1], names))
+    lines.append('    const A {} = {};\n'.format(name, value))
+    names[id(expr)] = name
+
+
+def generate_code(func_name, inputs, outputs, includes=None):
+    """Generate the source of the fused kernel.
+
+    Returns
+    -------
+    str
+        the source code
+    """
+    _check_identifier(func_name)
+    args_def = []
+    for expr in inputs:
+        assert expr.kind in ('tensor', 'scalar'), TypeError(
+            'The inputs should be tensors or scalars')
+        fmt = 'const T *{}' if expr.kind == 'tensor' else 'const T {}'
+        args_def.append(fmt.format(expr.value))
+    for name, _ in outputs:
+        _check_identifier(name)
+        args_def.append('T *{}'.format(name))
+    names = dict()
+    lines = []
+    for _, expr in outputs:
+        _emit(_as_expr(expr), names, lines)
+    for name, expr in outputs:
+        lines.append('    {}[i] = {};\n'.format(
+            name, _ref(_as_expr(expr), names)))
+    unknown = set(e for e in _get_leaves(outputs)) - \
+        set(e.value for e in inputs)
+    assert not unknown, ValueError(
+        'The inputs {} are not declared'.format(sorted(unknown)))
+    # the modification time is in the code, so that changing a header
+    # generates a new source file
+    include_lines = ''.join('#include "{}"  // {}\n'.format(
+        fname, get_file_hash(fname)) for fname in map(
+            os.path.abspath, includes or []))
+    return gen_code('./templates/fused_kernel.cpp')(
+        includes=include_lines,
+        func_name=func_name,
+        args_def=', '.join(args_def),
+        body=''.join(lines))
+
+
+def _get_leaves(outputs):
+    stack = [_as_expr(expr) for _, expr in outputs]
+    visited = set()
+    while stack:
+        expr = stack.pop()
+        if id(expr) in visited:
+            continue
+        visited.add(id(expr))
+        if expr.kind in ('tensor', 'scalar'):
+            yield expr.value
+        stack.extend(expr.args)
+
+
+def fuse(func_name, inputs, outputs, includes=None):
+    """Fuse the elementwise expressions into the function `func_name`.
+
+    Parameters
+    ----------
+    func_name: str
+        the name of the function, which is bound to mobula.func.<func_name>.
+    inputs: list of Expr
+        the input tensors and scalars in the order of the arguments.
+    outputs: list of (str, Expr)
+        the names and the expressions of the output tensors.
+    includes: list of str
+        the headers which define the called functions.
+
+    Returns
+    -------
+    MobulaFunc
+        func(n, *inputs, *outputs) computes the n elements.
+    """
+    code = generate_code(func_name, inputs, outputs, includes)
+    md5 = hashlib.md5()
+    md5.update(code.encode('utf-8'))
+    path = os.path.join(config.BUILD_PATH, 'build', 'fusion')
+    cpp_fname = os.path.abspath(os.path.join(path, '{}_{}.cpp'.format(
+        func_name, md5.hexdigest()[:8])))
+    if cpp_fname not in _FUSED_FUNCTIONS:
+        # the built instances are reused until the source file is modified
+        if not os.path.exists(cpp_fname):
+            makedirs(path, exist_ok=True)
+            tmp_fname = '{}.{}.tmp'.format(cpp_fname, os.getpid())
+            with open(tmp_fname, 'w') as fout:
+                fout.write(code)
+            os.rename(tmp_fname, cpp_fname)
+        functions = _get_functions_from_cpp(cpp_fname)
+        func.bind(functions)
+        _FUSED_FUNCTIONS[cpp_fname] = getattr(func, func_name)
+    return _FUSED_FUNCTIONS[cpp_fname]
@@ -9,10 +9,14 @@ import json
 import warnings
 import portalocker
 from ..internal.edict import edict
-from ..func import CFuncDef, bind, get_func_idcode, get_idcode_hash
-from ..building.build import source_to_so_ctx, get_virtual_dirname, build_context, file_is_changed, ENV_PATH
+from ..func import CFuncDef, bind, get_func_idcode, get_idcode_hash, register_dll
+from ..building.build import source_to_so_ctx, get_virtual_dirname, build_context, \
+    get_build_flag, get_runtime_lib, ENV_PATH
+from ..building.build_hash import get_file_hash
+from ..config import config
 from ..utils import get_git_hash, makedirs
-from ..internal.dtype import DType, CStruct, TemplateType, CTYPENAME2CTYPE
+from ..internal.dtype import DType, CStruct, ConstValue, TemplateType, \
+    CTYPENAME2CTYPE, get_ctype
 from ..version import OP_LOAD_MODULE_BUILD_VERSION
 from ..glue.common import CSTRUCT_CONSTRUCTOR
 from ..glue.backend import get_glue_modules
@@ -83,20 +87,38 @@ MOBULA_KERNEL_REG = _get_func_head_reg('MOBULA_(KERNEL|FUNC)')
 FUNC_REG = re.compile(
     r'^\s*(.*?)\s*\((.*?)\)(?:.*?)*')
 CPP_TEMPLATE_REG = re.compile(r'^\s*template\s*\<(.*?)\>\s*')
+CPP_TEMPLATE_BEGIN_REG = re.compile(r'^\s*template\s*\<')
+LAUNCH_BOUNDS_REG = re.compile(r'MOBULA_LAUNCH_BOUNDS\s*\(.*?\)')
+WORKSPACE_REG = re.compile(
+    r'MOBULA_WORKSPACE\s*\(\s*(\w+)\s*,\s*(\w+)\s*,\s*([^()]*?)\s*\)')
+COUNTER_REG = re.compile(r'MOBULA_COUNTER\s*\(\s*(\w+)\s*\)')
+VIEW_REG = re.compile(
+    r'MOBULA_VIEW\s*\(\s*((?:const\s+)?\w+)\s*,\s*(\w+)\s*,\s*(\d+)\s*\)')
+CONSTEXPR_REG = re.compile(
+    r'MOBULA_CONSTEXPR\s*\(\s*(\w+)\s*,\s*(\w+)\s*\)')
 
 
 def _get_template_decl(code):
+    """Get the names of the template types and of the template values, e.g.
+    `int kSize = kDynamicConst`, in the template declaration `code`."""
     match = CPP_TEMPLATE_REG.search(code)
     if match is None:
         return None
     blocks = match.groups()[0].split(',')
     templates = []
+    values = []
     for block in blocks:
-        block_sp = block.split()
+        # the default type, e.g. `typename index_t = int`, is ignored
+        block_sp = block.split('=')[0].split()
+        if not block_sp:
+            # the explicit specialization `template <>`
+            continue
         dtype, dname = block_sp
         if dtype.strip() == 'typename':
             templates.append(dname.strip())
-    return templates
+        else:
+            values.append(dname.strip())
+    return templates, values
 
 
 def parse_parameter_decl(decl):
@@ -136,9 +158,8 @@ def parse_parameter_decl(decl):
         return DType(ctypes.c_void_p, is_const=is_const), var_name
 
     # ctype func(...)
-    ctype_name = 'c_{}'.format(type_name)
-    if hasattr(ctypes, ctype_name):
-        ctype = getattr(ctypes, ctype_name)
+    ctype = get_ctype(type_name)
+    if ctype is not None:
         if is_pointer:
             ctype = ctypes.POINTER(ctype)
         return DType(ctype, is_const=is_const), var_name
@@ -167,8 +188,45 @@ def parse_parameters_list(plist):
         function name
     pars_list: list
         [(DType|TemplateType, variable name), ...]
+    workspace: dict
+        variable name -> the size expression of the workspace,
+        or None for the counter of MOBULA_COUNTER
+    views: dict
+        variable name -> the number of dimensions of the strided view
+    consts: dict
+        variable name -> the template value of MOBULA_CONSTEXPR
     """
 
+    # the launch bounds are only used by the GPU compiler
+    plist = LAUNCH_BOUNDS_REG.sub('', plist)
+    workspace = dict()
+
+    def _parse_workspace(match):
+        dtype, name, size = match.groups()
+        workspace[name] = size
+        return '{}* {}'.format(dtype, name)
+    plist = WORKSPACE_REG.sub(_parse_workspace, plist)
+
+    def _parse_counter(match):
+        name = match.groups()[0]
+        workspace[name] = None
+        # the wrapper passes an unsigned int pointer
+        return 'int* {}'.format(name)
+    plist = COUNTER_REG.sub(_parse_counter, plist)
+    views = dict()
+
+    def _parse_view(match):
+        dtype, name, ndim = match.groups()
+        views[name] = int(ndim)
+        return '{}* {}'.format(dtype, name)
+    plist = VIEW_REG.sub(_parse_view, plist)
+    consts = dict()
+
+    def _parse_constexpr(match):
+        name, tname = match.groups()
+        consts[name] = tname
+        return 'const int {}'.format(name)
+    plist = CONSTEXPR_REG.sub(_parse_constexpr, plist)
     match = FUNC_REG.search(plist)
     head, plist = match.groups()
     head_split = re.split(r'\s+', head)
@@ -176,11 +234,11 @@ def parse_parameters_list(plist):
     func_name = head_split[-1]
     rtn_type = head_split[-2] if len(head_split) == 3 else None
     pars_list = list(map(parse_parameter_decl, plist_split))
-    return rtn_type, func_name, pars_list
+    return rtn_type, func_name, pars_list, workspace, views, consts
 
 
 # runtime
-FuncInfo = namedtuple('FuncInfo', ['func', 'cpp_info'])
+FuncInfo = namedtuple('FuncInfo', ['func', 'cpp_info', 'dll'])
 CTX_FUNC_MAP = dict()  # CTX_FUNC_MAP[ctx][cpp_fname] -> FuncInfo
 
 
@@ -196,7 +254,7 @@ class CPPInfo:
     def __init__(self, cpp_fname):
         self.cpp_fname = cpp_fname
         self.function_args = dict()
-        self.dll = None
+        self.dlls = []
 
     def load_dll(self, dll_fname):
         """Load Dynamic-Link Library(*.so or *.dll).
@@ -205,15 +263,52 @@ class CPPInfo:
         ----------
         dll_fname:
             The name of Dynamic-Link Library.
+
+        Returns
+        -------
+        ctypes.CDLL
         """
+        dll = ctypes.CDLL(dll_fname)
         # keep reference
-        self.dll = ctypes.CDLL(dll_fname)
+        self.dlls.append(dll)
+        return dll
 
 
-def _build_lib(cpp_fname, code_buffer, ctx, target_name):
-    # the virtual dirname of the source code
-    cpp_path, cpp_basename = os.path.split(cpp_fname)
-    build_path = get_virtual_dirname(cpp_path)
+# the basename of a loaded runtime library -> ctypes.CDLL
+_RUNTIME_DLLS = dict()
+
+
+def load_runtime(ctx, runtime_fname):
+    """Load the runtime library which the libraries of the functions in the
+    context `ctx` are linked against, see `mobula.building.build.get_runtime_lib`.
+
+    It is loaded globally before the libraries of the functions, which share
+    it rather than loading their own state, and it is registered for the
+    functions exported by context.cpp.
+    """
+    # the basename is the soname, which is named by the hash of the flags, so
+    # a copy in AOT_PATH is the same runtime and it isn't loaded again
+    lib_name = os.path.basename(runtime_fname)
+    dll = _RUNTIME_DLLS.get(lib_name, None)
+    if dll is None:
+        dll = ctypes.CDLL(runtime_fname, mode=ctypes.RTLD_GLOBAL)
+        _RUNTIME_DLLS[lib_name] = dll
+        register_dll(ctx, dll)
+    return dll
+
+
+def _load_dll_with_runtime(cpp_info, ctx, dll_fname, runtime_fname):
+    if runtime_fname is not None:
+        load_runtime(ctx, runtime_fname)
+    dll = cpp_info.load_dll(dll_fname)
+    if runtime_fname is None:
+        # the buildin objects are linked into the library
+        register_dll(ctx, dll)
+    return dll
+
+
+def write_wrapper(cpp_fname, code_buffer, wrapper_fname):
+    """Write the wrapper file which includes `cpp_fname` and exports `code_buffer`."""
     create_time = time.strftime('%a %Y-%m-%d %H:%M:%S (%z)', time.localtime())
     git_hash = get_git_hash()
     extra_code = gen_code('./templates/header.cpp')(
@@ -222,15 +317,20 @@ def _build_lib(cpp_fname, code_buffer, ctx, target_name):
         create_time=create_time,
         inc_fname=os.path.abspath(cpp_fname),
         code=code_buffer)
+    with open(wrapper_fname, 'w') as fout:
+        fout.write(extra_code)
+
 
+def _build_lib(cpp_fname, code_buffer, ctx, target_name, wrapper_name):
+    # the virtual dirname of the source code
+    cpp_path, cpp_basename = os.path.split(cpp_fname)
+    build_path = get_virtual_dirname(cpp_path)
     build_path_ctx = os.path.join(build_path, 'build', ctx)
     makedirs(build_path_ctx, exist_ok=True)
 
     # build so
-    cpp_wrapper_fname = os.path.join(build_path_ctx,
-                                     os.path.splitext(cpp_basename)[0] + '_wrapper.cpp')
-    with open(cpp_wrapper_fname, 'w') as fout:
-        fout.write(extra_code)
+    cpp_wrapper_fname = os.path.join(build_path_ctx, wrapper_name)
+    write_wrapper(cpp_fname, code_buffer, cpp_wrapper_fname)
     # build lib
     srcs = [cpp_wrapper_fname]
 
@@ -245,31 +345,70 @@ def _dtype_to_tvm_value_type(dtype):
     return 'v_float64'
 
 
-def _get_args_inst_mx(i, t):
+def _get_args_inst_mx(i, t, ndim=None):
     s = 'args.values[%d].%s' % (i, _dtype_to_tvm_value_type(t))
     if t.is_pointer:
-        return '''
-          static_cast<{dtype}>(
+        data = '''static_cast<{dtype}>(
             static_cast<DLTensor*>({tv})->data)'''.format(dtype=t.cname, tv=s)
+        if ndim is not None:
+            # the NDArrays of MXNet are contiguous
+            return '''
+          mobula::StridedView<{dtype}, {ndim}>(
+            {data}, nullptr)'''.format(dtype=t.cname.replace('*', '').strip(),
+                                       ndim=ndim, data=data)
+        return '\n          ' + data
     else:
         s = '\n          ' + s
     return s
 
 
-def _generate_kernel_code(func_idcode_hash, arg_types, arg_names, func_name):
-    args_def = ', '.join(['{ctype} {name}'.format(
+def _get_args_inst(dtype, name, workspace, views):
+    if name in workspace:
+        return '{}_workspace.data()'.format(name)
+    if name in views:
+        # `name_layout` is nullptr if the tensor is contiguous
+        return 'mobula::StridedView<{}, {}>({}, {}_layout)'.format(
+            dtype.cname.replace('*', '').strip(), views[name], name, name)
+    return name
+
+
+def _generate_kernel_code(func_idcode_hash, arg_types, arg_names, func_name,
+                          workspace=None, views=None):
+    workspace = workspace or dict()
+    views = views or dict()
+    args_def = ', '.join([('{ctype} {name}, const int64_t* {name}_layout'
+                           if name in views else '{ctype} {name}').format(
         ctype=dtype.cname,
         name=name
-    ) for dtype, name in zip(arg_types, arg_names)])
-    args_inst = ', '.join(arg_names)
+    ) for dtype, name in zip(arg_types, arg_names) if name not in workspace])
+    args_inst = ', '.join([_get_args_inst(dtype, name, workspace, views)
+                           for dtype, name in zip(arg_types, arg_names)])
+    # the workspaces are allocated after the device is set
+    workspace_code = ''
+    num_counters = 0
+    for dtype, name in zip(arg_types, arg_names):
+        if name not in workspace:
+            continue
+        if workspace[name] is None:
+            workspace_code += '  KernelCounter {name}_workspace({index});\n'.format(
+                name=name, index=num_counters)
+            num_counters += 1
+        else:
+            workspace_code += '  Workspace<{dtype}> {name}_workspace({size});\n'.format(
+                dtype=dtype.cname.replace('*', ''), name=name, size=workspace[name])
 
     kernel_code = gen_code('./templates/kernel_code.cpp')(
         func_idcode_hash=func_idcode_hash,
         args_def=args_def,
         func_name=func_name,
-        args_inst=args_inst)
+        args_inst=args_inst,
+        workspace_code=workspace_code)
     kernel_code += '\n'
 
+    if workspace:
+        # the asynchronous execution for MXNet doesn't support workspace
+        return kernel_code
+
     args_def_async_mx = ', '.join(['{ctype} {name}'.format(
         ctype='NDArrayHandle' if dtype.is_pointer else dtype.cname,
         name=name
@@ -278,8 +417,8 @@ def _generate_kernel_code(func_idcode_hash, arg_types, arg_names, func_name):
     using_async_mx = all(
         map(lambda dtype: 'void' not in dtype.cname, arg_types))
     if using_async_mx:
-        args_inst_mx = [_get_args_inst_mx(i, t)
-                        for i, t in enumerate(arg_types)]
+        args_inst_mx = [_get_args_inst_mx(i, t, views.get(name, None))
+                        for i, (t, name) in enumerate(zip(arg_types, arg_names))]
         const_loc = []
         for i, dtype in enumerate(arg_types):
             if dtype.is_const and dtype.is_pointer:
@@ -290,7 +429,7 @@ def _generate_kernel_code(func_idcode_hash, arg_types, arg_names, func_name):
         async_mx_code = gen_code('./templates/async_mx_code.cpp')(
             func_idcode_hash=func_idcode_hash,
             func_name=func_name,
-            args_inst=args_inst,
+            args_inst=', '.join(arg_names),
             args_inst_mx=','.join(args_inst_mx),
             num_const=num_const,
             const_loc_code=const_loc_code,
@@ -323,7 +462,7 @@ def _generate_func_code(func_idcode_hash, rtn_type, arg_types, arg_names, func_n
     return code
 
 
-def _update_template_inst_map(idcode, template_functions, cfunc, arg_types):
+def update_template_inst_map(idcode, template_functions, cfunc, arg_types):
     # template function
     func_name = cfunc.func_name
     func_idcode_hash = get_idcode_hash(idcode)
@@ -347,6 +486,13 @@ def _update_template_inst_map(idcode, template_functions, cfunc, arg_types):
 
     template_inst = [template_mapping[tname]
                      for tname in cfunc.template_list]
+    # the values of the specialized MOBULA_CONSTEXPR parameters
+    const_mapping = dict((cfunc.consts[name], str(rtype.value))
+                         for rtype, name in zip(arg_types, cfunc.arg_names)
+                         if isinstance(rtype, ConstValue))
+    if const_mapping:
+        template_inst.extend(const_mapping.get(tname, 'mobula::kDynamicConst')
+                             for tname in cfunc.const_template_list)
     template_post = '<%s>' % (', '.join(template_inst)
                               ) if template_inst else ''
     rtn_type = cfunc.rtn_type
@@ -356,19 +502,19 @@ def _update_template_inst_map(idcode, template_functions, cfunc, arg_types):
     func_kind = cfunc.func_kind
     if func_kind == CFuncDef.KERNEL:
         code = _generate_kernel_code(func_idcode_hash, arg_types, cfunc.arg_names, '({}_kernel{})'.format(
-            func_name, template_post))
+            func_name, template_post), cfunc.workspace, cfunc.views)
     else:
         code = _generate_func_code(
             func_idcode_hash, rtn_type, arg_types, cfunc.arg_names, func_name + template_post)
     template_functions[idcode] = (code, rtn_type)
 
 
-def _add_function(func_map, func_idcode, rtn_type, cpp_info, dll_fname):
+def _add_function(func_map, func_idcode, rtn_type, cpp_info, dll, dll_fname):
     func_idcode_hash = get_idcode_hash(func_idcode)
-    func = getattr(cpp_info.dll, func_idcode_hash, None)
+    func = getattr(dll, func_idcode_hash, None)
     if func is None:
         functions = [name for name in dir(
-            cpp_info.dll) if not name.startswith('_')]
+            dll) if not name.startswith('_')]
         raise NameError('No function `{}` in DLL {}, current functions: {}'.format(
             func_idcode, dll_fname, functions))
     func.restype = CTYPENAME2CTYPE[rtn_type]
@@ -379,7 +525,123 @@ def _add_function(func_map, func_idcode, rtn_type, cpp_info, dll_fname):
             warnings.warn('The function `{}` in `{}` will be overridden by that in `{}`'.format(
                 func_idcode, old_func.cpp_info.cpp_fname, cpp_info.cpp_fname))
 
-    func_map[func_idcode] = FuncInfo(func=func, cpp_info=cpp_info)
+    func_map[func_idcode] = FuncInfo(func=func, cpp_info=cpp_info, dll=dll)
+
+
+# the index file in the directory built by `mobula.building.aot`
+AOT_INDEX_FILENAME = 'mobula_aot.json'
+# AOT_PATH -> {'functions': ctx -> cpp basename -> idcode -> (library, rtn_type),
+#             'runtimes': ctx -> the runtime library}
+_AOT_INDEX = dict()
+
+
+def _get_aot_index(aot_path):
+    index = _AOT_INDEX.get(aot_path, None)
+    if index is None:
+        index_fname = os.path.join(aot_path, AOT_INDEX_FILENAME)
+        with open(index_fname) as fin:
+            data = json.load(fin)
+        if data.get('version') != OP_LOAD_MODULE_BUILD_VERSION:
+            warnings.warn('The libraries in {} are built by MobulaOP {} rather than {}, and they will be ignored.'.format(
+                aot_path, data.get('version'), OP_LOAD_MODULE_BUILD_VERSION))
+            index = dict(functions=dict(), runtimes=dict())
+        else:
+            # the runtimes are missing on Windows
+            index = dict(functions=data['functions'],
+                         runtimes=data.get('runtimes', dict()))
+        _AOT_INDEX[aot_path] = index
+    return index
+
+
+def _load_aot_function(func_map, idcode, ctx, cpp_info):
+    """Load the function from the libraries built ahead of time.
+
+    The libraries are found by the basename of the source file, and neither
+    the source nor the build information is checked.
+
+    Returns
+    -------
+    bool: whether the function is loaded
+    """
+    aot_path = config.AOT_PATH
+    if not aot_path:
+        return False
+    cpp_basename = os.path.basename(cpp_info.cpp_fname)
+    index = _get_aot_index(aot_path)
+    inst = index['functions'].get(ctx, dict()).get(
+        cpp_basename, dict()).get(idcode, None)
+    if inst is None:
+        return False
+    dll_fname = os.path.join(aot_path, inst[0])
+    runtime_name = index['runtimes'].get(ctx, None)
+    dll = _load_dll_with_runtime(
+        cpp_info, ctx, dll_fname,
+        os.path.join(aot_path, runtime_name) if runtime_name else None)
+    _add_function(func_map, idcode, inst[1], cpp_info, dll, dll_fname)
+    return True
+
+
+# the name of the launch configs tuned by `config.AUTOTUNE` in the build
+# information, which maps the tuning key to the launch config, e.g.
+#   {"roi_align_forward_kernel...|cuda:0|2^20": {"block_size": 256, ...}}
+TUNING_NAME = 'tuning'
+
+
+def get_build_info_fname(cpp_fname):
+    """Get the build information of the libraries of a source file."""
+    cpp_path, cpp_basename = os.path.split(cpp_fname)
+    build_path = os.path.join(get_virtual_dirname(cpp_path), 'build')
+    return os.path.join(build_path, os.path.splitext(cpp_basename)[0] + '.json')
+
+
+def load_tuning(cpp_fname):
+    """Load the tuned launch configs of the kernels of a source file.
+
+    Returns
+    -------
+    dict: the tuning key -> the launch config
+    """
+    build_info_fname = get_build_info_fname(cpp_fname)
+    if not os.path.exists(build_info_fname):
+        return dict()
+    with open(build_info_fname) as build_info_fs:
+        portalocker.lock(build_info_fs, portalocker.LOCK_SH)
+        js_data = build_info_fs.read()
+        portalocker.unlock(build_info_fs)
+    if not js_data:
+        return dict()
+    map_data = json.loads(js_data)
+    if map_data.get('version') != OP_LOAD_MODULE_BUILD_VERSION:
+        return dict()
+    return map_data.get(TUNING_NAME, dict())
+
+
+def save_tuning(cpp_fname, key, launch):
+    """Save the tuned launch config of a kernel into the build information,
+    which is cleared when the source file changes."""
+    build_info_fname = get_build_info_fname(cpp_fname)
+    makedirs(os.path.dirname(build_info_fname), exist_ok=True)
+    with open(build_info_fname, 'a+') as build_info_fs:
+        portalocker.lock(build_info_fs, portalocker.LOCK_EX)
+        try:
+            build_info_fs.seek(0)
+            js_data = build_info_fs.read()
+            if js_data:
+                map_data = json.loads(js_data)
+            else:
+                # the kernels loaded ahead of time have no build information
+                map_data = dict(version=OP_LOAD_MODULE_BUILD_VERSION,
+                                source_hash=get_file_hash(cpp_fname))
+            if map_data.get('version') != OP_LOAD_MODULE_BUILD_VERSION:
+                return
+            map_data.setdefault(TUNING_NAME, dict())[key] = launch
+            build_info_fs.seek(0)
+            build_info_fs.truncate()
+            json.dump(map_data, build_info_fs)
+            build_info_fs.flush()
+            os.fsync(build_info_fs.fileno())
+        finally:
+            portalocker.unlock(build_info_fs)
 
 
 class OpLoader:
@@ -412,20 +674,30 @@ class OpLoader:
         # func_map: dict mapping idcode to CFunction
         func_map = CTX_FUNC_MAP[ctx][cpp_fname]
 
-        if idcode not in func_map:
+        if idcode not in func_map and config.AOT_PATH and \
+                any(isinstance(t, ConstValue) for t in arg_types) and \
+                not _load_aot_function(func_map, idcode, ctx, cpp_info):
+            # the specialized instance which isn't built ahead of time falls
+            # back to the generic instance rather than being built
+            arg_types = [DType(t.ctype, t.is_const) if isinstance(
+                t, ConstValue) else t for t in arg_types]
+            idcode = get_func_idcode(cfunc.func_name, arg_types)
+
+        if idcode not in func_map and not _load_aot_function(func_map, idcode, ctx, cpp_info):
             '''
             *load function* when one of the following conditions is True:
             1. idcode is not loaded
             2. loading the function with same function name but different cpp filename
+
+            Each template instance is built into its own library, so a new instance
+            doesn't rebuild the others.
             '''
             cpp_path, cpp_basename = os.path.split(cpp_fname)
             cpp_path = get_virtual_dirname(cpp_path)
             build_path = os.path.join(cpp_path, 'build')
 
-            use_template = bool(cfunc.template_list)
             makedirs(build_path, exist_ok=True)
-            build_info_fname = os.path.join(
-                build_path, os.path.splitext(cpp_basename)[0] + '.json')
+            build_info_fname = get_build_info_fname(cpp_fname)
             build_info_fs = open(build_info_fname, 'a+')
             portalocker.lock(build_info_fs, portalocker.LOCK_EX)
             build_info_fs.seek(0)
@@ -456,55 +728,58 @@ Please update MobulaOP.""" % (map_data.get('version'), OP_LOAD_MODULE_BUILD_VERS
 
             so_prefix = os.path.join(
                 cpp_path, 'build', os.path.splitext(cpp_basename)[0])
+            idcode_hash = get_idcode_hash(idcode)
             # The filename of build target
             dll_fname_format = '{prefix}_{ctx}'.format(
-                prefix=so_prefix, ctx=ctx) + '_{build_id}.so'
-            dll_fname = dll_fname_format.format(build_id=build_id)
-
-            file_changed = file_is_changed(cpp_fname)
-            dll_existed = os.path.exists(dll_fname)
-            func_existed = idcode in template_functions
-
-            if file_changed or not dll_existed or not func_existed or is_old_version:
-                # Rebuild DLL file
-                try:
-                    # try to remove old DLL file
-                    os.remove(dll_fname)
-                except:
-                    pass
-                if file_changed:
-                    # clear template_functions since some functions may have been deleted or renamed after codefile is changed.
-                    template_functions.clear()
-                if file_changed or not func_existed:
-                    '''
-                    we increase `build_id` by 1 when one of the following conditions is True:
-                    1. the cpp file has been changed
-                    2. new idcode
-
-                    When the cpp file is not changed, and idcode exists in template_functions,
-                    `build_id` will be not changed.
-                    '''
-                    build_id += 1
-                dll_fname = dll_fname_format.format(build_id=build_id)
+                prefix=so_prefix, ctx=ctx) + '_{build_id}_{idcode_hash}.so'
+
+            # the source file is compared with the one which the libraries are built from
+            source_hash = get_file_hash(cpp_fname)
+            file_changed = map_data.get('source_hash') != source_hash
+            if file_changed or is_old_version:
+                '''
+                we increase `build_id` by 1 when the cpp file has been changed,
+                in order to avoid loading the stale libraries with the same filename.
+                '''
+                for old_idcode in template_functions:
+                    try:
+                        # try to remove old DLL file
+                        os.remove(dll_fname_format.format(
+                            build_id=build_id, idcode_hash=get_idcode_hash(old_idcode)))
+                    except:
+                        pass
+                # clear template_functions since some functions may have been deleted or renamed after codefile is changed.
+                template_functions.clear()
+                build_id += 1
+            # the launch configs are tuned again for the new libraries
+            tuning = dict() if file_changed or is_old_version else \
+                map_data.get(TUNING_NAME, dict())
+            dll_fname = dll_fname_format.format(
+                build_id=build_id, idcode_hash=idcode_hash)
+
+            if idcode not in template_functions or not os.path.exists(dll_fname):
                 # build code
                 if idcode not in template_functions:
-                    _update_template_inst_map(
+                    update_template_inst_map(
                         idcode, template_functions, cfunc, arg_types)
-                # collects template instances code into code_buffer
-                code_buffer = ''.join([v[0]
-                                       for v in template_functions.values()])
+                # only the code of this template instance
+                code_buffer = template_functions[idcode][0]
+                wrapper_name = '{}_{}_wrapper.cpp'.format(
+                    os.path.splitext(cpp_basename)[0], idcode_hash)
 
                 with build_context():
                     try:
-                        _build_lib(cpp_fname, code_buffer, ctx, dll_fname)
+                        _build_lib(cpp_fname, code_buffer, ctx,
+                                   dll_fname, wrapper_name)
                     except:
                         # if build fail, unlock the build info file
                         portalocker.unlock(build_info_fs)
                         raise
                 # update template_functions
                 map_data = dict(version=OP_LOAD_MODULE_BUILD_VERSION,
-                                build_id=build_id)
+                                build_id=build_id, source_hash=source_hash)
                 map_data[TEMPLATE_FUNCTION_NAME] = template_functions
+                map_data[TUNING_NAME] = tuning
                 # clear the old context and write json data
                 build_info_fs.seek(0)
                 build_info_fs.truncate()
@@ -513,26 +788,34 @@ Please update MobulaOP.""" % (map_data.get('version'), OP_LOAD_MODULE_BUILD_VERS
                 os.fsync(build_info_fs.fileno())
             portalocker.unlock(build_info_fs)
 
-            # load all functions in the dll
-            cpp_info.load_dll(dll_fname)
-
-            # import all functions
-            for func_idcode in template_functions.keys():
-                _add_function(func_map,
-                              func_idcode, template_functions[func_idcode][1], cpp_info, dll_fname)
+            # load the function in the dll, after the runtime which it is
+            # linked against
+            runtime_fname = get_runtime_lib(ctx, *get_build_flag(ctx)[:3])
+            dll = _load_dll_with_runtime(
+                cpp_info, ctx, dll_fname, runtime_fname)
+            _add_function(func_map, idcode,
+                          template_functions[idcode][1], cpp_info, dll, dll_fname)
 
         self.func = func_map[idcode].func
         self.cpp_info = func_map[idcode].cpp_info
+        self.dll = func_map[idcode].dll
+        self.idcode = idcode
         self.idcode_hash = get_idcode_hash(idcode)
 
     def __call__(self, *args, **kwargs):
         return self.func(*args, **kwargs)
 
+    def load_tuning(self):
+        return load_tuning(self.cpp_info.cpp_fname)
+
+    def save_tuning(self, key, launch):
+        save_tuning(self.cpp_info.cpp_fname, key, launch)
+
     def get_async_func(self, glue_mod):
         async_name = getattr(glue_mod, 'async_name', None)
         if async_name is None:
             return None
-        return glue_mod.get_async_func(self.cpp_info, self.idcode_hash)
+        return glue_mod.get_async_func(self.dll, self.idcode_hash)
 
 
 def _get_functions_from_cpp(cpp_fname):
@@ -541,13 +824,19 @@ def _get_functions_from_cpp(cpp_fname):
     func_kind = ''
     func_started = False
     template_list = []
+    const_template_list = []
+    # a template declaration may span several lines
+    template_decl = ''
     cpp_info = CPPInfo(cpp_fname=cpp_fname)
     function_args = cpp_info.function_args
     for line in open(cpp_fname):
         if not func_started:
-            current_template_list = _get_template_decl(line)
-            if current_template_list is not None:
-                template_list = current_template_list
+            if template_decl or CPP_TEMPLATE_BEGIN_REG.search(line):
+                template_decl += line.strip() + ' '
+                if template_decl.count('<') <= template_decl.count('>'):
+                    template_list, const_template_list = _get_template_decl(
+                        template_decl)
+                    template_decl = ''
             match = MOBULA_KERNEL_REG.search(line)
             if match is not None:
                 func_def = ''
@@ -567,8 +856,8 @@ def _get_functions_from_cpp(cpp_fname):
             if unmatched_brackets == 0:
                 func_def = func_def.replace('\n', '').replace('\r', '')
                 func_started = False
-                rtn_type, kernel_name, par_list = parse_parameters_list(
-                    func_def)
+                rtn_type, kernel_name, par_list, workspace, views, consts = \
+                    parse_parameters_list(func_def)
                 # template name check
                 template_set = set(template_list)
                 assert len(template_set) == len(template_list),\
@@ -583,6 +872,13 @@ def _get_functions_from_cpp(cpp_fname):
                         use_template = True
                 if not use_template:
                     template_list = []
+                # the template values are given in order when specialized
+                if consts:
+                    assert set(consts.values()) == set(const_template_list),\
+                        Exception('The template values {} should be the ones of MOBULA_CONSTEXPR {}'.format(
+                            const_template_list, consts))
+                else:
+                    const_template_list = []
 
                 if func_kind == CFuncDef.KERNEL:
                     assert kernel_name.endswith('_kernel'),\
@@ -590,6 +886,15 @@ def _get_functions_from_cpp(cpp_fname):
                             e.g. addition_forward_kernel')
                     func_name = kernel_name[:-len('_kernel')]
                 elif func_kind == CFuncDef.FUNC:
+                    assert not workspace,\
+                        Exception('MOBULA_WORKSPACE is only supported by MOBULA_KERNEL, \
+                            please use `Workspace` in MOBULA_FUNC {}'.format(kernel_name))
+                    assert not views,\
+                        Exception('MOBULA_VIEW is only supported by MOBULA_KERNEL, \
+                            please use `StridedView` in MOBULA_FUNC {}'.format(kernel_name))
+                    assert not consts,\
+                        Exception('MOBULA_CONSTEXPR is only supported by MOBULA_KERNEL, \
+                            please use the template in MOBULA_FUNC {}'.format(kernel_name))
                     func_name = kernel_name
                 else:
                     raise Exception(
@@ -602,12 +907,17 @@ def _get_functions_from_cpp(cpp_fname):
                                      arg_types=[t[0] for t in par_list],
                                      rtn_type=rtn_type,
                                      template_list=template_list,
+                                     workspace=workspace,
+                                     views=views,
+                                     consts=consts,
+                                     const_template_list=const_template_list,
                                      loader=OpLoader,
                                      loader_kwargs=dict(
                                          cpp_info=cpp_info,
                                      )
                                      )
                 template_list = []
+                const_template_list = []
                 function_args[func_name] = funcdef_args
 
     assert unmatched_brackets == 0,\
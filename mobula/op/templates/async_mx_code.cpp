@@ -3,6 +3,7 @@ MOBULA_DLL PackedFunc* ${func_idcode_hash}_register_mx() {
       "${func_idcode_hash}",
       [](TVMArgs args, TVMRetValue*) {
         KERNEL_RUN_BEGIN(DEV_ID);
+        const mobula::ProfilerScope profiler_scope("${func_idcode_hash}");
         KERNEL_RUN_STREAM(${func_name}, STRM)(${args_inst_mx}
         );
         KERNEL_RUN_END();
@@ -0,0 +1,16 @@
+/*
+ * The fused elementwise kernel generated by mobula.op.fusion
+ *
+ * WARNING! All changes made in this file will be lost!
+ */
+${includes}
+namespace mobula {
+
+template <typename T, typename index_t = int>
+MOBULA_KERNEL ${func_name}_kernel(const index_t n, ${args_def}) {
+  typedef typename AccType<T>::type A;
+  parfor(n, [&](index_t i) {
+${body}  });
+}
+
+}  // namespace mobula
@@ -1,5 +1,6 @@
 MOBULA_DLL void ${func_idcode_hash}(const int device_id, ${args_def}) {
   KERNEL_RUN_BEGIN(device_id);
-  KERNEL_RUN(${func_name})(${args_inst});
+  const mobula::ProfilerScope profiler_scope("${func_idcode_hash}");
+${workspace_code}  KERNEL_RUN(${func_name})(${args_inst});
   KERNEL_RUN_END();
 }
@@ -0,0 +1,208 @@
+"""Profile the kernels and the calls of MobulaOP functions.
+
+Example:
+    with mobula.profiler.profile() as prof:
+        mobula.func.foo(n, a, b)
+    print(prof.summary())
+    prof.export_chrome_trace('trace.json')  # open it in chrome://tracing
+
+The profiler records two kinds of events:
+    call: a call of `mobula.func.<name>` in Python. `marshal_us` is the time
+        from the call to the launch of the C function, which includes the
+        dispatch and the extraction of the pointers.
+    kernel: a launch of KERNEL_RUN in C++, named by the exported function
+        (func_idcode_hash). `wall_us` is the time until KERNEL_RUN returns,
+        and `device_us` is measured by the events on GPU. When the kernels are
+        launched asynchronously, `wall_us` on GPU is the launch time.
+
+The profiler costs a flag check per call and per kernel when it is stopped.
+Build the GPU libraries with `config.USING_NVTX` to add the NVTX/roctx ranges
+of the kernels to Nsight Systems or rocprof as well.
+"""
+__all__ = ['start', 'stop', 'profile', 'Profile']
+
+import contextlib
+import ctypes
+import json
+import threading
+import time
+from . import func
+from .config import config
+
+# the same clock as std::chrono::steady_clock on Linux
+_now = getattr(time, 'monotonic', time.time)
+
+
+class ProfilerEvent(ctypes.Structure):
+    # the same layout as `ProfilerEvent` in profiler.h
+    _fields_ = [('name', ctypes.c_char_p),
+                ('n', ctypes.c_int64),
+                ('num_threads', ctypes.c_int32),
+                ('device_id', ctypes.c_int32),
+                ('start_us', ctypes.c_double),
+                ('wall_us', ctypes.c_double),
+                ('device_us', ctypes.c_double)]
+
+
+_CTXS = ('cpu', 'cuda', 'hip')
+
+
+def _take_kernel_events():
+    events = []
+    buf = (ProfilerEvent * 1024)()
+    for ctx in _CTXS:
+        for take in func.get_dll_funcs(ctx, 'profiler_take_events'):
+            take.argtypes = [ctypes.POINTER(ProfilerEvent), ctypes.c_int]
+            take.restype = ctypes.c_int
+            while True:
+                num = take(buf, len(buf))
+                for e in buf[:num]:
+                    events.append(dict(
+                        kind='kernel', name=e.name.decode('utf-8'), n=e.n,
+                        num_threads=e.num_threads, device_id=e.device_id,
+                        start_us=e.start_us, wall_us=e.wall_us,
+                        device_us=e.device_us))
+                if num < len(buf):
+                    break
+    return events
+
+
+class Profile:
+    """The events recorded between `start` and `stop`."""
+
+    def __init__(self):
+        self.events = []
+        self._lock = threading.Lock()
+        self._local = threading.local()
+
+    def call(self, mfunc, args, kwargs):
+        """Call `mfunc._call(args, kwargs)`, and record it."""
+        self._local.launch = None
+        start = _now()
+        try:
+            return mfunc._call(args, kwargs)
+        finally:
+            end = _now()
+            launch = self._local.launch or end
+            event = dict(kind='call', name=mfunc.name,
+                         start_us=start * 1e6, wall_us=(end - start) * 1e6,
+                         marshal_us=(launch - start) * 1e6,
+                         thread_id=threading.current_thread().ident)
+            with self._lock:
+                self.events.append(event)
+
+    def mark_launch(self):
+        """Mark that the C function is being launched on this thread."""
+        self._local.launch = _now()
+
+    def collect(self):
+        """Move the recorded kernels of the loaded libraries into `events`.
+        It waits for the kernels whose device time is measured."""
+        kernels = _take_kernel_events()
+        with self._lock:
+            self.events.extend(kernels)
+
+    def summary(self, sort_by='wall_us'):
+        """Get the table of the total time of each call and kernel.
+
+        Returns
+        -------
+        str
+        """
+        self.collect()
+        rows = dict()
+        for e in self.events:
+            key = (e['kind'], e['name'])
+            row = rows.setdefault(key, dict(
+                kind=e['kind'], name=e['name'], count=0, wall_us=0.0,
+                device_us=0.0, marshal_us=0.0))
+            row['count'] += 1
+            row['wall_us'] += e['wall_us']
+            row['device_us'] += max(e.get('device_us', 0.0), 0.0)
+            row['marshal_us'] += e.get('marshal_us', 0.0)
+        rows = sorted(rows.values(), key=lambda r: -r[sort_by])
+        fmt = '{:<6} {:<40} {:>8} {:>12} {:>12} {:>12} {:>12}'
+        lines = [fmt.format('kind', 'name', 'count', 'wall(ms)', 'avg(us)',
+                            'device(ms)', 'marshal(ms)')]
+        for r in rows:
+            lines.append(fmt.format(
+                r['kind'], r['name'][:40], r['count'],
+                '{:.3f}'.format(r['wall_us'] / 1e3),
+                '{:.1f}'.format(r['wall_us'] / r['count']),
+                '{:.3f}'.format(r['device_us'] / 1e3),
+                '{:.3f}'.format(r['marshal_us'] / 1e3)))
+        return '\n'.join(lines)
+
+    def chrome_trace(self):
+        """Get the events in the Chrome trace format.
+
+        The calls are on the tracks of their Python threads, and the kernels
+        are on the track of their device.
+
+        Returns
+        -------
+        dict
+        """
+        self.collect()
+        trace = []
+        for e in self.events:
+            if e['kind'] == 'call':
+                pid, tid = 'python', e['thread_id']
+                args = dict(marshal_us=e['marshal_us'])
+            else:
+                pid = 'cpu' if e['device_id'] < 0 else '{}:{}'.format(
+                    config.GPU_BACKEND, e['device_id'])
+                tid = 'kernels'
+                args = dict(n=e['n'], num_threads=e['num_threads'])
+                if e['device_us'] >= 0:
+                    args['device_us'] = e['device_us']
+            trace.append(dict(name=e['name'], cat=e['kind'], ph='X',
+                              ts=e['start_us'], dur=e['wall_us'], pid=pid,
+                              tid=tid, args=args))
+        return dict(traceEvents=trace, displayTimeUnit='ms')
+
+    def export_chrome_trace(self, fname):
+        """Write the events into the file `fname` in the Chrome trace format,
+        which is opened by chrome://tracing or Perfetto."""
+        with open(fname, 'w') as fout:
+            json.dump(self.chrome_trace(), fout)
+
+
+def start():
+    """Start recording the calls and the kernels into a new Profile.
+
+    Returns
+    -------
+    Profile
+    """
+    assert func.get_profiler() is None, RuntimeError(
+        'The profiler has been started')
+    prof = Profile()
+    # drop the kernels recorded before
+    _take_kernel_events()
+    func.set_profiler(prof)
+    return prof
+
+
+def stop():
+    """Stop recording, and collect the kernels.
+
+    Returns
+    -------
+    Profile
+    """
+    prof = func.get_profiler()
+    assert prof is not None, RuntimeError('The profiler is not started')
+    func.set_profiler(None)
+    prof.collect()
+    return prof
+
+
+@contextlib.contextmanager
+def profile():
+    """Profile the calls and the kernels in the `with` block."""
+    prof = start()
+    try:
+        yield prof
+    finally:
+        stop()
@@ -1,4 +1,4 @@
 """version information"""
-__version__ = 2.51
+__version__ = 2.52
 
 OP_LOAD_MODULE_BUILD_VERSION = __version__
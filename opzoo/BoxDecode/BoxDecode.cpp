@@ -0,0 +1,121 @@
+#include "mobula_op.h"
+
+namespace mobula {
+
+/*!
+ * \brief The parameters of the deltas of boxes, which decode
+ *  (dx, dy, dw, dh) * stds + means with the anchor (x1, y1, x2, y2) into
+ *  the center (x + dx * w, y + dy * h) and the size (w * exp(dw), h * exp(dh)).
+ */
+template <typename T>
+struct BoxDecodeParam {
+  T stds[4], means[4];
+  // the maximum of dw and dh, e.g. log(1000 / 16)
+  T clip;
+  // the boxes are clipped to the image when its size is positive
+  T im_height, im_width;
+};
+
+/*!
+ * \brief The box, and whether its coordinates are inside the image, of the
+ *  delta d with the anchor a.
+ *  The gradients are from the unclipped coordinates.
+ */
+template <typename A, typename T>
+MOBULA_DEVICE void decode_box(const T* a, const T* d,
+                              const BoxDecodeParam<A>& param, A* box,
+                              bool* inside, A* size, bool* unclipped) {
+  const A aw = static_cast<A>(a[2]) - static_cast<A>(a[0]);
+  const A ah = static_cast<A>(a[3]) - static_cast<A>(a[1]);
+  const A ax = static_cast<A>(a[0]) + static_cast<A>(0.5) * aw;
+  const A ay = static_cast<A>(a[1]) + static_cast<A>(0.5) * ah;
+  A delta[4];
+  for (int k = 0; k < 4; ++k) {
+    delta[k] = static_cast<A>(d[k]) * param.stds[k] + param.means[k];
+  }
+  unclipped[0] = delta[2] < param.clip;
+  unclipped[1] = delta[3] < param.clip;
+  size[0] = aw * exp(min(delta[2], param.clip));
+  size[1] = ah * exp(min(delta[3], param.clip));
+  const A cx = ax + delta[0] * aw;
+  const A cy = ay + delta[1] * ah;
+  box[0] = cx - static_cast<A>(0.5) * size[0];
+  box[1] = cy - static_cast<A>(0.5) * size[1];
+  box[2] = cx + static_cast<A>(0.5) * size[0];
+  box[3] = cy + static_cast<A>(0.5) * size[1];
+  for (int k = 0; k < 4; ++k) {
+    const A bound = k % 2 == 0 ? param.im_width : param.im_height;
+    inside[k] = bound <= 0 || (box[k] >= 0 && box[k] <= bound);
+    if (bound > 0) box[k] = min(max(box[k], static_cast<A>(0)), bound);
+  }
+}
+
+/*!
+ * \brief Decode the deltas (batch_size, num_anchors, num_classes * 4) with
+ *  the anchors (num_anchors, 4), or (batch_size, num_anchors, 4) when
+ *  batched_anchors, into the boxes (x1, y1, x2, y2) of the same shape.
+ *  nthreads is batch_size * num_anchors * num_classes.
+ */
+template <typename T>
+MOBULA_KERNEL box_decode_forward_kernel(
+    const int nthreads, const T* anchors, const T* deltas,
+    const int num_anchors, const int num_classes, const int batched_anchors,
+    const T std0, const T std1, const T std2, const T std3, const T mean0,
+    const T mean1, const T mean2, const T mean3, const T clip,
+    const T im_height, const T im_width, T* boxes) {
+  typedef typename AccType<T>::type A;
+  const BoxDecodeParam<A> param = {{std0, std1, std2, std3},
+                                   {mean0, mean1, mean2, mean3},
+                                   clip,
+                                   im_height,
+                                   im_width};
+  parfor(nthreads, [&](int index) {
+    const int n = index / num_classes;
+    const T* a = anchors + (batched_anchors ? n : n % num_anchors) * 4;
+    A box[4], size[2];
+    bool inside[4], unclipped[2];
+    decode_box(a, deltas + index * 4, param, box, inside, size, unclipped);
+    for (int k = 0; k < 4; ++k) boxes[index * 4 + k] = box[k];
+  });
+}
+
+// the gradients of the deltas are written into ddeltas
+template <typename T>
+MOBULA_KERNEL box_decode_backward_kernel(
+    const int nthreads, const T* anchors, const T* deltas,
+    const int num_anchors, const int num_classes, const int batched_anchors,
+    const T std0, const T std1, const T std2, const T std3, const T mean0,
+    const T mean1, const T mean2, const T mean3, const T clip,
+    const T im_height, const T im_width, const T* dboxes, T* ddeltas) {
+  typedef typename AccType<T>::type A;
+  const BoxDecodeParam<A> param = {{std0, std1, std2, std3},
+                                   {mean0, mean1, mean2, mean3},
+                                   clip,
+                                   im_height,
+                                   im_width};
+  parfor(nthreads, [&](int index) {
+    const int n = index / num_classes;
+    const T* a = anchors + (batched_anchors ? n : n % num_anchors) * 4;
+    A box[4], size[2];
+    bool inside[4], unclipped[2];
+    decode_box(a, deltas + index * 4, param, box, inside, size, unclipped);
+    A g[4];
+    for (int k = 0; k < 4; ++k) {
+      g[k] = inside[k] ? static_cast<A>(dboxes[index * 4 + k]) : A(0);
+    }
+    const A aw = static_cast<A>(a[2]) - static_cast<A>(a[0]);
+    const A ah = static_cast<A>(a[3]) - static_cast<A>(a[1]);
+    // x1 = cx - w / 2, x2 = cx + w / 2, and d(w) / d(dw) = w
+    T* dd = ddeltas + index * 4;
+    dd[0] = (g[0] + g[2]) * aw * param.stds[0];
+    dd[1] = (g[1] + g[3]) * ah * param.stds[1];
+    dd[2] = unclipped[0] ? (g[2] - g[0]) * static_cast<A>(0.5) * size[0] *
+                               param.stds[2]
+                         : A(0);
+    dd[3] = unclipped[1] ? (g[3] - g[1]) * static_cast<A>(0.5) * size[1] *
+                               param.stds[3]
+                         : A(0);
+  });
+}
+
+}  // namespace mobula
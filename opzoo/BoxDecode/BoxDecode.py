@@ -0,0 +1,73 @@
+import mobula
+from mobula.const import req
+import numpy as np
+
+
+@mobula.op.register
+class BoxDecode:
+    """Decode the deltas of boxes with the anchors.
+
+    The anchors are (N, 4), or (B, N, 4) for the anchors of each batch, in
+    (x1, y1, x2, y2). The deltas are (B, N, K * 4) of (dx, dy, dw, dh) for K
+    classes, which are `deltas * stds + means`, and the output boxes are of
+    the same shape. dw and dh are clipped to `clip`, and the boxes are clipped
+    to the image when `im_size` (height, width) is given.
+    """
+
+    def __init__(self, stds=(1., 1., 1., 1.), means=(0., 0., 0., 0.),
+                 clip=np.log(1000. / 16), im_size=None):
+        self.stds = [float(s) for s in stds]
+        self.means = [float(m) for m in means]
+        self.clip = float(clip)
+        self.im_size = (0., 0.) if im_size is None else tuple(map(float, im_size))
+
+    def _get_args(self, anchors, deltas):
+        N = deltas.shape[1]
+        K = deltas.shape[2] // 4
+        batched_anchors = int(len(anchors.shape) == 3)
+        return [anchors, deltas, N, K, batched_anchors] + self.stds + self.means + \
+            [self.clip, self.im_size[0], self.im_size[1]]
+
+    def _get_num_boxes(self, deltas):
+        return deltas.shape[0] * deltas.shape[1] * (deltas.shape[2] // 4)
+
+    def forward(self, anchors, deltas):
+        if self.req[0] == req.null:
+            return
+        args = self._get_args(anchors, deltas)
+        if self.req[0] == req.add:
+            out_temp = self.F.empty_like(self.y)
+            mobula.func.box_decode_forward(
+                self._get_num_boxes(deltas), *(args + [out_temp]))
+            self.y[:] += out_temp
+        else:
+            mobula.func.box_decode_forward(
+                self._get_num_boxes(deltas), *(args + [self.y]))
+
+    def backward(self, dy):
+        anchors, deltas = self.X
+        # the anchors are constants
+        if self.req[0] not in [req.null, req.add]:
+            self.dX[0][:] = 0
+        if self.req[1] == req.null:
+            return
+        args = self._get_args(anchors, deltas)
+        if self.req[1] == req.add:
+            ddeltas = self.F.empty_like(self.dX[1])
+            mobula.func.box_decode_backward(
+                self._get_num_boxes(deltas), *(args + [dy, ddeltas]))
+            self.dX[1][:] += ddeltas
+        else:
+            mobula.func.box_decode_backward(
+                self._get_num_boxes(deltas), *(args + [dy, self.dX[1]]))
+
+    def infer_shape(self, in_shape):
+        ashape, dshape = in_shape
+        assert len(dshape) == 3
+        assert dshape[2] % 4 == 0
+        assert len(ashape) in (2, 3)
+        assert ashape[-1] == 4
+        assert ashape[-2] == dshape[1]
+        if len(ashape) == 3:
+            assert ashape[0] == dshape[0]
+        return in_shape, [dshape]
@@ -0,0 +1,63 @@
+import mxnet as mx
+import numpy as np
+import mobula
+from mobula.testing import assert_almost_equal
+
+mobula.op.load('BoxDecode')
+
+
+def box_decode_np(anchors, deltas, stds, means, clip, im_size):
+    B, N = deltas.shape[:2]
+    deltas = deltas.reshape((B, N, -1, 4)) * stds + means
+    anchors = anchors.reshape((-1, N, 1, 4))
+    aw = anchors[..., 2] - anchors[..., 0]
+    ah = anchors[..., 3] - anchors[..., 1]
+    cx = anchors[..., 0] + 0.5 * aw + deltas[..., 0] * aw
+    cy = anchors[..., 1] + 0.5 * ah + deltas[..., 1] * ah
+    w = aw * np.exp(np.minimum(deltas[..., 2], clip))
+    h = ah * np.exp(np.minimum(deltas[..., 3], clip))
+    boxes = np.stack([cx - 0.5 * w, cy - 0.5 * h, cx + 0.5 * w, cy + 0.5 * h], axis=-1)
+    if im_size is not None:
+        boxes[..., 0::2] = np.clip(boxes[..., 0::2], 0, im_size[1])
+        boxes[..., 1::2] = np.clip(boxes[..., 1::2], 0, im_size[0])
+    return boxes.reshape((B, N, -1))
+
+
+def test_box_decode():
+    B, N, K = 2, 30, 3
+    stds = (0.1, 0.1, 0.2, 0.2)
+    means = (0., 0.1, 0., -0.1)
+    clip = 1.
+    for batched_anchors in [False, True]:
+        for im_size in [None, (60, 80)]:
+            xy = np.random.uniform(0, 60, (B if batched_anchors else 1, N, 2))
+            wh = np.random.uniform(4, 30, xy.shape)
+            anchors = np.concatenate([xy, xy + wh], axis=2)
+            if not batched_anchors:
+                anchors = anchors[0]
+            deltas = np.random.uniform(-2, 2, (B, N, K * 4))
+            dy = np.random.uniform(-1, 1, deltas.shape)
+            anchors_nd = mx.nd.array(anchors, dtype=np.float64)
+            deltas_nd = mx.nd.array(deltas, dtype=np.float64)
+            deltas_nd.attach_grad()
+            with mx.autograd.record():
+                boxes = mobula.op.BoxDecode(anchors_nd, deltas_nd, stds=stds, means=means,
+                                            clip=clip, im_size=im_size)
+            boxes.backward(mx.nd.array(dy, dtype=np.float64))
+            assert_almost_equal(boxes, box_decode_np(
+                anchors, deltas, stds, means, clip, im_size))
+            # the numerical gradient
+            eps = 1e-6
+            grad = np.zeros(deltas.shape)
+            for i in np.ndindex(deltas.shape):
+                p = deltas.copy()
+                m = deltas.copy()
+                p[i] += eps
+                m[i] -= eps
+                grad[i] = ((box_decode_np(anchors, p, stds, means, clip, im_size) -
+                            box_decode_np(anchors, m, stds, means, clip, im_size)) * dy).sum() / (2 * eps)
+            assert_almost_equal(deltas_nd.grad, grad, atol=1e-5)
+
+
+if __name__ == '__main__':
+    test_box_decode()
@@ -52,7 +52,8 @@ MOBULA_KERNEL col2im_kernel(const int n, const T* data_col, const int height,
                             const int stride_w, const int dilation_h,
                             const int dilation_w, const int height_col,
                             const int width_col, T* data_im) {
-  parfor(n, [&](int index) {
+  // the indices at the borders are covered by fewer columns
+  parfor(n, parfor_stealing(0, 8.0f * kernel_h * kernel_w), [&](int index) {
     T val = 0;
     const int w_im = index % width + pad_w;
     const int h_im = (index / width) % height + pad_h;
@@ -87,6 +88,252 @@ MOBULA_KERNEL col2im_kernel(const int n, const T* data_col, const int height,
   });
 }
 
+// data_im: (batch_size, channels, height, width)
+// data_col: (channels, kernel_h, kernel_w, batch_size, height_col, width_col)
+template <typename T, int kKernelH = kDynamicConst,
+          int kKernelW = kDynamicConst, int kStrideH = kDynamicConst,
+          int kStrideW = kDynamicConst, int kDilationH = kDynamicConst,
+          int kDilationW = kDynamicConst>
+MOBULA_KERNEL im2col_batch_kernel(
+    const int n, const T* data_im, const int batch_size, const int channels,
+    const int height, const int width,
+    MOBULA_CONSTEXPR(kernel_h, kKernelH), MOBULA_CONSTEXPR(kernel_w, kKernelW),
+    const int pad_h, const int pad_w, MOBULA_CONSTEXPR(stride_h, kStrideH),
+    MOBULA_CONSTEXPR(stride_w, kStrideW),
+    MOBULA_CONSTEXPR(dilation_h, kDilationH),
+    MOBULA_CONSTEXPR(dilation_w, kDilationW), const int height_col,
+    const int width_col, T* data_col) {
+  const int channel_size = height * width;
+  parfor(n, [&](int index) {
+    int tmp_index = index;
+    const int output_col = tmp_index % width_col;
+    tmp_index /= width_col;
+    const int output_row = tmp_index % height_col;
+    tmp_index /= height_col;
+    const int b = tmp_index % batch_size;
+    tmp_index /= batch_size;
+    const int kernel_col = tmp_index % kernel_w;
+    tmp_index /= kernel_w;
+    const int kernel_row = tmp_index % kernel_h;
+    tmp_index /= kernel_h;
+    const int channel = tmp_index;
+
+    const int input_row =
+        -pad_h + kernel_row * dilation_h + stride_h * output_row;
+    const int input_col =
+        -pad_w + kernel_col * dilation_w + stride_w * output_col;
+    data_col[index] =
+        (is_a_ge_zero_and_a_lt_b(input_row, height) &&
+         is_a_ge_zero_and_a_lt_b(input_col, width))
+            ? data_im[(b * channels + channel) * channel_size +
+                      input_row * width + input_col]
+            : static_cast<T>(0);
+  });
+}
+
+// data_col: (channels, kernel_h, kernel_w, batch_size, height_col, width_col)
+// data_im: (batch_size, channels, height, width)
+template <typename T, int kKernelH = kDynamicConst,
+          int kKernelW = kDynamicConst, int kStrideH = kDynamicConst,
+          int kStrideW = kDynamicConst, int kDilationH = kDynamicConst,
+          int kDilationW = kDynamicConst>
+MOBULA_KERNEL col2im_batch_kernel(
+    const int n, const T* data_col, const int batch_size, const int channels,
+    const int height, const int width,
+    MOBULA_CONSTEXPR(kernel_h, kKernelH), MOBULA_CONSTEXPR(kernel_w, kKernelW),
+    const int pad_h, const int pad_w, MOBULA_CONSTEXPR(stride_h, kStrideH),
+    MOBULA_CONSTEXPR(stride_w, kStrideW),
+    MOBULA_CONSTEXPR(dilation_h, kDilationH),
+    MOBULA_CONSTEXPR(dilation_w, kDilationW), const int height_col,
+    const int width_col, T* data_im) {
+  // the indices at the borders are covered by fewer columns
+  parfor(n, parfor_stealing(0, 8.0f * kernel_h * kernel_w), [&](int index) {
+    T val = 0;
+    const int w_im = index % width + pad_w;
+    const int h_im = (index / width) % height + pad_h;
+    const int c_im = (index / (width * height)) % channels;
+    const int b = index / (width * height * channels);
+    int kernel_extent_w = (kernel_w - 1) * dilation_w + 1;
+    int kernel_extent_h = (kernel_h - 1) * dilation_h + 1;
+    // compute the start and end of the output
+    const int w_col_start =
+        (w_im < kernel_extent_w) ? 0 : (w_im - kernel_extent_w) / stride_w + 1;
+    const int w_col_end = min(w_im / stride_w + 1, width_col);
+    const int h_col_start =
+        (h_im < kernel_extent_h) ? 0 : (h_im - kernel_extent_h) / stride_h + 1;
+    const int h_col_end = min(h_im / stride_h + 1, height_col);
+    for (int h_col = h_col_start; h_col < h_col_end; h_col += 1) {
+      for (int w_col = w_col_start; w_col < w_col_end; w_col += 1) {
+        int h_k = (h_im - h_col * stride_h);
+        int w_k = (w_im - w_col * stride_w);
+        if (h_k % dilation_h == 0 && w_k % dilation_w == 0) {
+          h_k /= dilation_h;
+          w_k /= dilation_w;
+          int data_col_index =
+              ((((c_im * kernel_h + h_k) * kernel_w + w_k) * batch_size + b) *
+                   height_col +
+               h_col) *
+                  width_col +
+              w_col;
+          val += data_col[data_col_index];
+        }
+      }
+    }
+    data_im[index] = val;
+  });
+}
+
+// data_im: (batch_size, height, width, channels)
+// data_col: (batch_size, height_col, width_col, kernel_h, kernel_w, channels)
+template <typename T>
+MOBULA_KERNEL im2col_nhwc_kernel(
+    const int n, const T* data_im, const int channels, const int height,
+    const int width, const int kernel_h, const int kernel_w, const int pad_h,
+    const int pad_w, const int stride_h, const int stride_w,
+    const int dilation_h, const int dilation_w, const int height_col,
+    const int width_col, T* data_col) {
+  // a row is the channels of a pixel, which are copied contiguously
+  parfor_rows(n / channels, channels, [&](int index, int cols, int lane,
+                                          int lanes) {
+    int tmp_index = index;
+    const int kernel_col = tmp_index % kernel_w;
+    tmp_index /= kernel_w;
+    const int kernel_row = tmp_index % kernel_h;
+    tmp_index /= kernel_h;
+    const int output_col = tmp_index % width_col;
+    tmp_index /= width_col;
+    const int output_row = tmp_index % height_col;
+    const int b = tmp_index / height_col;
+
+    const int input_row =
+        -pad_h + kernel_row * dilation_h + stride_h * output_row;
+    const int input_col =
+        -pad_w + kernel_col * dilation_w + stride_w * output_col;
+    T* col = data_col + index * channels;
+    if (is_a_ge_zero_and_a_lt_b(input_row, height) &&
+        is_a_ge_zero_and_a_lt_b(input_col, width)) {
+      const T* im =
+          data_im + ((b * height + input_row) * width + input_col) * channels;
+      for (int c = lane; c < cols; c += lanes) col[c] = im[c];
+    } else {
+      for (int c = lane; c < cols; c += lanes) col[c] = static_cast<T>(0);
+    }
+  });
+}
+
+// data_col: (batch_size, height_col, width_col, kernel_h, kernel_w, channels)
+// data_im: (batch_size, height, width, channels)
+template <typename T>
+MOBULA_KERNEL col2im_nhwc_kernel(
+    const int n, const T* data_col, const int channels, const int height,
+    const int width, const int kernel_h, const int kernel_w, const int pad_h,
+    const int pad_w, const int stride_h, const int stride_w,
+    const int dilation_h, const int dilation_w, const int height_col,
+    const int width_col, T* data_im) {
+  parfor_rows(n / channels, channels, [&](int index, int cols, int lane,
+                                          int lanes) {
+    const int w_im = index % width + pad_w;
+    const int h_im = (index / width) % height + pad_h;
+    const int b = index / (width * height);
+    int kernel_extent_w = (kernel_w - 1) * dilation_w + 1;
+    int kernel_extent_h = (kernel_h - 1) * dilation_h + 1;
+    // compute the start and end of the output
+    const int w_col_start =
+        (w_im < kernel_extent_w) ? 0 : (w_im - kernel_extent_w) / stride_w + 1;
+    const int w_col_end = min(w_im / stride_w + 1, width_col);
+    const int h_col_start =
+        (h_im < kernel_extent_h) ? 0 : (h_im - kernel_extent_h) / stride_h + 1;
+    const int h_col_end = min(h_im / stride_h + 1, height_col);
+    T* im = data_im + index * channels;
+    for (int c = lane; c < cols; c += lanes) im[c] = static_cast<T>(0);
+    for (int h_col = h_col_start; h_col < h_col_end; h_col += 1) {
+      for (int w_col = w_col_start; w_col < w_col_end; w_col += 1) {
+        int h_k = (h_im - h_col * stride_h);
+        int w_k = (w_im - w_col * stride_w);
+        if (h_k % dilation_h == 0 && w_k % dilation_w == 0) {
+          h_k /= dilation_h;
+          w_k /= dilation_w;
+          const T* col =
+              data_col +
+              ((((b * height_col + h_col) * width_col + w_col) * kernel_h +
+                h_k) *
+                   kernel_w +
+               w_k) *
+                  channels;
+          for (int c = lane; c < cols; c += lanes) im[c] += col[c];
+        }
+      }
+    }
+  });
+}
+
+// the convolution of a pixel, KH and KW are the kernel size if they are > 0
+template <typename T, int KH, int KW>
+MOBULA_DEVICE T conv2d_direct_pixel(const T* data_im, const T* weight,
+                                    const int channels, const int height,
+                                    const int width, const int kernel_h,
+                                    const int kernel_w, const int h_start,
+                                    const int w_start, const int dilation_h,
+                                    const int dilation_w) {
+  const int kh_num = KH > 0 ? KH : kernel_h;
+  const int kw_num = KW > 0 ? KW : kernel_w;
+  T val = 0;
+  for (int c = 0; c < channels; ++c) {
+    const T* x = data_im + c * height * width;
+    const T* w = weight + c * kh_num * kw_num;
+    for (int i = 0; i < kh_num; ++i) {
+      const int h = h_start + i * dilation_h;
+      if (!is_a_ge_zero_and_a_lt_b(h, height)) continue;
+      for (int j = 0; j < kw_num; ++j) {
+        const int v = w_start + j * dilation_w;
+        if (is_a_ge_zero_and_a_lt_b(v, width)) {
+          val += x[h * width + v] * w[i * kw_num + j];
+        }
+      }
+    }
+  }
+  return val;
+}
+
+// convolution without the column buffer
+// data_im: (batch_size, channels, height, width)
+// weight: (num_filter, channels, kernel_h, kernel_w)
+// data_out: (batch_size, num_filter, height_col, width_col)
+template <typename T>
+MOBULA_KERNEL conv2d_direct_kernel(
+    const int n, const T* data_im, const T* weight, const int channels,
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int dilation_h, const int dilation_w, const int num_filter,
+    const int height_col, const int width_col, T* data_out) {
+  parfor(n, [&](int index) {
+    const int output_col = index % width_col;
+    const int output_row = (index / width_col) % height_col;
+    const int d = (index / width_col / height_col) % num_filter;
+    const int b = index / width_col / height_col / num_filter;
+    const T* x = data_im + b * channels * height * width;
+    const T* w = weight + d * channels * kernel_h * kernel_w;
+    const int h_start = output_row * stride_h - pad_h;
+    const int w_start = output_col * stride_w - pad_w;
+    T val;
+    // unroll the loops of the common kernel sizes
+    if (kernel_h == 1 && kernel_w == 1) {
+      val = conv2d_direct_pixel<T, 1, 1>(x, w, channels, height, width, 1, 1,
+                                         h_start, w_start, dilation_h,
+                                         dilation_w);
+    } else if (kernel_h == 3 && kernel_w == 3) {
+      val = conv2d_direct_pixel<T, 3, 3>(x, w, channels, height, width, 3, 3,
+                                         h_start, w_start, dilation_h,
+                                         dilation_w);
+    } else {
+      val = conv2d_direct_pixel<T, 0, 0>(x, w, channels, height, width,
+                                         kernel_h, kernel_w, h_start, w_start,
+                                         dilation_h, dilation_w);
+    }
+    data_out[index] = val;
+  });
+}
+
 typedef float DType;
 void im2col(const DType* data_im, const int channels, const int height,
             const int width, const int kernel_h, const int kernel_w,
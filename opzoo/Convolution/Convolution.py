@@ -1,10 +1,13 @@
+import numpy as np
+
 import mobula
 from mobula.const import req
 
 
 @mobula.op.register
 class Conv2D:
-    def __init__(self, channels, kernel_size, strides=(1, 1), padding=(0, 0), dilation=(1, 1), groups=1):
+    def __init__(self, channels, kernel_size, strides=(1, 1), padding=(0, 0), dilation=(1, 1), groups=1,
+                 workspace=256, layout='NCHW'):
         self.channels = channels
         self.kernel_size = kernel_size
         self.strides = strides
@@ -12,47 +15,171 @@ class Conv2D:
         self.dilation = dilation
         assert groups == 1
         self.groups = groups
+        # the maximum size (MB) of the column buffer
+        self.workspace = workspace
+        # the layout of the input and the output, 'NCHW' or 'NHWC'.
+        # The weight is (num_filter, channels, kernel_h, kernel_w) for both.
+        assert layout in ('NCHW', 'NHWC'), ValueError(
+            'Unsupported layout: {}'.format(layout))
+        self.layout = layout
+
+    def _is_pointwise(self):
+        # 1x1 convolution without padding, stride and dilation is a GEMM on the input
+        return tuple(self.kernel_size) == (1, 1) and tuple(self.padding) == (0, 0) and \
+            tuple(self.strides) == (1, 1) and tuple(self.dilation) == (1, 1)
+
+    def _get_batch_ranges(self, N, col_size, dtype):
+        # the images in a batch are unfolded into one column buffer for a single GEMM
+        col_bytes = col_size * np.dtype(dtype).itemsize
+        batch_size = max(1, min(N, (self.workspace << 20) // col_bytes))
+        return [(i, min(i + batch_size, N)) for i in range(0, N, batch_size)]
+
+    def _get_pointwise_col(self, x):
+        # (B, C, H, W) -> (C, B * H * W), the columns of the pointwise convolution
+        B, C, H, W = x.shape
+        return x.reshape((B, C, H * W)).transpose((1, 0, 2)).reshape((C, B * H * W))
+
+    def _get_const_geometry(self):
+        # the kernels of NCHW are specialized by the kernel size, the strides
+        # and the dilation, which are fixed for the layer
+        K = mobula.func.constexpr
+        (KH, KW), (SH, SW), (DH, DW) = self.kernel_size, self.strides, \
+            self.dilation
+        return K(KH), K(KW), K(SH), K(SW), K(DH), K(DW)
+
+    def _get_nhwc_weight(self, weight):
+        # (D, C, KH, KW) -> (D, KH * KW * C), the order of the columns of NHWC
+        return weight.transpose((0, 2, 3, 1)).reshape((weight.shape[0], -1))
+
+    def _forward_nhwc(self, x, weight, bias):
+        N, H, W, C = x.shape
+        KH, KW = self.kernel_size
+        PH, PW = self.padding
+        SH, SW = self.strides
+        DH, DW = self.dilation
+        _, OH, OW, D = self.y.shape
+        csize = C * KH * KW
+        ohw = OH * OW
+        rweight = self._get_nhwc_weight(weight)
+        # the column buffer of NHWC has an image at least
+        for begin, end in self._get_batch_ranges(N, csize * ohw, x.dtype):
+            B = end - begin
+            if self._is_pointwise():
+                data_col = x[begin:end].reshape((B * ohw, C))
+            else:
+                data_col = self.F.empty((B * ohw, csize))
+                mobula.func.im2col_nhwc(
+                    data_col.size, x[begin:end], C, H, W, KH, KW, PH, PW, SH, SW, DH, DW, OH, OW, data_col)
+            out = self.F.dot(data_col, rweight.T).reshape((B, OH, OW, D))
+            if bias is not None:
+                out += bias.reshape((1, 1, 1, -1))
+            self.assign(self.y[begin:end], self.req[0], out)
+
+    def _backward_nhwc(self, dy):
+        N, H, W, C = self.dx.shape
+        KH, KW = self.kernel_size
+        PH, PW = self.padding
+        SH, SW = self.strides
+        DH, DW = self.dilation
+        _, OH, OW, D = dy.shape
+        csize = C * KH * KW
+        ohw = OH * OW
+        rweight = self._get_nhwc_weight(self.X[1])
+        dw = 0
+        for begin, end in self._get_batch_ranges(N, csize * ohw, dy.dtype):
+            B = end - begin
+            rdy = dy[begin:end].reshape((B * ohw, D))
+            data_col = self.F.dot(rdy, rweight)
+            if self._is_pointwise():
+                out = data_col.reshape((B, H, W, C))
+                x_col = self.x[begin:end].reshape((B * ohw, C))
+            else:
+                out = self.F.empty((B, H, W, C))
+                mobula.func.col2im_nhwc(
+                    out.size, data_col, C, H, W, KH, KW, PH, PW, SH, SW, DH, DW, OH, OW, out)
+                x_col = self.F.empty((B * ohw, csize))
+                mobula.func.im2col_nhwc(
+                    x_col.size, self.x[begin:end], C, H, W, KH, KW, PH, PW, SH, SW, DH, DW, OH, OW, x_col)
+            self.assign(self.dX[0][begin:end], self.req[0], out)
+            dw += self.F.dot(rdy.T, x_col)
+        # (D, KH, KW, C) -> (D, C, KH, KW)
+        self.assign(self.dX[1], self.req[1], dw.reshape(
+            (D, KH, KW, C)).transpose((0, 3, 1, 2)))
+        if len(self.X) == 3:
+            self.assign(self.dX[2], self.req[2], dy.sum(3, exclude=True))
 
     def forward(self, x, weight, bias=None):
         # y = wx + b
+        if self.layout == 'NHWC':
+            self._forward_nhwc(x, weight, bias)
+            return
         N, C, H, W = x.shape
         KH, KW = self.kernel_size
         PH, PW = self.padding
         SH, SW = self.strides
         DH, DW = self.dilation
         _, D, OH, OW = self.y.shape
+        cKH, cKW, cSH, cSW, cDH, cDW = self._get_const_geometry()
         csize = C * KH * KW
-        data_col = self.F.empty((csize, OH, OW))
+        ohw = OH * OW
         rweight = weight.reshape((D, csize))
-        rbias = bias.reshape((-1, 1, 1)) if bias is not None else None
-        for i in range(N):
-            mobula.func.im2col(
-                data_col.size, x[i], H, W, KH, KW, PH, PW, SH, SW, DH, DW, OH, OW, data_col)
-            out = self.F.dot(rweight, data_col).reshape((D, OH, OW))
+        rbias = bias.reshape((1, -1, 1, 1)) if bias is not None else None
+        col_bytes = csize * ohw * np.dtype(x.dtype).itemsize
+        if not self._is_pointwise() and col_bytes > (self.workspace << 20):
+            # the column buffer of an image exceeds the workspace
+            out = self.F.empty(self.y.shape)
+            mobula.func.conv2d_direct(
+                out.size, x, weight, C, H, W, KH, KW, PH, PW, SH, SW, DH, DW, D, OH, OW, out)
+            if rbias is not None:
+                out += rbias
+            self.assign(self.y, self.req[0], out)
+            return
+        for begin, end in self._get_batch_ranges(N, csize * ohw, x.dtype):
+            B = end - begin
+            if self._is_pointwise():
+                data_col = self._get_pointwise_col(x[begin:end])
+            else:
+                data_col = self.F.empty((csize, B * ohw))
+                mobula.func.im2col_batch(
+                    data_col.size, x[begin:end], B, C, H, W, cKH, cKW, PH, PW, cSH, cSW, cDH, cDW, OH, OW, data_col)
+            # (D, B, OH, OW) -> (B, D, OH, OW)
+            out = self.F.dot(rweight, data_col).reshape(
+                (D, B, OH, OW)).transpose((1, 0, 2, 3))
             if rbias is not None:
                 out += rbias
-            self.assign(self.y[i], self.req[0], out)
+            self.assign(self.y[begin:end], self.req[0], out)
 
     def backward(self, dy):
+        if self.layout == 'NHWC':
+            self._backward_nhwc(dy)
+            return
         N, C, H, W = self.dx.shape
         KH, KW = self.kernel_size
         PH, PW = self.padding
         SH, SW = self.strides
         DH, DW = self.dilation
         _, D, OH, OW = dy.shape
+        cKH, cKW, cSH, cSW, cDH, cDW = self._get_const_geometry()
         csize = C * KH * KW
         ohw = OH * OW
         weightT = self.X[1].reshape((D, csize)).T
-        out = self.F.empty_like(self.dx[0])
         dw = 0
-        for i in range(N):
-            rdy = dy[i].reshape((D, ohw))
+        for begin, end in self._get_batch_ranges(N, csize * ohw, dy.dtype):
+            B = end - begin
+            # (B, D, OH, OW) -> (D, B * OH * OW)
+            rdy = dy[begin:end].transpose((1, 0, 2, 3)).reshape((D, B * ohw))
             data_col = self.F.dot(weightT, rdy)
-            mobula.func.col2im(
-                self.dx[0].size, data_col, H, W, KH, KW, PH, PW, SH, SW, DH, DW, OH, OW, out)
-            self.assign(self.dX[0][i], self.req[0], out)
-            mobula.func.im2col(
-                data_col.size, self.x[i], H, W, KH, KW, PH, PW, SH, SW, DH, DW, OH, OW, data_col)
+            if self._is_pointwise():
+                # (C, B, H, W) -> (B, C, H, W)
+                out = data_col.reshape((C, B, H, W)).transpose((1, 0, 2, 3))
+                data_col = self._get_pointwise_col(self.x[begin:end])
+            else:
+                out = self.F.empty((B, C, H, W))
+                mobula.func.col2im_batch(
+                    out.size, data_col, B, C, H, W, cKH, cKW, PH, PW, cSH, cSW, cDH, cDW, OH, OW, out)
+                mobula.func.im2col_batch(
+                    data_col.size, self.x[begin:end], B, C, H, W, cKH, cKW, PH, PW, cSH, cSW, cDH, cDW, OH, OW, data_col)
+            self.assign(self.dX[0][begin:end], self.req[0], out)
             dw += self.F.dot(rdy, data_col.T)
         self.assign(self.dX[1], self.req[1], dw.reshape_like(self.dX[1]))
         if len(self.X) == 3:
@@ -60,12 +187,15 @@ class Conv2D:
 
     def infer_shape(self, in_shape):
         assert 2 <= len(
-            in_shape) <= 3, "The inputs should be feature map(NCHW layout), weight and bias(optional)"
-        assert len(in_shape[0]) == 4, "input: NCHW"
+            in_shape) <= 3, "The inputs should be feature map(NCHW or NHWC layout), weight and bias(optional)"
+        assert len(in_shape[0]) == 4, "input: {}".format(self.layout)
         assert len(in_shape[1]) == 4, "weight: DCKK"
         assert len(in_shape) == 2 or len(in_shape[2]) == 1, "bias: D"
         x, weight = in_shape[:2]
-        N, C, H, W = x
+        if self.layout == 'NHWC':
+            N, H, W, C = x
+        else:
+            N, C, H, W = x
         KH, KW = self.kernel_size
         PH, PW = self.padding
         SH, SW = self.strides
@@ -81,4 +211,6 @@ class Conv2D:
         assert weight[1] == C
         assert weight[2] == KH
         assert weight[3] == KW
+        if self.layout == 'NHWC':
+            return in_shape, [(N, OH, OW, D)]
         return in_shape, [(N, D, OH, OW)]
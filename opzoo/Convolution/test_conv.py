@@ -6,12 +6,9 @@ from mobula.testing import assert_almost_equal
 mobula.op.load('Convolution')
 
 
-def test_convolution():
-    N, C, H, W = 2, 2, 3, 4
+def check_convolution(kernel_size, strides, padding, workspace):
+    N, C, H, W = 3, 2, 3, 4
     channels = 3
-    kernel_size = (2, 3)
-    strides = (1, 2)
-    padding = (0, 1)
 
     x = mx.random.uniform(0, 1, shape=(N, C, H, W))
     our_x = x.copy()
@@ -38,7 +35,8 @@ def test_convolution():
 
     with mx.autograd.record():
         our_y = mobula.op.Conv2D(x=our_x, weight=our_weight, bias=our_bias, channels=channels,
-                                 kernel_size=kernel_size, strides=strides, padding=padding)
+                                 kernel_size=kernel_size, strides=strides, padding=padding,
+                                 workspace=workspace)
     our_y.backward(out_grad)
 
     atol = 1e-6
@@ -48,5 +46,49 @@ def test_convolution():
     assert_almost_equal(bias.grad, our_bias.grad, atol=atol)
 
 
+def test_convolution():
+    # workspace=0: the direct convolution and one image per GEMM
+    for workspace in [0, 256]:
+        check_convolution((2, 3), (1, 2), (0, 1), workspace)
+    # 1x1 convolution without the column buffer, by one image or the batch
+    for workspace in [0, 256]:
+        check_convolution((1, 1), (1, 1), (0, 0), workspace)
+
+
+def check_convolution_nhwc(kernel_size, strides, padding):
+    N, C, H, W = 3, 2, 5, 6
+    channels = 3
+    x = mx.random.uniform(0, 1, shape=(N, C, H, W))
+    weight = mx.random.uniform(-1, 1, shape=(channels, C) + kernel_size)
+    bias = mx.random.uniform(-1, 1, shape=(channels, ))
+    inputs = [x, weight, bias]
+    inputs_nhwc = [x.transpose((0, 2, 3, 1)), weight.copy(), bias.copy()]
+    for arr in inputs + inputs_nhwc:
+        arr.attach_grad()
+    kwargs = dict(channels=channels, kernel_size=kernel_size,
+                  strides=strides, padding=padding)
+    with mx.autograd.record():
+        y = mobula.op.Conv2D(x=inputs[0], weight=inputs[1],
+                             bias=inputs[2], **kwargs)
+        y_nhwc = mobula.op.Conv2D(x=inputs_nhwc[0], weight=inputs_nhwc[1],
+                                  bias=inputs_nhwc[2], layout='NHWC', **kwargs)
+    out_grad = mx.random.uniform(0, 1, shape=y.shape)
+    y.backward(out_grad)
+    y_nhwc.backward(out_grad.transpose((0, 2, 3, 1)))
+
+    atol = 1e-5
+    assert_almost_equal(y_nhwc.transpose((0, 3, 1, 2)), y, atol=atol)
+    assert_almost_equal(inputs_nhwc[0].grad.transpose(
+        (0, 3, 1, 2)), x.grad, atol=atol)
+    assert_almost_equal(inputs_nhwc[1].grad, weight.grad, atol=atol)
+    assert_almost_equal(inputs_nhwc[2].grad, bias.grad, atol=atol)
+
+
+def test_convolution_nhwc():
+    check_convolution_nhwc((2, 3), (1, 2), (0, 1))
+    check_convolution_nhwc((1, 1), (1, 1), (0, 0))
+
+
 if __name__ == '__main__':
     test_convolution()
+    test_convolution_nhwc()
@@ -6,65 +6,294 @@
 
 #if USING_CUDA
 #include <cuda.h>
-#else
-#include <algorithm>
-#include <cmath>
-using std::exp;
-using std::log;
-using std::max;
-using std::pow;
 #endif  // USING_CUDA
 
 namespace mobula {
 
-template <typename T>
-MOBULA_DEVICE inline T sigmoid(T x) {
-  T max_val = max(static_cast<T>(0), -1 * x);
-  T v0 = exp(-max_val);
-  return v0 / (v0 + exp(-x - max_val));
+// pow(x, gamma), where an integral gamma is the common case
+template <typename V, typename T>
+MOBULA_DEVICE inline V pow_gamma(const V &x, const T gamma,
+                                 const bool int_gamma) {
+  return int_gamma ? pow_int(x, static_cast<int>(gamma)) : pow(x, V(gamma));
 }
 
+// whether gamma is a small non-negative integer
 template <typename T>
-MOBULA_DEVICE inline T log_sigmoid(T x) {
-  T max_val = max(static_cast<T>(0), -1 * x);
-  return -1 * max_val - log(exp(-max_val) + exp(-x - max_val));
+MOBULA_DEVICE inline bool is_int_gamma(const T gamma) {
+  return gamma >= T(0) && gamma <= T(16) &&
+         T(static_cast<int>(gamma)) == gamma;
 }
 
+// the math of each element is over 128-bit vectors on GPU when the arrays are
+// aligned, and over the wide SIMD registers on CPU
+template <typename T>
+struct FocalLossSize {
+#if USING_CUDA || USING_HIP
+  static constexpr int value = VecAccessSize<T>::value;
+#else
+  static constexpr int value = VecMathSize<typename AccType<T>::type>::value;
+#endif
+};
+
+
+// the terms shared by the loss and the gradient of the logits x
+template <typename V, typename A>
+struct FocalLossTerms {
+  V sigmoid_x, sigmoid_neg_x, pow_sigmoid_x, pow_sigmoid_neg_x;
+  V log_sigmoid_x, log_sigmoid_neg_x;
+
+  MOBULA_DEVICE FocalLossTerms(const V &x, const A gamma,
+                               const bool int_gamma)
+      : sigmoid_x(fast_sigmoid(x)),
+        sigmoid_neg_x(V(1) - sigmoid_x),
+        pow_sigmoid_x(pow_gamma(sigmoid_x, gamma, int_gamma)),
+        pow_sigmoid_neg_x(pow_gamma(sigmoid_neg_x, gamma, int_gamma)),
+        log_sigmoid_x(log_sigmoid(x)),
+        log_sigmoid_neg_x(log_sigmoid(-x)) {}
+
+  MOBULA_DEVICE V loss(const V &y, const A alpha) const {
+    V output = alpha * y * pow_sigmoid_neg_x * log_sigmoid_x;
+    output += (1 - alpha) * (V(1) - y) * log_sigmoid_neg_x * pow_sigmoid_x;
+    return -output;
+  }
+
+  MOBULA_DEVICE V gradient(const V &y, const A alpha, const A gamma) const {
+    V output = (alpha - 1 - alpha * y) * pow_sigmoid_x * sigmoid_x;
+    output += alpha * y * pow_sigmoid_neg_x * sigmoid_neg_x;
+    output += (alpha - 1) * gamma * (y - V(1)) * sigmoid_neg_x *
+              pow_sigmoid_x * log_sigmoid_neg_x;
+    output -= alpha * gamma * sigmoid_x * y * pow_sigmoid_neg_x *
+              log_sigmoid_x;
+    output += sigmoid_x * y * pow_sigmoid_x;
+    return -output;
+  }
+};
+
+template <typename T>
+struct FocalLossForward {
+  typedef typename AccType<T>::type A;
+  A alpha, gamma;
+  bool int_gamma;
+  StridedView<const T, 4> logits, targets;
+  T *outputs;
+
+  template <int N>
+  MOBULA_DEVICE void apply(const int index, const int num) const {
+    typedef Vec<A, N> V;
+    V y = load_vec<N>(targets, index, num);
+    V x = load_vec<N>(logits, index, num);
+    const FocalLossTerms<V, A> terms(x, gamma, int_gamma);
+    store_vec(outputs + index, terms.loss(y, alpha), num);
+  }
+};
+
+template <typename T>
+struct FocalLossBackward {
+  typedef typename AccType<T>::type A;
+  A alpha, gamma;
+  bool int_gamma;
+  StridedView<const T, 4> logits, targets;
+  T *outputs;
+
+  template <int N>
+  MOBULA_DEVICE void apply(const int index, const int num) const {
+    typedef Vec<A, N> V;
+    V y = load_vec<N>(targets, index, num);
+    V x = load_vec<N>(logits, index, num);
+    const FocalLossTerms<V, A> terms(x, gamma, int_gamma);
+    store_vec(outputs + index, terms.gradient(y, alpha, gamma), num);
+  }
+};
+
+template <typename T>
+struct FocalLossForwardBackward {
+  typedef typename AccType<T>::type A;
+  A alpha, gamma;
+  bool int_gamma;
+  StridedView<const T, 4> logits, targets;
+  T *outputs, *grads;
+
+  template <int N>
+  MOBULA_DEVICE void apply(const int index, const int num) const {
+    typedef Vec<A, N> V;
+    V y = load_vec<N>(targets, index, num);
+    V x = load_vec<N>(logits, index, num);
+    const FocalLossTerms<V, A> terms(x, gamma, int_gamma);
+    store_vec(outputs + index, terms.loss(y, alpha), num);
+    store_vec(grads + index, terms.gradient(y, alpha, gamma), num);
+  }
+};
+
+/*!
+ * \brief Accumulate the loss and the number of the positives (targets > 0)
+ *  of the elements into the thread-private `loss` and `num_pos`, and store
+ *  the gradient into `grads` when it is not nullptr.
+ */
+template <typename T>
+struct FocalLossReduce {
+  typedef typename AccType<T>::type A;
+  A alpha, gamma;
+  bool int_gamma;
+  StridedView<const T, 4> logits, targets;
+  T *grads;
+  A *loss, *residual, *num_pos;
+
+  template <int N>
+  MOBULA_DEVICE void apply(const int index, const int num) const {
+    typedef Vec<A, N> V;
+    V y = load_vec<N>(targets, index, num);
+    V x = load_vec<N>(logits, index, num);
+    const FocalLossTerms<V, A> terms(x, gamma, int_gamma);
+    if (grads != nullptr) {
+      store_vec(grads + index, terms.gradient(y, alpha, gamma), num);
+    }
+    A ls[N], ys[N];
+    terms.loss(y, alpha).store(ls);
+    y.store(ys);
+    // the padding lanes of the tail are not accumulated
+    for (int k = 0; k < num; ++k) {
+      add_residual_reduce_func(*loss, ls[k], *residual);
+      if (ys[k] > A(0)) *num_pos += A(1);
+    }
+  }
+};
+
 template <typename T>
 MOBULA_KERNEL focal_loss_forward_kernel(const int out_size, T alpha, T gamma,
-                                        const T* logits, const T* targets,
+                                        MOBULA_VIEW(const T, logits, 4),
+                                        MOBULA_VIEW(const T, targets, 4),
                                         T* outputs) {
-  parfor(out_size, [&](int index) {
-    T y = targets[index];
-    T x = logits[index];
-    T sigmoid_x = sigmoid(x);
-    T sigmoid_neg_x = 1 - sigmoid_x;
-    T output = alpha * y * pow(sigmoid_neg_x, gamma) * log_sigmoid(x);
-    output += (1 - alpha) * (1 - y) * log_sigmoid(-x) * pow(sigmoid_x, gamma);
-    output *= -1;
-    outputs[index] = output;
-  });
+  typedef typename AccType<T>::type A;
+  const FocalLossForward<T> op{A(alpha), A(gamma), is_int_gamma(A(gamma)),
+                               logits, targets, outputs};
+  parfor_vec_aligned<FocalLossSize<T>::value>(
+      out_size, op, logits.data, targets.data, outputs);
 }  // focal_loss_forward_kernel
 
 template <typename T>
 MOBULA_KERNEL focal_loss_backward_kernel(const int out_size, T alpha, T gamma,
-                                         const T* logits, const T* targets,
+                                         MOBULA_VIEW(const T, logits, 4),
+                                         MOBULA_VIEW(const T, targets, 4),
                                          T* outputs) {
-  parfor(out_size, [&](int index) {
-    T y = targets[index];
-    T x = logits[index];
-    T sigmoid_x = sigmoid(x);
-    T sigmoid_neg_x = 1 - sigmoid_x;
-    T output = (alpha - 1 - alpha * y) * pow(sigmoid_x, 1 + gamma);
-    output += alpha * y * pow(sigmoid_neg_x, gamma + 1);
-    output += (alpha - 1) * gamma * (y - 1) * sigmoid_neg_x *
-              pow(sigmoid_x, gamma) * log_sigmoid(-x);
-    output -= alpha * gamma * sigmoid_x * y * pow(sigmoid_neg_x, gamma) *
-              log_sigmoid(x);
-    output += sigmoid_x * y * pow(sigmoid_x, gamma);
-    output *= -1;
-    outputs[index] = output;
-  });
+  typedef typename AccType<T>::type A;
+  const FocalLossBackward<T> op{A(alpha), A(gamma), is_int_gamma(A(gamma)),
+                                logits, targets, outputs};
+  parfor_vec_aligned<FocalLossSize<T>::value>(
+      out_size, op, logits.data, targets.data, outputs);
 }  // focal_loss_backward_kernel
 
+// the loss and the gradient of each element in a pass
+template <typename T>
+MOBULA_KERNEL focal_loss_forward_backward_kernel(
+    const int out_size, T alpha, T gamma, MOBULA_VIEW(const T, logits, 4),
+    MOBULA_VIEW(const T, targets, 4), T* outputs, T* grads) {
+  typedef typename AccType<T>::type A;
+  const FocalLossForwardBackward<T> op{
+      A(alpha), A(gamma), is_int_gamma(A(gamma)), logits, targets, outputs,
+      grads};
+  parfor_vec_aligned<FocalLossSize<T>::value>(
+      out_size, op, logits.data, targets.data, outputs, grads);
+}  // focal_loss_forward_backward_kernel
+
+// reduce the loss into loss[0], and add the number of the positives to
+// num_pos[0], which are of the accumulation type A, as well as the partials
+// of grid_reduce.
+// The gradient is stored when grads is not nullptr.
+template <typename T, typename A>
+MOBULA_DEVICE void reduce_focal_loss(const int out_size, T alpha, T gamma,
+                                     const StridedView<const T, 4>& logits,
+                                     const StridedView<const T, 4>& targets,
+                                     A* partials, unsigned int* counter,
+                                     A* loss, A* num_pos, T* grads) {
+  static_assert(std::is_same<A, typename AccType<T>::type>::value,
+                "A should be the accumulation type of T");
+  A thread_loss = 0, residual = 0, thread_num_pos = 0;
+  const FocalLossReduce<T> op{A(alpha), A(gamma), is_int_gamma(A(gamma)),
+                              logits, targets, grads,
+                              &thread_loss, &residual, &thread_num_pos};
+  if (grads != nullptr) {
+    parfor_vec_aligned<FocalLossSize<T>::value>(out_size, op, logits.data,
+                                                targets.data, grads);
+  } else {
+    parfor_vec_aligned<FocalLossSize<T>::value>(out_size, op, logits.data,
+                                                targets.data);
+  }
+  grid_reduce(thread_loss - residual, partials, counter, loss, add_func<A>,
+              A(0));
+  // the positives are added once per block
+  thread_num_pos = block_reduce(thread_num_pos, add_func<A>, A(0));
+#if USING_CUDA || USING_HIP
+  if (hipThreadIdx_x == 0) atomic_add(thread_num_pos, num_pos);
+#else
+  if (get_thread_num() == 0) atomic_add(thread_num_pos, num_pos);
+#endif  // USING_CUDA || USING_HIP
+}
+
+/*!
+ * \brief Reduce the loss without storing the loss of each element.
+ *  loss[0] is the sum of the loss, and num_pos[0], which is zero before the
+ *  launch, is the number of the elements whose targets are positive.
+ *  They are of A, the accumulation type of T, e.g. float for float16.
+ */
+template <typename T, typename A>
+MOBULA_KERNEL focal_loss_reduce_kernel(
+    const int out_size, T alpha, T gamma, MOBULA_VIEW(const T, logits, 4),
+    MOBULA_VIEW(const T, targets, 4),
+    MOBULA_WORKSPACE(A, partials, out_size / 32 + 1), MOBULA_COUNTER(counter),
+    A* loss, A* num_pos) {
+  reduce_focal_loss(out_size, alpha, gamma, logits, targets, partials, counter,
+                    loss, num_pos, static_cast<T*>(nullptr));
+}  // focal_loss_reduce_kernel
+
+// focal_loss_reduce_kernel which stores the gradient of each element as well
+template <typename T, typename A>
+MOBULA_KERNEL focal_loss_reduce_forward_backward_kernel(
+    const int out_size, T alpha, T gamma, MOBULA_VIEW(const T, logits, 4),
+    MOBULA_VIEW(const T, targets, 4),
+    MOBULA_WORKSPACE(A, partials, out_size / 32 + 1), MOBULA_COUNTER(counter),
+    A* loss, A* num_pos, T* grads) {
+  reduce_focal_loss(out_size, alpha, gamma, logits, targets, partials, counter,
+                    loss, num_pos, grads);
+}  // focal_loss_reduce_forward_backward_kernel
+
+/*!
+ * \brief Cast the reduced loss[0] of the accumulation type A into out[0],
+ *  scaled by norm[0] in A, which is 1 / count, or 1 / max(num_pos[0], 1) when
+ *  `normalized` is nonzero.
+ */
+template <typename T, typename A>
+MOBULA_KERNEL focal_loss_normalize_kernel(const int n, const A* num_pos,
+                                          const A* loss, const int count,
+                                          const int normalized, T* out,
+                                          A* norm) {
+  parfor(n, [&](int i) {
+    const A s = A(1) / (normalized ? max(num_pos[i], A(1)) : A(count));
+    norm[i] = s;
+    out[i] = loss[i] * s;
+  });
+}  // focal_loss_normalize_kernel
+
+template <typename T>
+struct FocalLossScale {
+  typedef typename AccType<T>::type A;
+  A scale;
+  const T *grads;
+  T *outputs;
+
+  template <int N>
+  MOBULA_DEVICE void apply(const int index, const int num) const {
+    store_vec(outputs + index, load_vec<N>(grads + index, num) * scale, num);
+  }
+};
+
+// outputs = grads * dy[0] * norm[0], the gradient of the reduced loss, where
+// norm is of the accumulation type A
+template <typename T, typename A>
+MOBULA_KERNEL focal_loss_scale_kernel(const int out_size, const T* grads,
+                                      const T* dy, const A* norm,
+                                      T* outputs) {
+  const FocalLossScale<T> op{A(dy[0]) * norm[0], grads, outputs};
+  parfor_vec_aligned<FocalLossSize<T>::value>(out_size, op, grads, outputs);
+}  // focal_loss_scale_kernel
+
 }  // namespace mobula
@@ -3,49 +3,102 @@ from mobula.const import req
 import numpy as np
 
 
+def _acc_zeros_like(F, x):
+    # the reduction of float16 and bfloat16 is accumulated in float32
+    out = F.zeros_like(x)
+    if 'float16' not in str(x.dtype):
+        return out
+    # torch.Tensor has no `astype`
+    return out.astype('float32') if hasattr(out, 'astype') else out.float()
+
+
 @mobula.op.register
 class FocalLoss:
-    def __init__(self, alpha=0.25, gamma=2):
+    """Sigmoid focal loss.
+
+    Parameters
+    ----------
+    reduction: str
+        'none' outputs the loss of each element. 'sum', 'mean' and
+        'normalized_by_positives' output the sum of the loss, divided by the
+        number of the elements or by the number of the positives (targets > 0)
+        at least 1, without storing the loss of each element.
+    fused_grad: bool
+        whether the forward stores the gradient for the backward, so that the
+        backward doesn't recompute it.
+    """
+    REDUCTIONS = ('none', 'sum', 'mean', 'normalized_by_positives')
+
+    def __init__(self, alpha=0.25, gamma=2, reduction='none',
+                 fused_grad=False):
+        assert reduction in self.REDUCTIONS, ValueError(
+            'Unknown reduction: {}'.format(reduction))
         self.alpha = alpha
         self.gamma = gamma
+        self.reduction = reduction
+        self.fused_grad = fused_grad
 
     def forward(self, logits, targets):
-        if self.req[0] == req.null:
-            return
-        out = self.y
-        out_size = np.prod(out.size()) if callable(out.size) else out.size
+        out_size = np.prod(logits.size()) if callable(
+            logits.size) else logits.size
         alpha = self.alpha
         gamma = self.gamma
-        if self.req[0] == req.add:
-            out_temp = self.F.zeros_like(out)
-            mobula.func.focal_loss_forward(out_size=out_size, alpha=alpha, gamma=gamma, logits=logits, targets=targets,
-                                           outputs=out_temp)
-            self.y[:] += out_temp
+        if self.fused_grad:
+            self.grads = self.F.empty_like(logits)
+        if self.reduction != 'none':
+            loss = _acc_zeros_like(self.F, self.y)
+            num_pos = _acc_zeros_like(self.F, self.y)
+            self.norm = _acc_zeros_like(self.F, self.y)
+            if self.fused_grad:
+                mobula.func.focal_loss_reduce_forward_backward(
+                    out_size, alpha, gamma, logits, targets, loss, num_pos,
+                    self.grads)
+            else:
+                mobula.func.focal_loss_reduce(
+                    out_size, alpha, gamma, logits, targets, loss, num_pos)
+            # the loss is divided by `count` in the accumulation type
+            count = out_size if self.reduction == 'mean' else 1
+            normalized = int(self.reduction == 'normalized_by_positives')
+            out = self.F.empty_like(self.y)
+            mobula.func.focal_loss_normalize(
+                1, num_pos, loss, count, normalized, out, self.norm)
+            self.assign(self.y, self.req[0], out)
+            return
+        if self.req[0] == req.null and not self.fused_grad:
+            return
+        out = self.y if self.req[0] in (req.write, req.inplace) else \
+            self.F.empty_like(self.y)
+        if self.fused_grad:
+            mobula.func.focal_loss_forward_backward(
+                out_size, alpha, gamma, logits, targets, out, self.grads)
         else:
-            self.y[:] = 0
             mobula.func.focal_loss_forward(out_size=out_size, alpha=alpha, gamma=gamma, logits=logits, targets=targets,
-                                           outputs=self.y)
+                                           outputs=out)
+        if out is not self.y:
+            self.assign(self.y, self.req[0], out)
 
     def backward(self, dy):
         assert self.req[1] == "null"
-        alpha = self.alpha
-        gamma = self.gamma
         logits = self.X[0]
         targets = self.X[1]
         out_size = np.prod(targets.size()) if callable(
             targets.size) else targets.size
-        if self.req[0] == req.add:
-            out_temp = self.F.zeros_like(self.dX[0])
-            mobula.func.focal_loss_forward(out_size=out_size, alpha=alpha, gamma=gamma, logits=logits, targets=targets,
-                                           outputs=out_temp)
-            self.dX[0] += out_temp
+        if self.fused_grad:
+            grads = self.grads
+        else:
+            grads = self.F.empty_like(self.dX[0])
+            mobula.func.focal_loss_backward(out_size=out_size, alpha=self.alpha, gamma=self.gamma, logits=logits,
+                                            targets=targets, outputs=grads)
+        if self.reduction == 'none':
+            self.assign(self.dX[0], self.req[0], grads * dy)
         else:
-            self.dX[0][:] = 0
-            mobula.func.focal_loss_backward(out_size=out_size, alpha=alpha, gamma=gamma, logits=logits, targets=targets,
-                                            outputs=self.dX[0])
-        self.dX[0][:] = self.dX[0][:] * dy
+            out = self.F.empty_like(grads)
+            mobula.func.focal_loss_scale(out_size, grads, dy, self.norm, out)
+            self.assign(self.dX[0], self.req[0], out)
 
     def infer_shape(self, in_shape):
         assert len(in_shape) == 2
         assert in_shape[0] == in_shape[1]
+        if self.reduction != 'none':
+            return in_shape, [(1, )]
         return in_shape, [in_shape[0]]
@@ -2,6 +2,7 @@ import mobula
 
 mobula.op.load('FocalLoss')
 import mxnet as mx
+import numpy as np
 import mxnet.autograd as ag
 from mobula.testing import assert_almost_equal
 
@@ -60,6 +61,63 @@ def test_FocalLoss_mx_cuda():
     assert_almost_equal(fl, fl_mobula)
 
 
+def test_FocalLoss_unaligned():
+    # the arrays which start at odd elements take the scalar variant on GPU
+    n = N * N
+    x = np.random.randn(n + 1).astype(np.float32)
+    y = (np.random.rand(n + 1) > 0.5).astype(np.float32)
+    for name in ['focal_loss_forward', 'focal_loss_backward']:
+        func = getattr(mobula.func, name)
+        out = np.empty(n + 1, dtype=np.float32)
+        out_gt = np.empty(n, dtype=np.float32)
+        func(n, .25, 2, x[1:], y[1:], out[1:])
+        func(n, .25, 2, x[1:].copy(), y[1:].copy(), out_gt)
+        assert_almost_equal(out[1:], out_gt)
+
+
+def test_FocalLoss_strided():
+    # the non-contiguous views are read without the copies
+    x = np.random.randn(N, 3, N).astype(np.float32)
+    y = (np.random.rand(N, 3, N) > 0.5).astype(np.float32)
+    for xv, yv in [(x.transpose(2, 0, 1), y.transpose(2, 0, 1)),
+                   (x[:, 1], y[::-1, 2]), (x[:, ::2, ::3], y[:, ::2, ::3])]:
+        out = np.empty(xv.shape, dtype=np.float32)
+        out_gt = np.empty(xv.shape, dtype=np.float32)
+        mobula.func.focal_loss_forward(xv.size, .25, 2, xv, yv, out)
+        mobula.func.focal_loss_forward(xv.size, .25, 2, xv.copy(), yv.copy(),
+                                       out_gt)
+        assert_almost_equal(out, out_gt)
+
+
+def test_FocalLoss_reduction():
+    x = mx.nd.random.randn(N, N, dtype="float64")
+    y = (mx.nd.random.uniform(shape=(N, N), dtype="float64") > 0.9).astype(
+        "float64")
+    num_pos = max(y.sum().asscalar(), 1)
+    for reduction, scale in [('none', 1), ('sum', 1), ('mean', 1.0 / (N * N)),
+                             ('normalized_by_positives', 1.0 / num_pos)]:
+        for fused_grad in [False, True]:
+            x0 = x.copy()
+            x1 = x.copy()
+            x0.attach_grad()
+            x1.attach_grad()
+            with ag.record():
+                fl = BCEFocalLoss(x0, y, alpha=.25, gamma=2)
+                if reduction != 'none':
+                    fl = fl.sum() * scale
+                fl_mobula = mobula.op.FocalLoss(
+                    alpha=.25, gamma=2, reduction=reduction,
+                    fused_grad=fused_grad, logits=x1, targets=y)
+            fl.backward()
+            fl_mobula.backward()
+            assert_almost_equal(fl.asnumpy().reshape(fl_mobula.shape),
+                                fl_mobula.asnumpy())
+            assert_almost_equal(x0.grad.asnumpy(), x1.grad.asnumpy())
+
+
 if __name__ == '__main__':
     test_FocalLoss_mx_cpu()
     test_FocalLoss_mx_cuda()
+    test_FocalLoss_unaligned()
+    test_FocalLoss_strided()
+    test_FocalLoss_reduction()
@@ -6,190 +6,208 @@
 
 #if USING_CUDA
 #include <cuda.h>
-#else
-#include <algorithm>
-#include <cmath>
-using std::exp;
-using std::log;
-using std::max;
-using std::min;
-using std::pow;
 #endif  // USING_CUDA
 
 namespace mobula {
 
+/*!
+ * \brief The terms of the IoU loss of the boxes [index, index + num) in a
+ *  vector, which are shared by the loss and the gradient.
+ *  The coordinates are in the order of l, t, r, b, and the corners are
+ *  tl, tr, bl, br, the sums of two coordinates in the log space.
+ */
+template <typename V>
+struct IoULossTerms {
+  typedef typename V::value_type T;
+  // the boxes whose targets are positive
+  typename V::mask_type valid;
+  // the log targets and the preds
+  V targets[4], preds[4];
+  // exp(corner - max_v) of the intersection and of the preds
+  V exp_i[4], exp_hat[4];
+  V I, X, X_hat, max_v;
+
+  // the vertical and the horizontal coordinates of the corner k
+  static MOBULA_DEVICE int vertical(const int k) { return k < 2 ? 1 : 3; }
+  static MOBULA_DEVICE int horizontal(const int k) {
+    return k % 2 == 0 ? 0 : 2;
+  }
+
+  // whether any box is valid
+  MOBULA_DEVICE bool load(const T* preds_data, const T* targets_data,
+                          const int index, const int num) {
+    for (int c = 0; c < 4; ++c) {
+      targets[c] = V::load_strided(targets_data + index * 4 + c, 4, num);
+      preds[c] = V::load_strided(preds_data + index * 4 + c, 4, num);
+    }
+    valid = (targets[0] > V(0)) & (targets[1] > V(0)) & (targets[2] > V(0)) &
+            (targets[3] > V(0));
+    if (!valid.any()) return false;
+    for (int c = 0; c < 4; ++c) {
+      targets[c] = fast_log(select(valid, targets[c], V(1)));
+    }
+    return true;
+  }
+
+  // the corners, and the intersection of their coordinates
+  MOBULA_DEVICE V corner(const V* coords, const int k) const {
+    return coords[vertical(k)] + coords[horizontal(k)];
+  }
+  MOBULA_DEVICE V corner_i(const int k) const {
+    return min(targets[vertical(k)], preds[vertical(k)]) +
+           min(targets[horizontal(k)], preds[horizontal(k)]);
+  }
+
+  MOBULA_DEVICE void compute_exp_i_hat() {
+    I = X_hat = V(0);
+    for (int k = 0; k < 4; ++k) {
+      exp_i[k] = fast_exp(corner_i(k) - max_v);
+      exp_hat[k] = fast_exp(corner(preds, k) - max_v);
+      I = I + exp_i[k];
+      X_hat = X_hat + exp_hat[k];
+    }
+  }
+
+  MOBULA_DEVICE void compute() {
+    max_v = corner(targets, 0);
+    for (int k = 0; k < 4; ++k) {
+      max_v = max(max_v, corner(targets, k));
+      max_v = max(max_v, corner(preds, k));
+      max_v = max(max_v, corner_i(k));
+    }
+    compute_exp_i_hat();
+    X = V(0);
+    for (int k = 0; k < 4; ++k) X = X + fast_exp(corner(targets, k) - max_v);
+  }
+
+  // the terms from the intermediates (I, X, X_hat, max_v) of each box, where
+  // the 12-way max and the exp of the targets are skipped. I and X_hat are
+  // the sums of the exps which the gradient needs, so they are recomputed.
+  MOBULA_DEVICE void compute_from_saved(const T* saved, const int index,
+                                        const int num) {
+    max_v = V::load_strided(saved + index * 4 + 3, 4, num);
+    compute_exp_i_hat();
+    X = V::load_strided(saved + index * 4 + 1, 4, num);
+  }
+
+  MOBULA_DEVICE V loss() const { return -fast_log(I / (X + X_hat - I)); }
+
+  // the gradient of the coordinate c = the partial of -log(I / U)
+  MOBULA_DEVICE V gradient(const int c) const {
+    const V U = X + X_hat - I;
+    // the corners which contain the coordinate c, e.g. tl and bl for l
+    const int k0 = c % 2 == 0 ? c / 2 : c - 1;
+    const int k1 = c % 2 == 0 ? c / 2 + 2 : c;
+    const V sum_i = exp_i[k0] + exp_i[k1];
+    const V sum_hat = exp_hat[k0] + exp_hat[k1];
+    // partial = partial_item_1 - partial_item_2,
+    // where partial_item_1 is 0 if the target is not greater than the pred
+    const V partial = select(targets[c] > preds[c],
+                             sum_i / I - (sum_hat - sum_i) / U, -(sum_hat / U));
+    return -partial;
+  }
+
+  // the outputs of the invalid boxes are unchanged
+  MOBULA_DEVICE void store(const V& val, T* p, const int stride,
+                           const int num) const {
+    select(valid, val, V::load_strided(p, stride, num))
+        .store_strided(p, stride, num);
+  }
+
+  MOBULA_DEVICE void store_gradient(T* grads, const int index,
+                                    const int num) const {
+    for (int c = 0; c < 4; ++c) {
+      store(gradient(c), grads + index * 4 + c, 4, num);
+    }
+  }
+};
+
+// the nominal cost of a vector of boxes
+constexpr float kIoULossVecCost = 128.0f;
+
+// parfor_vec over the boxes. The invalid boxes, e.g. the padding of the
+// targets, are skipped and often gathered, so the threads take the vectors
+// dynamically on CPU.
+template <typename V, typename Func>
+MOBULA_DEVICE void parfor_boxes(const int out_size, Func F) {
+  parfor_vec<V::kSize>(out_size, parfor_dynamic(0, kIoULossVecCost), F);
+}
+
 template <typename T>
 MOBULA_KERNEL iou_loss_forward_kernel(const int out_size, const T* preds,
                                       const T* targets, T* outputs) {
-  parfor(out_size, [&](int index) {
-    const int l = 0, t = 1, r = 2, b = 3;
-    T targets_l = targets[index * 4 + l];
-    T targets_t = targets[index * 4 + t];
-    T targets_r = targets[index * 4 + r];
-    T targets_b = targets[index * 4 + b];
-    T preds_l = preds[index * 4 + l];
-    T preds_t = preds[index * 4 + t];
-    T preds_r = preds[index * 4 + r];
-    T preds_b = preds[index * 4 + b];
-    if (targets_l > 0 && targets_t > 0 && targets_r > 0 && targets_b > 0) {
-      targets_l = log(targets_l);
-      targets_t = log(targets_t);
-      targets_r = log(targets_r);
-      targets_b = log(targets_b);
-      T tl = targets_t + targets_l;
-      T tr = targets_t + targets_r;
-      T bl = targets_b + targets_l;
-      T br = targets_b + targets_r;
-      T tl_hat = preds_t + preds_l;
-      T tr_hat = preds_t + preds_r;
-      T bl_hat = preds_b + preds_l;
-      T br_hat = preds_b + preds_r;
-      T x_t_i = min(targets_t, preds_t);
-      T x_b_i = min(targets_b, preds_b);
-      T x_l_i = min(targets_l, preds_l);
-      T x_r_i = min(targets_r, preds_r);
-      T tl_i = x_t_i + x_l_i;
-      T tr_i = x_t_i + x_r_i;
-      T bl_i = x_b_i + x_l_i;
-      T br_i = x_b_i + x_r_i;
-      T max_v = tl;
-      max_v = max(max_v, tr);
-      max_v = max(max_v, bl);
-      max_v = max(max_v, br);
-      max_v = max(max_v, tl_hat);
-      max_v = max(max_v, tr_hat);
-      max_v = max(max_v, bl_hat);
-      max_v = max(max_v, br_hat);
-      max_v = max(max_v, tl_i);
-      max_v = max(max_v, tr_i);
-      max_v = max(max_v, bl_i);
-      max_v = max(max_v, br_i);
-      T I = exp(tl_i - max_v) + exp(tr_i - max_v) + exp(bl_i - max_v) +
-            exp(br_i - max_v);
-      T X =
-          exp(tl - max_v) + exp(tr - max_v) + exp(bl - max_v) + exp(br - max_v);
-      T X_hat = exp(tl_hat - max_v) + exp(tr_hat - max_v) +
-                exp(bl_hat - max_v) + exp(br_hat - max_v);
-      T I_over_U = I / (X + X_hat - I);
-      T loss = log(I_over_U) * -1;
-      outputs[index] = loss;
-    }
+  typedef Vec<T, VecMathSize<T>::value> V;
+  parfor_boxes<V>(out_size, [&](int index, int num) {
+    IoULossTerms<V> terms;
+    if (!terms.load(preds, targets, index, num)) return;
+    terms.compute();
+    terms.store(terms.loss(), outputs + index, 1, num);
   });
 }  // iou_loss_forward_kernel
 
 template <typename T>
 MOBULA_KERNEL iou_loss_backward_kernel(const int out_size, const T* preds,
                                        const T* targets, T* outputs) {
-  parfor(out_size, [&](int index) {
-    const int l = 0, t = 1, r = 2, b = 3;
-    T targets_l = targets[index * 4 + l];
-    T targets_t = targets[index * 4 + t];
-    T targets_r = targets[index * 4 + r];
-    T targets_b = targets[index * 4 + b];
-    T preds_l = preds[index * 4 + l];
-    T preds_t = preds[index * 4 + t];
-    T preds_r = preds[index * 4 + r];
-    T preds_b = preds[index * 4 + b];
-    if (targets_l > 0 && targets_t > 0 && targets_r > 0 && targets_b > 0) {
-      targets_l = log(targets_l);
-      targets_t = log(targets_t);
-      targets_r = log(targets_r);
-      targets_b = log(targets_b);
-      T tl = targets_t + targets_l;
-      T tr = targets_t + targets_r;
-      T bl = targets_b + targets_l;
-      T br = targets_b + targets_r;
-      T tl_hat = preds_t + preds_l;
-      T tr_hat = preds_t + preds_r;
-      T bl_hat = preds_b + preds_l;
-      T br_hat = preds_b + preds_r;
-      T x_t_i = min(targets_t, preds_t);
-      T x_b_i = min(targets_b, preds_b);
-      T x_l_i = min(targets_l, preds_l);
-      T x_r_i = min(targets_r, preds_r);
-      T tl_i = x_t_i + x_l_i;
-      T tr_i = x_t_i + x_r_i;
-      T bl_i = x_b_i + x_l_i;
-      T br_i = x_b_i + x_r_i;
-      T max_v = tl;
-      max_v = max(max_v, tr);
-      max_v = max(max_v, bl);
-      max_v = max(max_v, br);
-      max_v = max(max_v, tl_hat);
-      max_v = max(max_v, tr_hat);
-      max_v = max(max_v, bl_hat);
-      max_v = max(max_v, br_hat);
-      max_v = max(max_v, tl_i);
-      max_v = max(max_v, tr_i);
-      max_v = max(max_v, bl_i);
-      max_v = max(max_v, br_i);
-      T I = exp(tl_i - max_v) + exp(tr_i - max_v) + exp(bl_i - max_v) +
-            exp(br_i - max_v);
-      T X =
-          exp(tl - max_v) + exp(tr - max_v) + exp(bl - max_v) + exp(br - max_v);
-      T X_hat = exp(tl_hat - max_v) + exp(tr_hat - max_v) +
-                exp(bl_hat - max_v) + exp(br_hat - max_v);
-
-      T partial_l;
-      if (targets_l > preds_l) {
-        T partial_item_1 = (exp(tl_i - max_v) + exp(bl_i - max_v)) / I;
-        T partial_item_2 = exp(tl_hat - max_v) + exp(bl_hat - max_v) -
-                           exp(tl_i - max_v) - exp(bl_i - max_v);
-        partial_item_2 /= (X + X_hat - I);
-        partial_l = partial_item_1 - partial_item_2;
-      } else {
-        T partial_item_1 = 0;
-        T partial_item_2 = exp(tl_hat - max_v) + exp(bl_hat - max_v);
-        partial_item_2 /= (X + X_hat - I);
-        partial_l = partial_item_1 - partial_item_2;
-      }
-      T partial_t;
-      if (targets_t > preds_t) {
-        T partial_item_1 = (exp(tl_i - max_v) + exp(tr_i - max_v)) / I;
-        T partial_item_2 = exp(tl_hat - max_v) + exp(tr_hat - max_v) -
-                           exp(tl_i - max_v) - exp(tr_i - max_v);
-        partial_item_2 /= (X + X_hat - I);
-        partial_t = partial_item_1 - partial_item_2;
-      } else {
-        T partial_item_1 = 0;
-        T partial_item_2 = exp(tl_hat - max_v) + exp(tr_hat - max_v);
-        partial_item_2 /= (X + X_hat - I);
-        partial_t = partial_item_1 - partial_item_2;
-      }
-
-      T partial_r;
-      if (targets_r > preds_r) {
-        T partial_item_1 = (exp(tr_i - max_v) + exp(br_i - max_v)) / I;
-        T partial_item_2 = exp(tr_hat - max_v) + exp(br_hat - max_v) -
-                           exp(tr_i - max_v) - exp(br_i - max_v);
-        partial_item_2 /= (X + X_hat - I);
-        partial_r = partial_item_1 - partial_item_2;
-      } else {
-        T partial_item_1 = 0;
-        T partial_item_2 = exp(tr_hat - max_v) + exp(br_hat - max_v);
-        partial_item_2 /= (X + X_hat - I);
-        partial_r = partial_item_1 - partial_item_2;
-      }
-
-      T partial_b;
-      if (targets_b > preds_b) {
-        T partial_item_1 = (exp(bl_i - max_v) + exp(br_i - max_v)) / I;
-        T partial_item_2 = exp(bl_hat - max_v) + exp(br_hat - max_v) -
-                           exp(bl_i - max_v) - exp(br_i - max_v);
-        partial_item_2 /= (X + X_hat - I);
-        partial_b = partial_item_1 - partial_item_2;
-      } else {
-        T partial_item_1 = 0;
-        T partial_item_2 = exp(bl_hat - max_v) + exp(br_hat - max_v);
-        partial_item_2 /= (X + X_hat - I);
-        partial_b = partial_item_1 - partial_item_2;
-      }
-      outputs[index * 4 + l] = -1 * partial_l;
-      outputs[index * 4 + t] = -1 * partial_t;
-      outputs[index * 4 + r] = -1 * partial_r;
-      outputs[index * 4 + b] = -1 * partial_b;
-    }
+  typedef Vec<T, VecMathSize<T>::value> V;
+  parfor_boxes<V>(out_size, [&](int index, int num) {
+    IoULossTerms<V> terms;
+    if (!terms.load(preds, targets, index, num)) return;
+    terms.compute();
+    terms.store_gradient(outputs, index, num);
   });
 }  // iou_loss_backward_kernel
 
+/*!
+ * \brief The loss and the gradient (out_size, 4) in one pass, for the
+ *  backward which follows the forward.
+ */
+template <typename T>
+MOBULA_KERNEL iou_loss_forward_backward_kernel(const int out_size,
+                                               const T* preds,
+                                               const T* targets, T* outputs,
+                                               T* grads) {
+  typedef Vec<T, VecMathSize<T>::value> V;
+  parfor_boxes<V>(out_size, [&](int index, int num) {
+    IoULossTerms<V> terms;
+    if (!terms.load(preds, targets, index, num)) return;
+    terms.compute();
+    terms.store(terms.loss(), outputs + index, 1, num);
+    terms.store_gradient(grads, index, num);
+  });
+}
+
+/*!
+ * \brief The loss, and the intermediates (I, X, X_hat, max_v) of each box in
+ *  saved (out_size, 4) for iou_loss_backward_saved.
+ */
+template <typename T>
+MOBULA_KERNEL iou_loss_forward_saved_kernel(const int out_size,
+                                            const T* preds, const T* targets,
+                                            T* outputs, T* saved) {
+  typedef Vec<T, VecMathSize<T>::value> V;
+  parfor_boxes<V>(out_size, [&](int index, int num) {
+    IoULossTerms<V> terms;
+    if (!terms.load(preds, targets, index, num)) return;
+    terms.compute();
+    terms.store(terms.loss(), outputs + index, 1, num);
+    terms.store(terms.I, saved + index * 4, 4, num);
+    terms.store(terms.X, saved + index * 4 + 1, 4, num);
+    terms.store(terms.X_hat, saved + index * 4 + 2, 4, num);
+    terms.store(terms.max_v, saved + index * 4 + 3, 4, num);
+  });
+}
+
+template <typename T>
+MOBULA_KERNEL iou_loss_backward_saved_kernel(const int out_size,
+                                             const T* preds, const T* targets,
+                                             const T* saved, T* outputs) {
+  typedef Vec<T, VecMathSize<T>::value> V;
+  parfor_boxes<V>(out_size, [&](int index, int num) {
+    IoULossTerms<V> terms;
+    if (!terms.load(preds, targets, index, num)) return;
+    terms.compute_from_saved(saved, index, num);
+    terms.store_gradient(outputs, index, num);
+  });
+}
+
 }  // namespace mobula
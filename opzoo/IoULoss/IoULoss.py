@@ -5,36 +5,63 @@ import numpy as np
 
 @mobula.op.register
 class IoULoss:
+    def __init__(self, save=None):
+        # what the forward keeps for the backward:
+        # None: nothing, and the backward recomputes the terms of the loss
+        # 'gradient': the gradient, which is computed with the loss in one pass
+        # 'intermediates': (I, X, X_hat, max_v) of each box
+        assert save in (None, 'gradient', 'intermediates'), ValueError(
+            'Unknown save mode: {}'.format(save))
+        self.save = save
+
+    def _forward(self, preds, targets, outputs):
+        out_size = preds.shape[0]
+        if self.save == 'gradient':
+            self.saved = self.F.zeros_like(preds)
+            mobula.func.iou_loss_forward_backward(
+                out_size=out_size, preds=preds, targets=targets, outputs=outputs, grads=self.saved)
+        elif self.save == 'intermediates':
+            self.saved = self.F.empty_like(preds)
+            mobula.func.iou_loss_forward_saved(
+                out_size=out_size, preds=preds, targets=targets, outputs=outputs, saved=self.saved)
+        else:
+            mobula.func.iou_loss_forward(
+                out_size=out_size, preds=preds, targets=targets, outputs=outputs)
+
     def forward(self, preds, targets):
         if self.req[0] == req.null:
             return
         out = self.y
-        out_size = preds.shape[0]
         if self.req[0] == req.add:
             out_temp = self.F.zeros_like(out)
-            mobula.func.iou_loss_forward(
-                out_size=out_size, preds=preds, targets=targets, outputs=out_temp)
-
+            self._forward(preds, targets, out_temp)
             self.y[:] += out_temp
         else:
             self.y[:] = 0
-            mobula.func.iou_loss_forward(
-                out_size=out_size, preds=preds, targets=targets, outputs=self.y)
+            self._forward(preds, targets, self.y)
+
+    def _backward(self, preds, targets, outputs):
+        out_size = preds.shape[0]
+        if self.save == 'gradient':
+            outputs[:] = self.saved
+        elif self.save == 'intermediates':
+            mobula.func.iou_loss_backward_saved(
+                out_size=out_size, preds=preds, targets=targets, saved=self.saved, outputs=outputs)
+        else:
+            mobula.func.iou_loss_backward(
+                out_size=out_size, preds=preds, targets=targets, outputs=outputs)
 
     def backward(self, dy):
         assert self.req[1] == req.null
         preds = self.X[0]
         targets = self.X[1]
-        out_size = preds.shape[0]
         if self.req[0] == req.add:
             out_temp = self.F.zeros_like(self.dX[0])
-            mobula.func.iou_loss_backward(
-                out_size=out_size, preds=preds, targets=targets, outputs=out_temp)
+            self._backward(preds, targets, out_temp)
             self.dX[0] += out_temp
         else:
             self.dX[0][:] = 0
-            mobula.func.iou_loss_backward(
-                out_size=out_size, preds=preds, targets=targets, outputs=self.dX[0][:])
+            self._backward(preds, targets, self.dX[0][:])
 
         self.dX[0][:] = self.dX[0][:] * dy
 
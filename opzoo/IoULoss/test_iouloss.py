@@ -130,6 +130,26 @@ def test_IoULoss_mx_cuda():
     test_IoULoss_mx(ctx)
 
 
+def test_IoULoss_save():
+    x = mx.nd.random.uniform(1, 5, shape=(N, 4), dtype="float64")
+    y = mx.nd.random.uniform(np.exp(1), np.exp(5), shape=(N, 4), dtype="float64")
+    # the invalid targets
+    y[::5, 1] = 0
+    dy = mx.nd.random.uniform(-1, 1, shape=(N, 1), dtype="float64")
+    results = []
+    for save in [None, 'gradient', 'intermediates']:
+        x1 = x.copy()
+        x1.attach_grad()
+        with ag.record():
+            loss = mobula.op.IoULoss(x1, y, save=save)
+        loss.backward(dy)
+        results.append((loss.asnumpy(), x1.grad.asnumpy()))
+    for loss, grad in results[1:]:
+        assert_almost_equal(loss, results[0][0])
+        assert_almost_equal(grad, results[0][1])
+
+
 if __name__ == '__main__':
     test_IoULoss_mx_cpu()
     test_IoULoss_mx_cuda()
+    test_IoULoss_save()
@@ -0,0 +1,196 @@
+#include "mobula_op.h"
+
+namespace mobula {
+
+// the IoU of the boxes (x1, y1, x2, y2)
+template <typename T>
+MOBULA_DEVICE typename AccType<T>::type get_box_iou(const T* a, const T* b) {
+  typedef typename AccType<T>::type A;
+  const A zero = 0;
+  const A w = max(min(static_cast<A>(a[2]), static_cast<A>(b[2])) -
+                      max(static_cast<A>(a[0]), static_cast<A>(b[0])),
+                  zero);
+  const A h = max(min(static_cast<A>(a[3]), static_cast<A>(b[3])) -
+                      max(static_cast<A>(a[1]), static_cast<A>(b[1])),
+                  zero);
+  const A inter = w * h;
+  const A area_a = max(static_cast<A>(a[2]) - static_cast<A>(a[0]), zero) *
+                   max(static_cast<A>(a[3]) - static_cast<A>(a[1]), zero);
+  const A area_b = max(static_cast<A>(b[2]) - static_cast<A>(b[0]), zero) *
+                   max(static_cast<A>(b[3]) - static_cast<A>(b[1]), zero);
+  const A area_union = area_a + area_b - inter;
+  return area_union > 0 ? inter / area_union : zero;
+}
+
+// whether the box i suppresses the box j
+template <typename T>
+MOBULA_DEVICE bool is_nms_suppressed(const T* boxes, const T* class_ids,
+                                     const int class_aware, const int i,
+                                     const int j, const float iou_threshold) {
+  if (class_aware && class_ids[i] != class_ids[j]) return false;
+  return get_box_iou(boxes + i * 4, boxes + j * 4) > iou_threshold;
+}
+
+/*!
+ * \brief Sort the boxes of each batch by the descending scores, and the boxes
+ *  with the same score by their indices.
+ *  nthreads is batch_size * num_boxes, and order is (batch_size, num_boxes),
+ *  the indices of the boxes in float.
+ */
+template <typename T>
+MOBULA_KERNEL nms_sort_kernel(const int nthreads, const T* scores,
+                              const int num_boxes, float* order) {
+  typedef typename AccType<T>::type A;
+#if USING_CUDA || USING_HIP
+  // the rank of a box is the number of the boxes before it
+  parfor(nthreads, [&](int index) {
+    const int i = index % num_boxes;
+    const T* batch_scores = scores + index - i;
+    const A s = batch_scores[i];
+    int rank = 0;
+    for (int j = 0; j < num_boxes; ++j) {
+      const A t = batch_scores[j];
+      rank += t > s || (t == s && j < i);
+    }
+    order[index - i + rank] = i;
+  });
+#else
+  parfor(nthreads / num_boxes, [&](int b) {
+    const T* batch_scores = scores + b * num_boxes;
+    std::vector<int> inds(num_boxes);
+    for (int i = 0; i < num_boxes; ++i) inds[i] = i;
+    std::stable_sort(inds.begin(), inds.end(), [&](int i, int j) {
+      return static_cast<A>(batch_scores[i]) > static_cast<A>(batch_scores[j]);
+    });
+    for (int i = 0; i < num_boxes; ++i) order[b * num_boxes + i] = inds[i];
+  });
+#endif  // USING_CUDA || USING_HIP
+}
+
+// the bits of a word of the suppression mask
+constexpr int kNMSMaskBits = 32;
+
+/*!
+ * \brief The suppression mask over the sorted boxes on GPU.
+ *  The bit k of the word w of the box i is whether the box i suppresses the
+ *  box (w * kNMSMaskBits + k) after it. The words are stored in the bits of
+ *  mask, (batch_size, num_boxes, num_words). It is unused on CPU.
+ *  nthreads is batch_size * num_boxes * num_words.
+ */
+template <typename T>
+MOBULA_KERNEL nms_mask_kernel(const int nthreads, const T* boxes,
+                              const T* class_ids, const int class_aware,
+                              const float* order, const int num_boxes,
+                              const float iou_threshold, float* mask) {
+#if USING_CUDA || USING_HIP
+  const int num_words = (num_boxes + kNMSMaskBits - 1) / kNMSMaskBits;
+  uint32_t* words = reinterpret_cast<uint32_t*>(mask);
+  parfor(nthreads, [&](int index) {
+    const int w = index % num_words;
+    const int i = (index / num_words) % num_boxes;
+    const int b = index / num_words / num_boxes;
+    const float* batch_order = order + b * num_boxes;
+    const T* batch_boxes = boxes + b * num_boxes * 4;
+    const T* batch_class_ids = class_ids + b * num_boxes;
+    const int box_i = batch_order[i];
+    uint32_t bits = 0;
+    const int end = min(num_boxes, (w + 1) * kNMSMaskBits);
+    for (int j = max(i + 1, w * kNMSMaskBits); j < end; ++j) {
+      if (is_nms_suppressed(batch_boxes, batch_class_ids, class_aware, box_i,
+                            static_cast<int>(batch_order[j]),
+                            iou_threshold)) {
+        bits |= 1u << (j - w * kNMSMaskBits);
+      }
+    }
+    words[index] = bits;
+  });
+#else
+  UNUSED(nthreads);
+  UNUSED(boxes);
+  UNUSED(class_ids);
+  UNUSED(class_aware);
+  UNUSED(order);
+  UNUSED(num_boxes);
+  UNUSED(iou_threshold);
+  UNUSED(mask);
+#endif  // USING_CUDA || USING_HIP
+}
+
+/*!
+ * \brief Keep the boxes which are not suppressed by the boxes of higher
+ *  scores, and the scores of which are not less than score_threshold.
+ *  keep is (batch_size, num_boxes), the indices of the kept boxes in int in
+ *  the descending order of the scores, followed by -1.
+ *  On GPU, a thread walks the mask of a batch. On CPU, the kept boxes are
+ *  visited in order, and each one suppresses the boxes after it by parfor.
+ *  nthreads is batch_size * num_boxes.
+ */
+template <typename T>
+MOBULA_KERNEL nms_suppress_kernel(
+    const int nthreads, const T* boxes, const T* scores, const T* class_ids,
+    const int class_aware, const float* order, const float* mask,
+    const int num_boxes, const float iou_threshold,
+    const float score_threshold, MOBULA_WORKSPACE(int, removed, nthreads),
+    int* keep) {
+  const int batch_size = nthreads / num_boxes;
+#if USING_CUDA || USING_HIP
+  const int num_words = (num_boxes + kNMSMaskBits - 1) / kNMSMaskBits;
+  const uint32_t* words = reinterpret_cast<const uint32_t*>(mask);
+  parfor(batch_size, [&](int b) {
+    const float* batch_order = order + b * num_boxes;
+    const T* batch_scores = scores + b * num_boxes;
+    uint32_t* batch_removed =
+        reinterpret_cast<uint32_t*>(removed + b * num_boxes);
+    int* batch_keep = keep + b * num_boxes;
+    for (int w = 0; w < num_words; ++w) batch_removed[w] = 0;
+    int count = 0;
+    for (int i = 0; i < num_boxes; ++i) {
+      const int w = i / kNMSMaskBits;
+      if (batch_removed[w] & (1u << (i % kNMSMaskBits))) continue;
+      const int box_i = batch_order[i];
+      // the scores of the boxes after it are not higher
+      if (batch_scores[box_i] < score_threshold) break;
+      batch_keep[count++] = box_i;
+      const uint32_t* row = words + (b * num_boxes + i) * num_words;
+      for (int k = w; k < num_words; ++k) batch_removed[k] |= row[k];
+    }
+    for (int i = count; i < num_boxes; ++i) batch_keep[i] = -1;
+  });
+#else
+  UNUSED(mask);
+  for (int b = 0; b < batch_size; ++b) {
+    const float* batch_order = order + b * num_boxes;
+    const T* batch_boxes = boxes + b * num_boxes * 4;
+    const T* batch_scores = scores + b * num_boxes;
+    const T* batch_class_ids = class_ids + b * num_boxes;
+    int* batch_removed = removed + b * num_boxes;
+    int* batch_keep = keep + b * num_boxes;
+    parfor(num_boxes, [&](int i) { batch_removed[i] = 0; });
+    __syncthreads();
+    // all threads visit the same boxes, since the flags are only written
+    // between the barriers
+    int count = 0;
+    for (int i = 0; i < num_boxes; ++i) {
+      if (batch_removed[i]) continue;
+      const int box_i = batch_order[i];
+      if (batch_scores[box_i] < score_threshold) break;
+      if (get_thread_num() == 0) batch_keep[count] = box_i;
+      ++count;
+      parfor(num_boxes - i - 1, [&](int k) {
+        const int j = i + 1 + k;
+        if (!batch_removed[j] &&
+            is_nms_suppressed(batch_boxes, batch_class_ids, class_aware,
+                              box_i, static_cast<int>(batch_order[j]),
+                              iou_threshold)) {
+          batch_removed[j] = 1;
+        }
+      });
+      __syncthreads();
+    }
+    parfor(num_boxes - count,
+           [&](int i) { batch_keep[count + i] = -1; });
+  }
+#endif  // USING_CUDA || USING_HIP
+}
+
+}  // namespace mobula
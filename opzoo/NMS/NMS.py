@@ -0,0 +1,75 @@
+import mobula
+from mobula.const import req
+import numpy as np
+
+# the bits of a word of the suppression mask, kNMSMaskBits in NMS.cpp
+MASK_BITS = 32
+
+
+@mobula.op.register
+class NMS:
+    """Non-maximum suppression of the boxes in each batch.
+
+    The inputs are the boxes (B, N, 4) of (x1, y1, x2, y2), the scores (B, N),
+    and the class ids (B, N) when `class_aware`, where only the boxes of the
+    same class suppress each other. The output (B, N) is the int32 indices of
+    the kept boxes in the descending order of the scores, followed by -1.
+    The boxes whose scores are less than `score_threshold` are dropped.
+    """
+
+    def __init__(self, iou_threshold=0.5, score_threshold=float('-inf'),
+                 class_aware=False):
+        self.iou_threshold = iou_threshold
+        self.score_threshold = score_threshold
+        self.class_aware = class_aware
+
+    def list_arguments(self):
+        return ['boxes', 'scores'] + (['class_ids'] if self.class_aware else [])
+
+    def _forward(self, boxes, scores, class_ids, out):
+        B, N = scores.shape
+        order = self.F.empty((B, N))
+        mobula.func.nms_sort(B * N, scores, N, order)
+        if mobula.glue.backend.get_var_glue(boxes).Tensor(boxes).dev_id is None:
+            # the mask is only computed on GPU, and unused by the kernel on CPU
+            mask = order
+        else:
+            num_words = (N + MASK_BITS - 1) // MASK_BITS
+            mask = self.F.empty((B, N, num_words))
+            mobula.func.nms_mask(B * N * num_words, boxes, class_ids,
+                                 int(self.class_aware), order, N,
+                                 self.iou_threshold, mask)
+        mobula.func.nms_suppress(B * N, boxes, scores, class_ids,
+                                 int(self.class_aware), order, mask, N,
+                                 self.iou_threshold, self.score_threshold, out)
+
+    def forward(self, boxes, scores, class_ids=None):
+        if self.req[0] == req.null:
+            return
+        if class_ids is None:
+            # unused by the kernels
+            class_ids = scores
+        if self.req[0] == req.add:
+            out_temp = self.F.empty_like(self.y)
+            self._forward(boxes, scores, class_ids, out_temp)
+            self.y[:] += out_temp
+        else:
+            self._forward(boxes, scores, class_ids, self.y)
+
+    def backward(self, dy):
+        for i in range(len(self.X)):
+            if self.req[i] not in [req.null, req.add]:
+                self.dX[i][:] = 0
+
+    def infer_shape(self, in_shape):
+        bshape, sshape = in_shape[:2]
+        assert len(bshape) == 3
+        assert bshape[2] == 4
+        assert list(sshape) == list(bshape[:2])
+        if self.class_aware:
+            assert list(in_shape[2]) == list(sshape)
+        return in_shape, [sshape]
+
+    def infer_type(self, in_type):
+        # the indices are exact whatever the dtype of the boxes is
+        return in_type, [np.int32]
@@ -0,0 +1,73 @@
+import mxnet as mx
+import numpy as np
+import mobula
+from mobula.testing import assert_almost_equal
+
+mobula.op.load('NMS')
+
+
+def get_iou(a, b):
+    w = max(min(a[2], b[2]) - max(a[0], b[0]), 0)
+    h = max(min(a[3], b[3]) - max(a[1], b[1]), 0)
+    inter = w * h
+    union = (a[2] - a[0]) * (a[3] - a[1]) + (b[2] - b[0]) * (b[3] - b[1]) - inter
+    return inter / union if union > 0 else 0
+
+
+def nms_np(boxes, scores, class_ids, iou_threshold, score_threshold):
+    order = np.argsort(-scores, kind='stable')
+    removed = np.zeros(len(order), dtype=np.bool_)
+    keep = []
+    for a, i in enumerate(order):
+        if removed[a] or scores[i] < score_threshold:
+            continue
+        keep.append(i)
+        for c in range(a + 1, len(order)):
+            j = order[c]
+            if class_ids is not None and class_ids[i] != class_ids[j]:
+                continue
+            if get_iou(boxes[i], boxes[j]) > iou_threshold:
+                removed[c] = True
+    return keep + [-1] * (len(order) - len(keep))
+
+
+def test_nms():
+    B, N = 3, 100
+    xy = np.random.uniform(0, 100, (B, N, 2))
+    wh = np.random.uniform(1, 40, (B, N, 2))
+    boxes = np.concatenate([xy, xy + wh], axis=2).astype(np.float32)
+    # the boxes with the same score are sorted by their indices
+    scores = np.random.randint(0, 20, (B, N)).astype(np.float32) / 20
+    class_ids = np.random.randint(0, 3, (B, N)).astype(np.float32)
+    for class_aware in [False, True]:
+        for score_threshold in [float('-inf'), 0.5]:
+            inputs = [mx.nd.array(boxes), mx.nd.array(scores)]
+            if class_aware:
+                inputs.append(mx.nd.array(class_ids))
+            keep = mobula.op.NMS(*inputs, iou_threshold=0.5,
+                                 score_threshold=score_threshold,
+                                 class_aware=class_aware)
+            for b in range(B):
+                ids = class_ids[b] if class_aware else None
+                target = nms_np(boxes[b], scores[b], ids, 0.5, score_threshold)
+                assert_almost_equal(keep[b], np.array(target, dtype=np.float32))
+
+
+
+def test_nms_float16():
+    # the indices above 2048 can't be represented by float16
+    N = 3000
+    # the disjoint boxes on a grid are all kept
+    xy = np.stack(np.divmod(np.arange(N), 64), axis=1) * 2
+    boxes = np.concatenate([xy, xy + 1], axis=1)[None].astype(np.float16)
+    scores = np.random.permutation(N)[None].astype(np.float16)
+    keep = mobula.op.NMS(mx.nd.array(boxes, dtype=np.float16),
+                         mx.nd.array(scores, dtype=np.float16))
+    assert keep.dtype == np.int32, keep.dtype
+    target = np.argsort(-scores[0].astype(np.float32), kind='stable')
+    assert (keep[0].asnumpy() == target).all()
+
+
+if __name__ == '__main__':
+    test_nms()
+    test_nms_float16()
@@ -6,15 +6,212 @@
 
 namespace mobula {
 
+// the plane of a non-contiguous view which starts at the element `base`
+template <typename T, int N>
+struct ViewPlane {
+  const StridedView<T, N>* view;
+  int64_t base;
+  MOBULA_DEVICE T& operator[](const int64_t i) const {
+    return (*view)[base + i];
+  }
+};
+
+// the average of the sample points in the bin (ph, pw) of a ROI, over the
+// channel which starts at offset_bottom_data, a pointer or a ViewPlane
+template <typename T, typename D>
+MOBULA_DEVICE typename AccType<T>::type roi_align_bin_forward(
+    const D& offset_bottom_data, const T* offset_bottom_rois,
+    const T spatial_scale, const int height, const int width,
+    const int pooled_height, const int pooled_width, const int sampling_ratio,
+    const int ph, const int pw, const int index) {
+  // the coordinates and the sums are in float for the 16-bit types
+  typedef typename AccType<T>::type A;
+  // Do not using rounding; this implementation detail is critical
+  A roi_start_w = offset_bottom_rois[1] * spatial_scale;
+  A roi_start_h = offset_bottom_rois[2] * spatial_scale;
+  A roi_end_w = offset_bottom_rois[3] * spatial_scale;
+  A roi_end_h = offset_bottom_rois[4] * spatial_scale;
+  // T roi_start_w = round(offset_bottom_rois[1] * spatial_scale);
+  // T roi_start_h = round(offset_bottom_rois[2] * spatial_scale);
+  // T roi_end_w = round(offset_bottom_rois[3] * spatial_scale);
+  // T roi_end_h = round(offset_bottom_rois[4] * spatial_scale);
+
+  // Force malformed ROIs to be 1x1
+  A roi_width = max(roi_end_w - roi_start_w, static_cast<A>(1.));
+  A roi_height = max(roi_end_h - roi_start_h, static_cast<A>(1.));
+  A bin_size_h = static_cast<A>(roi_height) / static_cast<A>(pooled_height);
+  A bin_size_w = static_cast<A>(roi_width) / static_cast<A>(pooled_width);
+
+  // We use roi_bin_grid to sample the grid and mimic integral
+  int roi_bin_grid_h = (sampling_ratio > 0)
+                           ? sampling_ratio
+                           : ceil(roi_height / pooled_height);  // e.g., = 2
+  int roi_bin_grid_w =
+      (sampling_ratio > 0) ? sampling_ratio : ceil(roi_width / pooled_width);
+
+  // We do average (integral) pooling inside a bin
+  const A count = roi_bin_grid_h * roi_bin_grid_w;  // e.g. = 4
+
+  A output_val = 0.;
+  for (int iy = 0; iy < roi_bin_grid_h; iy++)  // e.g., iy = 0, 1
+  {
+    const A y = roi_start_h + ph * bin_size_h +
+                static_cast<A>(iy + .5f) * bin_size_h /
+                    static_cast<A>(roi_bin_grid_h);  // e.g., 0.5, 1.5
+    for (int ix = 0; ix < roi_bin_grid_w; ix++) {
+      const A x = roi_start_w + pw * bin_size_w +
+                  static_cast<A>(ix + .5f) * bin_size_w /
+                      static_cast<A>(roi_bin_grid_w);
+
+      A val = bilinear_interpolate(offset_bottom_data, height, width, y, x,
+                                   index);
+      output_val += val;
+    }
+  }
+  output_val /= count;
+  return output_val;
+}
+
+// scatter the gradient of the bin (ph, pw) of a ROI into the channel which
+// starts at bottom_offset
 template <typename T>
-MOBULA_KERNEL roi_align_forward_kernel(const int nthreads, const T* bottom_data,
-                                       const T spatial_scale,
-                                       const int channels, const int height,
-                                       const int width, const int pooled_height,
-                                       const int pooled_width,
-                                       const int sampling_ratio,
-                                       const T* bottom_rois, T* top_data) {
-  parfor(nthreads, [&](int index) {
+MOBULA_DEVICE void roi_align_bin_backward(
+    ScatterBuffer<T>* diff, const int64_t bottom_offset,
+    const typename AccType<T>::type top_diff_this_bin,
+    const T* offset_bottom_rois, const T spatial_scale, const int height,
+    const int width, const int pooled_height, const int pooled_width,
+    const int sampling_ratio, const int ph, const int pw, const int index) {
+  typedef typename AccType<T>::type A;
+  // Do not using rounding; this implementation detail is critical
+  A roi_start_w = offset_bottom_rois[1] * spatial_scale;
+  A roi_start_h = offset_bottom_rois[2] * spatial_scale;
+  A roi_end_w = offset_bottom_rois[3] * spatial_scale;
+  A roi_end_h = offset_bottom_rois[4] * spatial_scale;
+  // T roi_start_w = round(offset_bottom_rois[1] * spatial_scale);
+  // T roi_start_h = round(offset_bottom_rois[2] * spatial_scale);
+  // T roi_end_w = round(offset_bottom_rois[3] * spatial_scale);
+  // T roi_end_h = round(offset_bottom_rois[4] * spatial_scale);
+
+  // Force malformed ROIs to be 1x1
+  A roi_width = max(roi_end_w - roi_start_w, static_cast<A>(1.));
+  A roi_height = max(roi_end_h - roi_start_h, static_cast<A>(1.));
+  A bin_size_h = static_cast<A>(roi_height) / static_cast<A>(pooled_height);
+  A bin_size_w = static_cast<A>(roi_width) / static_cast<A>(pooled_width);
+
+  // We use roi_bin_grid to sample the grid and mimic integral
+  int roi_bin_grid_h = (sampling_ratio > 0)
+                           ? sampling_ratio
+                           : ceil(roi_height / pooled_height);  // e.g., = 2
+  int roi_bin_grid_w =
+      (sampling_ratio > 0) ? sampling_ratio : ceil(roi_width / pooled_width);
+
+  // We do average (integral) pooling inside a bin
+  const A count = roi_bin_grid_h * roi_bin_grid_w;  // e.g. = 4
+
+  for (int iy = 0; iy < roi_bin_grid_h; iy++)  // e.g., iy = 0, 1
+  {
+    const A y = roi_start_h + ph * bin_size_h +
+                static_cast<A>(iy + .5f) * bin_size_h /
+                    static_cast<A>(roi_bin_grid_h);  // e.g., 0.5, 1.5
+    for (int ix = 0; ix < roi_bin_grid_w; ix++) {
+      const A x = roi_start_w + pw * bin_size_w +
+                  static_cast<A>(ix + .5f) * bin_size_w /
+                      static_cast<A>(roi_bin_grid_w);
+
+      A w1, w2, w3, w4;
+      int x_low, x_high, y_low, y_high;
+
+      bilinear_interpolate_gradient(height, width, y, x, w1, w2, w3, w4,
+                                    x_low, x_high, y_low, y_high, index);
+
+      A g1 = top_diff_this_bin * w1 / count;
+      A g2 = top_diff_this_bin * w2 / count;
+      A g3 = top_diff_this_bin * w3 / count;
+      A g4 = top_diff_this_bin * w4 / count;
+
+      if (x_low >= 0 && x_high >= 0 && y_low >= 0 && y_high >= 0) {
+        diff->add(static_cast<A>(g1), bottom_offset + y_low * width + x_low);
+        diff->add(static_cast<A>(g2), bottom_offset + y_low * width + x_high);
+        diff->add(static_cast<A>(g3), bottom_offset + y_high * width + x_low);
+        diff->add(static_cast<A>(g4),
+                  bottom_offset + y_high * width + x_high);
+      }  // if
+    }    // ix
+  }      // iy
+}
+
+// the number of the batches which the ROIs refer to
+template <typename T>
+MOBULA_DEVICE int get_roi_batch_size(const T* bottom_rois, const int num_rois) {
+  int batch_size = 0;
+  for (int i = 0; i < num_rois; ++i) {
+    batch_size = max(batch_size, static_cast<int>(bottom_rois[i * 5]) + 1);
+  }
+  return batch_size;
+}
+
+// the cost of a bin of the adaptive sampling_ratio varies with the size of
+// its ROI, so the threads steal the bins of the large ROIs on CPU
+constexpr float kRoIAlignAdaptiveBinCost = 256.0f;
+
+MOBULA_DEVICE inline ParforSchedule get_roi_align_schedule(
+    const int sampling_ratio) {
+  return sampling_ratio > 0 ? parfor_static()
+                            : parfor_stealing(0, kRoIAlignAdaptiveBinCost);
+}
+
+template <typename T, typename index_t = int, int kPooledHeight = kDynamicConst,
+          int kPooledWidth = kDynamicConst, int kSamplingRatio = kDynamicConst>
+MOBULA_KERNEL roi_align_forward_kernel(
+    const index_t nthreads, MOBULA_VIEW(const T, bottom_data, 4),
+    const T spatial_scale, const int channels, const int height,
+    const int width, MOBULA_CONSTEXPR(pooled_height, kPooledHeight),
+    MOBULA_CONSTEXPR(pooled_width, kPooledWidth),
+    MOBULA_CONSTEXPR(sampling_ratio, kSamplingRatio), const T* bottom_rois,
+    T* top_data) {
+  parfor(nthreads, get_roi_align_schedule(sampling_ratio), [&](index_t index) {
+    // (n, c, ph, pw) is an element in the pooled output
+    int pw = index % pooled_width;
+    int ph = (index / pooled_width) % pooled_height;
+    int c = (index / pooled_width / pooled_height) % channels;
+    int n = index / pooled_width / pooled_height / channels;
+
+    const T* offset_bottom_rois = bottom_rois + n * 5;
+    int roi_batch_ind = offset_bottom_rois[0];
+    const int64_t offset =
+        static_cast<int64_t>(roi_batch_ind * channels + c) * height * width;
+    if (bottom_data.is_contiguous) {
+      top_data[index] = roi_align_bin_forward(
+          bottom_data.data + offset, offset_bottom_rois, spatial_scale, height,
+          width, pooled_height, pooled_width, sampling_ratio, ph, pw, index);
+    } else {
+      const ViewPlane<const T, 4> plane{&bottom_data, offset};
+      top_data[index] = roi_align_bin_forward(
+          plane, offset_bottom_rois, spatial_scale, height, width,
+          pooled_height, pooled_width, sampling_ratio, ph, pw, index);
+    }
+  });
+}
+
+template <typename T, typename index_t = int, int kPooledHeight = kDynamicConst,
+          int kPooledWidth = kDynamicConst, int kSamplingRatio = kDynamicConst>
+MOBULA_KERNEL roi_align_backward_kernel(
+    const index_t nthreads, const T* top_diff, const T spatial_scale,
+    const int channels, const int height, const int width,
+    MOBULA_CONSTEXPR(pooled_height, kPooledHeight),
+    MOBULA_CONSTEXPR(pooled_width, kPooledWidth),
+    MOBULA_CONSTEXPR(sampling_ratio, kSamplingRatio), T* bottom_diff,
+    const T* bottom_rois) {
+  // the private copies of bottom_diff only cover the referenced batches
+  int batch_size = 0;
+  if (ScatterBuffer<T>::kPrivatizable) {
+    batch_size = get_roi_batch_size(
+        bottom_rois, nthreads / (channels * pooled_height * pooled_width));
+  }
+  ScatterBuffer<T> diff(bottom_diff,
+                        static_cast<size_t>(batch_size) * channels * height *
+                            width);
+  parfor(nthreads, get_roi_align_schedule(sampling_ratio), [&](index_t index) {
     // (n, c, ph, pw) is an element in the pooled output
     int pw = index % pooled_width;
     int ph = (index / pooled_width) % pooled_height;
@@ -23,141 +220,582 @@ MOBULA_KERNEL roi_align_forward_kernel(const int nthreads, const T* bottom_data,
 
     const T* offset_bottom_rois = bottom_rois + n * 5;
     int roi_batch_ind = offset_bottom_rois[0];
+    const int64_t bottom_offset =
+        static_cast<int64_t>(roi_batch_ind * channels + c) * height * width;
+    roi_align_bin_backward(&diff, bottom_offset, top_diff[index],
+                           offset_bottom_rois, spatial_scale, height, width,
+                           pooled_height, pooled_width, sampling_ratio, ph, pw,
+                           index);
+  });  // parfor
+  diff.merge();
+}  // RoIAlignBackward
 
-    // Do not using rounding; this implementation detail is critical
-    T roi_start_w = offset_bottom_rois[1] * spatial_scale;
-    T roi_start_h = offset_bottom_rois[2] * spatial_scale;
-    T roi_end_w = offset_bottom_rois[3] * spatial_scale;
-    T roi_end_h = offset_bottom_rois[4] * spatial_scale;
-    // T roi_start_w = round(offset_bottom_rois[1] * spatial_scale);
-    // T roi_start_h = round(offset_bottom_rois[2] * spatial_scale);
-    // T roi_end_w = round(offset_bottom_rois[3] * spatial_scale);
-    // T roi_end_h = round(offset_bottom_rois[4] * spatial_scale);
+/*
+ * The sampling table of the ROIs with a fixed sampling_ratio, which is shared
+ * by the channels and by the forward and the backward.
+ * The bilinear weights are separable, so a ROI has the entries of its
+ * pooled_height * sampling_ratio sample rows, and then of its
+ * pooled_width * sampling_ratio sample columns. An entry is
+ * (offset of the low pixel, offset of the high pixel, weight of the low pixel,
+ * weight of the high pixel) in float, where the offsets of the rows are
+ * multiplied by width, and the offset is -1 out of the feature map.
+ */
+constexpr int kRoIAlignTableEntry = 4;
 
+// table: (num_rois, (pooled_height + pooled_width) * sampling_ratio, 4)
+template <typename T>
+MOBULA_KERNEL roi_align_table_kernel(const int nthreads, const T* bottom_rois,
+                                     const T spatial_scale, const int height,
+                                     const int width, const int pooled_height,
+                                     const int pooled_width,
+                                     const int sampling_ratio, float* table) {
+  typedef typename AccType<T>::type A;
+  const int num_rows = pooled_height * sampling_ratio;
+  const int num_entries = num_rows + pooled_width * sampling_ratio;
+  parfor(nthreads, [&](int index) {
+    const int k = index % num_entries;
+    const int n = index / num_entries;
+    const T* offset_bottom_rois = bottom_rois + n * 5;
+    // the rows are along y, and the columns are along x
+    const bool is_row = k < num_rows;
+    const int i = is_row ? k : k - num_rows;
+    const int pooled_size = is_row ? pooled_height : pooled_width;
+    const int size = is_row ? height : width;
+    // Do not use rounding; this implementation detail is critical
+    const A roi_start = offset_bottom_rois[is_row ? 2 : 1] * spatial_scale;
+    const A roi_end = offset_bottom_rois[is_row ? 4 : 3] * spatial_scale;
     // Force malformed ROIs to be 1x1
-    T roi_width = max(roi_end_w - roi_start_w, static_cast<T>(1.));
-    T roi_height = max(roi_end_h - roi_start_h, static_cast<T>(1.));
-    T bin_size_h = static_cast<T>(roi_height) / static_cast<T>(pooled_height);
-    T bin_size_w = static_cast<T>(roi_width) / static_cast<T>(pooled_width);
+    const A roi_size = max(roi_end - roi_start, static_cast<A>(1.));
+    const A bin_size = roi_size / static_cast<A>(pooled_size);
+    const int p = i / sampling_ratio;
+    const int s = i % sampling_ratio;
+    const A v = roi_start + p * bin_size +
+                static_cast<A>(s + .5f) * bin_size /
+                    static_cast<A>(sampling_ratio);
+    int low, high;
+    A w_low, w_high;
+    float* entry = table + index * kRoIAlignTableEntry;
+    if (bilinear_axis(size, v, low, high, w_low, w_high)) {
+      const int stride = is_row ? width : 1;
+      entry[0] = low * stride;
+      entry[1] = high * stride;
+      entry[2] = w_low;
+      entry[3] = w_high;
+    } else {
+      entry[0] = entry[1] = -1;
+      entry[2] = entry[3] = 0;
+    }
+  });
+}
+
+template <typename T, typename index_t = int, int kPooledHeight = kDynamicConst,
+          int kPooledWidth = kDynamicConst, int kSamplingRatio = kDynamicConst>
+MOBULA_KERNEL roi_align_forward_table_kernel(
+    const index_t nthreads, const T* bottom_data, const int channels,
+    const int height, const int width,
+    MOBULA_CONSTEXPR(pooled_height, kPooledHeight),
+    MOBULA_CONSTEXPR(pooled_width, kPooledWidth),
+    MOBULA_CONSTEXPR(sampling_ratio, kSamplingRatio), const T* bottom_rois,
+    const float* table, T* top_data) {
+  typedef typename AccType<T>::type A;
+  const int num_rows = pooled_height * sampling_ratio;
+  const int num_entries = num_rows + pooled_width * sampling_ratio;
+  const A count = sampling_ratio * sampling_ratio;
+  parfor(nthreads, [&](index_t index) {
+    // (n, c, ph, pw) is an element in the pooled output
+    int pw = index % pooled_width;
+    int ph = (index / pooled_width) % pooled_height;
+    int c = (index / pooled_width / pooled_height) % channels;
+    int n = index / pooled_width / pooled_height / channels;
+
+    int roi_batch_ind = bottom_rois[n * 5];
+    const T* offset_bottom_data =
+        bottom_data +
+        static_cast<int64_t>(roi_batch_ind * channels + c) * height * width;
+    const float* rows = table + (n * num_entries + ph * sampling_ratio) *
+                                    kRoIAlignTableEntry;
+    const float* cols =
+        table + (n * num_entries + num_rows + pw * sampling_ratio) *
+                    kRoIAlignTableEntry;
+
+    A output_val = 0.;
+    for (int iy = 0; iy < sampling_ratio; ++iy) {
+      const float* ry = rows + iy * kRoIAlignTableEntry;
+      if (ry[0] < 0) continue;
+      const T* y_low = offset_bottom_data + static_cast<int>(ry[0]);
+      const T* y_high = offset_bottom_data + static_cast<int>(ry[1]);
+      for (int ix = 0; ix < sampling_ratio; ++ix) {
+        const float* cx = cols + ix * kRoIAlignTableEntry;
+        if (cx[0] < 0) continue;
+        const int x_low = cx[0], x_high = cx[1];
+        output_val += ry[2] * (cx[2] * static_cast<A>(y_low[x_low]) +
+                               cx[3] * static_cast<A>(y_low[x_high])) +
+                      ry[3] * (cx[2] * static_cast<A>(y_high[x_low]) +
+                               cx[3] * static_cast<A>(y_high[x_high]));
+      }
+    }
+    top_data[index] = output_val / count;
+  });
+}
+
+template <typename T, typename index_t = int, int kPooledHeight = kDynamicConst,
+          int kPooledWidth = kDynamicConst, int kSamplingRatio = kDynamicConst>
+MOBULA_KERNEL roi_align_backward_table_kernel(
+    const index_t nthreads, const T* top_diff, const int channels,
+    const int height, const int width,
+    MOBULA_CONSTEXPR(pooled_height, kPooledHeight),
+    MOBULA_CONSTEXPR(pooled_width, kPooledWidth),
+    MOBULA_CONSTEXPR(sampling_ratio, kSamplingRatio), T* bottom_diff,
+    const T* bottom_rois, const float* table) {
+  typedef typename AccType<T>::type A;
+  const int num_rows = pooled_height * sampling_ratio;
+  const int num_entries = num_rows + pooled_width * sampling_ratio;
+  const A count = sampling_ratio * sampling_ratio;
+  int batch_size = 0;
+  if (ScatterBuffer<T>::kPrivatizable) {
+    batch_size = get_roi_batch_size(
+        bottom_rois, nthreads / (channels * pooled_height * pooled_width));
+  }
+  ScatterBuffer<T> diff(bottom_diff,
+                        static_cast<size_t>(batch_size) * channels * height *
+                            width);
+  parfor(nthreads, [&](index_t index) {
+    int pw = index % pooled_width;
+    int ph = (index / pooled_width) % pooled_height;
+    int c = (index / pooled_width / pooled_height) % channels;
+    int n = index / pooled_width / pooled_height / channels;
+
+    int roi_batch_ind = bottom_rois[n * 5];
+    const int64_t bottom_offset =
+        static_cast<int64_t>(roi_batch_ind * channels + c) * height * width;
+    const float* rows = table + (n * num_entries + ph * sampling_ratio) *
+                                    kRoIAlignTableEntry;
+    const float* cols =
+        table + (n * num_entries + num_rows + pw * sampling_ratio) *
+                    kRoIAlignTableEntry;
+    const A g = static_cast<A>(top_diff[index]) / count;
+
+    for (int iy = 0; iy < sampling_ratio; ++iy) {
+      const float* ry = rows + iy * kRoIAlignTableEntry;
+      if (ry[0] < 0) continue;
+      const int64_t y_low = bottom_offset + static_cast<int>(ry[0]);
+      const int64_t y_high = bottom_offset + static_cast<int>(ry[1]);
+      const A g_low = g * ry[2], g_high = g * ry[3];
+      for (int ix = 0; ix < sampling_ratio; ++ix) {
+        const float* cx = cols + ix * kRoIAlignTableEntry;
+        if (cx[0] < 0) continue;
+        const int x_low = cx[0], x_high = cx[1];
+        diff.add(g_low * cx[2], y_low + x_low);
+        diff.add(g_low * cx[3], y_low + x_high);
+        diff.add(g_high * cx[2], y_high + x_low);
+        diff.add(g_high * cx[3], y_high + x_high);
+      }
+    }
+  });
+  diff.merge();
+}
+
+// the weight of the pixel `v` in the `num` entries of the table, whose offsets
+// are multiplied by `stride`
+MOBULA_DEVICE inline float get_roi_align_table_weight(const float* entries,
+                                                      const int num,
+                                                      const int v,
+                                                      const int stride) {
+  const float offset = static_cast<float>(v * stride);
+  float w = 0;
+  for (int i = 0; i < num; ++i) {
+    const float* e = entries + i * kRoIAlignTableEntry;
+    if (e[0] == offset) w += e[2];
+    if (e[1] == offset) w += e[3];
+  }
+  return w;
+}
+
+// whether the pixel `v` is in the range of the `num` entries, which are in
+// ascending order except the entries out of the feature map
+MOBULA_DEVICE inline bool is_in_roi_align_table(const float* entries,
+                                                const int num, const int v,
+                                                const int stride) {
+  const float offset = static_cast<float>(v * stride);
+  int first = 0, last = num - 1;
+  while (first <= last && entries[first * kRoIAlignTableEntry] < 0) ++first;
+  while (last >= first && entries[last * kRoIAlignTableEntry] < 0) --last;
+  return first <= last && entries[first * kRoIAlignTableEntry] <= offset &&
+         offset <= entries[last * kRoIAlignTableEntry + 1];
+}
+
+// the channels of a pixel which a thread gathers together, sharing the search
+// of the ROIs over the pixel, in registers on GPU
+#if USING_CUDA || USING_HIP
+constexpr int kRoIAlignGatherChannels = 16;
+#else
+constexpr int kRoIAlignGatherChannels = 128;
+#endif
+
+/*!
+ * \brief The backward of roi_align_forward_table without atomic_add.
+ *  Each pixel of bottom_diff gathers the gradients of the bins over it, by
+ *  visiting the ROIs of its batch in order, so the result is reproducible.
+ *  nthreads is the size of bottom_diff, (batch_size, channels, height, width).
+ */
+template <typename T>
+MOBULA_KERNEL roi_align_backward_gather_kernel(
+    const int nthreads, const T* top_diff, const int num_rois,
+    const int channels, const int height, const int width,
+    const int pooled_height, const int pooled_width, const int sampling_ratio,
+    T* bottom_diff, const T* bottom_rois, const float* table) {
+  typedef typename AccType<T>::type A;
+  const int num_rows = pooled_height * sampling_ratio;
+  const int num_entries = num_rows + pooled_width * sampling_ratio;
+  const int pooled_size = pooled_height * pooled_width;
+  const A count = sampling_ratio * sampling_ratio;
+  const int plane = height * width;
+  // (b, y, x) is a pixel, whose channels are the columns
+  parfor_rows(nthreads / channels, channels, [&](int index, int cols, int lane,
+                                                 int lanes) {
+    const int x = index % width;
+    const int y = (index / width) % height;
+    const int b = index / plane;
+    T* offset_bottom_diff = bottom_diff + b * channels * plane + y * width + x;
+    for (int c0 = lane; c0 < cols; c0 += lanes * kRoIAlignGatherChannels) {
+      A grads[kRoIAlignGatherChannels] = {0};
+      for (int n = 0; n < num_rois; ++n) {
+        if (static_cast<int>(bottom_rois[n * 5]) != b) continue;
+        const float* rows = table + n * num_entries * kRoIAlignTableEntry;
+        const float* columns = rows + num_rows * kRoIAlignTableEntry;
+        if (!is_in_roi_align_table(rows, num_rows, y, width) ||
+            !is_in_roi_align_table(columns, num_entries - num_rows, x,
+                                   1)) {
+          continue;
+        }
+        const T* offset_top_diff = top_diff + n * channels * pooled_size;
+        for (int ph = 0; ph < pooled_height; ++ph) {
+          const A wy = get_roi_align_table_weight(
+              rows + ph * sampling_ratio * kRoIAlignTableEntry,
+              sampling_ratio, y, width);
+          if (wy == 0) continue;
+          for (int pw = 0; pw < pooled_width; ++pw) {
+            const A w =
+                wy * get_roi_align_table_weight(
+                         columns + pw * sampling_ratio * kRoIAlignTableEntry,
+                         sampling_ratio, x, 1);
+            if (w == 0) continue;
+            const T* t = offset_top_diff + ph * pooled_width + pw;
+            for (int k = 0; k < kRoIAlignGatherChannels; ++k) {
+              const int c = c0 + k * lanes;
+              if (c < cols) grads[k] += w * static_cast<A>(t[c * pooled_size]);
+            }
+          }
+        }
+      }
+      for (int k = 0; k < kRoIAlignGatherChannels; ++k) {
+        const int c = c0 + k * lanes;
+        if (c < cols) {
+          offset_bottom_diff[c * plane] += grads[k] / count;
+        }
+      }
+    }
+  });
+}
+
+// the sample points of a bin are visited in batches, whose weights are
+// computed once and applied to all channels
+constexpr int kRoIAlignSampleBatch = 16;
+
+// Get the valid sample points [begin, end) of the bin (ph, pw), and return
+// their number
+template <typename A>
+MOBULA_DEVICE int get_roi_align_samples(
+    const int begin, const int end, const A roi_start_h, const A roi_start_w,
+    const A bin_size_h, const A bin_size_w, const int roi_bin_grid_h,
+    const int roi_bin_grid_w, const int ph, const int pw, const int height,
+    const int width, const int channels, BilinearSample<A>* samples) {
+  int num_samples = 0;
+  for (int i = begin; i < end; ++i) {
+    const int iy = i / roi_bin_grid_w;
+    const int ix = i % roi_bin_grid_w;
+    const A y = roi_start_h + ph * bin_size_h +
+                static_cast<A>(iy + .5f) * bin_size_h /
+                    static_cast<A>(roi_bin_grid_h);
+    const A x = roi_start_w + pw * bin_size_w +
+                static_cast<A>(ix + .5f) * bin_size_w /
+                    static_cast<A>(roi_bin_grid_w);
+    num_samples += bilinear_sample_nhwc(height, width, channels, y, x,
+                                        samples[num_samples]);
+  }
+  return num_samples;
+}
+
+// bottom_data: (batch_size, height, width, channels)
+// top_data: (num_rois, pooled_height, pooled_width, channels)
+template <typename T>
+MOBULA_KERNEL roi_align_forward_nhwc_kernel(
+    const int nthreads, const T* bottom_data, const T spatial_scale,
+    const int channels, const int height, const int width,
+    const int pooled_height, const int pooled_width, const int sampling_ratio,
+    const T* bottom_rois, T* top_data) {
+  typedef typename AccType<T>::type A;
+  // the channels of a pixel are contiguous, and vectorized on CPU
+  constexpr int N = VecSize<A>::value;
+  typedef Vec<A, N> V;
+  parfor_rows(nthreads / channels, channels, [&](int index, int cols, int lane,
+                                                 int lanes) {
+    // (n, ph, pw) is a bin in the pooled output
+    int pw = index % pooled_width;
+    int ph = (index / pooled_width) % pooled_height;
+    int n = index / pooled_width / pooled_height;
+
+    const T* offset_bottom_rois = bottom_rois + n * 5;
+    int roi_batch_ind = offset_bottom_rois[0];
+
+    A roi_start_w = offset_bottom_rois[1] * spatial_scale;
+    A roi_start_h = offset_bottom_rois[2] * spatial_scale;
+    A roi_end_w = offset_bottom_rois[3] * spatial_scale;
+    A roi_end_h = offset_bottom_rois[4] * spatial_scale;
+
+    A roi_width = max(roi_end_w - roi_start_w, static_cast<A>(1.));
+    A roi_height = max(roi_end_h - roi_start_h, static_cast<A>(1.));
+    A bin_size_h = static_cast<A>(roi_height) / static_cast<A>(pooled_height);
+    A bin_size_w = static_cast<A>(roi_width) / static_cast<A>(pooled_width);
 
     const T* offset_bottom_data =
-        bottom_data + (roi_batch_ind * channels + c) * height * width;
+        bottom_data + roi_batch_ind * height * width * channels;
+    T* offset_top_data = top_data + index * channels;
 
-    // We use roi_bin_grid to sample the grid and mimic integral
     int roi_bin_grid_h = (sampling_ratio > 0)
                              ? sampling_ratio
-                             : ceil(roi_height / pooled_height);  // e.g., = 2
+                             : ceil(roi_height / pooled_height);
     int roi_bin_grid_w =
         (sampling_ratio > 0) ? sampling_ratio : ceil(roi_width / pooled_width);
+    const int count = roi_bin_grid_h * roi_bin_grid_w;
 
-    // We do average (integral) pooling inside a bin
-    const T count = roi_bin_grid_h * roi_bin_grid_w;  // e.g. = 4
-
-    T output_val = 0.;
-    for (int iy = 0; iy < roi_bin_grid_h; iy++)  // e.g., iy = 0, 1
-    {
-      const T y = roi_start_h + ph * bin_size_h +
-                  static_cast<T>(iy + .5f) * bin_size_h /
-                      static_cast<T>(roi_bin_grid_h);  // e.g., 0.5, 1.5
-      for (int ix = 0; ix < roi_bin_grid_w; ix++) {
-        const T x = roi_start_w + pw * bin_size_w +
-                    static_cast<T>(ix + .5f) * bin_size_w /
-                        static_cast<T>(roi_bin_grid_w);
-
-        T val = bilinear_interpolate(offset_bottom_data, height, width, y, x,
-                                     index);
-        output_val += val;
+    BilinearSample<A> samples[kRoIAlignSampleBatch];
+    for (int begin = 0; begin < count; begin += kRoIAlignSampleBatch) {
+      const int end = min(begin + kRoIAlignSampleBatch, count);
+      const int num_samples = get_roi_align_samples(
+          begin, end, roi_start_h, roi_start_w, bin_size_h, bin_size_w,
+          roi_bin_grid_h, roi_bin_grid_w, ph, pw, height, width, channels,
+          samples);
+      for (int c = lane * N; c < cols; c += lanes * N) {
+        const int num = min(N, cols - c);
+        // the partial sums of the previous batches are kept in the output
+        V val = begin == 0 ? V(0) : load_vec<N>(offset_top_data + c, num);
+        for (int i = 0; i < num_samples; ++i) {
+          const BilinearSample<A>& s = samples[i];
+          for (int k = 0; k < 4; ++k) {
+            val += s.weights[k] *
+                   load_vec<N>(offset_bottom_data + s.offsets[k] + c, num);
+          }
+        }
+        if (end == count) val /= V(static_cast<A>(count));
+        store_vec(offset_top_data + c, val, num);
       }
     }
-    output_val /= count;
-
-    top_data[index] = output_val;
   });
 }
 
+// top_diff: (num_rois, pooled_height, pooled_width, channels)
+// bottom_diff: (batch_size, height, width, channels)
 template <typename T>
-MOBULA_KERNEL roi_align_backward_kernel(
+MOBULA_KERNEL roi_align_backward_nhwc_kernel(
     const int nthreads, const T* top_diff, const T spatial_scale,
     const int channels, const int height, const int width,
     const int pooled_height, const int pooled_width, const int sampling_ratio,
     T* bottom_diff, const T* bottom_rois) {
-  parfor(nthreads, [&](int index) {
-    // (n, c, ph, pw) is an element in the pooled output
+  typedef typename AccType<T>::type A;
+  constexpr int N = VecSize<A>::value;
+  typedef Vec<A, N> V;
+  int batch_size = 0;
+  if (ScatterBuffer<T>::kPrivatizable) {
+    batch_size = get_roi_batch_size(
+        bottom_rois, nthreads / (channels * pooled_height * pooled_width));
+  }
+  ScatterBuffer<T> diff(bottom_diff,
+                        static_cast<size_t>(batch_size) * height * width *
+                            channels);
+  parfor_rows(nthreads / channels, channels, [&](int index, int cols, int lane,
+                                                 int lanes) {
     int pw = index % pooled_width;
     int ph = (index / pooled_width) % pooled_height;
-    int c = (index / pooled_width / pooled_height) % channels;
-    int n = index / pooled_width / pooled_height / channels;
+    int n = index / pooled_width / pooled_height;
 
     const T* offset_bottom_rois = bottom_rois + n * 5;
     int roi_batch_ind = offset_bottom_rois[0];
 
-    // Do not using rounding; this implementation detail is critical
-    T roi_start_w = offset_bottom_rois[1] * spatial_scale;
-    T roi_start_h = offset_bottom_rois[2] * spatial_scale;
-    T roi_end_w = offset_bottom_rois[3] * spatial_scale;
-    T roi_end_h = offset_bottom_rois[4] * spatial_scale;
-    // T roi_start_w = round(offset_bottom_rois[1] * spatial_scale);
-    // T roi_start_h = round(offset_bottom_rois[2] * spatial_scale);
-    // T roi_end_w = round(offset_bottom_rois[3] * spatial_scale);
-    // T roi_end_h = round(offset_bottom_rois[4] * spatial_scale);
-
-    // Force malformed ROIs to be 1x1
-    T roi_width = max(roi_end_w - roi_start_w, static_cast<T>(1.));
-    T roi_height = max(roi_end_h - roi_start_h, static_cast<T>(1.));
-    T bin_size_h = static_cast<T>(roi_height) / static_cast<T>(pooled_height);
-    T bin_size_w = static_cast<T>(roi_width) / static_cast<T>(pooled_width);
+    A roi_start_w = offset_bottom_rois[1] * spatial_scale;
+    A roi_start_h = offset_bottom_rois[2] * spatial_scale;
+    A roi_end_w = offset_bottom_rois[3] * spatial_scale;
+    A roi_end_h = offset_bottom_rois[4] * spatial_scale;
 
-    T* offset_bottom_diff =
-        bottom_diff + (roi_batch_ind * channels + c) * height * width;
+    A roi_width = max(roi_end_w - roi_start_w, static_cast<A>(1.));
+    A roi_height = max(roi_end_h - roi_start_h, static_cast<A>(1.));
+    A bin_size_h = static_cast<A>(roi_height) / static_cast<A>(pooled_height);
+    A bin_size_w = static_cast<A>(roi_width) / static_cast<A>(pooled_width);
 
-    int top_offset = (n * channels + c) * pooled_height * pooled_width;
-    const T* offset_top_diff = top_diff + top_offset;
-    const T top_diff_this_bin = offset_top_diff[ph * pooled_width + pw];
+    const int bottom_offset = roi_batch_ind * height * width * channels;
+    const T* offset_top_diff = top_diff + index * channels;
 
-    // We use roi_bin_grid to sample the grid and mimic integral
     int roi_bin_grid_h = (sampling_ratio > 0)
                              ? sampling_ratio
-                             : ceil(roi_height / pooled_height);  // e.g., = 2
+                             : ceil(roi_height / pooled_height);
     int roi_bin_grid_w =
         (sampling_ratio > 0) ? sampling_ratio : ceil(roi_width / pooled_width);
+    const int count = roi_bin_grid_h * roi_bin_grid_w;
 
-    // We do average (integral) pooling inside a bin
-    const T count = roi_bin_grid_h * roi_bin_grid_w;  // e.g. = 4
-
-    for (int iy = 0; iy < roi_bin_grid_h; iy++)  // e.g., iy = 0, 1
-    {
-      const T y = roi_start_h + ph * bin_size_h +
-                  static_cast<T>(iy + .5f) * bin_size_h /
-                      static_cast<T>(roi_bin_grid_h);  // e.g., 0.5, 1.5
-      for (int ix = 0; ix < roi_bin_grid_w; ix++) {
-        const T x = roi_start_w + pw * bin_size_w +
-                    static_cast<T>(ix + .5f) * bin_size_w /
-                        static_cast<T>(roi_bin_grid_w);
-
-        T w1, w2, w3, w4;
-        int x_low, x_high, y_low, y_high;
-
-        bilinear_interpolate_gradient(height, width, y, x, w1, w2, w3, w4,
-                                      x_low, x_high, y_low, y_high, index);
-
-        T g1 = top_diff_this_bin * w1 / count;
-        T g2 = top_diff_this_bin * w2 / count;
-        T g3 = top_diff_this_bin * w3 / count;
-        T g4 = top_diff_this_bin * w4 / count;
-
-        if (x_low >= 0 && x_high >= 0 && y_low >= 0 && y_high >= 0) {
-          atomic_add(static_cast<T>(g1),
-                     offset_bottom_diff + y_low * width + x_low);
-          atomic_add(static_cast<T>(g2),
-                     offset_bottom_diff + y_low * width + x_high);
-          atomic_add(static_cast<T>(g3),
-                     offset_bottom_diff + y_high * width + x_low);
-          atomic_add(static_cast<T>(g4),
-                     offset_bottom_diff + y_high * width + x_high);
-        }  // if
-      }    // ix
-    }      // iy
-  });      // parfor
-}  // RoIAlignBackward
+    BilinearSample<A> samples[kRoIAlignSampleBatch];
+    for (int begin = 0; begin < count; begin += kRoIAlignSampleBatch) {
+      const int end = min(begin + kRoIAlignSampleBatch, count);
+      const int num_samples = get_roi_align_samples(
+          begin, end, roi_start_h, roi_start_w, bin_size_h, bin_size_w,
+          roi_bin_grid_h, roi_bin_grid_w, ph, pw, height, width, channels,
+          samples);
+      for (int c = lane * N; c < cols; c += lanes * N) {
+        const int num = min(N, cols - c);
+        const V g = load_vec<N>(offset_top_diff + c, num) /
+                    V(static_cast<A>(count));
+        for (int i = 0; i < num_samples; ++i) {
+          const BilinearSample<A>& s = samples[i];
+          for (int k = 0; k < 4; ++k) {
+            const V gk = s.weights[k] * g;
+            const int offset = bottom_offset + s.offsets[k] + c;
+            for (int j = 0; j < num; ++j) diff.add(gk[j], offset + j);
+          }
+        }
+      }
+    }
+  });
+  diff.merge();
+}
+
+/*!
+ * \brief The feature maps of a pyramid, e.g. P2 ~ P5 of FPN, which are passed
+ *  to the kernels as the arguments of each level.
+ */
+constexpr int kRoIAlignMaxLevels = 5;
+
+template <typename T>
+struct RoIAlignLevel {
+  const T* data;
+  T spatial_scale;
+  int height, width;
+};
+
+/*!
+ * \brief The level of a ROI in the pyramid, by the rule of FPN:
+ *  floor(canonical_level + log2(sqrt(area) / canonical_scale)), which is
+ *  clipped to [min_level, min_level + num_levels) and relative to min_level.
+ */
+template <typename T>
+MOBULA_DEVICE int get_roi_level(const T* offset_bottom_rois,
+                                const int num_levels, const int min_level,
+                                const T canonical_scale,
+                                const int canonical_level) {
+  typedef typename AccType<T>::type A;
+  const A roi_width = offset_bottom_rois[3] - offset_bottom_rois[1];
+  const A roi_height = offset_bottom_rois[4] - offset_bottom_rois[2];
+  const A roi_size = sqrt(max(roi_width * roi_height, static_cast<A>(0)));
+  const int level = static_cast<int>(
+      floor(canonical_level +
+            log2(roi_size / static_cast<A>(canonical_scale) +
+                 static_cast<A>(1e-6))));
+  return min(max(level - min_level, 0), num_levels - 1);
+}
+
+/*!
+ * \brief ROIAlign over a feature pyramid in one launch.
+ *  Each ROI is pooled from the level of get_roi_level, and the output keeps
+ *  the order of the ROIs. The levels after num_levels are unused.
+ */
+template <typename T, typename index_t = int>
+MOBULA_KERNEL roi_align_multilevel_forward_kernel(
+    const index_t nthreads, const T* bottom_rois, const int num_levels,
+    const int min_level, const T canonical_scale, const int canonical_level,
+    const int channels, const int pooled_height, const int pooled_width,
+    const int sampling_ratio, T* top_data, const T* data0,
+    const T spatial_scale0, const int height0, const int width0,
+    const T* data1, const T spatial_scale1, const int height1,
+    const int width1, const T* data2, const T spatial_scale2,
+    const int height2, const int width2, const T* data3,
+    const T spatial_scale3, const int height3, const int width3,
+    const T* data4, const T spatial_scale4, const int height4,
+    const int width4) {
+  const RoIAlignLevel<T> levels[kRoIAlignMaxLevels] = {
+      {data0, spatial_scale0, height0, width0},
+      {data1, spatial_scale1, height1, width1},
+      {data2, spatial_scale2, height2, width2},
+      {data3, spatial_scale3, height3, width3},
+      {data4, spatial_scale4, height4, width4}};
+  parfor(nthreads, get_roi_align_schedule(sampling_ratio), [&](index_t index) {
+    // (n, c, ph, pw) is an element in the pooled output
+    int pw = index % pooled_width;
+    int ph = (index / pooled_width) % pooled_height;
+    int c = (index / pooled_width / pooled_height) % channels;
+    int n = index / pooled_width / pooled_height / channels;
+
+    const T* offset_bottom_rois = bottom_rois + n * 5;
+    int roi_batch_ind = offset_bottom_rois[0];
+    const RoIAlignLevel<T>& level =
+        levels[get_roi_level(offset_bottom_rois, num_levels, min_level,
+                             canonical_scale, canonical_level)];
+    const T* offset_bottom_data =
+        level.data + static_cast<int64_t>(roi_batch_ind * channels + c) *
+                         level.height * level.width;
+    top_data[index] = roi_align_bin_forward(
+        offset_bottom_data, offset_bottom_rois, level.spatial_scale,
+        level.height, level.width, pooled_height, pooled_width,
+        sampling_ratio, ph, pw, index);
+  });
+}
+
+template <typename T, typename index_t = int>
+MOBULA_KERNEL roi_align_multilevel_backward_kernel(
+    const index_t nthreads, const T* top_diff, const T* bottom_rois,
+    const int num_levels, const int min_level, const T canonical_scale,
+    const int canonical_level, const int channels, const int pooled_height,
+    const int pooled_width, const int sampling_ratio, T* diff0,
+    const T spatial_scale0, const int height0, const int width0, T* diff1,
+    const T spatial_scale1, const int height1, const int width1, T* diff2,
+    const T spatial_scale2, const int height2, const int width2, T* diff3,
+    const T spatial_scale3, const int height3, const int width3, T* diff4,
+    const T spatial_scale4, const int height4, const int width4) {
+  const RoIAlignLevel<T> levels[kRoIAlignMaxLevels] = {
+      {diff0, spatial_scale0, height0, width0},
+      {diff1, spatial_scale1, height1, width1},
+      {diff2, spatial_scale2, height2, width2},
+      {diff3, spatial_scale3, height3, width3},
+      {diff4, spatial_scale4, height4, width4}};
+  int batch_size = 0;
+  if (ScatterBuffer<T>::kPrivatizable) {
+    batch_size = get_roi_batch_size(
+        bottom_rois, nthreads / (channels * pooled_height * pooled_width));
+  }
+  const size_t plane_size = static_cast<size_t>(batch_size) * channels;
+  ScatterBuffer<T> diffs[kRoIAlignMaxLevels] = {
+      ScatterBuffer<T>(diff0, plane_size * height0 * width0),
+      ScatterBuffer<T>(diff1, plane_size * height1 * width1),
+      ScatterBuffer<T>(diff2, plane_size * height2 * width2),
+      ScatterBuffer<T>(diff3, plane_size * height3 * width3),
+      ScatterBuffer<T>(diff4, plane_size * height4 * width4)};
+  parfor(nthreads, get_roi_align_schedule(sampling_ratio), [&](index_t index) {
+    // (n, c, ph, pw) is an element in the pooled output
+    int pw = index % pooled_width;
+    int ph = (index / pooled_width) % pooled_height;
+    int c = (index / pooled_width / pooled_height) % channels;
+    int n = index / pooled_width / pooled_height / channels;
+
+    const T* offset_bottom_rois = bottom_rois + n * 5;
+    int roi_batch_ind = offset_bottom_rois[0];
+    const int l = get_roi_level(offset_bottom_rois, num_levels, min_level,
+                                canonical_scale, canonical_level);
+    const RoIAlignLevel<T>& level = levels[l];
+    const int64_t bottom_offset = static_cast<int64_t>(
+        roi_batch_ind * channels + c) * level.height * level.width;
+    roi_align_bin_backward(&diffs[l], bottom_offset, top_diff[index],
+                           offset_bottom_rois, level.spatial_scale,
+                           level.height, level.width, pooled_height,
+                           pooled_width, sampling_ratio, ph, pw, index);
+  });
+  for (int l = 0; l < kRoIAlignMaxLevels; ++l) diffs[l].merge();
+}
 
 }  // namespace mobula
@@ -6,26 +6,79 @@ import numpy as np
 
 @mobula.op.register
 class ROIAlign:
-    def __init__(self, pooled_size, spatial_scale, sampling_ratio):
+    def __init__(self, pooled_size, spatial_scale, sampling_ratio, layout='NCHW',
+                 deterministic=False):
         self.pooled_size = pooled_size
         self.spatial_scale = spatial_scale
         self.sampling_ratio = sampling_ratio
+        # the layout of the data and the output, 'NCHW' or 'NHWC'
+        assert layout in ('NCHW', 'NHWC'), ValueError(
+            'Unsupported layout: {}'.format(layout))
+        self.layout = layout
+        # gather the gradients of each pixel without atomic_add, so that the
+        # gradient is reproducible
+        assert not deterministic or self._use_table(), ValueError(
+            'deterministic needs the NCHW layout and sampling_ratio > 0')
+        self.deterministic = deterministic
+
+    def _get_chw(self, shape):
+        if self.layout == 'NHWC':
+            return shape[3], shape[1], shape[2]
+        return shape[1], shape[2], shape[3]
+
+    def _get_const_params(self):
+        # the kernels are specialized by the pooled size and the sampling ratio
+        # of the layer
+        K = mobula.func.constexpr
+        PH, PW = self.pooled_size
+        return K(PH), K(PW), K(self.sampling_ratio)
+
+    def _use_table(self):
+        # the sampling table has a fixed size for a fixed sampling ratio
+        return self.layout == 'NCHW' and self.sampling_ratio > 0
+
+    def _build_table(self, data, rois):
+        # the geometry of the ROIs is computed once for all channels, and the
+        # table is kept for backward
+        PH, PW = self.pooled_size
+        C, H, W = self._get_chw(data.shape)
+        self.table = self.F.empty(
+            (rois.shape[0], (PH + PW) * self.sampling_ratio, 4))
+        table_size = np.prod(self.table.size()) if callable(
+            self.table.size) else self.table.size
+        mobula.func.roi_align_table(table_size // 4, rois, self.spatial_scale,
+                                    H, W, PH, PW, self.sampling_ratio, self.table)
+
+    def _forward(self, data, rois, out):
+        out_size = np.prod(out.size()) if callable(out.size) else out.size
+        C, H, W = self._get_chw(data.shape)
+        PH, PW = self.pooled_size
+        if self._use_table():
+            self._build_table(data, rois)
+            cPH, cPW, cS = self._get_const_params()
+            mobula.func.roi_align_forward_table(
+                out_size, data, C, H, W, cPH, cPW, cS, rois, self.table, out)
+            return
+        # the kernels of NHWC take the constants as the plain values
+        cPH, cPW, cS = self._get_const_params()
+        forward = mobula.func.roi_align_forward_nhwc if self.layout == 'NHWC' \
+            else mobula.func.roi_align_forward
+        forward(out_size, data, self.spatial_scale, C, H, W,
+                cPH, cPW, cS, rois, out)
 
     def forward(self, data, rois):
+        # the table of the last forward is of the last ROIs, so the backward
+        # rebuilds it unless this forward builds it
+        self.table = None
         if self.req[0] == req.null:
             return
 
-        out = self.y
-        out_size = np.prod(out.size()) if callable(out.size) else out.size
-
         if self.req[0] == req.add:
-            out_temp = self.F.empty_like(out)
-            mobula.func.roi_align_forward(out_size, data, self.spatial_scale, data.shape[1], data.shape[
-                                          2], data.shape[3], self.pooled_size[0], self.pooled_size[1], self.sampling_ratio, rois, out_temp)
+            out_temp = self.F.empty_like(self.y)
+            self._forward(data, rois, out_temp)
             self.y[:] += out_temp
         else:
-            mobula.func.roi_align_forward(out_size, data, self.spatial_scale, data.shape[1], data.shape[
-                                          2], data.shape[3], self.pooled_size[0], self.pooled_size[1], self.sampling_ratio, rois, self.y)
+            self._forward(data, rois, self.y)
 
     def backward(self, dy):
         if self.req[0] == req.null:
@@ -35,8 +88,25 @@ class ROIAlign:
         data, rois = self.X
 
         dy_size = np.prod(dy.size()) if callable(dy.size) else dy.size
-        mobula.func.roi_align_backward(dy_size, dy, self.spatial_scale, data.shape[1], data.shape[2], data.shape[
-                                       3], self.pooled_size[0], self.pooled_size[1], self.sampling_ratio, self.dX[0], rois)
+        data_size = np.prod(data.size()) if callable(data.size) else data.size
+        C, H, W = self._get_chw(data.shape)
+        PH, PW = self.pooled_size
+        if self._use_table():
+            if getattr(self, 'table', None) is None:
+                self._build_table(data, rois)
+            if self.deterministic:
+                mobula.func.roi_align_backward_gather(
+                    data_size, dy, rois.shape[0], C, H, W, PH, PW, self.sampling_ratio, self.dX[0], rois, self.table)
+            else:
+                cPH, cPW, cS = self._get_const_params()
+                mobula.func.roi_align_backward_table(
+                    dy_size, dy, C, H, W, cPH, cPW, cS, self.dX[0], rois, self.table)
+        else:
+            cPH, cPW, cS = self._get_const_params()
+            backward = mobula.func.roi_align_backward_nhwc if self.layout == 'NHWC' \
+                else mobula.func.roi_align_backward
+            backward(dy_size, dy, self.spatial_scale, C, H, W,
+                     cPH, cPW, cS, self.dX[0], rois)
 
         if self.req[1] not in [req.null, req.add]:
             self.dX[1][:] = 0
@@ -46,6 +116,105 @@ class ROIAlign:
         assert len(dshape) == 4
         assert len(rshape) == 2
         assert rshape[1] == 5
-        oshape = [rshape[0], dshape[1],
-                  self.pooled_size[0], self.pooled_size[1]]
+        if self.layout == 'NHWC':
+            oshape = [rshape[0], self.pooled_size[0],
+                      self.pooled_size[1], dshape[3]]
+        else:
+            oshape = [rshape[0], dshape[1],
+                      self.pooled_size[0], self.pooled_size[1]]
         return [dshape, rshape], [oshape]
+
+
+# the number of the levels which the kernels of MultiLevelROIAlign accept
+MAX_NUM_LEVELS = 5
+
+
+@mobula.op.register
+class MultiLevelROIAlign:
+    """ROIAlign over the feature maps of a pyramid in one launch.
+
+    Each ROI is assigned to a level by the rule of FPN,
+    floor(canonical_level + log2(sqrt(area) / canonical_scale)), which is
+    clipped to the levels. The i-th feature map has the spatial scale
+    `spatial_scales[i]`, which halves from level to level, e.g.
+    [1 / 4., 1 / 8., 1 / 16., 1 / 32.] for P2 ~ P5.
+    The output is (num_rois, C, pooled_height, pooled_width) in the order of
+    the ROIs.
+    """
+
+    def __init__(self, pooled_size, spatial_scales, sampling_ratio,
+                 canonical_scale=224, canonical_level=4):
+        assert 1 <= len(spatial_scales) <= MAX_NUM_LEVELS, ValueError(
+            'The number of levels should be in [1, {}]'.format(MAX_NUM_LEVELS))
+        self.pooled_size = pooled_size
+        self.spatial_scales = list(spatial_scales)
+        self.sampling_ratio = sampling_ratio
+        self.canonical_scale = canonical_scale
+        self.canonical_level = canonical_level
+        # the level of the first feature map, e.g. 2 for the scale 1 / 4
+        self.min_level = int(round(-np.log2(spatial_scales[0])))
+
+    def list_arguments(self):
+        return ['rois'] + ['data%d' % i for i in range(len(self.spatial_scales))]
+
+    def _get_level_args(self, datas):
+        # the unused levels are empty
+        args = []
+        for i in range(MAX_NUM_LEVELS):
+            if i < len(datas):
+                args.extend([datas[i], self.spatial_scales[i],
+                             datas[i].shape[2], datas[i].shape[3]])
+            else:
+                args.extend([datas[0], 0, 0, 0])
+        return args
+
+    def _forward(self, rois, datas, out):
+        out_size = np.prod(out.size()) if callable(out.size) else out.size
+        PH, PW = self.pooled_size
+        mobula.func.roi_align_multilevel_forward(
+            out_size, rois, len(datas), self.min_level, self.canonical_scale,
+            self.canonical_level, datas[0].shape[1], PH, PW,
+            self.sampling_ratio, out, *self._get_level_args(datas))
+
+    def forward(self, rois, data0, data1=None, data2=None, data3=None, data4=None):
+        if self.req[0] == req.null:
+            return
+        datas = self.X[1:]
+        if self.req[0] == req.add:
+            out_temp = self.F.empty_like(self.y)
+            self._forward(rois, datas, out_temp)
+            self.y[:] += out_temp
+        else:
+            self._forward(rois, datas, self.y)
+
+    def backward(self, dy):
+        rois = self.X[0]
+        datas = self.X[1:]
+        for i in range(len(datas)):
+            if self.req[i + 1] not in [req.null, req.add]:
+                self.dX[i + 1][:] = 0
+        # the gradients of the levels with req.null are computed in a
+        # temporary array
+        diffs = [self.dX[i + 1] if self.req[i + 1] != req.null
+                 else self.F.zeros_like(datas[i]) for i in range(len(datas))]
+        dy_size = np.prod(dy.size()) if callable(dy.size) else dy.size
+        PH, PW = self.pooled_size
+        mobula.func.roi_align_multilevel_backward(
+            dy_size, dy, rois, len(datas), self.min_level, self.canonical_scale,
+            self.canonical_level, datas[0].shape[1], PH, PW,
+            self.sampling_ratio, *self._get_level_args(diffs))
+        if self.req[0] not in [req.null, req.add]:
+            self.dX[0][:] = 0
+
+    def infer_shape(self, in_shape):
+        rshape = in_shape[0]
+        dshapes = in_shape[1:]
+        assert len(rshape) == 2
+        assert rshape[1] == 5
+        assert len(dshapes) == len(self.spatial_scales)
+        for dshape in dshapes:
+            assert len(dshape) == 4
+            assert dshape[:2] == dshapes[0][:2]
+        oshape = [rshape[0], dshapes[0][1],
+                  self.pooled_size[0], self.pooled_size[1]]
+        return in_shape, [oshape]
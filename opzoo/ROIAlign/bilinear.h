@@ -7,9 +7,11 @@
 
 namespace mobula {
 
-template <typename T>
-MOBULA_DEVICE T bilinear_interpolate(const T* bottom_data, const int height,
-                                     const int width, T y, T x,
+// the coordinates and the result are of type A, e.g. float for float16 data.
+// `bottom_data` is a pointer or an accessor of the plane, e.g. ViewPlane.
+template <typename D, typename A>
+MOBULA_DEVICE A bilinear_interpolate(const D& bottom_data, const int height,
+                                     const int width, A y, A x,
                                      const int /*index for debug only*/) {
   // deal with cases that inverse elements are out of feature map boundary
   if (y < -1.0 || y > height || x < -1.0 || x > width) {
@@ -31,29 +33,29 @@ MOBULA_DEVICE T bilinear_interpolate(const T* bottom_data, const int height,
 
   if (y_low >= height - 1) {
     y_high = y_low = height - 1;
-    y = static_cast<T>(y_low);
+    y = static_cast<A>(y_low);
   } else {
     y_high = y_low + 1;
   }
 
   if (x_low >= width - 1) {
     x_high = x_low = width - 1;
-    x = static_cast<T>(x_low);
+    x = static_cast<A>(x_low);
   } else {
     x_high = x_low + 1;
   }
 
-  T ly = y - y_low;
-  T lx = x - x_low;
-  T hy = 1. - ly, hx = 1. - lx;
+  A ly = y - y_low;
+  A lx = x - x_low;
+  A hy = 1. - ly, hx = 1. - lx;
   // do bilinear interpolation
-  T v1 = bottom_data[y_low * width + x_low];
-  T v2 = bottom_data[y_low * width + x_high];
-  T v3 = bottom_data[y_high * width + x_low];
-  T v4 = bottom_data[y_high * width + x_high];
-  T w1 = hy * hx, w2 = hy * lx, w3 = ly * hx, w4 = ly * lx;
+  A v1 = bottom_data[y_low * width + x_low];
+  A v2 = bottom_data[y_low * width + x_high];
+  A v3 = bottom_data[y_high * width + x_low];
+  A v4 = bottom_data[y_high * width + x_high];
+  A w1 = hy * hx, w2 = hy * lx, w3 = ly * hx, w4 = ly * lx;
 
-  T val = (w1 * v1 + w2 * v2 + w3 * v3 + w4 * v4);
+  A val = (w1 * v1 + w2 * v2 + w3 * v3 + w4 * v4);
 
   return val;
 }
@@ -111,6 +113,53 @@ MOBULA_DEVICE void bilinear_interpolate_gradient(
   return;
 }
 
+// the bilinear weights along an axis of `size` pixels, which are separable:
+// the weight of the pixel (y, x) is the product of the weights of y and x.
+// Return false if `v` is out of the feature map.
+template <typename A>
+MOBULA_DEVICE bool bilinear_axis(const int size, A v, int& low, int& high,
+                                 A& w_low, A& w_high) {
+  if (v < -1.0 || v > size) return false;
+  if (v <= 0) v = 0;
+  low = static_cast<int>(v);
+  if (low >= size - 1) {
+    high = low = size - 1;
+    v = static_cast<A>(low);
+  } else {
+    high = low + 1;
+  }
+  w_high = v - low;
+  w_low = 1. - w_high;
+  return true;
+}
+
+// the 4 neighbouring pixels of a sample point in the channels-last data,
+// whose offsets are of their first channels
+template <typename A>
+struct BilinearSample {
+  int offsets[4];
+  A weights[4];
+};
+
+// the sample point (y, x) of the data (height, width, channels), whose weights
+// are shared by the channels. Return false if it is out of the feature map.
+template <typename A>
+MOBULA_DEVICE bool bilinear_sample_nhwc(const int height, const int width,
+                                        const int channels, const A y,
+                                        const A x, BilinearSample<A>& sample) {
+  int x_low, x_high, y_low, y_high;
+  bilinear_interpolate_gradient(height, width, y, x, sample.weights[0],
+                                sample.weights[1], sample.weights[2],
+                                sample.weights[3], x_low, x_high, y_low,
+                                y_high, 0);
+  if (y_low < 0) return false;
+  sample.offsets[0] = (y_low * width + x_low) * channels;
+  sample.offsets[1] = (y_low * width + x_high) * channels;
+  sample.offsets[2] = (y_high * width + x_low) * channels;
+  sample.offsets[3] = (y_high * width + x_high) * channels;
+  return true;
+}
+
 }  // namespace mobula
 
 #endif  // _MOBULA_BILINEAR_
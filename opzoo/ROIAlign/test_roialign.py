@@ -240,7 +240,7 @@ def test_roi_align_nd():
     mx.nd.waitall()
 
 
-def test_roi_align_value():
+def check_roi_align_value(sampling_ratio):
     dtype = np.float32
 
     dlen = 224
@@ -250,7 +250,6 @@ def test_roi_align_value():
     pooled_size = (3, 4)
 
     spatial_scale = H * 1.0 / dlen
-    sampling_ratio = 0
     data = mx.nd.array(
         np.arange(N * C * W * H).reshape((N, C, H, W)), dtype=dtype)
     # data = mx.nd.random.uniform(0, 1, (N, C, H, W), dtype = dtype)
@@ -282,7 +281,113 @@ def test_roi_align_value():
     assert_almost_equal(rois.grad.asnumpy(), drois, atol=atol, rtol=rtol)
 
 
+def test_roi_align_value():
+    # the adaptive sampling, and the sampling table of a fixed ratio
+    for sampling_ratio in [0, 2]:
+        check_roi_align_value(sampling_ratio)
+
+
+def test_roi_align_nhwc():
+    dtype = np.float32
+    N, C, H, W = 2, 13, 16, 16
+    R = 5
+    pooled_size = (3, 4)
+    # 25 sample points per bin are visited in two batches
+    for sampling_ratio in [0, 5]:
+        data = mx.nd.random.uniform(-1, 1, (N, C, H, W), dtype=dtype)
+        xy = mx.nd.random.uniform(0, 8, (R, 2), dtype=dtype)
+        wh = mx.nd.random.uniform(0, 8, (R, 2), dtype=dtype)
+        batch_ind = mx.nd.array(np.random.randint(0, N, size=(R, 1)))
+        rois = mx.nd.concat(batch_ind, xy, xy + wh, dim=1)
+        data_nhwc = data.transpose((0, 2, 3, 1))
+        data.attach_grad()
+        data_nhwc.attach_grad()
+        dy = mx.nd.random.uniform(-1, 1, (R, C) + pooled_size, dtype=dtype)
+        with mx.autograd.record():
+            output = mobula.op.ROIAlign(data=data, rois=rois, pooled_size=pooled_size,
+                                        spatial_scale=1.0, sampling_ratio=sampling_ratio)
+            output_nhwc = mobula.op.ROIAlign(data=data_nhwc, rois=rois, pooled_size=pooled_size,
+                                             spatial_scale=1.0, sampling_ratio=sampling_ratio,
+                                             layout='NHWC')
+        output.backward(dy)
+        output_nhwc.backward(dy.transpose((0, 2, 3, 1)))
+        assert_almost_equal(output_nhwc.transpose(
+            (0, 3, 1, 2)), output, atol=1e-5)
+        assert_almost_equal(data_nhwc.grad.transpose(
+            (0, 3, 1, 2)), data.grad, atol=1e-5)
+
+
+def test_roi_align_deterministic():
+    dtype = np.float32
+    N, C, H, W = 2, 3, 16, 16
+    R = 9
+    pooled_size = (3, 4)
+    data = mx.nd.random.uniform(-1, 1, (N, C, H, W), dtype=dtype)
+    xy = mx.nd.random.uniform(0, 8, (R, 2), dtype=dtype)
+    wh = mx.nd.random.uniform(0, 8, (R, 2), dtype=dtype)
+    batch_ind = mx.nd.array(np.random.randint(0, N, size=(R, 1)))
+    rois = mx.nd.concat(batch_ind, xy, xy + wh, dim=1)
+    dy = mx.nd.random.uniform(-1, 1, (R, C) + pooled_size, dtype=dtype)
+    grads = []
+    for deterministic in [False, True, True]:
+        data.attach_grad()
+        with mx.autograd.record():
+            output = mobula.op.ROIAlign(data=data, rois=rois, pooled_size=pooled_size,
+                                        spatial_scale=1.0, sampling_ratio=2,
+                                        deterministic=deterministic)
+        output.backward(dy)
+        grads.append(data.grad.asnumpy())
+    assert_almost_equal(grads[1], grads[0], atol=1e-5)
+    # the gathered gradients are the same bits
+    assert (grads[1] == grads[2]).all()
+
+
+def test_multi_level_roi_align():
+    dtype = np.float32
+    N, C = 2, 3
+    R = 30
+    pooled_size = (3, 2)
+    spatial_scales = [1 / 4., 1 / 8., 1 / 16., 1 / 32.]
+    datas = [mx.nd.random.uniform(-1, 1, (N, C, 256 // s, 320 // s), dtype=dtype)
+             for s in [4, 8, 16, 32]]
+    xy = mx.nd.random.uniform(0, 240, (R, 2), dtype=dtype)
+    wh = mx.nd.array(np.exp(np.random.uniform(0, 6, (R, 2))), dtype=dtype)
+    batch_ind = mx.nd.array(np.random.randint(0, N, size=(R, 1)))
+    rois = mx.nd.concat(batch_ind, xy, xy + wh, dim=1)
+    dy = mx.nd.random.uniform(-1, 1, (R, C) + pooled_size, dtype=dtype)
+    for data in datas:
+        data.attach_grad()
+    with mx.autograd.record():
+        output = mobula.op.MultiLevelROIAlign(rois, *datas, pooled_size=pooled_size,
+                                              spatial_scales=spatial_scales, sampling_ratio=2)
+    output.backward(dy)
+    grads = [data.grad.asnumpy() for data in datas]
+
+    # split the ROIs into the levels
+    rois_np = rois.asnumpy()
+    areas = (rois_np[:, 3] - rois_np[:, 1]) * (rois_np[:, 4] - rois_np[:, 2])
+    levels = np.floor(4 + np.log2(np.sqrt(areas) / 224 + 1e-6)).astype(np.int32)
+    levels = np.clip(levels - 2, 0, len(datas) - 1)
+    real_output = np.zeros(output.shape, dtype=dtype)
+    for i, data in enumerate(datas):
+        inds = np.where(levels == i)[0]
+        data.attach_grad()
+        if len(inds) == 0:
+            assert (grads[i] == 0).all()
+            continue
+        with mx.autograd.record():
+            out = mobula.op.ROIAlign(data=data, rois=mx.nd.array(rois_np[inds]), pooled_size=pooled_size,
+                                     spatial_scale=spatial_scales[i], sampling_ratio=2)
+        out.backward(mx.nd.array(dy.asnumpy()[inds]))
+        real_output[inds] = out.asnumpy()
+        assert_almost_equal(grads[i], data.grad, atol=1e-5)
+    assert_almost_equal(output, real_output, atol=1e-5)
+
+
 if __name__ == '__main__':
     test_roi_align_value()
     test_roi_align_sym()
     test_roi_align_nd()
+    test_roi_align_nhwc()
+    test_roi_align_deterministic()
+    test_multi_level_roi_align()
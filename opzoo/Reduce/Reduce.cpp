@@ -0,0 +1,319 @@
+#include "mobula_op.h"
+
+namespace mobula {
+
+/*!
+ * \brief The reducers of the axis and segment reductions.
+ *  reduce(dst, src, residual) accumulates a scalar or a Vec, which starts from
+ *  init(first), where `first` is an element of the reduced data. The value of
+ *  an accumulator is result(dst, residual), and merge(dst, src) merges the
+ *  values of the threads. T is the type of the accumulators, which is
+ *  AccType of the type of the data.
+ */
+template <typename T>
+struct SumReducer {
+  // whether the accumulation is compensated, see add_residual_reduce_func
+  bool compensated;
+
+  template <typename V>
+  MOBULA_DEVICE V init(const V &) const {
+    return V(T(0));
+  }
+  template <typename V>
+  MOBULA_DEVICE void reduce(V &dst, const V &src, V &residual) const {
+    if (compensated) {
+      add_residual_reduce_func(dst, src, residual);
+    } else {
+      dst += src;
+    }
+  }
+  template <typename V>
+  MOBULA_DEVICE V result(const V &dst, const V &residual) const {
+    return dst - residual;
+  }
+  static MOBULA_DEVICE void merge(T &dst, const T &src) { dst += src; }
+};
+
+template <typename T>
+struct MaxReducer {
+  template <typename V>
+  MOBULA_DEVICE V init(const V &first) const {
+    return first;
+  }
+  template <typename V>
+  MOBULA_DEVICE void reduce(V &dst, const V &src, V &) const {
+    dst = select(src > dst, src, dst);
+  }
+  template <typename V>
+  MOBULA_DEVICE V result(const V &dst, const V &) const {
+    return dst;
+  }
+  static MOBULA_DEVICE void merge(T &dst, const T &src) { max_func(dst, src); }
+};
+
+// the value of x[begin * stride], x[(begin + step) * stride], ... in
+// [0, end * stride), or init(first) if there is no element
+template <typename T, typename Reducer, typename A = typename AccType<T>::type>
+MOBULA_DEVICE A reduce_strided(const T *x, const int begin, const int end,
+                               const int step, const int stride, const A first,
+                               const Reducer &reducer) {
+  A value = reducer.init(first);
+  A residual = 0;
+  for (int i = begin; i < end; i += step) {
+    reducer.reduce(value, A(x[i * stride]), residual);
+  }
+  return reducer.result(value, residual);
+}
+
+// the value of x[begin:end] accumulated by the vectors of a thread
+template <typename T, typename Reducer, typename A = typename AccType<T>::type>
+MOBULA_DEVICE A reduce_range(const T *x, const int begin, const int end,
+                             const A first, const Reducer &reducer) {
+  typedef Vec<A> V;
+  constexpr int W = VecSize<A>::value;
+  V acc = reducer.init(V(first));
+  V residual(A(0));
+  int i = begin;
+  for (; i + W <= end; i += W) reducer.reduce(acc, V::load(x + i), residual);
+  acc = reducer.result(acc, residual);
+  A value = acc[0];
+  for (int k = 1; k < W; ++k) Reducer::merge(value, acc[k]);
+  Reducer::merge(value, reduce_strided(x, i, end, 1, 1, first, reducer));
+  return value;
+}
+
+/*!
+ * \brief Reduce the (outer, middle, inner) tensor X on the middle axis into
+ *  the (outer, inner) tensor Y, which is multiplied by `scale`.
+ *  When inner == 1, the rows are contiguous. Each of them is reduced by a
+ *  thread with vectors on CPU, or by the threads together when the rows are
+ *  fewer than the threads. On GPU, the lanes of a warp reduce a row.
+ *  Otherwise, the adjacent threads reduce the adjacent columns. The vectors of
+ *  a thread reduce the adjacent columns on CPU, and the lanes of a warp
+ *  reduce a column together on GPU when the columns are fewer than the warps.
+ *  All threads of the kernel should call it together.
+ */
+template <typename T, typename Reducer, typename A = typename AccType<T>::type>
+MOBULA_DEVICE void reduce_axis(const int outer, const int middle,
+                               const int inner, const T *X,
+                               const Reducer &reducer, const A scale, T *Y) {
+  if (inner == 1) {
+#if !(USING_CUDA || USING_HIP)
+    const int num_threads = get_num_threads();
+    if (outer < num_threads) {
+      int start, end;
+      get_parfor_range(middle, num_threads, get_thread_num(), &start, &end);
+      for (int row = 0; row < outer; ++row) {
+        const T *x = X + row * middle;
+        const A init = reducer.init(A(x[0]));
+        A value = start < end ? reduce_range(x, start, end, init, reducer)
+                              : init;
+        value = block_reduce(value, Reducer::merge, init);
+        if (get_thread_num() == 0) Y[row] = value * scale;
+      }
+      return;
+    }
+#endif  // !(USING_CUDA || USING_HIP)
+    parfor_rows(outer, middle, [&](int row, int cols, int lane, int lanes) {
+      const T *x = X + row * middle;
+#if USING_CUDA || USING_HIP
+      A value = reduce_strided(x, lane, cols, lanes, 1, A(x[0]), reducer);
+      value = warp_reduce(value, Reducer::merge, lanes);
+#else
+      static_cast<void>(lanes);
+      const A value = reduce_range(x, 0, cols, A(x[0]), reducer);
+#endif  // USING_CUDA || USING_HIP
+      if (lane == 0 && cols > 0) Y[row] = value * scale;
+    });
+    return;
+  }
+#if USING_CUDA || USING_HIP
+  const int N = outer * inner;
+  const int max_lanes = N * kWarpSize <= get_num_threads() ? kWarpSize : 1;
+  parfor_rows(N, middle,
+              [&](int i, int cols, int lane, int lanes) {
+                const int o = i / inner;
+                const T *x = X + o * middle * inner + i % inner;
+                A value = reduce_strided(x, lane, cols, lanes, inner,
+                                         A(x[0]), reducer);
+                value = warp_reduce(value, Reducer::merge, lanes);
+                if (lane == 0 && cols > 0) Y[i] = value * scale;
+              },
+              max_lanes);
+#else
+  typedef Vec<A> V;
+  constexpr int W = VecSize<A>::value;
+  const int num_chunks = (inner + W - 1) / W;
+  parfor(outer * num_chunks, [&](int i) {
+    const int o = i / num_chunks;
+    const int k = i % num_chunks * W;
+    const int num = std::min(W, inner - k);
+    const T *x = X + o * middle * inner + k;
+    V value = reducer.init(V::load(x, num));
+    V residual(A(0));
+    for (int m = 0; m < middle; ++m) {
+      reducer.reduce(value, V::load(x + m * inner, num), residual);
+    }
+    value = reducer.result(value, residual) * V(scale);
+    value.store(Y + o * inner + k, num);
+  });
+#endif  // USING_CUDA || USING_HIP
+}
+
+/*!
+ * \brief Reduce the segments X[offsets[i]:offsets[i + 1]] into Y[i], which is
+ *  divided by the length of the segment if `mean` is true.
+ *  The empty segments are 0.
+ */
+template <typename T, typename I, typename Reducer,
+          typename A = typename AccType<T>::type>
+MOBULA_DEVICE void reduce_segments(const int num_segments, const T *X,
+                                   const I *offsets, const Reducer &reducer,
+                                   const bool mean, T *Y) {
+  if (num_segments <= 0) return;
+  // the lanes are chosen by the mean length of the segments
+  const int mean_length =
+      (static_cast<int>(offsets[num_segments]) - static_cast<int>(offsets[0])) /
+      num_segments;
+  parfor_rows(num_segments, std::max(mean_length, 1), [&](int i, int cols,
+                                                          int lane, int lanes) {
+    const int begin = static_cast<int>(offsets[i]);
+    const int length = cols > 0 ? static_cast<int>(offsets[i + 1]) - begin : 0;
+    const T *x = X + begin;
+    A value = 0;
+    if (length > 0) {
+#if USING_CUDA || USING_HIP
+      value = reduce_strided(x, lane, length, lanes, 1, A(x[0]), reducer);
+#else
+      value = reduce_range(x, 0, length, A(x[0]), reducer);
+#endif  // USING_CUDA || USING_HIP
+    }
+    value = warp_reduce(value, Reducer::merge, lanes);
+    if (lane == 0 && cols > 0) {
+      Y[i] = (mean && length > 0) ? value / A(length) : value;
+    }
+  });
+}
+
+// the backward of reduce_axis, dX = scale * dY or for the maximums
+// dX = dY when X == Y, otherwise 0
+template <typename T, typename A = typename AccType<T>::type>
+MOBULA_DEVICE void reduce_axis_backward(const int size, const int middle,
+                                        const int inner, const T *X,
+                                        const T *Y, const T *dY, const A scale,
+                                        const bool accumulate, T *dX) {
+  parfor(size, [&](int i) {
+    const int j = i / (middle * inner) * inner + i % inner;
+    const A grad = (X == nullptr || X[i] == Y[j]) ? A(dY[j]) * scale : A(0);
+    dX[i] = accumulate ? A(dX[i]) + grad : grad;
+  });
+}
+
+// the backward of reduce_segments, see reduce_axis_backward
+template <typename T, typename I, typename A = typename AccType<T>::type>
+MOBULA_DEVICE void reduce_segments_backward(const int num_segments, const T *X,
+                                            const I *offsets, const T *Y,
+                                            const T *dY, const bool mean,
+                                            const bool accumulate, T *dX) {
+  if (num_segments <= 0) return;
+  const int mean_length =
+      (static_cast<int>(offsets[num_segments]) - static_cast<int>(offsets[0])) /
+      num_segments;
+  parfor_rows(num_segments, std::max(mean_length, 1), [&](int i, int cols,
+                                                          int lane, int lanes) {
+    if (cols == 0) return;
+    const int begin = static_cast<int>(offsets[i]);
+    const int length = static_cast<int>(offsets[i + 1]) - begin;
+    const A dy = mean ? A(dY[i]) / A(length) : A(dY[i]);
+    for (int k = begin + lane; k < begin + length; k += lanes) {
+      const A grad = (X == nullptr || X[k] == Y[i]) ? dy : A(0);
+      dX[k] = accumulate ? A(dX[k]) + grad : grad;
+    }
+  });
+}
+
+/*!
+ * \brief Y = scale * sum(X) on the middle axis of the (size / middle / inner,
+ *  middle, inner) tensor X.
+ *  The accumulation is compensated when `compensated` is true.
+ */
+template <typename T>
+MOBULA_KERNEL reduce_sum_kernel(const int size, const T *X, const int middle,
+                                const int inner, const bool compensated,
+                                const T scale, T *Y) {
+  typedef typename AccType<T>::type A;
+  SumReducer<A> reducer{compensated};
+  reduce_axis(size / (middle * inner), middle, inner, X, reducer, A(scale), Y);
+}
+
+// Y = max(X) on the middle axis, see reduce_sum_kernel
+template <typename T>
+MOBULA_KERNEL reduce_max_kernel(const int size, const T *X, const int middle,
+                                const int inner, T *Y) {
+  typedef typename AccType<T>::type A;
+  reduce_axis(size / (middle * inner), middle, inner, X, MaxReducer<A>(), A(1),
+              Y);
+}
+
+// dX = scale * dY, where dY is broadcast on the middle axis
+// dX is added to when `accumulate` is true
+template <typename T>
+MOBULA_KERNEL reduce_sum_backward_kernel(const int size, const T *dY,
+                                         const int middle, const int inner,
+                                         const T scale, const bool accumulate,
+                                         T *dX) {
+  reduce_axis_backward(size, middle, inner, static_cast<const T *>(nullptr),
+                       static_cast<const T *>(nullptr), dY,
+                       typename AccType<T>::type(scale), accumulate, dX);
+}
+
+// dX = dY for the maximums Y of X, otherwise 0
+template <typename T>
+MOBULA_KERNEL reduce_max_backward_kernel(const int size, const T *X,
+                                         const T *Y, const T *dY,
+                                         const int middle, const int inner,
+                                         const bool accumulate, T *dX) {
+  reduce_axis_backward(size, middle, inner, X, Y, dY,
+                       typename AccType<T>::type(1), accumulate, dX);
+}
+
+/*!
+ * \brief Y[i] = sum(X[offsets[i]:offsets[i + 1]]), which is divided by the
+ *  length of the segment if `mean` is true.
+ */
+template <typename T, typename I>
+MOBULA_KERNEL segment_sum_kernel(const int num_segments, const T *X,
+                                 const I *offsets, const bool compensated,
+                                 const bool mean, T *Y) {
+  SumReducer<typename AccType<T>::type> reducer{compensated};
+  reduce_segments(num_segments, X, offsets, reducer, mean, Y);
+}
+
+template <typename T, typename I>
+MOBULA_KERNEL segment_max_kernel(const int num_segments, const T *X,
+                                 const I *offsets, T *Y) {
+  reduce_segments(num_segments, X, offsets,
+                  MaxReducer<typename AccType<T>::type>(), false, Y);
+}
+
+// the segments cover X, and dX is added to when `accumulate` is true
+template <typename T, typename I>
+MOBULA_KERNEL segment_sum_backward_kernel(const int num_segments,
+                                          const I *offsets, const T *dY,
+                                          const bool mean,
+                                          const bool accumulate, T *dX) {
+  reduce_segments_backward(num_segments, static_cast<const T *>(nullptr),
+                           offsets, static_cast<const T *>(nullptr), dY, mean,
+                           accumulate, dX);
+}
+
+template <typename T, typename I>
+MOBULA_KERNEL segment_max_backward_kernel(const int num_segments, const T *X,
+                                          const I *offsets, const T *Y,
+                                          const T *dY, const bool accumulate,
+                                          T *dX) {
+  reduce_segments_backward(num_segments, X, offsets, Y, dY, false, accumulate,
+                           dX);
+}
+
+}  // namespace mobula
@@ -0,0 +1,179 @@
+import mobula
+from mobula.const import req
+import numpy as np
+
+
+def _prod(shape):
+    return int(np.prod(shape)) if len(shape) > 0 else 1
+
+
+def get_reduce_shape(shape, axis=None):
+    """Get the (outer, middle, inner) decomposition of reducing `shape` on
+    `axis`, which is None for all axes, an axis or the adjacent axes.
+
+    Returns
+    -------
+    ((outer, middle, inner), the reduced axes)
+    """
+    ndim = len(shape)
+    if axis is None:
+        axes = list(range(ndim))
+    elif isinstance(axis, int):
+        axes = [axis]
+    else:
+        axes = list(axis)
+    axes = sorted(set(a + ndim if a < 0 else a for a in axes))
+    assert axes and 0 <= axes[0] and axes[-1] < ndim, ValueError(
+        'Invalid axis {} for the shape {}'.format(axis, shape))
+    assert axes[-1] - axes[0] + 1 == len(axes), ValueError(
+        'The reduced axes {} should be adjacent'.format(axis))
+    begin, end = axes[0], axes[-1] + 1
+    shape_3d = (_prod(shape[:begin]), _prod(shape[begin:end]),
+                _prod(shape[end:]))
+    return shape_3d, axes
+
+
+class _AxisReduce:
+    def __init__(self, axis=None, keepdims=False):
+        self.axis = axis
+        self.keepdims = keepdims
+
+    def _get_shape(self, x):
+        return get_reduce_shape(x.shape, self.axis)[0]
+
+    def infer_shape(self, in_shape):
+        shape = in_shape[0]
+        axes = get_reduce_shape(shape, self.axis)[1]
+        if self.keepdims:
+            out_shape = [1 if i in axes else s for i, s in enumerate(shape)]
+        else:
+            out_shape = [s for i, s in enumerate(shape) if i not in axes]
+        return in_shape, [out_shape or [1]]
+
+
+class _SumReduce(_AxisReduce):
+    def __init__(self, axis=None, keepdims=False, compensated=False):
+        _AxisReduce.__init__(self, axis, keepdims)
+        self.compensated = compensated
+
+    def _get_scale(self, middle):
+        return 1.0
+
+    def forward(self, x):
+        if self.req[0] == req.null:
+            return
+        outer, middle, inner = self._get_shape(x)
+        y = self.F.empty_like(self.y) if self.req[0] == req.add else self.y
+        mobula.func.reduce_sum(outer * middle * inner, x, middle, inner,
+                               self.compensated, self._get_scale(middle), y)
+        if self.req[0] == req.add:
+            self.y[:] += y
+
+    def backward(self, dy):
+        if self.req[0] == req.null:
+            return
+        outer, middle, inner = self._get_shape(self.x)
+        mobula.func.reduce_sum_backward(
+            outer * middle * inner, dy, middle, inner,
+            self._get_scale(middle), self.req[0] == req.add, self.dx)
+
+
+# the sum on an axis or the adjacent axes, which are all axes if axis is None
+# the accumulation is compensated if `compensated` is True
+@mobula.op.register
+class ReduceSum(_SumReduce):
+    pass
+
+
+@mobula.op.register
+class ReduceMean(_SumReduce):
+    def _get_scale(self, middle):
+        return 1.0 / middle
+
+
+@mobula.op.register
+class ReduceMax(_AxisReduce):
+    def forward(self, x):
+        if self.req[0] == req.null:
+            return
+        outer, middle, inner = self._get_shape(x)
+        y = self.F.empty_like(self.y) if self.req[0] == req.add else self.y
+        mobula.func.reduce_max(outer * middle * inner, x, middle, inner, y)
+        if self.req[0] == req.add:
+            self.y[:] += y
+
+    def backward(self, dy):
+        if self.req[0] == req.null:
+            return
+        outer, middle, inner = self._get_shape(self.x)
+        mobula.func.reduce_max_backward(
+            outer * middle * inner, self.x, self.y, dy, middle, inner,
+            self.req[0] == req.add, self.dx)
+
+
+# the reduction of the segments data[offsets[i]:offsets[i + 1]], where data is
+# (N, ) and offsets is (S + 1, ) with offsets[0] = 0 and offsets[S] = N.
+# The output is (S, ), and the empty segments are 0.
+class _SegmentReduce:
+    def infer_shape(self, in_shape):
+        dshape, oshape = in_shape
+        assert len(dshape) == 1
+        assert len(oshape) == 1
+        return in_shape, [[oshape[0] - 1]]
+
+    def _backward_offsets(self):
+        if self.req[1] not in [req.null, req.add]:
+            self.dX[1][:] = 0
+
+
+class _SegmentSumReduce(_SegmentReduce):
+    mean = False
+
+    def __init__(self, compensated=False):
+        self.compensated = compensated
+
+    def forward(self, data, offsets):
+        if self.req[0] == req.null:
+            return
+        y = self.F.empty_like(self.y) if self.req[0] == req.add else self.y
+        mobula.func.segment_sum(offsets.shape[0] - 1, data, offsets,
+                                self.compensated, self.mean, y)
+        if self.req[0] == req.add:
+            self.y[:] += y
+
+    def backward(self, dy):
+        if self.req[0] != req.null:
+            offsets = self.X[1]
+            mobula.func.segment_sum_backward(
+                offsets.shape[0] - 1, offsets, dy, self.mean,
+                self.req[0] == req.add, self.dX[0])
+        self._backward_offsets()
+
+
+@mobula.op.register
+class SegmentSum(_SegmentSumReduce):
+    pass
+
+
+@mobula.op.register
+class SegmentMean(_SegmentSumReduce):
+    mean = True
+
+
+@mobula.op.register
+class SegmentMax(_SegmentReduce):
+    def forward(self, data, offsets):
+        if self.req[0] == req.null:
+            return
+        y = self.F.empty_like(self.y) if self.req[0] == req.add else self.y
+        mobula.func.segment_max(offsets.shape[0] - 1, data, offsets, y)
+        if self.req[0] == req.add:
+            self.y[:] += y
+
+    def backward(self, dy):
+        if self.req[0] != req.null:
+            data, offsets = self.X
+            mobula.func.segment_max_backward(
+                offsets.shape[0] - 1, data, offsets, self.y, dy,
+                self.req[0] == req.add, self.dX[0])
+        self._backward_offsets()
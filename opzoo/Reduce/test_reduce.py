@@ -0,0 +1,109 @@
+import mxnet as mx
+import numpy as np
+import mobula
+from mobula.testing import assert_almost_equal
+
+mobula.op.load('Reduce')
+
+T = np.float32
+atol = 1e-4
+rtol = 1e-4
+
+AXES = [None, 0, 1, -1, (1, 2), (0, 1)]
+
+
+def check_reduce(op, mx_op, shape, axis, keepdims):
+    data = mx.random.uniform(-1, 1, shape=shape)
+    data2 = data.copy()
+    data.attach_grad()
+    data2.attach_grad()
+    with mx.autograd.record():
+        out = op(data, axis=axis, keepdims=keepdims)
+    with mx.autograd.record():
+        gt = mx_op(data2, axis=axis, keepdims=keepdims)
+    assert out.shape == gt.shape, (out.shape, gt.shape)
+    dy = mx.random.uniform(-1, 1, shape=out.shape)
+    out.backward(dy)
+    gt.backward(dy)
+    assert_almost_equal(out, gt, atol=atol, rtol=rtol)
+    assert_almost_equal(data.grad, data2.grad, atol=atol, rtol=rtol)
+
+
+def test_reduce_sum():
+    for shape in [(3, 4, 5), (2, 1000, 3), (1, 5000, 1)]:
+        for axis in AXES:
+            for keepdims in [False, True]:
+                check_reduce(mobula.op.ReduceSum, mx.nd.sum,
+                             shape, axis, keepdims)
+
+
+def test_reduce_mean():
+    for shape in [(3, 4, 5), (2, 1000, 3)]:
+        for axis in AXES:
+            check_reduce(mobula.op.ReduceMean, mx.nd.mean, shape, axis, False)
+
+
+def test_reduce_max():
+    for shape in [(3, 4, 5), (2, 1000, 3)]:
+        for axis in AXES:
+            check_reduce(mobula.op.ReduceMax, mx.nd.max, shape, axis, False)
+
+
+def test_reduce_sum_compensated():
+    data = mx.nd.array(np.full((100000, ), 0.1, dtype=T))
+    out = mobula.op.ReduceSum(data, compensated=True)
+    assert_almost_equal(out, [10000.0], atol=1e-2, rtol=1e-6)
+
+
+def check_segment(op, np_op, lengths):
+    offsets = np.concatenate([[0], np.cumsum(lengths)]).astype(T)
+    N = int(offsets[-1])
+    data_np = np.random.uniform(-1, 1, size=(N, )).astype(T)
+    data = mx.nd.array(data_np)
+    data.attach_grad()
+    dy_np = np.random.uniform(-1, 1, size=(len(lengths), )).astype(T)
+    with mx.autograd.record():
+        out = op(data, mx.nd.array(offsets))
+    out.backward(mx.nd.array(dy_np))
+    gt = np.zeros(len(lengths), dtype=T)
+    grad = np.zeros(N, dtype=T)
+    for i, (begin, end) in enumerate(zip(offsets[:-1], offsets[1:])):
+        begin, end = int(begin), int(end)
+        if begin == end:
+            continue
+        gt[i], grad[begin:end] = np_op(data_np[begin:end], dy_np[i])
+    assert_almost_equal(out, gt, atol=atol, rtol=rtol)
+    assert_almost_equal(data.grad, grad, atol=atol, rtol=rtol)
+
+
+def _np_sum(x, dy):
+    return x.sum(), np.full(x.shape, dy)
+
+
+def _np_mean(x, dy):
+    return x.mean(), np.full(x.shape, dy / x.size)
+
+
+def _np_max(x, dy):
+    grad = np.zeros(x.shape, dtype=x.dtype)
+    grad[x == x.max()] = dy
+    return x.max(), grad
+
+
+def test_segment_reduce():
+    for lengths in [[3, 0, 5, 1], [1000, 1, 0, 33], [0]]:
+        check_segment(mobula.op.SegmentSum, _np_sum, lengths)
+        check_segment(mobula.op.SegmentMean, _np_mean, lengths)
+        check_segment(mobula.op.SegmentMax, _np_max, lengths)
+
+
+def test_reduce_float16():
+    # the sums are accumulated in float, and a sum in half stops at 256
+    data_np = np.random.uniform(0, 1, size=(4, 3000)).astype(np.float16)
+    data = mx.nd.array(data_np, dtype=np.float16)
+    out = mobula.op.ReduceSum(data, axis=-1)
+    assert out.dtype == np.float16
+    gt = data_np.astype(np.float64).sum(axis=-1)
+    assert_almost_equal(out.asnumpy().astype(np.float64), gt, atol=1, rtol=1e-3)
+    out = mobula.op.ReduceMax(data, axis=0)
+    assert_almost_equal(out.asnumpy(), data_np.max(axis=0), atol=0, rtol=0)
@@ -2,66 +2,278 @@
 
 namespace mobula {
 
+#if !(USING_CUDA || USING_HIP)
+// the number of the columns whose statistics are merged together on CPU
+constexpr int kSoftmaxChunkSize = 256;
+#endif  // !(USING_CUDA || USING_HIP)
+
+// merge the maximum `m2` and the sum `s2` of exp(x - m2) into (m, s)
 template <typename T>
-MOBULA_KERNEL softmax_channel_forward_kernel(const int C, const int N,
-                                             const T *X, T *tmp, T *Y) {
-  const T *x = X;
-  T *y = Y;
-  for (int n = 0; n < N; ++n, x += C, y += C) {
-    // max
-    Reduce(C, x, tmp, max_func<T>, x[0]);
-    const T max_value = tmp[0];
-    parfor(C, [&](int i) { y[i] = exp(x[i] - max_value); });
-    __syncthreads();
-    // sum
-    Reduce(C, y, tmp, add_residual_reduce_func<T>, add_residual_merge_func<T>,
-           T(0));
-    const T sum_value = tmp[0];
-    parfor(C, [&](int i) { y[i] /= sum_value; });
-    __syncthreads();
+MOBULA_DEVICE inline void online_softmax_merge(const T m2, const T s2, T *m,
+                                               T *s) {
+  if (m2 > *m) {
+    *s = *s * fast_exp(*m - m2) + s2;
+    *m = m2;
+  } else {
+    *s += s2 * fast_exp(m2 - *m);
+  }
+}
+
+/*!
+ * \brief Compute the maximum `m` of a row and the sum `s` of exp(x - m) in one
+ *  read, by rescaling the running sum when the running maximum changes.
+ *  The arguments `cols`, `lane` and `lanes` are those of parfor_rows, and the
+ *  statistics are of the accumulation type A.
+ */
+template <typename T, typename A>
+MOBULA_DEVICE inline void online_softmax_row(const T *x, const int cols,
+                                             const int lane, const int lanes,
+                                             A *m, A *s) {
+  *m = x[0];
+  *s = 0;
+#if USING_CUDA || USING_HIP
+  for (int c = lane; c < cols; c += lanes) {
+    const A v = x[c];
+    if (v > *m) {
+      *s = *s * fast_exp(*m - v) + A(1);
+      *m = v;
+    } else {
+      *s += fast_exp(v - *m);
+    }
+  }
+  for (int mask = lanes / 2; mask > 0; mask /= 2) {
+    online_softmax_merge(warp_shfl_xor(*m, mask), warp_shfl_xor(*s, mask), m,
+                         s);
+  }
+#else
+  // the maximum of a chunk is found before its sum, so that the loops are
+  // vectorized and the running sum is rescaled once per chunk
+  static_cast<void>(lane);
+  static_cast<void>(lanes);
+  for (int begin = 0; begin < cols; begin += kSoftmaxChunkSize) {
+    const int end = std::min(begin + kSoftmaxChunkSize, cols);
+    A chunk_max = *m;
+    for (int c = begin; c < end; ++c) chunk_max = std::max(chunk_max, A(x[c]));
+    A chunk_sum = 0;
+    for (int c = begin; c < end; ++c) {
+      chunk_sum += fast_exp(A(x[c]) - chunk_max);
+    }
+    online_softmax_merge(chunk_max, chunk_sum, m, s);
+  }
+#endif  // USING_CUDA || USING_HIP
+}
+
+// the sum of a row, see online_softmax_row
+template <typename T, typename A = typename AccType<T>::type>
+MOBULA_DEVICE inline A sum_row(const T *x, const int cols, const int lane,
+                               const int lanes) {
+  A s = 0;
+  for (int c = lane; c < cols; c += lanes) s += A(x[c]);
+  return warp_reduce(s, add_func<A>, lanes);
+}
+
+/*!
+ * \brief Y = softmax(X) on the last axis, where X is a (size / C, C) matrix.
+ *  On GPU, X is read twice: once for the statistics, and once for the output.
+ *  On CPU, the threads compute each row together when the rows are fewer than
+ *  the threads. The statistics are accumulated in AccType<T>::type.
+ */
+template <typename T>
+MOBULA_DEVICE void softmax_forward(const int size, const int C, const T *X,
+                                   T *Y) {
+  typedef typename AccType<T>::type A;
+  const int N = size / C;
+#if !(USING_CUDA || USING_HIP)
+  const int num_threads = get_num_threads();
+  if (N < num_threads) {
+    int start, end;
+    get_parfor_range(C, num_threads, get_thread_num(), &start, &end);
+    for (int row = 0; row < N; ++row) {
+      const T *x = X + row * C;
+      T *y = Y + row * C;
+      // x[0] is the initial maximum of the threads without any column
+      A m = x[0];
+      for (int c = start; c < end; ++c) m = std::max(m, A(x[c]));
+      m = block_reduce(m, max_func<A>, A(x[0]));
+      A s = 0;
+      for (int c = start; c < end; ++c) {
+        const A e = fast_exp(A(x[c]) - m);
+        y[c] = e;
+        s += e;
+      }
+      const A inv_s = A(1) / block_reduce(s, add_func<A>, A(0));
+      for (int c = start; c < end; ++c) y[c] *= inv_s;
+    }
+    return;
   }
+#endif  // !(USING_CUDA || USING_HIP)
+  parfor_rows(N, C, [&](int row, int cols, int lane, int lanes) {
+    const T *x = X + row * C;
+    T *y = Y + row * C;
+#if USING_CUDA || USING_HIP
+    A m, s;
+    online_softmax_row(x, cols, lane, lanes, &m, &s);
+    const A inv_s = A(1) / s;
+    for (int c = lane; c < cols; c += lanes) {
+      y[c] = fast_exp(A(x[c]) - m) * inv_s;
+    }
+#else
+    // the row is in the cache, so computing exp once is faster than one read
+    static_cast<void>(lane);
+    static_cast<void>(lanes);
+    A m = x[0];
+    for (int c = 1; c < cols; ++c) m = std::max(m, A(x[c]));
+    A s = 0;
+    for (int c = 0; c < cols; ++c) {
+      const A e = fast_exp(A(x[c]) - m);
+      y[c] = e;
+      s += e;
+    }
+    const A inv_s = A(1) / s;
+    for (int c = 0; c < cols; ++c) y[c] *= inv_s;
+#endif  // USING_CUDA || USING_HIP
+  });
 }
 
+template <typename T>
+MOBULA_KERNEL softmax_forward_kernel(const int size, const int C, const T *X,
+                                     T *Y) {
+  softmax_forward(size, C, X, Y);
+}
+
+// the kernels of the old interface, which compute the same softmax
 template <typename T>
 MOBULA_KERNEL softmax_batch_forward_kernel(const int N, const int C, const T *X,
                                            T *Y) {
-  parfor(N, [&](int i) {
-    const T *x = X + i * C;
-    T *y = Y + i * C;
-    // find maximum
-    T max_value = x[0];
-    for (int c = 1; c < C; ++c) {
-      if (x[c] > max_value) max_value = x[c];
-    }
-    // compute exp(x - max_value)
-    for (int c = 0; c < C; ++c) {
-      y[c] = exp(x[c] - max_value);
+  softmax_forward(N * C, C, X, Y);
+}
+
+template <typename T>
+MOBULA_KERNEL softmax_channel_forward_kernel(const int C, const int N,
+                                             const T *X, T *Y) {
+  softmax_forward(N * C, C, X, Y);
+}
+
+// Y = log(softmax(X)) = X - max - log(sum(exp(X - max)))
+template <typename T>
+MOBULA_KERNEL log_softmax_forward_kernel(const int size, const int C,
+                                         const T *X, T *Y) {
+  typedef typename AccType<T>::type A;
+  parfor_rows(size / C, C, [&](int row, int cols, int lane, int lanes) {
+    const T *x = X + row * C;
+    T *y = Y + row * C;
+    A m, s;
+    online_softmax_row(x, cols, lane, lanes, &m, &s);
+    const A lse = m + fast_log(s);
+    for (int c = lane; c < cols; c += lanes) y[c] = A(x[c]) - lse;
+  });
+}
+
+// dX = dY - exp(Y) * sum(dY), where Y = log_softmax(X)
+// dX is added to when `accumulate` is true
+template <typename T>
+MOBULA_KERNEL log_softmax_backward_kernel(const int size, const int C,
+                                          const T *Y, const T *dY,
+                                          const bool accumulate, T *dX) {
+  typedef typename AccType<T>::type A;
+  parfor_rows(size / C, C, [&](int row, int cols, int lane, int lanes) {
+    const T *y = Y + row * C;
+    const T *dy = dY + row * C;
+    T *dx = dX + row * C;
+    const A sum_dy = sum_row(dy, cols, lane, lanes);
+    for (int c = lane; c < cols; c += lanes) {
+      const A grad = A(dy[c]) - fast_exp(A(y[c])) * sum_dy;
+      dx[c] = accumulate ? A(dx[c]) + grad : grad;
     }
-    // sum
-    T sum_value = 0;
-    for (int c = 0; c < C; ++c) {
-      sum_value += y[c];
+  });
+}
+
+/*!
+ * \brief The cross entropy between softmax(X) and the labels, where X is a
+ *  (size / C, C) matrix of the logits.
+ *  loss[i] = LSE[i] - X[i, labels[i]], where LSE[i] = log(sum(exp(X[i, :])))
+ *  is saved for the backward, so the probabilities are not stored.
+ *  The rows whose labels are not in [0, C) are ignored, whose loss is 0.
+ */
+template <typename T, typename L>
+MOBULA_KERNEL softmax_cross_entropy_forward_kernel(const int size, const int C,
+                                                   const T *X, const L *labels,
+                                                   T *loss, T *LSE) {
+  typedef typename AccType<T>::type A;
+  parfor_rows(size / C, C, [&](int row, int cols, int lane, int lanes) {
+    const T *x = X + row * C;
+    A m, s;
+    online_softmax_row(x, cols, lane, lanes, &m, &s);
+    if (lane == 0 && cols > 0) {
+      const A lse = m + fast_log(s);
+      const int label = static_cast<int>(labels[row]);
+      LSE[row] = lse;
+      loss[row] = (label >= 0 && label < C) ? lse - A(x[label]) : A(0);
     }
-    // divide by sum
-    for (int c = 0; c < C; ++c) {
-      y[c] /= sum_value;
+  });
+}
+
+// dX[i, j] = (exp(X[i, j] - LSE[i]) - (j == labels[i])) * dloss[i]
+// dX is added to when `accumulate` is true
+template <typename T, typename L>
+MOBULA_KERNEL softmax_cross_entropy_backward_kernel(
+    const int size, const int C, const T *X, const L *labels, const T *LSE,
+    const T *dloss, const bool accumulate, T *dX) {
+  typedef typename AccType<T>::type A;
+  parfor(size, [&](int i) {
+    const int row = i / C;
+    const int label = static_cast<int>(labels[row]);
+    A grad = 0;
+    if (label >= 0 && label < C) {
+      const A p = fast_exp(A(X[i]) - A(LSE[row]));
+      grad = (i - row * C == label ? p - A(1) : p) * A(dloss[row]);
     }
+    dX[i] = accumulate ? A(dX[i]) + grad : grad;
   });
 }
 
+/*!
+ * \brief dX = Y * (dY - sum(Y * dY)) on the last axis, where Y = softmax(X)
+ *  is a (size / C, C) matrix. dX is added to when `accumulate` is true.
+ *  On CPU, the threads compute each row together when the rows are fewer than
+ *  the threads.
+ */
 template <typename T>
-MOBULA_KERNEL softmax_backward_kernel(const int N, const int C, const T *Y,
-                                      const T *dY, T *dX) {
-  parfor(N, [&](int i) {
-    const T *y = Y + i * C;
-    const T *dy = dY + i * C;
-    T *dx = dX + i * C;
-    for (int j = 0; j < C; ++j) {
-      T &grad = dx[j];
-      for (int k = 0; k < C; ++k) {
-        grad -= y[j] * y[k] * dy[k];
+MOBULA_KERNEL softmax_backward_kernel(const int size, const int C, const T *Y,
+                                      const T *dY, const bool accumulate,
+                                      T *dX) {
+  typedef typename AccType<T>::type A;
+  const int N = size / C;
+#if !(USING_CUDA || USING_HIP)
+  const int num_threads = get_num_threads();
+  if (N < num_threads) {
+    int start, end;
+    get_parfor_range(C, num_threads, get_thread_num(), &start, &end);
+    for (int row = 0; row < N; ++row) {
+      const T *y = Y + row * C;
+      const T *dy = dY + row * C;
+      T *dx = dX + row * C;
+      A dot = 0;
+      for (int c = start; c < end; ++c) dot += A(y[c]) * A(dy[c]);
+      dot = block_reduce(dot, add_func<A>, A(0));
+      for (int c = start; c < end; ++c) {
+        const A grad = A(y[c]) * (A(dy[c]) - dot);
+        dx[c] = accumulate ? A(dx[c]) + grad : grad;
       }
-      grad += y[j] * dy[j];
+    }
+    return;
+  }
+#endif  // !(USING_CUDA || USING_HIP)
+  parfor_rows(N, C, [&](int row, int cols, int lane, int lanes) {
+    const T *y = Y + row * C;
+    const T *dy = dY + row * C;
+    T *dx = dX + row * C;
+    A dot = 0;
+    for (int c = lane; c < cols; c += lanes) dot += A(y[c]) * A(dy[c]);
+    dot = warp_reduce(dot, add_func<A>, lanes);
+    for (int c = lane; c < cols; c += lanes) {
+      const A grad = A(y[c]) * (A(dy[c]) - dot);
+      dx[c] = accumulate ? A(dx[c]) + grad : grad;
     }
   });
 }
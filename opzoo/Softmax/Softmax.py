@@ -1,36 +1,95 @@
 import mobula
 from mobula.const import req
-import warnings
+import numpy as np
 
 
-# this softmax support 1 or 2-dim input and the reduce on axis 0
+def _get_size(x):
+    return np.prod(x.size()) if callable(x.size) else x.size
+
+
+def _get_num_classes(x):
+    return x.shape[-1] if x.ndim == 2 else _get_size(x)
+
+
+def _get_output(op, i):
+    # the kernels write the temporary output which is added to the output
+    if op.req[i] == req.add:
+        return op.F.empty_like(op.Y[i])
+    return op.Y[i]
+
+
+# this softmax support 1 or 2-dim input and the reduce on the last axis
 @mobula.op.register
 class Softmax:
     def forward(self, x):
-        warnings.warn(
-            'There is a flaky bug in Softmax :( We will fix it later.')
-
-        if x.ndim == 2:
-            N, C = x.shape
-        else:
-            N, C = 1, x.size
-        if C > N:
-            tmp = self.F.empty_like(x)
-            mobula.func.softmax_channel_forward(C, N, x, tmp, self.y)
-        else:
-            mobula.func.softmax_batch_forward(N, C, x, self.y)
+        if self.req[0] == req.null:
+            return
+        y = _get_output(self, 0)
+        mobula.func.softmax_forward(_get_size(x), _get_num_classes(x), x, y)
+        if self.req[0] == req.add:
+            self.y[:] += y
 
     def backward(self, dy):
         if self.req[0] == req.null:
             return
-        elif self.req[0] == req.write:
-            self.dx[:] = 0
-        if dy.ndim == 2:
-            N, C = dy.shape
-        else:
-            N, C = 1, dy.size
-        mobula.func.softmax_backward(N, C, self.y, dy, self.dx)
+        mobula.func.softmax_backward(
+            _get_size(dy), _get_num_classes(dy), self.y, dy,
+            self.req[0] == req.add, self.dx)
 
     def infer_shape(self, in_shape):
         assert len(in_shape[0]) in [1, 2]
         return in_shape, in_shape
+
+
+# log(softmax(x)) on the last axis of 1 or 2-dim input
+@mobula.op.register
+class LogSoftmax:
+    def forward(self, x):
+        if self.req[0] == req.null:
+            return
+        y = _get_output(self, 0)
+        mobula.func.log_softmax_forward(
+            _get_size(x), _get_num_classes(x), x, y)
+        if self.req[0] == req.add:
+            self.y[:] += y
+
+    def backward(self, dy):
+        if self.req[0] == req.null:
+            return
+        mobula.func.log_softmax_backward(
+            _get_size(dy), _get_num_classes(dy), self.y, dy,
+            self.req[0] == req.add, self.dx)
+
+    def infer_shape(self, in_shape):
+        assert len(in_shape[0]) in [1, 2]
+        return in_shape, in_shape
+
+
+# the cross entropy between softmax(data) and the labels without storing the
+# probabilities, where data is (N, C) and label is (N, ). The output loss is
+# (N, ), and the samples whose labels are not in [0, C) are ignored.
+@mobula.op.register
+class SoftmaxCrossEntropy:
+    def forward(self, data, label):
+        # the log-sum-exp of each row is saved for the backward
+        self.lse = self.F.empty_like(self.y)
+        loss = _get_output(self, 0)
+        mobula.func.softmax_cross_entropy_forward(
+            _get_size(data), data.shape[1], data, label, loss, self.lse)
+        if self.req[0] == req.add:
+            self.y[:] += loss
+
+    def backward(self, dy):
+        if self.req[0] != req.null:
+            data, label = self.X
+            mobula.func.softmax_cross_entropy_backward(
+                _get_size(data), data.shape[1], data, label, self.lse, dy,
+                self.req[0] == req.add, self.dX[0])
+        if self.req[1] not in [req.null, req.add]:
+            self.dX[1][:] = 0
+
+    def infer_shape(self, in_shape):
+        dshape, lshape = in_shape
+        assert len(dshape) == 2
+        assert len(lshape) == 1 and lshape[0] == dshape[0]
+        return in_shape, [lshape]
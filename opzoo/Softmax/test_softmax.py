@@ -54,9 +54,85 @@ def test_softmax2d_grad():
         assert_almost_equal(data.grad, data2.grad, atol=atol, rtol=rtol)
     softmax2d_grad(3, 10)
     softmax2d_grad(10, 3)
+    softmax2d_grad(2, 1000)
+
+
+def test_softmax_grad_add():
+    N, C = 4, 100
+    data = mx.random.uniform(0, 1, shape=(N, C))
+    data.attach_grad(grad_req='add')
+    dy = mx.random.uniform(0, 1, shape=(N, C))
+    with mx.autograd.record():
+        out = mobula.op.Softmax(data)
+    out.backward(dy)
+    grad = data.grad.copy()
+    with mx.autograd.record():
+        out = mobula.op.Softmax(data)
+    out.backward(dy)
+    assert_almost_equal(data.grad, grad * 2, atol=atol, rtol=rtol)
+
+
+def test_log_softmax():
+    def log_softmax(N, C):
+        data = mx.random.uniform(-10, 10, shape=(N, C))
+        data2 = data.copy()
+        data.attach_grad()
+        data2.attach_grad()
+
+        dy = mx.random.uniform(0, 1, shape=(N, C))
+        with mx.autograd.record():
+            out = mobula.op.LogSoftmax(data)
+        out.backward(dy)
+        with mx.autograd.record():
+            gt = mx.nd.log_softmax(data2, axis=-1)
+        gt.backward(dy)
+        assert_almost_equal(out, gt, atol=atol, rtol=rtol)
+        assert_almost_equal(data.grad, data2.grad, atol=atol, rtol=rtol)
+    log_softmax(3, 10)
+    log_softmax(10, 3)
+    log_softmax(2, 1000)
+
+
+def test_softmax_cross_entropy():
+    def softmax_cross_entropy(N, C):
+        data = mx.random.uniform(-10, 10, shape=(N, C))
+        label = mx.nd.array(np.random.randint(0, C, size=(N, )))
+        # the ignored sample
+        label[0] = -1
+        data2 = data.copy()
+        data.attach_grad()
+        data2.attach_grad()
+
+        dy = mx.random.uniform(0, 1, shape=(N, ))
+        with mx.autograd.record():
+            out = mobula.op.SoftmaxCrossEntropy(data, label)
+        out.backward(dy)
+        with mx.autograd.record():
+            valid = label >= 0
+            gt = -mx.nd.pick(mx.nd.log_softmax(data2, axis=-1),
+                             label * valid, axis=-1) * valid
+        gt.backward(dy)
+        assert_almost_equal(out, gt, atol=atol, rtol=rtol)
+        assert_almost_equal(data.grad, data2.grad, atol=atol, rtol=rtol)
+    softmax_cross_entropy(3, 10)
+    softmax_cross_entropy(10, 3)
+    softmax_cross_entropy(2, 1000)
+
+
+def test_softmax_float16():
+    # the statistics are accumulated in float
+    data = mx.random.uniform(-3, 3, shape=(5, 1000)).astype(np.float16)
+    out = mobula.op.Softmax(data)
+    assert out.dtype == np.float16
+    gt = mx.nd.softmax(data.astype(T), axis=-1)
+    assert_almost_equal(out.astype(T), gt, atol=1e-4, rtol=2e-3)
 
 
 if __name__ == '__main__':
     test_softmax1d()
     test_softmax2d()
     test_softmax2d_grad()
+    test_softmax_grad_add()
+    test_log_softmax()
+    test_softmax_cross_entropy()
+    test_softmax_float16()
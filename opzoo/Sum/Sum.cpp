@@ -3,8 +3,10 @@
 namespace mobula {
 
 template <typename T>
-MOBULA_KERNEL sum_kernel(const int N, const T *X, T *Y) {
-  Reduce(N, X, Y, add_residual_reduce_func<T>, add_residual_merge_func<T>,
-         T(0));
+MOBULA_KERNEL sum_kernel(const int N, const T *X,
+                         MOBULA_WORKSPACE(T, partials, N / 32 + 1),
+                         MOBULA_COUNTER(counter), T *Y) {
+  device_reduce(N, X, partials, counter, Y, add_residual_reduce_func<T>,
+                add_func<T>, T(0));
 }
 }  // namespace mobula
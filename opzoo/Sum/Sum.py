@@ -4,9 +4,9 @@ import mobula
 @mobula.op.register
 class Sum:
     def forward(self, x):
-        tmp = self.F.empty_like(x)
+        tmp = self.F.empty_like(self.y)
         mobula.func.sum(x.size, x, tmp)
-        self.assign(self.y, self.req[0], tmp[0])
+        self.assign(self.y, self.req[0], tmp)
 
     def backward(self, dy):
         self.assign(self.dx, self.req[0], dy)
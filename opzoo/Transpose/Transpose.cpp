@@ -34,4 +34,91 @@ MOBULA_KERNEL transpose_2d_co_kernel(const int N, const T *X, const int R,
   });
 }
 
+// the tiles of transpose_blocked_kernel are kTransposeTile x kTransposeTile
+constexpr int kTransposeTile = 32;
+
+/*!
+ * \brief Y[b, c, r, e] = X[b, r, c, e]
+ *  X: (B, R, C, E), Y: (B, C, R, E), N = B * R * C * E
+ *  The (R, C) planes are transposed by tiles. On GPU, a block moves a tile
+ *  through the shared memory, so that the reads and the writes are both
+ *  coalesced. On CPU, a thread writes a tile column by column, and the rows
+ *  of the tile stay in the cache. A non-contiguous X is gathered without the
+ *  tiles.
+ */
+template <typename T>
+MOBULA_KERNEL transpose_blocked_kernel(const int N, MOBULA_VIEW(const T, X, 4),
+                                       const int B, const int R, const int C,
+                                       const int E, T *Y) {
+  if (!X.is_contiguous) {
+    parfor(N, [&](int i) {
+      const int e = i % E;
+      const int r = i / E % R;
+      const int c = i / (E * R) % C;
+      const int b = i / (E * R * C);
+      Y[i] = X[((b * R + r) * C + c) * E + e];
+    });
+    return;
+  }
+  const int tiles_r = (R + kTransposeTile - 1) / kTransposeTile;
+  const int tiles_c = (C + kTransposeTile - 1) / kTransposeTile;
+  const int num_tiles = B * tiles_r * tiles_c;
+#if USING_CUDA || USING_HIP
+  if (E == 1) {
+    // the padding avoids the bank conflicts
+    __shared__ T tile[kTransposeTile][kTransposeTile + 1];
+    for (int t = hipBlockIdx_x; t < num_tiles; t += hipGridDim_x) {
+      const int r0 = (t / tiles_c) % tiles_r * kTransposeTile;
+      const int c0 = t % tiles_c * kTransposeTile;
+      const T *x = X.data + t / (tiles_r * tiles_c) * R * C;
+      T *y = Y + t / (tiles_r * tiles_c) * R * C;
+      for (int k = hipThreadIdx_x; k < kTransposeTile * kTransposeTile;
+           k += hipBlockDim_x) {
+        const int r = r0 + k / kTransposeTile, c = c0 + k % kTransposeTile;
+        if (r < R && c < C) tile[r - r0][c - c0] = x[r * C + c];
+      }
+      __syncthreads();
+      for (int k = hipThreadIdx_x; k < kTransposeTile * kTransposeTile;
+           k += hipBlockDim_x) {
+        const int c = c0 + k / kTransposeTile, r = r0 + k % kTransposeTile;
+        if (r < R && c < C) y[c * R + r] = tile[r - r0][c - c0];
+      }
+      __syncthreads();
+    }
+    return;
+  }
+  // the adjacent threads copy the adjacent elements of E
+  parfor(N, [&](int i) {
+    const int e = i % E;
+    const int r = i / E % R;
+    const int c = i / (E * R) % C;
+    const int b = i / (E * R * C);
+    Y[i] = X.data[((b * R + r) * C + c) * E + e];
+  });
+#else
+  static_cast<void>(N);  // N is for the grid on GPU
+  parfor(num_tiles, [&](int t) {
+    const int r0 = (t / tiles_c) % tiles_r * kTransposeTile;
+    const int c0 = t % tiles_c * kTransposeTile;
+    const int r1 = r0 + kTransposeTile < R ? r0 + kTransposeTile : R;
+    const int c1 = c0 + kTransposeTile < C ? c0 + kTransposeTile : C;
+    const T *x = X.data + t / (tiles_r * tiles_c) * R * C * E;
+    T *y = Y + t / (tiles_r * tiles_c) * R * C * E;
+    if (E == 1) {
+      for (int c = c0; c < c1; ++c) {
+        for (int r = r0; r < r1; ++r) y[c * R + r] = x[r * C + c];
+      }
+    } else {
+      for (int c = c0; c < c1; ++c) {
+        for (int r = r0; r < r1; ++r) {
+          const T *src = x + (r * C + c) * E;
+          T *dst = y + (c * R + r) * E;
+          for (int e = 0; e < E; ++e) dst[e] = src[e];
+        }
+      }
+    }
+  });
+#endif  // USING_CUDA || USING_HIP
+}
+
 }  // namespace mobula
@@ -2,20 +2,96 @@ import mobula
 from mobula.const import req
 
 
+def _prod(shape):
+    p = 1
+    for s in shape:
+        p *= s
+    return p
+
+
+def get_transpose_plan(shape, axes):
+    """Split the permutation into the passes of transpose_blocked.
+
+    A pass swaps the adjacent groups of axes [i, j) and [j, k), which is the
+    transpose of (R, C) in the layout (B, R, C, E), where B, R, C and E are
+    the products of the sizes of the axes [0, i), [i, j), [j, k) and [k, ndim).
+
+    Returns
+    -------
+    list of (B, R, C, E)
+    """
+    ndim = len(shape)
+    assert sorted(axes) == list(range(ndim)), ValueError(
+        'Invalid axes {} for the shape {}'.format(axes, shape))
+    # the axes of size 1 never move data
+    cur = [a for a in range(ndim) if shape[a] != 1]
+    target = [a for a in axes if shape[a] != 1]
+    plan = []
+    for i in range(len(target)):
+        if cur[i] == target[i]:
+            continue
+        j = cur.index(target[i])
+        # move the longest group which is already in the target order
+        k = j + 1
+        while k < len(cur) and i + k - j < len(target) and cur[k] == target[i + k - j]:
+            k += 1
+        sizes = [shape[a] for a in cur]
+        plan.append((_prod(sizes[:i]), _prod(sizes[i:j]),
+                     _prod(sizes[j:k]), _prod(sizes[k:])))
+        cur = cur[:i] + cur[j:k] + cur[i:j] + cur[k:]
+    return plan
+
+
+def transpose(F, x, axes, out):
+    """out = x.transpose(axes) by the passes of transpose_blocked."""
+    plan = get_transpose_plan(x.shape, axes)
+    if not plan:
+        out[:] = x.reshape(out.shape)
+        return
+    src = x
+    for t, (B, R, C, E) in enumerate(plan):
+        dst = out if t + 1 == len(plan) else F.empty_like(out)
+        mobula.func.transpose_blocked(x.size, src, B, R, C, E, dst)
+        src = dst
+
+
+@mobula.op.register
+class Transpose:
+    def __init__(self, axes):
+        self.axes = list(axes)
+        self.inv_axes = [0] * len(self.axes)
+        for i, a in enumerate(self.axes):
+            self.inv_axes[a] = i
+
+    def forward(self, x):
+        assert self.req[0] in [req.write, req.inplace]
+        transpose(self.F, x, self.axes, self.y)
+
+    def backward(self, dy):
+        assert self.req[0] in [req.write, req.inplace]
+        transpose(self.F, dy, self.inv_axes, self.dx)
+
+    def infer_shape(self, in_shape):
+        assert len(in_shape) == 1
+        assert len(in_shape[0]) == len(self.axes)
+        return in_shape, [[in_shape[0][a] for a in self.axes]]
+
+
 @mobula.op.register
 class Transpose2D:
     def __init__(self, continuous_input=True):
-        self.func = mobula.func.transpose_2d_ci if continuous_input else mobula.func.transpose_2d_co
+        # the tiled kernel reads and writes continuously for both
+        self.continuous_input = continuous_input
 
     def forward(self, x):
         assert self.req[0] in [req.write, req.inplace]
         R, C = x.shape
-        self.func(x.size, x, R, C, self.y)
+        mobula.func.transpose_blocked(x.size, x, 1, R, C, 1, self.y)
 
     def backward(self, dy):
         assert self.req[0] in [req.write, req.inplace]
         R, C = self.x.shape
-        self.func(self.x.size, dy, C, R, self.dx)
+        mobula.func.transpose_blocked(dy.size, dy, 1, C, R, 1, self.dx)
 
     def infer_shape(self, in_shape):
         assert len(in_shape) == 1
@@ -17,5 +17,32 @@ def test_transpose2d():
         assert_almost_equal(y, x.T)
 
 
+def test_transpose():
+    for shape, axes in [((2, 3, 4, 5), (0, 2, 3, 1)), ((2, 3, 4), (2, 1, 0)),
+                        ((3, 1, 40, 33), (3, 2, 1, 0)), ((2, 3), (0, 1))]:
+        x = mx.nd.array(np.random.uniform(size=shape))
+        x.attach_grad()
+        dy = mx.nd.array(np.random.uniform(
+            size=[shape[a] for a in axes]))
+        with mx.autograd.record():
+            y = mobula.op.Transpose(x, axes=axes)
+        y.backward(dy)
+        assert_almost_equal(y, x.transpose(axes))
+        assert_almost_equal(x.grad, dy.transpose(
+            tuple(int(a) for a in np.argsort(axes))))
+
+
+def test_transpose_strided():
+    # a non-contiguous input is read through its strides
+    x = np.random.uniform(size=(4, 6, 5)).astype(T)
+    for xv in [x.transpose(1, 0, 2), x[:, ::2], x[::-1, 1:5, 1:4]]:
+        B, R, C, E = 1, xv.shape[0], xv.shape[1], xv.shape[2]
+        y = np.empty((C, R, E), dtype=T)
+        mobula.func.transpose_blocked(xv.size, xv, B, R, C, E, y)
+        assert_almost_equal(y, xv.transpose(1, 0, 2))
+
+
 if __name__ == '__main__':
     test_transpose2d()
+    test_transpose()
+    test_transpose_strided()
@@ -41,3 +41,29 @@ def test_multiple_gpus():
         outs.append((output.asnumpy(), data.grad.asnumpy()))
     for a, b in zip(*outs):
         mobula.testing.assert_almost_equal(a, b)
+
+
+def _has_torch_gpu():
+    try:
+        import torch
+    except ImportError:
+        return False
+    return torch.cuda.is_available()
+
+
+@unittest.skipIf(not _has_torch_gpu(), 'PyTorch with GPU is not available')
+def test_torch_current_stream():
+    import torch
+    mobula.op.load('./utils', os.path.join(os.path.dirname(__file__), '../test_func'))
+    n = 1 << 20
+    stream = torch.cuda.Stream()
+    with torch.cuda.stream(stream):
+        a = torch.rand(n, device='cuda')
+        b = torch.rand(n, device='cuda')
+        c = torch.empty_like(a)
+        # the kernel is ordered after the inputs on the same stream
+        mobula.func.mul_elemwise(n, a, b, c)
+        d = c * 2
+    stream.synchronize()
+    mobula.testing.assert_almost_equal(d.cpu().numpy(),
+                                       (a * b * 2).cpu().numpy())
@@ -0,0 +1,4 @@
+template <typename T>
+MOBULA_KERNEL aot_add_kernel(const int n, const T *a, const T b, T *out) {
+  parfor(n, [&](int i) { out[i] = a[i] + b; });
+}
@@ -0,0 +1,5 @@
+#include "mobula_op.h"
+
+extern "C" {
+MOBULA_DLL int TestBuildCache() { return 42; }
+}
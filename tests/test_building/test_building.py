@@ -1,8 +1,10 @@
 import ctypes
 import os
+import shutil
 
 import mobula
 from mobula.testing import assert_almost_equal, gradcheck
+from mobula.utils import makedirs
 
 
 def test_custom_struct():
@@ -72,10 +74,12 @@ def test_template_build():
         mobula.func.mul_elemwise.build('cpu', dict(T='int'))
         assert mobula.config.BUILD_IN_LOCAL_PATH == True
         env_path = os.path.dirname(__file__)
-        code_fname = os.path.join(
-            env_path,
-            'test_template', 'build', 'cpu', 'test_template_wrapper.cpp')
-        code = open(code_fname).read()
+        build_path = os.path.join(env_path, 'test_template', 'build', 'cpu')
+        # each template instance has its own wrapper
+        code_fnames = [os.path.join(build_path, name) for name in os.listdir(build_path)
+                       if name.startswith('test_template_mul_elemwise_') and name.endswith('_wrapper.cpp')]
+        assert len(code_fnames) == 2, code_fnames
+        code = ''.join(open(fname).read() for fname in code_fnames)
         '''
         In windows, `ctypes.c_int` is the same as `ctypes.c_long`, whose name is `c_long`. The function of `get_ctype_name` will return `int32_t` :(
         '''
@@ -83,8 +87,105 @@ def test_template_build():
         assert 'mul_elemwise_kernel<int' in code, code
 
 
+def test_build_cache():
+    from mobula.building.build import source_to_so_ctx
+    env_path = os.path.join(os.path.dirname(__file__), 'BuildCache')
+    cache_path = os.path.join(env_path, 'cache')
+    src = os.path.join(env_path, 'BuildCache.cpp')
+    obj = os.path.join(env_path, 'BuildCache.o')
+    shutil.rmtree(cache_path, ignore_errors=True)
+    with mobula.config.TempConfig(BUILD_CACHE_PATH=cache_path):
+        # two build directories share the cache
+        for i in range(2):
+            build_path = os.path.join(env_path, 'build_{}'.format(i))
+            makedirs(build_path, exist_ok=True)
+            target_name = os.path.join(build_path, 'BuildCache.so')
+            if os.path.exists(target_name):
+                os.remove(target_name)
+            if os.path.exists(obj):
+                os.remove(obj)
+            source_to_so_ctx(build_path, [src], target_name, 'cpu')
+            assert ctypes.CDLL(target_name).TestBuildCache() == 42
+        # the second library is copied from the cache without compiling
+        assert not os.path.exists(obj)
+    libs = [name for _, _, names in os.walk(cache_path)
+            for name in names if name.endswith('.so')]
+    assert len(libs) == 1, libs
+
+
+def test_buildin_path():
+    from mobula.building.build import get_build_flag, get_buildin_path
+    paths = set()
+    for using_openmp in [False, True]:
+        with mobula.config.TempConfig(USING_OPENMP=using_openmp):
+            compiler, cflags = get_build_flag('cpu')[:2]
+            paths.add(get_buildin_path('cpu', compiler, cflags))
+            # the same flags share the objects
+            assert get_buildin_path('cpu', compiler, cflags) in paths
+    # the objects of other flags are never linked
+    assert len(paths) == 2, paths
+
+
+def test_shared_runtime():
+    from mobula.building.build_utils import OS_IS_WINDOWS
+    from mobula.op.loader import CTX_FUNC_MAP
+    if OS_IS_WINDOWS:
+        return
+    env_path = os.path.dirname(__file__)
+    mobula.op.load('AOT', env_path)
+    import numpy as np
+    for dtype in [np.float32, np.int32]:
+        a = np.array([1, 2, 3], dtype=dtype)
+        out = np.empty_like(a)
+        mobula.func.aot_add(a.size, a, 2, out)
+        assert_almost_equal(out, a + 2)
+    cpp_fname = os.path.join(env_path, 'AOT', 'AOT.cpp')
+    dll_names = [func_info.dll._name
+                 for func_info in CTX_FUNC_MAP['cpu'][cpp_fname].values()]
+    assert len(dll_names) == 2, dll_names
+    # the libraries share the runtime, which is the only one registered
+    registered = [dll._name for dll in mobula.func._loaded_dlls['cpu']]
+    for name in registered:
+        assert os.path.basename(name).startswith('libmobula_cpu_'), name
+    assert not set(dll_names) & set(registered)
+    # the functions are loaded from the AOT directory by `test_aot_build`
+    del CTX_FUNC_MAP['cpu'][cpp_fname]
+
+
+def test_aot_build():
+    from mobula.building import aot
+    from mobula.building.build_path import get_virtual_dirname
+    from mobula.op.loader import CTX_FUNC_MAP
+    env_path = os.path.dirname(__file__)
+    out_dir = os.path.join(env_path, 'AOT', 'aot_build')
+    manifest = dict(ctx=['cpu'], dtypes=['float', 'int'],
+                    ops=[dict(op='AOT', path='.')])
+    aot.build(manifest, out_dir, env_path)
+    with mobula.config.TempConfig(AOT_PATH=out_dir):
+        mobula.op.load('AOT', env_path)
+        import numpy as np
+        for dtype in [np.float32, np.int32]:
+            a = np.array([1, 2, 3], dtype=dtype)
+            out = np.empty_like(a)
+            mobula.func.aot_add(a.size, a, 2, out)
+            assert_almost_equal(out, a + 2)
+    # the libraries are loaded from the AOT directory without building
+    cpp_fname = os.path.join(env_path, 'AOT', 'AOT.cpp')
+    funcs = CTX_FUNC_MAP['cpu'][cpp_fname]
+    assert len(funcs) == 2
+    for func_info in funcs.values():
+        assert func_info.dll._name.startswith(out_dir), func_info.dll._name
+    build_info_fname = os.path.join(get_virtual_dirname(
+        os.path.join(env_path, 'AOT')), 'build', 'AOT.json')
+    assert not os.path.exists(build_info_fname)
+
+
 if __name__ == '__main__':
     test_custom_struct()
     test_custom_ctensor()
     test_build_path()
     test_template_build()
+    test_build_cache()
+    test_buildin_path()
+    test_shared_runtime()
+    test_aot_build()
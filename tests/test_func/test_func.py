@@ -1,5 +1,6 @@
 import mobula
 from mobula.testing import assert_almost_equal
+from nose.tools import assert_raises
 import numpy as np
 import os
 import ctypes
@@ -30,6 +31,127 @@ def test_func_kwargs():
     assert_almost_equal(a * b, c)
 
 
+def test_synchronize():
+    a = np.random.random((5, 5))
+    b = np.random.random((5, 5))
+    c = np.empty((5, 5))
+    mobula.func.mul_elemwise(a.size, a, b, c)
+    mobula.func.synchronize()
+    assert_almost_equal(a * b, c)
+
+
+def test_dispatch_cache():
+    func = mobula.func.mul_elemwise
+    for dtype in [np.float32, np.float64, np.float32]:
+        a = np.random.random((5, 5)).astype(dtype)
+        b = np.random.random((5, 5)).astype(dtype)
+        c = np.empty((5, 5), dtype=dtype)
+        func(a.size, a, b, c)
+        assert_almost_equal(a * b, c)
+    # a dispatcher for each signature
+    # the ctype of `a` in the signatures
+    ctypes_a = set(signature[0][1][1] for signature in func.dispatchers)
+    assert set([ctypes.c_float, ctypes.c_double]) <= ctypes_a
+    num_dispatchers = len(func.dispatchers)
+    func(a.size, a, b, c)
+    assert len(func.dispatchers) == num_dispatchers
+
+
+def test_graph_replay():
+    a = np.random.random((5, 5)).astype(np.float32)
+    b = np.random.random((5, 5)).astype(np.float32)
+    c = np.empty_like(a)
+    out = np.empty_like(a)
+    with mobula.graph.capture() as g:
+        mobula.func.mul_elemwise(a.size, a, b, c)
+        mobula.func.test_workspace(c.size, c, out)
+    assert_almost_equal(a * b, c)
+    assert len(g.calls) == 2
+    a[:] = np.random.random((5, 5))
+    g.replay()
+    assert_almost_equal(a * b, c)
+    assert_almost_equal(c.ravel()[::-1].reshape(c.shape) * 2, out)
+    g.release()
+
+
+def test_memory_pool():
+    n = 1000
+    out = np.empty((n, ), dtype=np.int32)
+    mobula.func.test_new_array(n, out)
+    assert (out == np.arange(n)).all()
+    old_stats = mobula.memory.stats('cpu')
+    mobula.func.test_new_array(n, out)
+    stats = mobula.memory.stats('cpu')
+    assert stats['num_allocs'] == old_stats['num_allocs'] + 1
+    assert stats['num_hits'] == old_stats['num_hits'] + 1
+    assert stats['bytes_in_use'] == 0
+    assert stats['bytes_cached'] > 0
+    mobula.memory.trim('cpu')
+    assert mobula.memory.stats('cpu')['bytes_cached'] == 0
+
+
+def test_profiler():
+    a = np.random.random((5, 5))
+    b = np.random.random((5, 5))
+    c = np.empty((5, 5))
+    mobula.func.mul_elemwise(a.size, a, b, c)
+    with mobula.profiler.profile() as prof:
+        for _ in range(3):
+            mobula.func.mul_elemwise(a.size, a, b, c)
+    # the calls after stopping are not recorded
+    mobula.func.mul_elemwise(a.size, a, b, c)
+    calls = [e for e in prof.events if e['kind'] == 'call']
+    kernels = [e for e in prof.events if e['kind'] == 'kernel']
+    assert len(calls) == 3 and len(kernels) == 3
+    assert all(e['name'] == 'mul_elemwise' for e in calls)
+    assert all(0 <= e['marshal_us'] <= e['wall_us'] for e in calls)
+    for e in kernels:
+        assert e['name'].startswith('mul_elemwise_')
+        assert e['n'] == a.size and e['num_threads'] >= 1
+        assert e['device_id'] == -1 and e['device_us'] == -1
+    trace = prof.chrome_trace()['traceEvents']
+    assert len(trace) == 6 and all(e['ph'] == 'X' for e in trace)
+    assert 'mul_elemwise' in prof.summary()
+
+
+def test_workspace():
+    a = np.random.random((100, )).astype(np.float32)
+    out = np.empty_like(a)
+    mobula.func.test_workspace(a.size, a, out)
+    assert_almost_equal(out, a[::-1] * 2)
+    assert mobula.memory.stats('cpu')['bytes_in_use'] == 0
+
+
+def test_vec():
+    for dtype in [np.float32, np.float64]:
+        # the sizes with the tails of the vectors
+        for n in [1, 7, 33]:
+            a = np.random.uniform(0.1, 2, size=(n, )).astype(dtype)
+            b = np.random.uniform(0.1, 2, size=(n, )).astype(dtype)
+            out = np.empty_like(a)
+            mobula.func.test_vec(n, a, b, out)
+            target = np.where(a > b, np.exp(a) * b, np.log(a) - b)
+            assert_almost_equal(out, target, atol=1e-5)
+
+
+def test_fast_math():
+    a = np.random.uniform(-10, 10, size=(100, ))
+    out = np.empty((100, 3))
+    mobula.func.test_fast_math(a.size, a, out)
+    sigmoid = 1.0 / (1.0 + np.exp(-a))
+    assert_almost_equal(out[:, 0], sigmoid)
+    assert_almost_equal(out[:, 1], np.log(sigmoid))
+    assert_almost_equal(out[:, 2], a ** -3)
+
+
+def test_device_reduce():
+    for n in [1, 33, 100000]:
+        a = np.random.uniform(-10, 10, size=(n, ))
+        out = np.empty((1, ))
+        mobula.func.test_device_reduce(a.size, a, out)
+        assert out[0] == a.max()
+
+
 def test_default_value_op():
     a = np.random.random((5, 5))
     b = np.random.random((5, 5))
@@ -88,6 +210,97 @@ def test_void_pointer():
     assert out == pv
 
 
+def test_index_type():
+    # the large size is launched by the instance of int64_t
+    for n in [10, 2 ** 31 + 3]:
+        out = np.zeros(3)
+        mobula.func.test_index_type(n, n - 3, out)
+        assert_almost_equal(out, np.arange(n - 3, n))
+    # the kernel declared with `const int n` refuses the large size
+    a = np.zeros(1)
+    assert_raises(OverflowError, lambda: mobula.func.mul_elemwise(
+        2 ** 31, a, a, a))
+
+
+def test_constexpr():
+    func = mobula.func.test_constexpr
+    a = np.arange(12, dtype=np.float32)
+    for stride in [1, 2, 3]:
+        n = a.size // stride
+        for value in [stride, mobula.func.constexpr(stride)]:
+            out = np.empty(n, dtype=np.float32)
+            func(n, a, value, out)
+            assert_almost_equal(out, a[::stride])
+    # the instance of each value and the generic one
+    consts = set(signature[3] for signature in func.dispatchers)
+    assert consts == set([(), ((2, 1),), ((2, 2),), ((2, 3),)])
+    # the parameter which isn't MOBULA_CONSTEXPR takes the plain value
+    b = np.empty_like(a)
+    mobula.func.mul_elemwise(mobula.func.constexpr(a.size), a, a, b)
+    assert_almost_equal(a * a, b)
+
+
+def test_autotune():
+    func = mobula.func.test_autotune
+    a = np.random.random((1000, )).astype(np.float32)
+    out = np.ones_like(a)
+    with mobula.config.TempConfig(AUTOTUNE=True):
+        func(a.size, a, out)
+        # the kernel accumulates into the output, which is restored after
+        # each run of the candidates
+        assert_almost_equal(out, a + 1)
+        dispatcher = next(iter(func.dispatchers.values()))
+        key = dispatcher.tuning_prefix + '2^10'
+        launch = dispatcher.tuning_loader.load_tuning()[key]
+        assert launch['num_threads'] >= 1
+        # the launch config in the build information isn't tuned again
+        dispatcher.tuned.clear()
+
+        def tune(*args):
+            raise AssertionError('The launch config is tuned again')
+        dispatcher._tune = tune
+        func(a.size, a, out)
+        assert_almost_equal(out, a * 2 + 1)
+        assert dispatcher.tuned['2^10'] == launch
+
+
+def test_async_cpu():
+    a = np.random.random((1000, )).astype(np.float32)
+    out = np.zeros_like(a)
+    with mobula.config.TempConfig(USING_ASYNC_CPU=True):
+        # the calls are executed in order
+        futures = [mobula.func.test_autotune(a.size, a, out)
+                   for _ in range(3)]
+        mobula.func.wait(out)
+        assert all(future.done() for future in futures)
+        assert_almost_equal(out, a * 3)
+        # write the input after the calls which read it
+        b = np.empty_like(a)
+        future = mobula.func.mul_elemwise(a.size, a, a, b)
+        mobula.func.wait(a, for_write=True)
+        assert future.done()
+        a[:] = 2
+        assert_almost_equal(b, out * out / 9)
+        x = np.array([39], dtype=np.int32)
+        y = np.empty_like(x)
+        future = mobula.func.set_and_return(x, y)
+        assert future.result() == 39
+        assert_almost_equal(x, y)
+        # the calls on the overlapping views are ordered
+        c = np.zeros_like(a)
+        future = mobula.func.test_autotune(500, a[500:], c[500:])
+        mobula.func.wait(c[250:750])
+        assert future.done()
+        # the calls of the custom operators run at once
+        with mobula.func.run_sync():
+            assert mobula.func.set_and_return(x, y) == 39
+        expected = out + 4
+        mobula.func.test_autotune(a.size, a, out)
+    # the calls which run at once wait for the pushed calls
+    mobula.func.test_autotune(a.size, a, out)
+    assert_almost_equal(out, expected)
+
+
 def test_mobula_func():
     # skip float temporarily
     ns = [np.int32, np.int64]  # , np.float32, np.float64]
@@ -113,3 +326,13 @@ def test_atomic_add():
         target = np.dot(a, b)
         assert_almost_equal(out, target, atol=1e-3)
         # print('test_atomic_add', time.time() - tic)
+
+
+def test_atomic_add_dtypes():
+    I = U = J = 50
+    for dtype in [np.float64, np.int32, np.int64]:
+        a = np.random.randint(0, 10, size=(I, U)).astype(dtype)
+        b = np.random.randint(0, 10, size=(U, J)).astype(dtype)
+        out = np.zeros((I, J), dtype=dtype)
+        mobula.func.test_atomic_add_by_gemm(U, I, J, a, b, out)
+        assert_almost_equal(out, np.dot(a, b))
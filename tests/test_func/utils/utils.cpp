@@ -27,6 +27,24 @@ MOBULA_KERNEL test_void_pointer_kernel(const int n, const void *p, T *out) {
   *out = reinterpret_cast<T>(p);
 }
 
+template <typename T, typename index_t = int>
+MOBULA_KERNEL test_index_type_kernel(const index_t n, const index_t offset,
+                                     T *out) {
+  parfor(n - offset, [&](index_t i) { out[i] = static_cast<T>(offset + i); });
+}
+
+template <typename T, int kStride = kDynamicConst>
+MOBULA_KERNEL test_constexpr_kernel(const int n, const T *a,
+                                    MOBULA_CONSTEXPR(stride, kStride),
+                                    T *out) {
+  parfor(n, [&](int i) { out[i] = a[i * stride]; });
+}
+
+template <typename T>
+MOBULA_KERNEL test_autotune_kernel(const int n, const T *a, T *out) {
+  parfor(n, [&](int i) { out[i] += a[i]; });
+}
+
 template <typename T>
 MOBULA_KERNEL infer_type_for_const_kernel(const int n, T value, T *out) {
   parfor(n, [&](int i) { out[i] = value; });
@@ -53,4 +71,45 @@ MOBULA_KERNEL test_atomic_add_by_gemm_kernel(const int U, const int I,
   });
 }
 
+template <typename T>
+MOBULA_KERNEL test_workspace_kernel(const int n, const T *a,
+                                    MOBULA_WORKSPACE(T, tmp, n), T *out) {
+  parfor(n, [&](int i) { tmp[i] = a[i] * 2; });
+  __syncthreads();
+  parfor(n, [&](int i) { out[i] = tmp[n - 1 - i]; });
+}
+
+template <typename T>
+MOBULA_KERNEL test_vec_kernel(const int n, const T *a, const T *b, T *out) {
+  typedef Vec<T> V;
+  parfor_vec<V::kSize>(n, [&](int i, int num) {
+    V x = V::load(a + i, num), y = V::load(b + i, num);
+    select(x > y, exp(x) * y, log(x) - y).store(out + i, num);
+  });
+}
+
+template <typename T>
+MOBULA_KERNEL test_fast_math_kernel(const int n, const T *a, T *out) {
+  parfor(n, [&](int i) {
+    out[i * 3] = fast_sigmoid(a[i]);
+    out[i * 3 + 1] = log_sigmoid(a[i]);
+    out[i * 3 + 2] = pow_int(a[i], -3);
+  });
+}
+
+template <typename T>
+MOBULA_KERNEL test_device_reduce_kernel(const int n, const T *a,
+                                        MOBULA_WORKSPACE(T, partials,
+                                                         n / 32 + 1),
+                                        MOBULA_COUNTER(counter), T *out) {
+  device_reduce(n, a, partials, counter, out, max_func<T>, a[0]);
+}
+
+MOBULA_FUNC void test_new_array(const int n, int *out) {
+  int *buf = new_array<int>(n);
+  for (int i = 0; i < n; ++i) buf[i] = i;
+  MemcpyDevToHost(out, buf, sizeof(int) * n);
+  del_array(buf);
+}
+
 }  // namespace mobula
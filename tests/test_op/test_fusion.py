@@ -0,0 +1,37 @@
+import mobula
+from mobula.op import fusion
+from mobula.testing import assert_almost_equal
+import numpy as np
+
+
+def test_fuse_elementwise():
+    x = fusion.tensor('x')
+    t = fusion.tensor('t')
+    alpha = fusion.scalar('alpha')
+    p = fusion.call('fast_sigmoid', x)
+    out = alpha * p * (1 - p) + t / 2.0
+    func = fusion.fuse('test_fused_sigmoid', [x, t, alpha], [
+                       ('y', out), ('p', p), ('q', -p)])
+    assert func is mobula.func.test_fused_sigmoid
+    for dtype in [np.float32, np.float64]:
+        x_data = np.random.uniform(-5, 5, size=(100, )).astype(dtype)
+        t_data = np.random.uniform(-1, 1, size=(100, )).astype(dtype)
+        y, p_out, q = [np.empty_like(x_data) for _ in range(3)]
+        func(x_data.size, x_data, t_data, 0.5, y, p_out, q)
+        s = 1.0 / (1.0 + np.exp(-x_data))
+        assert_almost_equal(y, 0.5 * s * (1 - s) + t_data / 2.0, atol=1e-5)
+        assert_almost_equal(p_out, s, atol=1e-5)
+        assert_almost_equal(q, -s, atol=1e-5)
+    # the same expression is generated once
+    assert fusion.fuse('test_fused_sigmoid', [x, t, alpha], [
+        ('y', out), ('p', p), ('q', -p)]) is func
+
+
+def test_fuse_undeclared_input():
+    x = fusion.tensor('x')
+    y = fusion.tensor('y')
+    try:
+        fusion.fuse('test_fused_undeclared', [x], [('out', x + y)])
+    except AssertionError:
+        return
+    assert False, 'The undeclared input should be reported'
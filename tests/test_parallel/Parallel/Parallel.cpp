@@ -14,3 +14,21 @@ MOBULA_KERNEL test_parfor_kernel(const int N, int *out) {
   __syncthreads();
   parfor(N, [&](int i) { out[i] += i; });
 }
+
+// kind: 0 static, 1 dynamic, 2 stealing
+MOBULA_KERNEL test_parfor_schedule_kernel(const int N, const int kind,
+                                          int *out) {
+  const ParforSchedule schedule = kind == 0   ? parfor_static()
+                                  : kind == 1 ? parfor_dynamic(3)
+                                              : parfor_stealing();
+  parfor(N, [&](int i) { out[i] = 0; });
+  __syncthreads();
+  // the scheduled parfors in turn reuse the state of the launch
+  for (int r = 0; r < 3; ++r) {
+    parfor(N, schedule, [&](int i) { out[i] += i; });
+  }
+}
+
+MOBULA_KERNEL test_num_threads_kernel(const int N, int *out) {
+  if (get_thread_num() == 0) out[0] = get_num_threads();
+}
@@ -23,6 +23,61 @@ def test_parfor():
     assert (x == np.arange(N).astype(np.int32)).all()
 
 
+def test_repeated_launch():
+    # the workers are reused between launches with different sizes
+    with mobula.config.TempConfig(INLINE_GRAIN=0):
+        for _ in range(10):
+            for N in range(1, 64):
+                x = np.empty((N, ), dtype=np.int32)
+                mobula.func.test_parfor(N, x)
+                assert (x == np.arange(N).astype(np.int32)).all()
+
+
+def test_parfor_schedule():
+    for kind in range(3):
+        for N in [1, 7, 10000]:
+            x = np.empty((N, ), dtype=np.int32)
+            mobula.func.test_parfor_schedule(N, kind, x)
+            assert (x == np.arange(N).astype(np.int32) * 3).all(), kind
+
+
+def test_num_threads():
+    x = np.zeros((1, ), dtype=np.int32)
+    # the tiny kernels run on the calling thread
+    with mobula.config.TempConfig(INLINE_GRAIN=1024):
+        mobula.func.test_num_threads(1000, x)
+        assert x[0] == 1, x[0]
+    with mobula.config.TempConfig(INLINE_GRAIN=0, NUM_THREADS=2):
+        mobula.func.test_num_threads(1000, x)
+        assert 1 <= x[0] <= 2, x[0]
+        # the override of the call ignores the inline grain
+        mobula.func.test_num_threads(1000, x, num_threads=1)
+        assert x[0] == 1, x[0]
+        mobula.config.set_num_threads(1)
+        mobula.func.test_num_threads(1000, x)
+        assert x[0] == 1, x[0]
+
+
+def test_thread_affinity():
+    N = 10000
+    # the calling thread is never pinned
+    get_cpus = getattr(os, 'sched_getaffinity', lambda pid: None)
+    cpus = get_cpus(0)
+    for affinity in ['compact', 'scatter', '']:
+        with mobula.config.TempConfig(THREAD_AFFINITY=affinity):
+            x = np.zeros((1, ), dtype=np.int32)
+            mobula.func.test_syncthreads(N, x)
+            assert x[0] == N, (affinity, x[0])
+            y = np.empty((N, ), dtype=np.int32)
+            mobula.func.test_parfor(N, y)
+            assert (y == np.arange(N).astype(np.int32)).all(), affinity
+            assert get_cpus(0) == cpus, affinity
+
+
 if __name__ == '__main__':
     test_sync()
     test_parfor()
+    test_repeated_launch()
+    test_parfor_schedule()
+    test_num_threads()
+    test_thread_affinity()